@@ -0,0 +1,157 @@
+
+#include "admission-control.h"
+
+#include <algorithm>
+#include <string>
+#include <utility>
+
+#include "absl/flags/flag.h"
+
+ABSL_FLAG(bool, admission_control, true,
+          "Refuse calls beyond a concurrency limit that adapts to latency, "
+          "and calls that cannot finish before their deadline.");
+ABSL_FLAG(int, admission_max_limit, 1000,
+          "The most calls admission control lets run at once.");
+ABSL_FLAG(std::int64_t, resource_quota_bytes, 512 << 20,
+          "The memory gRPC may use for calls; 0 for no limit.");
+ABSL_FLAG(int, max_server_threads, 0,
+          "The most threads gRPC may use to serve calls; 0 for no limit.");
+
+namespace mathematics {
+
+AdmissionControl::Permit& AdmissionControl::Permit::operator=(
+    Permit&& other) {
+  if (this != &other) {
+    if (control_ != nullptr) {
+      control_->Release(*this);
+    }
+    control_ = other.control_;
+    start_ = other.start_;
+    other.control_ = nullptr;
+  }
+  return *this;
+}
+
+AdmissionControl::Permit::~Permit() {
+  if (control_ != nullptr) {
+    control_->Release(*this);
+  }
+}
+
+AdmissionControl::AdmissionControl(Options options)
+    : options_(options),
+      limit_(options.initial_limit),
+      window_start_(std::chrono::steady_clock::now()),
+      limit_gauge_(metrics::NewGauge(
+          "arithmetic_server_concurrency_limit",
+          "How many calls admission control lets run at once.")),
+      in_flight_gauge_(metrics::NewGauge("arithmetic_server_in_flight_calls",
+                                         "Calls being served.")),
+      over_limit_(metrics::NewCounter(
+          "arithmetic_server_rejected_calls_total",
+          "Calls refused before any work was done on them, by reason.",
+          {{"reason", "over_limit"}})),
+      past_deadline_(metrics::NewCounter(
+          "arithmetic_server_rejected_calls_total",
+          "Calls refused before any work was done on them, by reason.",
+          {{"reason", "deadline"}})) {
+  limit_gauge_->Set(options.initial_limit);
+}
+
+std::unique_ptr<AdmissionControl> AdmissionControl::FromFlags() {
+  if (!absl::GetFlag(FLAGS_admission_control)) {
+    return nullptr;
+  }
+  Options options;
+  options.max_limit = absl::GetFlag(FLAGS_admission_max_limit);
+  options.initial_limit = std::min(options.initial_limit, options.max_limit);
+  options.min_limit = std::min(options.min_limit, options.max_limit);
+  return std::make_unique<AdmissionControl>(options);
+}
+
+grpc::Status AdmissionControl::Admit(
+    const grpc::ServerContextBase& context, Permit* permit) {
+  const auto remaining =
+      context.deadline() - std::chrono::system_clock::now();
+  if (remaining <= std::chrono::nanoseconds(static_cast<std::int64_t>(
+                       typical_latency_ns_.load(std::memory_order_relaxed)))) {
+    past_deadline_->Increment();
+    return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                        remaining.count() <= 0
+                            ? "The deadline passed before the call started."
+                            : "The call cannot finish before its deadline.");
+  }
+
+  const int in_flight = in_flight_.fetch_add(1, std::memory_order_relaxed);
+  const double limit = limit_.load(std::memory_order_relaxed);
+  if (in_flight + 1 > limit) {
+    in_flight_.fetch_sub(1, std::memory_order_relaxed);
+    over_limit_->Increment();
+    return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                        "The server is at its limit of " +
+                            std::to_string(static_cast<int>(limit)) +
+                            " concurrent calls.");
+  }
+  in_flight_gauge_->Add(1);
+  *permit = Permit();
+  permit->control_ = this;
+  permit->start_ = std::chrono::steady_clock::now();
+  return grpc::Status::OK;
+}
+
+void AdmissionControl::Release(const Permit& permit) {
+  in_flight_.fetch_sub(1, std::memory_order_relaxed);
+  in_flight_gauge_->Add(-1);
+  const auto now = std::chrono::steady_clock::now();
+  const double latency_ns =
+      std::chrono::duration<double, std::nano>(now - permit.start_).count();
+
+  std::lock_guard<std::mutex> lock(mu_);
+  const double typical = typical_latency_ns_.load(std::memory_order_relaxed);
+  typical_latency_ns_.store(
+      typical == 0 ? latency_ns : 0.95 * typical + 0.05 * latency_ns,
+      std::memory_order_relaxed);
+  if (window_min_latency_ns_ == 0 || latency_ns < window_min_latency_ns_) {
+    window_min_latency_ns_ = latency_ns;
+  }
+  if (min_latency_ns_ == 0 || latency_ns < min_latency_ns_) {
+    min_latency_ns_ = latency_ns;
+  }
+  if (now - window_start_ >= kMinLatencyWindow) {
+    min_latency_ns_ = window_min_latency_ns_;
+    window_min_latency_ns_ = 0;
+    window_start_ = now;
+  }
+
+  double limit = limit_.load(std::memory_order_relaxed);
+  const double slow_ns = std::max(
+      min_latency_ns_ * kLatencyTolerance,
+      min_latency_ns_ +
+          std::chrono::duration<double, std::nano>(kLatencySlack).count());
+  if (latency_ns <= slow_ns) {
+    limit = std::min<double>(options_.max_limit, limit + 1 / limit);
+  } else if (now - last_decrease_ >= kDecreaseInterval) {
+    limit = std::max<double>(options_.min_limit, limit * kBackoff);
+    last_decrease_ = now;
+  }
+  limit_.store(limit, std::memory_order_relaxed);
+  limit_gauge_->Set(static_cast<std::int64_t>(limit));
+}
+
+void SetResourceQuotaFromFlags(grpc::ServerBuilder* builder) {
+  const std::int64_t bytes = absl::GetFlag(FLAGS_resource_quota_bytes);
+  const int threads = absl::GetFlag(FLAGS_max_server_threads);
+  if (bytes <= 0 && threads <= 0) {
+    return;
+  }
+  grpc::ResourceQuota quota("arithmetic-server");
+  if (bytes > 0) {
+    quota.Resize(bytes);
+  }
+  if (threads > 0) {
+    quota.SetMaxThreads(threads);
+  }
+  builder->SetResourceQuota(quota);
+}
+
+}  // namespace mathematics
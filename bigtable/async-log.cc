@@ -0,0 +1,300 @@
+
+#include "async-log.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mathematics {
+namespace async_log {
+namespace {
+
+// Must be a power of 2.
+constexpr std::uint64_t kRingSize = kRingRecords;
+static_assert((kRingSize & (kRingSize - 1)) == 0,
+              "kRingRecords must be a power of 2");
+
+constexpr auto kMinIdle = std::chrono::microseconds(500);
+constexpr auto kMaxIdle = std::chrono::milliseconds(20);
+
+// A single-producer, single-consumer ring of records. The producer is the
+// thread owning the ring, the consumer is whoever holds Logger::drain_mu_.
+struct Ring {
+  alignas(64) std::atomic<std::uint64_t> head{0};  // Next record to drain.
+  alignas(64) std::atomic<std::uint64_t> tail{0};  // Next record to fill.
+  std::atomic<bool> abandoned{false};  // Set when the owning thread exits.
+  std::uint16_t thread_index = 0;
+  Record records[kRingSize];
+};
+
+class Logger {
+ public:
+  static Logger& Instance() {
+    static Logger* logger = new Logger;
+    return *logger;
+  }
+
+  std::shared_ptr<Ring> NewRing() {
+    auto ring = std::make_shared<Ring>();
+    std::lock_guard<std::mutex> lock(rings_mu_);
+    ring->thread_index = next_thread_index_++;
+    rings_.push_back(ring);
+    return ring;
+  }
+
+  void Flush() {
+    std::lock_guard<std::mutex> lock(drain_mu_);
+    DrainOnce();
+  }
+
+  void CountDrop() { dropped_.fetch_add(1, std::memory_order_relaxed); }
+
+  std::uint64_t dropped() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  Logger() {
+    std::thread([this] { DrainLoop(); }).detach();
+    std::atexit([] { Logger::Instance().Flush(); });
+  }
+
+  void DrainLoop() {
+    std::chrono::microseconds idle = kMinIdle;
+    for (;;) {
+      std::size_t written;
+      {
+        std::lock_guard<std::mutex> lock(drain_mu_);
+        written = DrainOnce();
+      }
+      if (written > 0) {
+        idle = kMinIdle;
+        std::this_thread::yield();
+        continue;
+      }
+      std::this_thread::sleep_for(idle);
+      idle = std::min<std::chrono::microseconds>(idle * 2, kMaxIdle);
+    }
+  }
+
+  // Writes out everything committed to the rings so far, oldest first.
+  // Returns the number of records written. Requires drain_mu_.
+  std::size_t DrainOnce() {
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+      std::lock_guard<std::mutex> lock(rings_mu_);
+      rings = rings_;
+    }
+
+    struct Pending {
+      Ring* ring;
+      std::uint64_t end;
+      bool abandoned;
+    };
+    std::vector<Pending> pending;
+    std::vector<const Record*> records;
+    for (const auto& ring : rings) {
+      // Read 'abandoned' first, so that a ring seen as abandoned has no
+      // records committed after the 'tail' read below.
+      const bool abandoned = ring->abandoned.load(std::memory_order_acquire);
+      const std::uint64_t head = ring->head.load(std::memory_order_relaxed);
+      const std::uint64_t tail = ring->tail.load(std::memory_order_acquire);
+      for (std::uint64_t i = head; i != tail; ++i) {
+        records.push_back(&ring->records[i & (kRingSize - 1)]);
+      }
+      pending.push_back({ring.get(), tail, abandoned});
+    }
+    std::stable_sort(records.begin(), records.end(),
+                     [](const Record* a, const Record* b) {
+                       return a->timestamp_us < b->timestamp_us;
+                     });
+
+    std::string out;
+    std::string err;
+    for (const Record* r : records) {
+      Format(*r, r->site->severity() == Severity::kInfo ? &out : &err);
+    }
+    const std::uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+    if (dropped != reported_dropped_) {
+      err += "W async_log: dropped " +
+             std::to_string(dropped - reported_dropped_) +
+             " info records, ring buffers full\n";
+      reported_dropped_ = dropped;
+    }
+    WriteFully(STDOUT_FILENO, out);
+    WriteFully(STDERR_FILENO, err);
+
+    bool any_abandoned = false;
+    for (const auto& p : pending) {
+      p.ring->head.store(p.end, std::memory_order_release);
+      any_abandoned = any_abandoned || p.abandoned;
+    }
+    if (any_abandoned) {
+      std::lock_guard<std::mutex> lock(rings_mu_);
+      rings_.erase(std::remove_if(rings_.begin(), rings_.end(),
+                                  [](const std::shared_ptr<Ring>& ring) {
+                                    return ring->abandoned.load() &&
+                                           ring->head.load() ==
+                                               ring->tail.load();
+                                  }),
+                   rings_.end());
+    }
+    return records.size();
+  }
+
+  // Formats a record as "I1018 12:34:56.789012 3] message". Requires
+  // drain_mu_.
+  void Format(const Record& r, std::string* out) {
+    static constexpr char kSeverityLetter[] = {'I', 'W', 'E'};
+    const std::time_t seconds = r.timestamp_us / 1000000;
+    if (seconds != formatted_second_) {
+      std::tm tm;
+      localtime_r(&seconds, &tm);
+      std::strftime(formatted_time_, sizeof(formatted_time_), "%m%d %H:%M:%S",
+                    &tm);
+      formatted_second_ = seconds;
+    }
+    char prefix[64];
+    std::snprintf(prefix, sizeof(prefix), "%c%s.%06d %d] ",
+                  kSeverityLetter[static_cast<int>(r.site->severity())],
+                  formatted_time_, static_cast<int>(r.timestamp_us % 1000000),
+                  r.thread_index);
+    out->append(prefix);
+
+    int arg = 0;
+    for (const char* f = r.site->format(); *f != '\0';) {
+      if (f[0] == '{' && f[1] == '}' && arg < r.num_args) {
+        AppendArg(r, arg++, out);
+        f += 2;
+      } else {
+        out->push_back(*f++);
+      }
+    }
+    if (r.suppressed > 0) {
+      out->append(" (" + std::to_string(r.suppressed) + " suppressed)");
+    }
+    out->push_back('\n');
+  }
+
+  static void AppendArg(const Record& r, int arg, std::string* out) {
+    switch (r.types[arg]) {
+      case Record::kInt:
+        out->append(std::to_string(r.values[arg].i));
+        break;
+      case Record::kDouble: {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%g", r.values[arg].d);
+        out->append(buf);
+        break;
+      }
+      case Record::kString:
+        out->append(r.strings + r.values[arg].s.offset, r.values[arg].s.size);
+        break;
+    }
+  }
+
+  static void WriteFully(int fd, const std::string& data) {
+    std::size_t done = 0;
+    while (done < data.size()) {
+      ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+      if (n <= 0) return;
+      done += n;
+    }
+  }
+
+  std::mutex drain_mu_;
+  std::uint64_t reported_dropped_ = 0;  // Guarded by drain_mu_.
+  std::time_t formatted_second_ = -1;   // Guarded by drain_mu_.
+  char formatted_time_[32];             // Guarded by drain_mu_.
+
+  std::mutex rings_mu_;
+  std::vector<std::shared_ptr<Ring>> rings_;  // Guarded by rings_mu_.
+  std::uint16_t next_thread_index_ = 0;       // Guarded by rings_mu_.
+
+  std::atomic<std::uint64_t> dropped_{0};
+};
+
+// Owns the calling thread's ring and marks it abandoned on thread exit, so
+// that the logger can free it once drained.
+struct ThreadRing {
+  std::shared_ptr<Ring> ring = Logger::Instance().NewRing();
+  ~ThreadRing() { ring->abandoned.store(true, std::memory_order_release); }
+};
+
+Ring* CurrentRing() {
+  thread_local ThreadRing thread_ring;
+  return thread_ring.ring.get();
+}
+
+}  // namespace
+
+bool LogSite::ShouldLog() {
+  if (sample_every_n_ > 1 &&
+      calls_.fetch_add(1, std::memory_order_relaxed) % sample_every_n_ != 0) {
+    suppressed_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  if (max_per_second_ > 0) {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    std::int64_t window = window_second_.load(std::memory_order_relaxed);
+    if (window != ts.tv_sec &&
+        window_second_.compare_exchange_strong(window, ts.tv_sec,
+                                               std::memory_order_relaxed)) {
+      window_count_.store(0, std::memory_order_relaxed);
+    }
+    if (window_count_.fetch_add(1, std::memory_order_relaxed) >=
+        max_per_second_) {
+      suppressed_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  }
+  return true;
+}
+
+Record* BeginRecord(bool may_drop) {
+  Ring* ring = CurrentRing();
+  const std::uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+  if (tail - ring->head.load(std::memory_order_acquire) >= kRingSize) {
+    if (may_drop) {
+      Logger::Instance().CountDrop();
+      return nullptr;
+    }
+    // Empties this ring, as nothing can be added to it meanwhile.
+    Logger::Instance().Flush();
+  }
+  return &ring->records[tail & (kRingSize - 1)];
+}
+
+void CommitRecord() {
+  Ring* ring = CurrentRing();
+  ring->tail.store(ring->tail.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_release);
+}
+
+void Flush() { Logger::Instance().Flush(); }
+
+std::uint64_t DroppedRecords() { return Logger::Instance().dropped(); }
+
+namespace internal {
+
+std::int64_t NowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+std::uint16_t ThreadIndex() { return CurrentRing()->thread_index; }
+
+}  // namespace internal
+}  // namespace async_log
+}  // namespace mathematics
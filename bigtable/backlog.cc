@@ -0,0 +1,260 @@
+
+#include "backlog.h"
+
+#include <algorithm>
+#include <random>
+#include <string>
+
+#include "absl/flags/flag.h"
+
+ABSL_FLAG(std::int64_t, max_backlog, 0,
+          "Turn requests away while more than this many are waiting for the "
+          "processors; 0 for no limit.");
+ABSL_FLAG(int, backlog_probe_interval_ms, 1000,
+          "How often the geometry server reads the backlog.");
+ABSL_FLAG(bool, count_backlog, false,
+          "Count scheduled and completed requests in the database, which "
+          "must have the backlog schema. Implied by --max_backlog; the "
+          "processors need it for the geometry servers' limit to work.");
+ABSL_FLAG(int, backlog_flush_interval_ms, 1000,
+          "How often the counts of scheduled and completed requests are "
+          "written to the database.");
+ABSL_FLAG(int, backlog_window_seconds, 60,
+          "Requests are counted in windows this long, by when they were "
+          "published. Must be the same on the servers and processors.");
+ABSL_FLAG(int, backlog_windows, 15,
+          "How many of the last windows the backlog is read from; requests "
+          "waiting longer are not counted.");
+
+namespace mathematics {
+namespace {
+
+// Returns the start of the window 'time' falls in, in seconds since the
+// epoch.
+std::int64_t WindowStart(std::chrono::system_clock::time_point time,
+                         std::chrono::seconds window) {
+  const std::int64_t seconds =
+      std::chrono::duration_cast<std::chrono::seconds>(
+          time.time_since_epoch())
+          .count();
+  return seconds - seconds % window.count();
+}
+
+std::chrono::seconds WindowFromFlags() {
+  return std::chrono::seconds(
+      std::max(absl::GetFlag(FLAGS_backlog_window_seconds), 1));
+}
+
+}  // namespace
+
+BacklogCounter::BacklogCounter(BacklogStore* store,
+                               std::chrono::seconds window,
+                               std::chrono::milliseconds interval)
+    : store_(store),
+      window_(window),
+      interval_(interval),
+      flush_failures_(metrics::NewCounter(
+          "backlog_counter_flush_failures_total",
+          "Failed writes of the backlog counters; the counts are kept for "
+          "the next write.")) {
+  flusher_ = std::thread(&BacklogCounter::FlushLoop, this);
+}
+
+BacklogCounter::~BacklogCounter() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  flusher_.join();
+  Flush();
+}
+
+std::unique_ptr<BacklogCounter> BacklogCounter::FromFlags(
+    BacklogStore* store) {
+  if (!absl::GetFlag(FLAGS_count_backlog) &&
+      absl::GetFlag(FLAGS_max_backlog) <= 0) {
+    return nullptr;
+  }
+  return std::make_unique<BacklogCounter>(
+      store, WindowFromFlags(),
+      std::chrono::milliseconds(
+          absl::GetFlag(FLAGS_backlog_flush_interval_ms)));
+}
+
+void BacklogCounter::AddScheduled(
+    std::chrono::system_clock::time_point published) {
+  std::lock_guard<std::mutex> lock(counts_mu_);
+  counts_[WindowStart(published, window_)].scheduled++;
+}
+
+void BacklogCounter::AddCompleted(
+    std::chrono::system_clock::time_point published) {
+  std::lock_guard<std::mutex> lock(counts_mu_);
+  counts_[WindowStart(published, window_)].completed++;
+}
+
+void BacklogCounter::Flush() {
+  thread_local std::minstd_rand random(std::random_device{}());
+
+  BacklogWindows counts;
+  {
+    std::lock_guard<std::mutex> lock(counts_mu_);
+    counts.swap(counts_);
+  }
+  BacklogWindows failed;
+  for (const auto& window : counts) {
+    if (!store_
+             ->Add(window.first, random() % kBacklogShards,
+                   window.second.scheduled, window.second.completed)
+             .ok()) {
+      flush_failures_->Increment();
+      failed.insert(window);
+    }
+  }
+  if (failed.empty()) {
+    return;
+  }
+  // Kept for the next write.
+  std::lock_guard<std::mutex> lock(counts_mu_);
+  for (const auto& window : failed) {
+    BacklogTotals& totals = counts_[window.first];
+    totals.scheduled += window.second.scheduled;
+    totals.completed += window.second.completed;
+  }
+}
+
+void BacklogCounter::FlushLoop() {
+  std::unique_lock<std::mutex> lock(mu_);
+  while (!cv_.wait_for(lock, interval_, [this] { return stop_; })) {
+    lock.unlock();
+    Flush();
+    lock.lock();
+  }
+}
+
+BacklogGate::BacklogGate(BacklogStore* store, std::int64_t max_backlog,
+                         std::chrono::seconds window, int windows,
+                         std::chrono::milliseconds interval)
+    : store_(store),
+      max_backlog_(max_backlog),
+      window_(window),
+      windows_(std::max(windows, 1)),
+      interval_(interval),
+      backlog_gauge_(metrics::NewGauge(
+          "geometry_server_backlog",
+          "Requests published but not yet processed, as last read.")),
+      rejections_(metrics::NewCounter(
+          "geometry_server_backlog_rejections_total",
+          "Requests turned away because the backlog was over the limit.")),
+      probe_failures_(metrics::NewCounter(
+          "geometry_server_backlog_probe_failures_total",
+          "Failed reads of the backlog counters.")),
+      untrusted_probes_(metrics::NewCounter(
+          "geometry_server_backlog_untrusted_probes_total",
+          "Reads of the backlog counters that found no completed requests, "
+          "so that the limit was not applied.")) {
+  prober_ = std::thread(&BacklogGate::ProbeLoop, this);
+}
+
+BacklogGate::~BacklogGate() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  prober_.join();
+}
+
+std::unique_ptr<BacklogGate> BacklogGate::FromFlags(BacklogStore* store) {
+  const std::int64_t max_backlog = absl::GetFlag(FLAGS_max_backlog);
+  if (max_backlog <= 0) {
+    return nullptr;
+  }
+  return std::make_unique<BacklogGate>(
+      store, max_backlog, WindowFromFlags(),
+      absl::GetFlag(FLAGS_backlog_windows),
+      std::chrono::milliseconds(
+          absl::GetFlag(FLAGS_backlog_probe_interval_ms)));
+}
+
+grpc::Status BacklogGate::Admit(grpc::ServerContext* context) {
+  const std::int64_t backlog = backlog_.load(std::memory_order_relaxed);
+  if (backlog <= max_backlog_) {
+    return grpc::Status::OK;
+  }
+  rejections_->Increment();
+  const std::int64_t retry_after_ms =
+      retry_after_ms_.load(std::memory_order_relaxed);
+  context->AddTrailingMetadata("grpc-retry-pushback-ms",
+                               std::to_string(retry_after_ms));
+  return grpc::Status(
+      grpc::StatusCode::RESOURCE_EXHAUSTED,
+      std::to_string(backlog) + " requests are waiting to be processed, " +
+          "over the limit of " + std::to_string(max_backlog_) +
+          "; retry after " + std::to_string(retry_after_ms) + " ms.");
+}
+
+void BacklogGate::Probe() {
+  const std::int64_t since =
+      WindowStart(std::chrono::system_clock::now(), window_) -
+      (windows_ - 1) * window_.count();
+  google::cloud::StatusOr<BacklogWindows> windows = store_->Read(since);
+  const auto now = std::chrono::steady_clock::now();
+  if (!windows.ok()) {
+    probe_failures_->Increment();
+    return;
+  }
+  std::int64_t backlog = 0;
+  std::int64_t completed = 0;
+  // Completed since the last probe.
+  std::int64_t newly_completed = 0;
+  for (const auto& window : *windows) {
+    const BacklogTotals& totals = window.second;
+    // Redelivered messages may be acknowledged twice.
+    backlog += std::max<std::int64_t>(0, totals.scheduled - totals.completed);
+    completed += totals.completed;
+    auto last = last_windows_.find(window.first);
+    newly_completed += std::max<std::int64_t>(
+        0, totals.completed -
+               (last == last_windows_.end() ? 0 : last->second.completed));
+  }
+  if (completed == 0 && backlog > 0) {
+    untrusted_probes_->Increment();
+    backlog = 0;
+  }
+
+  std::chrono::milliseconds retry_after = kMinRetryAfter;
+  const std::int64_t excess = backlog - max_backlog_;
+  if (excess > 0) {
+    const double seconds =
+        std::chrono::duration<double>(now - last_probe_).count();
+    const double rate = last_probe_.time_since_epoch().count() == 0
+                            ? 0
+                            : newly_completed / seconds;
+    retry_after = kMaxRetryAfter;
+    if (rate > 0) {
+      retry_after = std::chrono::milliseconds(
+          static_cast<std::int64_t>(1000 * excess / rate));
+    }
+    retry_after = std::clamp<std::chrono::milliseconds>(
+        retry_after, kMinRetryAfter, kMaxRetryAfter);
+  }
+
+  last_windows_ = *std::move(windows);
+  last_probe_ = now;
+  backlog_.store(backlog, std::memory_order_relaxed);
+  retry_after_ms_.store(retry_after.count(), std::memory_order_relaxed);
+  backlog_gauge_->Set(backlog);
+}
+
+void BacklogGate::ProbeLoop() {
+  std::unique_lock<std::mutex> lock(mu_);
+  do {
+    lock.unlock();
+    Probe();
+    lock.lock();
+  } while (!cv_.wait_for(lock, interval_, [this] { return stop_; }));
+}
+
+}  // namespace mathematics
@@ -0,0 +1,177 @@
+
+#ifndef BACKLOG_H_
+#define BACKLOG_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <google/cloud/status_or.h>
+#include <grpcpp/grpcpp.h>
+
+#include "metrics.h"
+
+// Backpressure from the processors to the geometry servers.
+//
+// The geometry servers count the requests they publish and the processors
+// count the requests they acknowledge, in counters kept in the database
+// both use. A BacklogGate in each geometry server reads the totals every so
+// often, and while the difference, the requests published but not yet
+// processed, is over --max_backlog, turns new requests away with
+// RESOURCE_EXHAUSTED and a hint of when to retry. That keeps the time from
+// scheduling a computation to its result bounded, instead of the backlog
+// growing for as long as the clients keep up the load.
+//
+// The counts are not exact: a process that is killed loses those it has not
+// written yet, and a message delivered again may be acknowledged twice. So
+// that such errors do not add up over time, requests are counted in windows
+// of --backlog_window_seconds by when they were published, both when
+// scheduled and when completed, and the gate only reads the last
+// --backlog_windows windows. Each window's backlog is taken as at least 0,
+// and an error in the counts ages out with its window. Requests left
+// waiting longer than that are no longer counted.
+//
+// If no request at all was counted as completed over those windows, the
+// processors are not counting, e.g. run without --count_backlog, or have
+// been doing nothing for that long; either way the counts cannot be
+// trusted, and the gate lets requests through.
+//
+// The counters are split into kBacklogShards shards, each updated by a
+// read-modify-write, so that writers rarely contend for one. Writers do not
+// update them per request: a BacklogCounter adds up the counts in memory
+// and writes them to one shard at a time, once per flush interval.
+//
+// Counting is off unless --count_backlog is set, on the processors and the
+// geometry servers alike, or --max_backlog, which implies it.
+// --backlog_window_seconds must be the same everywhere.
+
+namespace mathematics {
+
+constexpr int kBacklogShards = 16;
+
+struct BacklogTotals {
+  std::int64_t scheduled = 0;
+  std::int64_t completed = 0;
+};
+
+// The counts by window, keyed by the start of the window in seconds since
+// the epoch.
+using BacklogWindows = std::map<std::int64_t, BacklogTotals>;
+
+// Where the counters are kept.
+class BacklogStore {
+ public:
+  virtual ~BacklogStore() = default;
+
+  // Adds to the counters of 'shard', in 0 .. kBacklogShards - 1, of the
+  // window starting at 'window_start'.
+  virtual google::cloud::Status Add(std::int64_t window_start, int shard,
+                                    std::int64_t scheduled,
+                                    std::int64_t completed) = 0;
+
+  // Returns the counters summed across the shards, for the windows starting
+  // at or after 'since'.
+  virtual google::cloud::StatusOr<BacklogWindows> Read(std::int64_t since) = 0;
+};
+
+class BacklogCounter {
+ public:
+  BacklogCounter(BacklogStore* store, std::chrono::seconds window,
+                 std::chrono::milliseconds interval);
+
+  // Writes what is left to write.
+  ~BacklogCounter();
+
+  BacklogCounter(const BacklogCounter&) = delete;
+  BacklogCounter& operator=(const BacklogCounter&) = delete;
+
+  // With --backlog_window_seconds and --backlog_flush_interval_ms. Returns
+  // nullptr unless --count_backlog or --max_backlog is set, so that
+  // deployments without the backlog schema do not write to it.
+  static std::unique_ptr<BacklogCounter> FromFlags(BacklogStore* store);
+
+  // Counts a request published at 'published', as it is scheduled or
+  // completed.
+  void AddScheduled(std::chrono::system_clock::time_point published);
+  void AddCompleted(std::chrono::system_clock::time_point published);
+
+ private:
+  void Flush();
+  void FlushLoop();
+
+  BacklogStore* store_;  // Not owned.
+  const std::chrono::seconds window_;
+  const std::chrono::milliseconds interval_;
+
+  std::mutex counts_mu_;
+  BacklogWindows counts_;  // Not yet written. Guarded by counts_mu_.
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool stop_ = false;  // Guarded by mu_.
+  std::thread flusher_;
+
+  metrics::Counter* flush_failures_;
+};
+
+class BacklogGate {
+ public:
+  BacklogGate(BacklogStore* store, std::int64_t max_backlog,
+              std::chrono::seconds window, int windows,
+              std::chrono::milliseconds interval);
+  ~BacklogGate();
+
+  BacklogGate(const BacklogGate&) = delete;
+  BacklogGate& operator=(const BacklogGate&) = delete;
+
+  // With --max_backlog, --backlog_window_seconds, --backlog_windows and
+  // --backlog_probe_interval_ms. Returns nullptr if --max_backlog is 0.
+  static std::unique_ptr<BacklogGate> FromFlags(BacklogStore* store);
+
+  // Returns OK if a request may be scheduled. Otherwise returns
+  // RESOURCE_EXHAUSTED, and sets the grpc-retry-pushback-ms trailer of
+  // 'context' to when the backlog should be back under the limit, at the
+  // rate the processors are working through it.
+  grpc::Status Admit(grpc::ServerContext* context);
+
+ private:
+  static constexpr std::chrono::seconds kMinRetryAfter{1};
+  static constexpr std::chrono::seconds kMaxRetryAfter{60};
+
+  void Probe();
+  void ProbeLoop();
+
+  BacklogStore* store_;  // Not owned.
+  const std::int64_t max_backlog_;
+  const std::chrono::seconds window_;
+  const int windows_;
+  const std::chrono::milliseconds interval_;
+
+  // From the last probe; 0 until the first one, so that a store that
+  // cannot be read does not stop all work.
+  std::atomic<std::int64_t> backlog_{0};
+  std::atomic<std::int64_t> retry_after_ms_{0};
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool stop_ = false;  // Guarded by mu_.
+  // The previous probe, for the rate of completions. Used by the prober
+  // only.
+  BacklogWindows last_windows_;
+  std::chrono::steady_clock::time_point last_probe_;
+  std::thread prober_;
+
+  metrics::Gauge* backlog_gauge_;
+  metrics::Counter* rejections_;
+  metrics::Counter* probe_failures_;
+  metrics::Counter* untrusted_probes_;
+};
+
+}  // namespace mathematics
+
+#endif  // BACKLOG_H_
@@ -0,0 +1,79 @@
+
+#include "bigtable-backlog-store.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <string>
+
+namespace mathematics {
+namespace {
+
+namespace cbt = ::google::cloud::bigtable;
+
+constexpr char kRowPrefix[] = "backlog#";
+// Just past the rows that start with kRowPrefix.
+constexpr char kRowsEnd[] = "backlog$";
+constexpr char kColumnFamily[] = "backlog";
+constexpr char kScheduledColumn[] = "scheduled";
+constexpr char kCompletedColumn[] = "completed";
+
+// The key of the rows of the window starting at 'window_start', before the
+// shard. Zero-padded, so that the rows sort by window.
+std::string WindowKey(std::int64_t window_start) {
+  char key[32];
+  std::snprintf(key, sizeof(key), "%s%012" PRId64 "#", kRowPrefix,
+                window_start);
+  return key;
+}
+
+}  // namespace
+
+google::cloud::Status BigtableBacklogStore::Add(std::int64_t window_start,
+                                                int shard,
+                                                std::int64_t scheduled,
+                                                std::int64_t completed) {
+  // Table is not thread-safe; copies are.
+  auto table = table_;
+  auto row = table.ReadModifyWriteRow(
+      WindowKey(window_start) + std::to_string(shard),
+      cbt::ReadModifyWriteRule::IncrementAmount(kColumnFamily,
+                                                kScheduledColumn, scheduled),
+      cbt::ReadModifyWriteRule::IncrementAmount(kColumnFamily,
+                                                kCompletedColumn, completed));
+  return row.status();
+}
+
+google::cloud::StatusOr<BacklogWindows> BigtableBacklogStore::Read(
+    std::int64_t since) {
+  auto table = table_;
+  BacklogWindows windows;
+  auto rows = table.ReadRows(
+      cbt::RowSet(cbt::RowRange::Range(WindowKey(since), kRowsEnd)),
+      cbt::Filter::Chain(cbt::Filter::FamilyRegex(kColumnFamily),
+                         cbt::Filter::Latest(1)));
+  for (auto& row : rows) {
+    if (!row.ok()) {
+      return row.status();
+    }
+    std::int64_t window_start;
+    if (std::sscanf(row->row_key().c_str() + sizeof(kRowPrefix) - 1,
+                    "%" SCNd64, &window_start) != 1) {
+      continue;
+    }
+    BacklogTotals& totals = windows[window_start];
+    for (const cbt::Cell& cell : row->cells()) {
+      auto value = cell.decode_big_endian_integer<std::int64_t>();
+      if (!value.ok()) {
+        return value.status();
+      }
+      if (cell.column_qualifier() == kScheduledColumn) {
+        totals.scheduled += *value;
+      } else if (cell.column_qualifier() == kCompletedColumn) {
+        totals.completed += *value;
+      }
+    }
+  }
+  return windows;
+}
+
+}  // namespace mathematics
@@ -0,0 +1,41 @@
+
+#ifndef BIGTABLE_BACKLOG_STORE_H_
+#define BIGTABLE_BACKLOG_STORE_H_
+
+#include <cstdint>
+#include <utility>
+
+#include <google/cloud/bigtable/table.h>
+
+#include "backlog.h"
+
+namespace mathematics {
+
+// Keeps the backlog counters in the rows "backlog#<window start>#<shard>"
+// of the length table, the window start zero-padded to 12 digits, as 64-bit
+// big-endian integers in the columns "scheduled" and "completed" of the
+// "backlog" column family. Bigtable increments them atomically.
+//
+// The table must have the family before --count_backlog or --max_backlog is
+// set, and a garbage collection policy that removes the rows of old
+// windows, e.g. with
+//
+//   $ cbt -instance foobar-instance createfamily foobar-table backlog
+//   $ cbt -instance foobar-instance setgcpolicy foobar-table backlog maxage=1d
+class BigtableBacklogStore final : public BacklogStore {
+ public:
+  explicit BigtableBacklogStore(google::cloud::bigtable::Table table)
+      : table_(std::move(table)) {}
+
+  google::cloud::Status Add(std::int64_t window_start, int shard,
+                            std::int64_t scheduled,
+                            std::int64_t completed) override;
+  google::cloud::StatusOr<BacklogWindows> Read(std::int64_t since) override;
+
+ private:
+  const google::cloud::bigtable::Table table_;
+};
+
+}  // namespace mathematics
+
+#endif  // BIGTABLE_BACKLOG_STORE_H_
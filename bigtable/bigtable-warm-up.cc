@@ -0,0 +1,64 @@
+
+#include "bigtable-warm-up.h"
+
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/flag.h"
+
+ABSL_FLAG(int, bigtable_channels, 4,
+          "The gRPC channels the Bigtable data client keeps open, all "
+          "connected at startup.");
+
+namespace mathematics {
+namespace {
+
+namespace cbt = ::google::cloud::bigtable;
+
+constexpr char kWarmUpRowPrefix[] = "warm-up#";
+
+}  // namespace
+
+cbt::ClientOptions BigtableClientOptionsFromFlags() {
+  cbt::ClientOptions options;
+  options.set_connection_pool_size(absl::GetFlag(FLAGS_bigtable_channels));
+  return options;
+}
+
+void WarmUpBigtable(cbt::Table table, std::size_t channels,
+                    std::chrono::system_clock::time_point deadline) {
+  // Reads have no deadline of their own, so a read that hangs is left
+  // behind, on its own copy of the table, rather than waited for.
+  std::vector<std::future<google::cloud::Status>> reads;
+  for (std::size_t i = 0; i < channels; i++) {
+    std::packaged_task<google::cloud::Status()> read([table, i]() mutable {
+      return table
+          .ReadRow(kWarmUpRowPrefix + std::to_string(i),
+                   cbt::Filter::Latest(1))
+          .status();
+    });
+    reads.push_back(read.get_future());
+    std::thread(std::move(read)).detach();
+  }
+  int failed = 0;
+  for (auto& read : reads) {
+    if (read.wait_until(deadline) != std::future_status::ready) {
+      failed++;
+      continue;
+    }
+    google::cloud::Status status = read.get();
+    if (!status.ok()) {
+      std::cerr << "Bigtable warm-up read failed: " << status << std::endl;
+      failed++;
+    }
+  }
+  if (failed > 0) {
+    std::cerr << failed << " of " << channels
+              << " Bigtable channels are not warm" << std::endl;
+  }
+}
+
+}  // namespace mathematics
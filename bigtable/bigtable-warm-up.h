@@ -0,0 +1,26 @@
+
+#ifndef BIGTABLE_WARM_UP_H_
+#define BIGTABLE_WARM_UP_H_
+
+#include <chrono>
+#include <cstddef>
+
+#include <google/cloud/bigtable/table.h>
+
+namespace mathematics {
+
+// The client options for the length table: --bigtable_channels channels in
+// the data client's pool.
+google::cloud::bigtable::ClientOptions BigtableClientOptionsFromFlags();
+
+// Opens the channels of the pool behind 'table', 'channels' of them, by
+// reading a row that does not exist on each at once. The data client picks
+// channels in turn, so 'channels' concurrent reads reach every one. Waits
+// until 'deadline' at most, and logs reads that failed or did not finish.
+void WarmUpBigtable(google::cloud::bigtable::Table table,
+                    std::size_t channels,
+                    std::chrono::system_clock::time_point deadline);
+
+}  // namespace mathematics
+
+#endif  // BIGTABLE_WARM_UP_H_
@@ -8,8 +8,22 @@
 #include <sstream>
 #include <string>
 
+#include "absl/flags/parse.h"
+#include "arithmetic-balancer.h"
 #include "arithmetic-service.grpc.pb.h"
+#include "async-log.h"
+#include "backlog.h"
+#include "bigtable-backlog-store.h"
+#include "bigtable-warm-up.h"
+#include "envelope.h"
 #include "geometry-service.pb.h"
+#include "lane-scheduler.h"
+#include "metrics.h"
+#include "packed-numbers.h"
+#include "scoped-arena.h"
+#include "startup.h"
+#include "sum-of-squares.h"
+#include "tracing.h"
 
 namespace mathematics {
 namespace {
@@ -49,23 +63,65 @@ std::string FormatDuration(std::chrono::system_clock::duration t) {
 
 class GeometryComputer {
  public:
-  GeometryComputer(Arithmetic::Stub* arithmetic)
+  GeometryComputer(ArithmeticBalancer* arithmetic, bool local_arithmetic)
       : arithmetic_(arithmetic),
+        local_arithmetic_(local_arithmetic),
         random_(std::chrono::system_clock::now().time_since_epoch().count()) {}
 
   cloud::Status ComputeLength(
       const ScheduleLengthComputationRequest& request,
-      const std::chrono::system_clock::time_point& deadline, double* length) {
+      const std::chrono::system_clock::time_point& deadline,
+      const tracing::SpanContext& trace_parent, double* length) {
+    tracing::Span span("GeometryComputer.ComputeLength", trace_parent);
+    span.SetAttribute("coordinates",
+                      request.coordinates_size() +
+                          packed::Count(request.packed_coordinates()));
     double sum = 0;
-    for (const auto& n : request.coordinates()) {
-      int square;
-      grpc::Status s = ComputeSquare(n, deadline, &square);
+    if (local_arithmetic_) {
+      std::uint64_t squares;
+      grpc::Status s = SumSquaresLocally(request, &squares);
       if (!s.ok()) {
+        span.SetStatus(s.error_code(), s.error_message());
+        return cloud::Status(static_cast<cloud::StatusCode>(s.error_code()),
+                             s.error_message());
+      }
+      sum = squares;
+    } else if (!request.packed_coordinates().empty()) {
+      std::uint64_t packed_sum;
+      grpc::Status s =
+          SumPackedSquares(request, deadline, span.context(), &packed_sum);
+      if (!s.ok()) {
+        span.SetStatus(s.error_code(), s.error_message());
         return cloud::Status(
             static_cast<cloud::StatusCode>(s.error_code()),
             s.error_message() + "; calling the arithmetic server.");
       }
-      sum += square;
+      sum = packed_sum;
+    } else if (arithmetic_->use_square_stream()) {
+      std::vector<std::int64_t> squares;
+      grpc::Status s = ComputeSquares(request.coordinates(), deadline,
+                                      span.context(), &squares);
+      if (!s.ok()) {
+        span.SetStatus(s.error_code(), s.error_message());
+        return cloud::Status(
+            static_cast<cloud::StatusCode>(s.error_code()),
+            s.error_message() + "; calling the arithmetic server.");
+      }
+      for (std::int64_t square : squares) {
+        sum += square;
+      }
+    } else {
+      for (const auto& n : request.coordinates()) {
+        int square;
+        grpc::Status s = ComputeSquare(n, deadline, span.context(), &square);
+        if (!s.ok()) {
+          span.SetStatus(s.error_code(), s.error_message());
+          return cloud::Status(
+              static_cast<cloud::StatusCode>(s.error_code()),
+              s.error_message() + "; calling the arithmetic server.");
+        }
+        sum += square;
+      }
     }
 
     *length = sqrt(sum);
@@ -77,6 +133,8 @@ class GeometryComputer {
   bool IsRetryableError(const grpc::Status& status) const {
     switch (status.error_code()) {
       case grpc::StatusCode::UNAVAILABLE:
+      // Refused by an overloaded arithmetic server, without doing any work.
+      case grpc::StatusCode::RESOURCE_EXHAUSTED:
         return true;
       default:
         return false;
@@ -85,21 +143,152 @@ class GeometryComputer {
 
   grpc::Status ComputeSquare(
       int n, const std::chrono::system_clock::time_point& deadline,
-      int* square) {
+      const tracing::SpanContext& trace_parent, int* square) {
     ComputeSquareRequest request;
     request.set_number(n);
+    ComputeSquareResponse response;
+
+    grpc::Status s = CallWithRetries(
+        "Arithmetic.ComputeSquare", deadline, [&](int attempt) {
+          tracing::Span call_span("Arithmetic.ComputeSquare/client",
+                                  trace_parent);
+          call_span.SetAttribute("attempt", attempt);
+          grpc::Status s = arithmetic_->ComputeSquare(
+              [&call_span, &deadline] {
+                auto ctx = std::make_unique<grpc::ClientContext>();
+                ctx->set_deadline(deadline);
+                tracing::Inject(call_span.context(), ctx.get());
+                return ctx;
+              },
+              request, &response);
+          call_span.SetStatus(s.error_code(), s.error_message());
+          return s;
+        });
+    if (s.ok()) {
+      *square = response.square();
+    }
+    return s;
+  }
+
+  grpc::Status ComputeSquares(
+      const google::protobuf::RepeatedField<std::int32_t>& numbers,
+      const std::chrono::system_clock::time_point& deadline,
+      const tracing::SpanContext& trace_parent,
+      std::vector<std::int64_t>* squares) {
+    return CallWithRetries(
+        "Arithmetic.SquareStream", deadline, [&](int attempt) {
+          tracing::Span call_span("Arithmetic.SquareStream/client",
+                                  trace_parent);
+          call_span.SetAttribute("attempt", attempt);
+          call_span.SetAttribute("numbers", numbers.size());
+          grpc::Status s = arithmetic_->ComputeSquares(
+              numbers.data(), numbers.size(), deadline, squares);
+          call_span.SetStatus(s.error_code(), s.error_message());
+          return s;
+        });
+  }
+
+  // Sets '*sum' to the sum of the squares of the coordinates of 'request',
+  // squared in-process rather than by the arithmetic servers.
+  grpc::Status SumSquaresLocally(
+      const ScheduleLengthComputationRequest& request, std::uint64_t* sum) {
+    const std::string& coordinates = request.packed_coordinates();
+    std::size_t count;
+    std::size_t end;
+    std::int32_t bad;
+    if (coordinates.empty()) {
+      count = request.coordinates_size();
+      end = SumOfSquares(request.coordinates().data(), count, sum);
+      bad = end < count ? request.coordinates(end) : 0;
+    } else {
+      if (request.coordinates_size() > 0) {
+        return grpc::Status(
+            grpc::StatusCode::INVALID_ARGUMENT,
+            "request has both coordinates and packed_coordinates");
+      }
+      if (!packed::WellFormed(coordinates)) {
+        return grpc::Status(
+            grpc::StatusCode::INVALID_ARGUMENT,
+            "request.packed_coordinates is not a whole number of uint16");
+      }
+      count = packed::Count(coordinates);
+      end = SumOfPackedSquares(coordinates, sum);
+      bad = end < count ? packed::At(coordinates, end) : 0;
+    }
+    if (end != count) {
+      std::stringstream ss;
+      ss << "request.coordinates[" << end << "] " << bad
+         << " is outside the valid range 0 .. " << packed::kMaxNumber;
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, ss.str());
+    }
+    return grpc::Status::OK;
+  }
 
+  // Sets '*sum' to the sum of the squares of the packed coordinates of
+  // 'request', computed with a single ComputePackedSquares call.
+  grpc::Status SumPackedSquares(
+      const ScheduleLengthComputationRequest& request,
+      const std::chrono::system_clock::time_point& deadline,
+      const tracing::SpanContext& trace_parent, std::uint64_t* sum) {
+    const std::string& coordinates = request.packed_coordinates();
+    if (request.coordinates_size() > 0) {
+      return grpc::Status(
+          grpc::StatusCode::INVALID_ARGUMENT,
+          "request has both coordinates and packed_coordinates");
+    }
+    if (!packed::WellFormed(coordinates)) {
+      return grpc::Status(
+          grpc::StatusCode::INVALID_ARGUMENT,
+          "request.packed_coordinates is not a whole number of uint16");
+    }
+    ComputePackedSquaresRequest squares_req;
+    *squares_req.mutable_packed_numbers() = coordinates;
+    ComputePackedSquaresResponse squares_resp;
+    grpc::Status s = CallWithRetries(
+        "Arithmetic.ComputePackedSquares", deadline, [&](int attempt) {
+          tracing::Span call_span("Arithmetic.ComputePackedSquares/client",
+                                  trace_parent);
+          call_span.SetAttribute("attempt", attempt);
+          call_span.SetAttribute("numbers", packed::Count(coordinates));
+          grpc::Status s = arithmetic_->ComputePackedSquares(
+              [&call_span, &deadline] {
+                auto ctx = std::make_unique<grpc::ClientContext>();
+                ctx->set_deadline(deadline);
+                tracing::Inject(call_span.context(), ctx.get());
+                return ctx;
+              },
+              squares_req, &squares_resp);
+          call_span.SetStatus(s.error_code(), s.error_message());
+          return s;
+        });
+    if (!s.ok()) {
+      return s;
+    }
+    if (squares_resp.packed_squares().size() != 2 * coordinates.size()) {
+      return grpc::Status(grpc::StatusCode::INTERNAL,
+                          "The arithmetic server returned the wrong number "
+                          "of squares.");
+    }
+    *sum = packed::Sum(squares_resp.packed_squares());
+    return grpc::Status::OK;
+  }
+
+  // Calls 'call(attempt)', with attempt = 1, 2, ..., until it succeeds,
+  // fails with an error that is not retryable, or the deadline would pass
+  // before the next attempt. Waits with jittered exponential backoff
+  // between attempts.
+  template <typename Call>
+  grpc::Status CallWithRetries(
+      const char* method,
+      const std::chrono::system_clock::time_point& deadline, Call call) {
     const auto kInitialDelayMs = 200;
     const double kScaling = 1.5;
 
     auto next_delay_ms = kInitialDelayMs;
 
-    for (;;) {
-      ComputeSquareResponse response;
-      grpc::ClientContext ctx;
-      grpc::Status s = arithmetic_->ComputeSquare(&ctx, request, &response);
+    for (int attempt = 1;; attempt++) {
+      grpc::Status s = call(attempt);
       if (s.ok()) {
-        *square = response.square();
         return grpc::Status::OK;
       }
       if (!IsRetryableError(s)) {
@@ -112,13 +301,12 @@ class GeometryComputer {
       next_delay_ms *= kScaling;
 
       if (std::chrono::system_clock::now() + delay > deadline) {
-        return grpc::Status(
-            grpc::StatusCode::DEADLINE_EXCEEDED,
-            "Deadline exceeded calling Arithmetic.ComputeSquare");
+        return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                            std::string("Deadline exceeded calling ") + method);
       }
 
-      std::cerr << "ComputeSquare request failed: " << s.error_message()
-                << "; will retry after " << FormatDuration(delay) << std::endl;
+      ASYNC_LOG(kWarning, "{} request failed: {}; will retry after {}", method,
+                s.error_message(), FormatDuration(delay));
 
       std::this_thread::sleep_for(delay);
     }
@@ -131,64 +319,282 @@ class GeometryComputer {
     return dist(random_);
   }
 
-  Arithmetic::Stub* arithmetic_;  // Not owned.
+  ArithmeticBalancer* arithmetic_;  // Not owned.
+  const bool local_arithmetic_;
   std::mutex mu_;
   std::default_random_engine random_;  // Guarded by mu_.
 };
 
+// Processing lag and outcome metrics, served on --metrics_port.
+struct ProcessorMetrics {
+  metrics::Histogram* queue_delay = metrics::NewHistogram(
+      "geometry_processor_queue_delay_seconds",
+      "Time from the geometry server publishing a request to the processor "
+      "starting on it.",
+      metrics::ExponentialBuckets(0.001, 2, 24));
+  metrics::Histogram* compute_time = metrics::NewHistogram(
+      "geometry_processor_compute_seconds",
+      "Time spent computing a length.", metrics::LatencyBuckets());
+  metrics::Histogram* write_time = metrics::NewHistogram(
+      "geometry_processor_write_seconds",
+      "Time spent writing a result to Bigtable.", metrics::LatencyBuckets());
+  metrics::Counter* acks = metrics::NewCounter(
+      "geometry_processor_acks_total", "Messages processed and acknowledged.");
+  metrics::Counter* malformed_drops = metrics::NewCounter(
+      "geometry_processor_drops_total",
+      "Messages left unacknowledged, by reason.",
+      {{"reason", "malformed"}});
+  metrics::Counter* compute_failure_drops = metrics::NewCounter(
+      "geometry_processor_drops_total",
+      "Messages left unacknowledged, by reason.",
+      {{"reason", "compute_failure"}});
+  metrics::Counter* write_failure_drops = metrics::NewCounter(
+      "geometry_processor_drops_total",
+      "Messages left unacknowledged, by reason.",
+      {{"reason", "write_failure"}});
+  metrics::Gauge* in_flight = metrics::NewGauge(
+      "geometry_processor_in_flight_messages",
+      "Messages, or requests of envelopes, currently being processed.");
+};
+
+// Returns when the request in 'm' was published. 'request' is null if the
+// message could not be parsed.
+std::chrono::system_clock::time_point PublishTime(
+    const ScheduleLengthComputationRequest* request, const pubsub::Message& m) {
+  if (request != nullptr && request->publish_time_micros() != 0) {
+    return std::chrono::system_clock::time_point(
+        std::chrono::microseconds(request->publish_time_micros()));
+  }
+  return m.publish_time();
+}
+
+// Returns how long the request in 'm' waited to be processed. 'request' is
+// null if the message could not be parsed.
+double QueueDelaySeconds(const ScheduleLengthComputationRequest* request,
+                         const pubsub::Message& m) {
+  return std::chrono::duration<double>(std::chrono::system_clock::now() -
+                                       PublishTime(request, m))
+      .count();
+}
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Returns the trace context the geometry server attached to 'm', if any.
+tracing::SpanContext ExtractTraceContext(const pubsub::Message& m) {
+  const auto attributes = m.attributes();
+  auto it = attributes.find(tracing::kTraceparentKey);
+  if (it == attributes.end()) return tracing::SpanContext();
+  return tracing::SpanContext::FromTraceparent(it->second);
+}
+
 void Run() {
+  StartupTimer startup;
+  if (!tracing::StartFileExporterFromFlags()) {
+    std::cerr << "Failed to open the trace file" << std::endl;
+    exit(-1);
+  }
+  if (!metrics::StartHttpServerFromFlags()) {
+    std::cerr << "Failed to start the metrics server" << std::endl;
+    exit(-1);
+  }
+  ProcessorMetrics processor_metrics;
+
   pubsub::Subscription subscription(kProjectId, kSubscriptionId);
   pubsub::Subscriber subscriber(pubsub::MakeSubscriberConnection(subscription));
 
-  grpc::ChannelArguments args;
-  args.SetLoadBalancingPolicyName("round_robin");
-  std::unique_ptr<Arithmetic::Stub> stub(Arithmetic::NewStub(
-      grpc::CreateCustomChannel("127.0.0.1:50051",
-                                grpc::InsecureChannelCredentials(), args)));
-  GeometryComputer computer(stub.get());
+  const bool local_arithmetic = LocalArithmeticFromFlags();
+  std::unique_ptr<ArithmeticBalancer> arithmetic =
+      ArithmeticBalancer::FromFlags();
+  if (arithmetic == nullptr) {
+    exit(-1);
+  }
+  if (!local_arithmetic) {
+    arithmetic->WaitForConnected(startup.deadline());
+  }
+  GeometryComputer computer(arithmetic.get(), local_arithmetic);
 
+  const cbt::ClientOptions bigtable_options = BigtableClientOptionsFromFlags();
   const cbt::Table table(
       cbt::CreateDefaultDataClient(kProjectId, kBigtableInstanceId,
-                                   cbt::ClientOptions()),
+                                   bigtable_options),
       kBigtableTableId, cbt::AlwaysRetryMutationPolicy());
+  WarmUpBigtable(table, bigtable_options.connection_pool_size(),
+                 startup.deadline());
+  // Counts the requests acknowledged, for the geometry servers to tell how
+  // far behind the processors are.
+  BigtableBacklogStore backlog_store(table);
+  std::unique_ptr<BacklogCounter> backlog =
+      BacklogCounter::FromFlags(&backlog_store);
+
+  EnvelopeTracker envelopes;
+
+  // Computes the length for 'request', which came in message 'm', writes it
+  // and returns whether it is done with.
+  auto process = [&](const ScheduleLengthComputationRequest& request,
+                     const pubsub::Message& m, tracing::Span* span) {
+    span->SetAttribute("id", request.id());
+    processor_metrics.queue_delay->Observe(QueueDelaySeconds(&request, m));
+
+    ASYNC_LOG(kInfo, "Received a length computation request with id {}",
+              request.id());
+
+    double length;
+    const auto deadline =
+        std::chrono::system_clock::now() + std::chrono::minutes(1);
+    const auto compute_start = std::chrono::steady_clock::now();
+    auto status =
+        computer.ComputeLength(request, deadline, span->context(), &length);
+    processor_metrics.compute_time->Observe(SecondsSince(compute_start));
+    if (!status.ok()) {
+      processor_metrics.compute_failure_drops->Increment();
+      ASYNC_LOG(kError, "Length computation failure: {} [{}]",
+                status.message(), cloud::StatusCodeToString(status.code()));
+      span->SetStatus(static_cast<int>(status.code()), status.message());
+      return false;
+    }
 
-  auto session =
-      subscriber.Subscribe([&](const pubsub::Message& m, pubsub::AckHandler h) {
-        ScheduleLengthComputationRequest request;
-        if (!request.ParseFromString(m.data())) {
-          std::cerr << "Malformed message, id: " << m.message_id() << std::endl;
-          return;
-        }
+    // Table is not thread-safe, so we need to make a copy before using it.
+    // (Since subscriber callbacks may run in parallel threads.)
+    cbt::Table table_copy = table;
+
+    LengthComputationResult lcr;
+    lcr.set_length(length);
+
+    cbt::SingleRowMutation mutation(request.id());
+    mutation.emplace_back(cbt::SetCell(kLengthResultColumnFamily, "",
+                                       lcr.SerializeAsString()));
+    tracing::Span write_span("bigtable.Apply", span->context());
+    const auto write_start = std::chrono::steady_clock::now();
+    status = table_copy.Apply(std::move(mutation));
+    processor_metrics.write_time->Observe(SecondsSince(write_start));
+    write_span.SetStatus(static_cast<int>(status.code()), status.message());
+    write_span.End();
+    if (!status.ok()) {
+      processor_metrics.write_failure_drops->Increment();
+      span->SetStatus(static_cast<int>(status.code()), status.message());
+      ASYNC_LOG(kError, "Bigtable write failure: {} [{}]", status.message(),
+                cloud::StatusCodeToString(status.code()));
+      return false;
+    }
 
-        std::cout << "Received a length computation request with id "
-                  << request.id() << std::endl;
+    return true;
+  };
+
+  // Processes message 'm', a single request, and acknowledges it once done
+  // with.
+  auto handle = [&](const pubsub::Message& m, pubsub::AckHandler h) {
+    const tracing::SpanContext publish_context = ExtractTraceContext(m);
+    // Time between the publish and the start of processing, including the
+    // wait in the lane.
+    tracing::Span("pubsub.Queue", publish_context, m.publish_time()).End();
+    tracing::Span span("GeometryProcessor.ProcessMessage", publish_context);
+    span.SetAttribute("message_id", m.message_id());
+    metrics::GaugeIncrement in_flight(processor_metrics.in_flight);
+
+    // Parsed onto the thread's arena block, and freed with it.
+    ScopedArena arena;
+    auto& request = *arena.Create<ScheduleLengthComputationRequest>();
+    if (!request.ParseFromString(m.data())) {
+      processor_metrics.queue_delay->Observe(QueueDelaySeconds(nullptr, m));
+      processor_metrics.malformed_drops->Increment();
+      ASYNC_LOG(kError, "Malformed message, id: {}", m.message_id());
+      span.SetStatus(grpc::StatusCode::INVALID_ARGUMENT, "Malformed message");
+      return;
+    }
+    if (!process(request, m, &span)) {
+      return;
+    }
 
-        double length;
-        const auto deadline =
-            std::chrono::system_clock::now() + std::chrono::minutes(1);
-        auto status = computer.ComputeLength(request, deadline, &length);
-        if (!status.ok()) {
-          std::cerr << "Length computation failure: " << status << std::endl;
-          return;
-        }
+    std::move(h).ack();
+    processor_metrics.acks->Increment();
+    if (backlog != nullptr) {
+      backlog->AddCompleted(PublishTime(&request, m));
+    }
+  };
 
-        // Table is not thread-safe, so we need to make a copy before using it.
-        // (Since subscriber callbacks may run in parallel threads.)
-        cbt::Table table_copy = table;
+  std::unique_ptr<LaneScheduler> lanes = LaneScheduler::FromFlags();
+  if (lanes == nullptr) {
+    exit(-1);
+  }
 
-        LengthComputationResult lcr;
-        lcr.set_length(length);
+  // Submits each request of the envelope in message 'm' to a lane, as if it
+  // came in a message of its own, so that the lanes bound how many requests
+  // are processed at once whatever message they came in. The last request
+  // done acknowledges the message, if all of them are.
+  auto split = [&](const pubsub::Message& m,
+                   std::shared_ptr<pubsub::AckHandler> h) {
+    const tracing::SpanContext publish_context = ExtractTraceContext(m);
+    tracing::Span("pubsub.Queue", publish_context, m.publish_time()).End();
+    tracing::Span span("GeometryProcessor.ProcessMessage", publish_context);
+    span.SetAttribute("message_id", m.message_id());
+
+    // Shared by the requests, which outlive this call in their lanes.
+    auto message = std::make_shared<const pubsub::Message>(m);
+    auto envelope = std::make_shared<ScheduleLengthComputationBatch>();
+    if (!envelope->ParseFromString(m.data())) {
+      processor_metrics.queue_delay->Observe(QueueDelaySeconds(nullptr, m));
+      processor_metrics.malformed_drops->Increment();
+      ASYNC_LOG(kError, "Malformed message, id: {}", m.message_id());
+      span.SetStatus(grpc::StatusCode::INVALID_ARGUMENT, "Malformed message");
+      return;
+    }
+    span.SetAttribute("requests", envelope->requests_size());
+
+    std::shared_ptr<EnvelopeTracker::Delivery> delivery =
+        envelopes.Begin(m.message_id(), envelope->requests_size());
+    if (delivery->pending().empty()) {
+      std::move(*h).ack();
+      processor_metrics.acks->Increment();
+      if (backlog != nullptr) {
+        for (const auto& r : envelope->requests()) {
+          backlog->AddCompleted(PublishTime(&r, m));
+        }
+      }
+      return;
+    }
+    const tracing::SpanContext context = span.context();
+    for (int i : delivery->pending()) {
+      const std::size_t bytes = envelope->requests(i).ByteSizeLong();
+      lanes->Submit(
+          lanes->LaneFor(m.attributes(), bytes), bytes,
+          [&process, &processor_metrics, &backlog, message, envelope,
+           delivery, h, i, context] {
+            tracing::Span request_span(
+                "GeometryProcessor.ProcessRequest",
+                RequestTraceContext(*envelope, i, context));
+            metrics::GaugeIncrement in_flight(processor_metrics.in_flight);
+            if (delivery->Record(i, process(envelope->requests(i), *message,
+                                            &request_span))) {
+              std::move(*h).ack();
+              processor_metrics.acks->Increment();
+              if (backlog != nullptr) {
+                for (const auto& r : envelope->requests()) {
+                  backlog->AddCompleted(PublishTime(&r, *message));
+                }
+              }
+            }
+          });
+    }
+  };
 
-        cbt::SingleRowMutation mutation(request.id());
-        mutation.emplace_back(cbt::SetCell(kLengthResultColumnFamily, "",
-                                           lcr.SerializeAsString()));
-        status = table_copy.Apply(std::move(mutation));
-        if (!status.ok()) {
-          std::cerr << "Bigtable write failure: " << status << std::endl;
+  startup.Ready("Geometry processor");
+  auto session =
+      subscriber.Subscribe([&](const pubsub::Message& m, pubsub::AckHandler h) {
+        // The message waits in its lane while the subscriber goes on to
+        // deliver others.
+        auto handler = std::make_shared<pubsub::AckHandler>(std::move(h));
+        if (IsEnvelope(m.attributes())) {
+          split(m, std::move(handler));
           return;
         }
-
-        std::move(h).ack();
+        const std::size_t bytes = m.data().size();
+        lanes->Submit(
+            lanes->LaneFor(m.attributes(), bytes), bytes,
+            [&handle, m, handler] { handle(m, std::move(*handler)); });
       });
 
   auto status = session.get();
@@ -198,4 +604,7 @@ void Run() {
 }  // namespace
 }  // namespace mathematics
 
-int main() { mathematics::Run(); }
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  mathematics::Run();
+}
@@ -1,7 +1,9 @@
 
+#include <chrono>
 #include <cmath>
 #include <iostream>
 #include <memory>
+#include <string>
 #include <thread>
 
 #include <google/cloud/bigtable/table.h>
@@ -13,7 +15,24 @@
 #include <grpc/grpc.h>
 #include <grpcpp/grpcpp.h>
 
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "backlog.h"
+#include "bigtable-backlog-store.h"
+#include "bigtable-warm-up.h"
+#include "envelope.h"
 #include "geometry-service.grpc.pb.h"
+#include "lane-scheduler.h"
+#include "metrics.h"
+#include "packed-numbers.h"
+#include "publish-dedup.h"
+#include "scoped-arena.h"
+#include "startup.h"
+#include "tracing.h"
+
+ABSL_FLAG(std::string, listen_address, "127.0.0.20:40123",
+          "The address to serve on: host:port, or unix:/path/to/socket or "
+          "unix-abstract:name for a Unix domain socket.");
 
 namespace mathematics {
 namespace {
@@ -31,8 +50,15 @@ constexpr char kTopicId[] = "foobar-topic";
 class GeometryServiceImpl final : public Geometry::Service {
  public:
   GeometryServiceImpl(std::shared_ptr<pubsub::PublisherConnection> pubsub_conn,
-                      cbt::Table length_table)
-      : publisher_(pubsub_conn), length_table_(length_table) {}
+                      cbt::Table length_table, PublishDedup* dedup,
+                      PublishBatcher* batcher, BacklogCounter* backlog_counter,
+                      BacklogGate* backlog_gate)
+      : publisher_(pubsub_conn),
+        length_table_(length_table),
+        dedup_(dedup),
+        batcher_(batcher),
+        backlog_counter_(backlog_counter),
+        backlog_gate_(backlog_gate) {}
 
   grpc::Status ScheduleLengthComputation(
       grpc::ServerContext* context,
@@ -44,17 +70,78 @@ class GeometryServiceImpl final : public Geometry::Service {
     // multiple threads is guaranteed to work. Two threads operating on the same
     // instance of this class is not guaranteed to work."
     auto publisher = publisher_;
-    auto message_id = publisher
-                          .Publish(pubsub::MessageBuilder()
-                                       .SetData(request->SerializeAsString())
-                                       .Build())
-                          .get();
+
+    tracing::Span span("Geometry.ScheduleLengthComputation",
+                       tracing::Extract(*context));
+    span.SetAttribute("id", request->id());
+    span.SetAttribute("coordinates",
+                      request->coordinates_size() +
+                          packed::Count(request->packed_coordinates()));
+    if (backlog_gate_ != nullptr) {
+      grpc::Status admitted = backlog_gate_->Admit(context);
+      if (!admitted.ok()) {
+        span.SetStatus(admitted.error_code(), admitted.error_message());
+        return admitted;
+      }
+    }
+
+    // Stamped when published; the rest is what identifies a request sent
+    // again.
+    ScopedArena arena;
+    auto& stamped = *arena.Create<ScheduleLengthComputationRequest>();
+    stamped = *request;
+    stamped.clear_publish_time_micros();
+
+    auto publish = [&]() -> PublishDedup::Result {
+      tracing::Span publish_span("pubsub.Publish", span.context());
+      stamped.set_publish_time_micros(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::system_clock::now().time_since_epoch())
+              .count());
+      // A request with a priority goes on its own, so that the processors can
+      // route it by the attribute.
+      if (batcher_ != nullptr && stamped.priority() == PRIORITY_DEFAULT) {
+        return batcher_->Publish(stamped, publish_span.context()).get();
+      }
+
+      pubsub::MessageBuilder message;
+      message.SetData(stamped.SerializeAsString());
+      if (publish_span.context().valid()) {
+        // The processor continues the trace from here.
+        message.InsertAttribute(tracing::kTraceparentKey,
+                                publish_span.context().ToTraceparent());
+      }
+      if (stamped.priority() != PRIORITY_DEFAULT) {
+        message.InsertAttribute(kPriorityKey,
+                                Priority_Name(stamped.priority()));
+      }
+      return publisher.Publish(std::move(message).Build()).get();
+    };
+    PublishDedup::Result message_id;
+    bool duplicate = false;
+    if (dedup_ == nullptr) {
+      message_id = publish();
+    } else {
+      message_id = dedup_->Publish(
+          PublishDedup::MakeKey(request->id(), 0,
+                                stamped.SerializeAsString()),
+          publish, &duplicate);
+      if (duplicate) {
+        span.SetAttribute("duplicate", 1);
+      }
+    }
     if (!message_id.ok()) {
+      span.SetStatus(static_cast<int>(message_id.status().code()),
+                     message_id.status().message());
       return grpc::Status(
           static_cast<grpc::StatusCode>(message_id.status().code()),
           message_id.status().message() +
               "; publishing a length computation request to pubsub.");
     }
+    if (!duplicate && backlog_counter_ != nullptr) {
+      backlog_counter_->AddScheduled(std::chrono::system_clock::time_point(
+          std::chrono::microseconds(stamped.publish_time_micros())));
+    }
     return grpc::Status::OK;
   }
 
@@ -93,22 +180,52 @@ class GeometryServiceImpl final : public Geometry::Service {
  private:
   const pubsub::Publisher publisher_;
   const cbt::Table length_table_;
+  PublishDedup* const dedup_;              // Not owned; nullptr if off.
+  PublishBatcher* const batcher_;          // Not owned; nullptr if off.
+  BacklogCounter* const backlog_counter_;  // Not owned; nullptr if off.
+  BacklogGate* const backlog_gate_;        // Not owned; nullptr if off.
 };
 
 void RunServer() {
+  StartupTimer startup;
+  if (!tracing::StartFileExporterFromFlags()) {
+    std::cerr << "Failed to open the trace file" << std::endl;
+    exit(-1);
+  }
+  if (!metrics::StartHttpServerFromFlags()) {
+    std::cerr << "Failed to start the metrics server" << std::endl;
+    exit(-1);
+  }
+
   // Connect to pubsub for publishing.
   std::shared_ptr<pubsub::PublisherConnection> pubsub_conn(
       pubsub::MakePublisherConnection(pubsub::Topic(kProjectId, kTopicId), {}));
 
   // Connect to bigtable.
+  const cbt::ClientOptions bigtable_options = BigtableClientOptionsFromFlags();
   cbt::Table length_table(
       cbt::CreateDefaultDataClient(kProjectId, kBigtableInstanceId,
-                                   cbt::ClientOptions()),
+                                   bigtable_options),
       kBigtableTableId, cbt::AlwaysRetryMutationPolicy());
+  WarmUpBigtable(length_table, bigtable_options.connection_pool_size(),
+                 startup.deadline());
+
+  std::unique_ptr<PublishDedup> dedup = PublishDedup::FromFlags();
+  std::unique_ptr<PublishBatcher> batcher =
+      PublishBatcher::FromFlags(pubsub_conn);
+
+  BigtableBacklogStore backlog_store(length_table);
+  std::unique_ptr<BacklogCounter> backlog_counter =
+      BacklogCounter::FromFlags(&backlog_store);
+  std::unique_ptr<BacklogGate> backlog_gate =
+      BacklogGate::FromFlags(&backlog_store);
 
   // Create the service implementation and start the server.
-  std::string server_address("127.0.0.20:40123");
-  GeometryServiceImpl service(pubsub_conn, length_table);
+  const std::string server_address = absl::GetFlag(FLAGS_listen_address);
+  GeometryServiceImpl service(pubsub_conn, length_table, dedup.get(),
+                              batcher.get(), backlog_counter.get(),
+                              backlog_gate.get());
+  grpc::EnableDefaultHealthCheckService(true);
   grpc::ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
   builder.RegisterService(&service);
@@ -119,10 +236,14 @@ void RunServer() {
     exit(-1);
   }
   std::cout << "Server listening on " << server_address << std::endl;
+  startup.Ready("Geometry server");
   server->Wait();
 }
 
 }  // namespace
 }  // namespace mathematics
 
-int main() { mathematics::RunServer(); }
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  mathematics::RunServer();
+}
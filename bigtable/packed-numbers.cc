@@ -0,0 +1,59 @@
+
+#include "packed-numbers.h"
+
+namespace mathematics {
+namespace packed {
+
+// The loops below read and write bytes explicitly, so they are correct on
+// any host; on little-endian ones compilers turn them into plain vector
+// loads and stores.
+
+std::string Pack(const std::int32_t* numbers, std::size_t count) {
+  std::string packed(2 * count, '\0');
+  auto* p = reinterpret_cast<unsigned char*>(&packed[0]);
+  for (std::size_t i = 0; i < count; i++) {
+    p[2 * i] = numbers[i] & 0xff;
+    p[2 * i + 1] = (numbers[i] >> 8) & 0xff;
+  }
+  return packed;
+}
+
+std::size_t FindOutOfRange(const std::string& numbers) {
+  const std::size_t count = Count(numbers);
+  for (std::size_t i = 0; i < count; i++) {
+    if (At(numbers, i) > kMaxNumber) {
+      return i;
+    }
+  }
+  return count;
+}
+
+void Square(const std::string& numbers, std::string* squares) {
+  const std::size_t count = Count(numbers);
+  squares->resize(4 * count);
+  const auto* in = reinterpret_cast<const unsigned char*>(numbers.data());
+  auto* out = reinterpret_cast<unsigned char*>(&(*squares)[0]);
+  for (std::size_t i = 0; i < count; i++) {
+    const std::uint32_t n = in[2 * i] | in[2 * i + 1] << 8;
+    const std::uint32_t square = n * n;
+    out[4 * i] = square & 0xff;
+    out[4 * i + 1] = (square >> 8) & 0xff;
+    out[4 * i + 2] = (square >> 16) & 0xff;
+    out[4 * i + 3] = square >> 24;
+  }
+}
+
+std::uint64_t Sum(const std::string& squares) {
+  const std::size_t count = squares.size() / 4;
+  const auto* p = reinterpret_cast<const unsigned char*>(squares.data());
+  std::uint64_t sum = 0;
+  for (std::size_t i = 0; i < count; i++) {
+    sum += std::uint32_t{p[4 * i]} | std::uint32_t{p[4 * i + 1]} << 8 |
+           std::uint32_t{p[4 * i + 2]} << 16 |
+           std::uint32_t{p[4 * i + 3]} << 24;
+  }
+  return sum;
+}
+
+}  // namespace packed
+}  // namespace mathematics
@@ -0,0 +1,61 @@
+
+#ifndef PACKED_NUMBERS_H_
+#define PACKED_NUMBERS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// The packed encoding of the packed_* bytes fields: numbers as little-endian
+// uint16, two bytes each, and their squares as little-endian uint32, four
+// bytes each.
+//
+// Coordinates and numbers are at most 1000, yet as repeated varint fields
+// they take two bytes on the wire and are decoded one at a time into a
+// RepeatedField. Packed, they are the same two bytes, and are read in place
+// from the parsed message with no decoding step:
+//
+//   std::size_t bad = packed::FindOutOfRange(request.packed_numbers());
+//   ...
+//   packed::Square(request.packed_numbers(),
+//                  response->mutable_packed_squares());
+
+namespace mathematics {
+namespace packed {
+
+// The largest number the arithmetic server squares.
+constexpr std::int32_t kMaxNumber = 1000;
+
+// Returns 'count' numbers, each of which must be in 0 .. 65535, packed.
+std::string Pack(const std::int32_t* numbers, std::size_t count);
+
+// Whether 'numbers' is a whole number of packed numbers.
+inline bool WellFormed(const std::string& numbers) {
+  return numbers.size() % 2 == 0;
+}
+
+inline std::size_t Count(const std::string& numbers) {
+  return numbers.size() / 2;
+}
+
+inline std::int32_t At(const std::string& numbers, std::size_t i) {
+  const auto* p = reinterpret_cast<const unsigned char*>(numbers.data());
+  return p[2 * i] | p[2 * i + 1] << 8;
+}
+
+// Returns the index of the first number in 'numbers' above kMaxNumber, or
+// Count(numbers) if there is none.
+std::size_t FindOutOfRange(const std::string& numbers);
+
+// Sets '*squares' to the packed squares of 'numbers', all of which must be
+// in range.
+void Square(const std::string& numbers, std::string* squares);
+
+// Returns the sum of packed 'squares'. Exact: with squares up to 10^6 it
+// cannot overflow for any message that fits in memory.
+std::uint64_t Sum(const std::string& squares);
+
+}  // namespace packed
+}  // namespace mathematics
+
+#endif  // PACKED_NUMBERS_H_
@@ -0,0 +1,46 @@
+
+#ifndef SCOPED_ARENA_H_
+#define SCOPED_ARENA_H_
+
+#include <cstddef>
+
+#include <google/protobuf/arena.h>
+
+namespace mathematics {
+
+// A protobuf arena for the messages of one subscriber callback or one
+// synchronous RPC. Messages created on it, and everything they own, are
+// freed at once when it goes out of scope instead of one by one.
+//
+// Its first kBlockSize bytes are a block that belongs to the thread and is
+// reused by each ScopedArena the thread creates, so a callback whose
+// messages fit in it does not touch the heap for them. Only the outermost
+// ScopedArena on a thread gets the block; one nested in it starts on the
+// heap.
+class ScopedArena {
+ public:
+  static constexpr std::size_t kBlockSize = 16 * 1024;
+
+  ScopedArena();
+  ~ScopedArena();
+
+  ScopedArena(const ScopedArena&) = delete;
+  ScopedArena& operator=(const ScopedArena&) = delete;
+
+  // Returns a new, empty message that lives as long as the arena.
+  template <typename Message>
+  Message* Create() {
+    return google::protobuf::Arena::CreateMessage<Message>(&arena_);
+  }
+
+  google::protobuf::Arena* get() { return &arena_; }
+
+ private:
+  // Before arena_, which sets it.
+  bool has_thread_block_ = false;
+  google::protobuf::Arena arena_;
+};
+
+}  // namespace mathematics
+
+#endif  // SCOPED_ARENA_H_
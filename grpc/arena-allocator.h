@@ -0,0 +1,97 @@
+
+#ifndef ARENA_ALLOCATOR_H_
+#define ARENA_ALLOCATOR_H_
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <google/protobuf/arena.h>
+#include <grpcpp/support/message_allocator.h>
+
+namespace mathematics {
+
+// Allocates the request and response of a callback-API unary method on a
+// protobuf arena, rather than with a heap allocation for each message and
+// each of their strings and repeated fields. Each call gets an arena whose
+// first kBlockSize bytes come with it; when the call is done the arena is
+// reset, which keeps that block, and kept for a later call. Calls whose
+// messages fit in the block never touch the heap for them. Thread-safe.
+//
+// Set on a service with its SetMessageAllocatorFor_<Method>(), and destroy
+// only after the server that uses it is shut down.
+template <typename Request, typename Response>
+class ArenaAllocator final
+    : public grpc::MessageAllocator<Request, Response> {
+ public:
+  static constexpr std::size_t kBlockSize = 4096;
+
+  ArenaAllocator() = default;
+  ArenaAllocator(const ArenaAllocator&) = delete;
+  ArenaAllocator& operator=(const ArenaAllocator&) = delete;
+
+  grpc::MessageHolder<Request, Response>* AllocateMessages() override {
+    std::unique_ptr<Holder> holder;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (!free_.empty()) {
+        holder = std::move(free_.back());
+        free_.pop_back();
+      }
+    }
+    if (holder == nullptr) holder = std::make_unique<Holder>(this);
+    holder->Allocate();
+    return holder.release();
+  }
+
+ private:
+  // Enough for all calls in flight at once on a busy server; more than this
+  // are freed when done rather than kept.
+  static constexpr std::size_t kMaxFree = 1024;
+
+  class Holder final : public grpc::MessageHolder<Request, Response> {
+   public:
+    explicit Holder(ArenaAllocator* allocator)
+        : allocator_(allocator), arena_(Options(block_)) {}
+
+    void Allocate() {
+      this->set_request(
+          google::protobuf::Arena::CreateMessage<Request>(&arena_));
+      this->set_response(
+          google::protobuf::Arena::CreateMessage<Response>(&arena_));
+    }
+
+    // Called by gRPC when the call is done with the messages.
+    void Release() override {
+      arena_.Reset();
+      allocator_->Free(this);
+    }
+
+   private:
+    static google::protobuf::ArenaOptions Options(char* block) {
+      google::protobuf::ArenaOptions options;
+      options.initial_block = block;
+      options.initial_block_size = kBlockSize;
+      return options;
+    }
+
+    ArenaAllocator* const allocator_;  // Not owned.
+    // Before arena_, which is constructed on it.
+    alignas(std::max_align_t) char block_[kBlockSize];
+    google::protobuf::Arena arena_;
+  };
+
+  void Free(Holder* holder) {
+    std::unique_ptr<Holder> owned(holder);
+    std::lock_guard<std::mutex> lock(mu_);
+    if (free_.size() < kMaxFree) free_.push_back(std::move(owned));
+  }
+
+  std::mutex mu_;
+  std::vector<std::unique_ptr<Holder>> free_;  // Guarded by mu_.
+};
+
+}  // namespace mathematics
+
+#endif  // ARENA_ALLOCATOR_H_
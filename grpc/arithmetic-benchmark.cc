@@ -0,0 +1,156 @@
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "arithmetic-service.grpc.pb.h"
+#include "geometry-service.pb.h"
+#include "packed-numbers.h"
+#include "square-stream.h"
+
+// Compares the cost per number of squaring numbers with one unary
+// ComputeSquare call each, over a SquareStream, and in packed
+// ComputePackedSquares calls of --vector_size numbers, against a running
+// arithmetic server:
+//
+//   $ ./arithmetic-server &
+//   $ ./arithmetic-benchmark --numbers=100000
+
+ABSL_FLAG(std::string, target, "127.0.0.1:50051",
+          "The arithmetic server to call.");
+ABSL_FLAG(int, numbers, 10000, "How many numbers to square in each mode.");
+ABSL_FLAG(int, window, 128,
+          "Numbers outstanding at once on the square stream.");
+ABSL_FLAG(int, vector_size, 500,
+          "Numbers per ComputePackedSquares call, and per repeated-field "
+          "message in the encoding comparison.");
+
+using ::mathematics::Arithmetic;
+using ::mathematics::ComputePackedSquaresRequest;
+using ::mathematics::ComputePackedSquaresResponse;
+using ::mathematics::ComputeSquareRequest;
+using ::mathematics::ComputeSquareResponse;
+using ::mathematics::SquareStream;
+
+namespace {
+
+void Report(const char* mode, int numbers,
+            std::chrono::steady_clock::duration elapsed) {
+  double us = std::chrono::duration<double, std::micro>(elapsed).count();
+  std::cout << mode << ": " << numbers << " numbers in " << us / 1000
+            << " ms, " << us / numbers << " us/number" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  const int n = absl::GetFlag(FLAGS_numbers);
+
+  std::unique_ptr<Arithmetic::Stub> stub(Arithmetic::NewStub(
+      grpc::CreateChannel(absl::GetFlag(FLAGS_target),
+                          grpc::InsecureChannelCredentials())));
+
+  std::vector<std::int32_t> numbers(n);
+  for (int i = 0; i < n; i++) {
+    numbers[i] = i % 1000;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; i++) {
+    ComputeSquareRequest request;
+    request.set_number(numbers[i]);
+    ComputeSquareResponse response;
+    grpc::ClientContext context;
+    grpc::Status status = stub->ComputeSquare(&context, request, &response);
+    if (!status.ok()) {
+      std::cerr << "ComputeSquare failed: " << status.error_message()
+                << std::endl;
+      return 1;
+    }
+  }
+  Report("unary ComputeSquare", n, std::chrono::steady_clock::now() - start);
+
+  SquareStream stream(stub.get(), absl::GetFlag(FLAGS_window));
+  std::vector<std::int64_t> squares;
+  start = std::chrono::steady_clock::now();
+  grpc::Status status =
+      stream.ComputeSquares(numbers.data(), numbers.size(),
+                            std::chrono::system_clock::time_point::max(),
+                            &squares);
+  if (!status.ok()) {
+    std::cerr << "SquareStream failed: " << status.error_message()
+              << std::endl;
+    return 1;
+  }
+  Report("SquareStream", n, std::chrono::steady_clock::now() - start);
+
+  for (int i = 0; i < n; i++) {
+    if (squares[i] != std::int64_t{numbers[i]} * numbers[i]) {
+      std::cerr << "Wrong square of " << numbers[i] << ": " << squares[i]
+                << std::endl;
+      return 1;
+    }
+  }
+
+  const int vector_size = absl::GetFlag(FLAGS_vector_size);
+  std::uint64_t packed_sum = 0;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; i += vector_size) {
+    ComputePackedSquaresRequest request;
+    request.set_packed_numbers(mathematics::packed::Pack(
+        numbers.data() + i, std::min(vector_size, n - i)));
+    ComputePackedSquaresResponse response;
+    grpc::ClientContext context;
+    status = stub->ComputePackedSquares(&context, request, &response);
+    if (!status.ok()) {
+      std::cerr << "ComputePackedSquares failed: " << status.error_message()
+                << std::endl;
+      return 1;
+    }
+    packed_sum += mathematics::packed::Sum(response.packed_squares());
+  }
+  Report("packed ComputePackedSquares", n,
+         std::chrono::steady_clock::now() - start);
+
+  std::uint64_t sum = 0;
+  for (std::int64_t square : squares) {
+    sum += square;
+  }
+  if (packed_sum != sum) {
+    std::cerr << "Wrong sum of packed squares: " << packed_sum << std::endl;
+    return 1;
+  }
+
+  // The encodings of one vector, on the wire and in parsing time.
+  const int m = std::min(vector_size, n);
+  mathematics::ComputeLengthRequest repeated;
+  repeated.mutable_coordinates()->Add(numbers.begin(), numbers.begin() + m);
+  mathematics::ComputeLengthRequest packed;
+  packed.set_packed_coordinates(
+      mathematics::packed::Pack(numbers.data(), m));
+  for (const auto* message : {&repeated, &packed}) {
+    const std::string wire = message->SerializeAsString();
+    constexpr int kParses = 10000;
+    mathematics::ComputeLengthRequest parsed;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kParses; i++) {
+      parsed.ParseFromString(wire);
+    }
+    const double us = std::chrono::duration<double, std::micro>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+    std::cout << (message == &repeated ? "repeated" : "packed") << " "
+              << m << " coordinates: " << wire.size() << " bytes, "
+              << us / kParses << " us to parse" << std::endl;
+  }
+  return 0;
+}
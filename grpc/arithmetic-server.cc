@@ -1,7 +1,6 @@
 
 #include <iostream>
 #include <memory>
-#include <sstream>
 #include <string>
 
 #include <grpc/grpc.h>
@@ -10,53 +9,41 @@
 #include <grpc++/server_context.h>
 #include <grpc++/security/server_credentials.h>
 
-#include "arithmetic-service.grpc.pb.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "admission-control.h"
+#include "arithmetic-service-impl.h"
+#include "metrics.h"
+#include "tracing.h"
+
+ABSL_FLAG(std::string, listen_address, "127.0.0.1:50051",
+          "The address to serve on: host:port, or unix:/path/to/socket or "
+          "unix-abstract:name for a Unix domain socket, which skips the TCP "
+          "stack for clients on the same host. Run several replicas on "
+          "different addresses to balance across them with "
+          "--arithmetic_endpoints.");
 
 namespace mathematics {
 namespace {
 
 using ::grpc::Server;
 using ::grpc::ServerBuilder;
-using ::grpc::ServerContext;
-using ::grpc::Status;
-using ::grpc::StatusCode;
-
-class ArithmeticServiceImpl final : public Arithmetic::Service {
- public:
-  ArithmeticServiceImpl() {}
 
-  Status ComputeSquare(ServerContext* context,
-                       const ComputeSquareRequest* request,
-                       ComputeSquareResponse* response) override {
-    if (request->number() < 0 || request->number() > 1000) {
-      std::stringstream ss;
-      ss << "request.number " << request->number() << " is outside the valid range 0 .. 1000";
-      return Status(StatusCode::INVALID_ARGUMENT, ss.str());
-    }
-    response->set_square(request->number() * request->number());
-
-    return Status::OK;
+void RunServer() {
+  if (!tracing::StartFileExporterFromFlags()) {
+    std::cerr << "Failed to open the trace file" << std::endl;
+    exit(-1);
   }
-
-  Status ComputeCube(ServerContext* context,
-                     const ComputeCubeRequest* request,
-                     ComputeCubeResponse* response) override {
-    int n = request->number();
-    if (n < 0 || n > 1000) {
-      std::stringstream ss;
-      ss << "request.number " << n << " is outside the valid range 0 .. 1000";
-      return Status(StatusCode::INVALID_ARGUMENT, ss.str());
-    }
-    response->set_cube(n * n * n);
-    
-    return Status::OK;
+  if (!metrics::StartHttpServerFromFlags()) {
+    std::cerr << "Failed to start the metrics server" << std::endl;
+    exit(-1);
   }
-};
 
-void RunServer() {
-  std::string server_address("127.0.0.1:50051");
-  ArithmeticServiceImpl service;
+  const std::string server_address = absl::GetFlag(FLAGS_listen_address);
+  std::unique_ptr<AdmissionControl> admission = AdmissionControl::FromFlags();
+  ArithmeticServiceImpl service(admission.get());
   ServerBuilder builder;
+  SetResourceQuotaFromFlags(&builder);
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
   builder.RegisterService(&service);
   std::unique_ptr<Server> server(builder.BuildAndStart());
@@ -71,6 +58,7 @@ void RunServer() {
 }  // namespace
 }  // namespace mathematics
 
-int main() {
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
   mathematics::RunServer();
 }
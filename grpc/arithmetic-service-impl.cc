@@ -0,0 +1,156 @@
+
+#include "arithmetic-service-impl.h"
+
+#include <sstream>
+#include <string>
+
+#include "packed-numbers.h"
+#include "tracing.h"
+
+namespace mathematics {
+
+using ::grpc::CallbackServerContext;
+using ::grpc::ServerContext;
+using ::grpc::ServerContextBase;
+using ::grpc::ServerReaderWriter;
+using ::grpc::ServerUnaryReactor;
+using ::grpc::Status;
+using ::grpc::StatusCode;
+
+ArithmeticServiceImpl::ArithmeticServiceImpl(AdmissionControl* admission)
+    : admission_(admission) {
+  SetMessageAllocatorFor_ComputePackedSquares(&packed_squares_allocator_);
+}
+
+Status ArithmeticServiceImpl::ComputeSquare(
+    ServerContext* context, const ComputeSquareRequest* request,
+    ComputeSquareResponse* response) {
+  AdmissionControl::Permit permit;
+  Status admitted = Admit(*context, &permit);
+  if (!admitted.ok()) {
+    return admitted;
+  }
+  tracing::Span span("Arithmetic.ComputeSquare", tracing::Extract(*context));
+  span.SetAttribute("number", request->number());
+  if (request->number() < 0 || request->number() > 1000) {
+    std::stringstream ss;
+    ss << "request.number " << request->number()
+       << " is outside the valid range 0 .. 1000";
+    span.SetStatus(StatusCode::INVALID_ARGUMENT, ss.str());
+    return Status(StatusCode::INVALID_ARGUMENT, ss.str());
+  }
+  response->set_square(request->number() * request->number());
+
+  return Status::OK;
+}
+
+Status ArithmeticServiceImpl::ComputeCube(ServerContext* context,
+                                          const ComputeCubeRequest* request,
+                                          ComputeCubeResponse* response) {
+  AdmissionControl::Permit permit;
+  Status admitted = Admit(*context, &permit);
+  if (!admitted.ok()) {
+    return admitted;
+  }
+  tracing::Span span("Arithmetic.ComputeCube", tracing::Extract(*context));
+  int n = request->number();
+  span.SetAttribute("number", n);
+  if (n < 0 || n > 1000) {
+    std::stringstream ss;
+    ss << "request.number " << n << " is outside the valid range 0 .. 1000";
+    span.SetStatus(StatusCode::INVALID_ARGUMENT, ss.str());
+    return Status(StatusCode::INVALID_ARGUMENT, ss.str());
+  }
+  response->set_cube(n * n * n);
+
+  return Status::OK;
+}
+
+Status ArithmeticServiceImpl::SquareStream(
+    ServerContext* context,
+    ServerReaderWriter<SquareStreamResponse, SquareStreamRequest>* stream) {
+  SquareStreamRequest request;
+  SquareStreamResponse response;
+  while (stream->Read(&request)) {
+    response.Clear();
+    response.set_request_id(request.request_id());
+    const int n = request.number();
+    {
+      // Each request is admitted on its own, as a call would be: a stream
+      // lasts as long as the client wants, and holding a place for all of
+      // it would count idle streams against the limit.
+      AdmissionControl::Permit permit;
+      Status admitted = Admit(*context, &permit);
+      if (!admitted.ok()) {
+        response.set_error_code(admitted.error_code());
+        response.set_error_message(admitted.error_message());
+      } else if (n < 0 || n > 1000) {
+        std::stringstream ss;
+        ss << "request.number " << n
+           << " is outside the valid range 0 .. 1000";
+        response.set_error_code(StatusCode::INVALID_ARGUMENT);
+        response.set_error_message(ss.str());
+      } else {
+        response.set_square(n * n);
+      }
+    }
+    if (!stream->Write(response)) {
+      break;
+    }
+  }
+
+  return Status::OK;
+}
+
+ServerUnaryReactor* ArithmeticServiceImpl::ComputePackedSquares(
+    CallbackServerContext* context, const ComputePackedSquaresRequest* request,
+    ComputePackedSquaresResponse* response) {
+  ServerUnaryReactor* reactor = context->DefaultReactor();
+  reactor->Finish(PackedSquares(*context, *request, response));
+  return reactor;
+}
+
+Status ArithmeticServiceImpl::PackedSquares(
+    const ServerContextBase& context,
+    const ComputePackedSquaresRequest& request,
+    ComputePackedSquaresResponse* response) {
+  AdmissionControl::Permit permit;
+  Status admitted = Admit(context, &permit);
+  if (!admitted.ok()) {
+    return admitted;
+  }
+  tracing::Span span("Arithmetic.ComputePackedSquares",
+                     tracing::Extract(context));
+  // Read in place from the request, with no per-number decoding.
+  const std::string& numbers = request.packed_numbers();
+  if (!packed::WellFormed(numbers)) {
+    std::stringstream ss;
+    ss << "request.packed_numbers has " << numbers.size()
+       << " bytes, which is not a whole number of uint16";
+    span.SetStatus(StatusCode::INVALID_ARGUMENT, ss.str());
+    return Status(StatusCode::INVALID_ARGUMENT, ss.str());
+  }
+  span.SetAttribute("numbers", packed::Count(numbers));
+  const std::size_t bad = packed::FindOutOfRange(numbers);
+  if (bad != packed::Count(numbers)) {
+    std::stringstream ss;
+    ss << "request.packed_numbers[" << bad << "] "
+       << packed::At(numbers, bad) << " is outside the valid range 0 .. "
+       << packed::kMaxNumber;
+    span.SetStatus(StatusCode::INVALID_ARGUMENT, ss.str());
+    return Status(StatusCode::INVALID_ARGUMENT, ss.str());
+  }
+  packed::Square(numbers, response->mutable_packed_squares());
+
+  return Status::OK;
+}
+
+Status ArithmeticServiceImpl::Admit(const ServerContextBase& context,
+                                    AdmissionControl::Permit* permit) {
+  if (admission_ == nullptr) {
+    return Status::OK;
+  }
+  return admission_->Admit(context, permit);
+}
+
+}  // namespace mathematics
@@ -0,0 +1,63 @@
+
+#ifndef ARITHMETIC_SERVICE_IMPL_H_
+#define ARITHMETIC_SERVICE_IMPL_H_
+
+#include <grpcpp/grpcpp.h>
+
+#include "admission-control.h"
+#include "arena-allocator.h"
+#include "arithmetic-service.grpc.pb.h"
+
+namespace mathematics {
+
+// The Arithmetic service, for the arithmetic servers and for binaries that
+// serve it alongside other services.
+//
+// ComputePackedSquares uses the callback API, so that its request and
+// response, strings and all, are allocated on a pooled arena rather than on
+// the heap; it never blocks, so it does not hold up the callback threads.
+// The other methods keep the synchronous API: gRPC already puts their
+// messages, which have no strings, in the memory of the call.
+class ArithmeticServiceImpl final
+    : public Arithmetic::WithCallbackMethod_ComputePackedSquares<
+          Arithmetic::Service> {
+ public:
+  // 'admission' may be null, for no admission control.
+  explicit ArithmeticServiceImpl(AdmissionControl* admission);
+
+  grpc::Status ComputeSquare(grpc::ServerContext* context,
+                             const ComputeSquareRequest* request,
+                             ComputeSquareResponse* response) override;
+
+  grpc::Status ComputeCube(grpc::ServerContext* context,
+                           const ComputeCubeRequest* request,
+                           ComputeCubeResponse* response) override;
+
+  grpc::Status SquareStream(
+      grpc::ServerContext* context,
+      grpc::ServerReaderWriter<SquareStreamResponse, SquareStreamRequest>*
+          stream) override;
+
+  grpc::ServerUnaryReactor* ComputePackedSquares(
+      grpc::CallbackServerContext* context,
+      const ComputePackedSquaresRequest* request,
+      ComputePackedSquaresResponse* response) override;
+
+ private:
+  // The body of ComputePackedSquares.
+  grpc::Status PackedSquares(const grpc::ServerContextBase& context,
+                             const ComputePackedSquaresRequest& request,
+                             ComputePackedSquaresResponse* response);
+
+  // Returns OK and sets '*permit' if the call may be served.
+  grpc::Status Admit(const grpc::ServerContextBase& context,
+                     AdmissionControl::Permit* permit);
+
+  AdmissionControl* const admission_;  // Not owned; nullptr if off.
+  ArenaAllocator<ComputePackedSquaresRequest, ComputePackedSquaresResponse>
+      packed_squares_allocator_;
+};
+
+}  // namespace mathematics
+
+#endif  // ARITHMETIC_SERVICE_IMPL_H_
@@ -0,0 +1,126 @@
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "arithmetic-balancer.h"
+#include "arithmetic-service-impl.h"
+
+// Measures how ComputeSquare throughput through an ArithmeticBalancer scales
+// with the number of connections it opens to a replica, for --threads
+// concurrent callers:
+//
+//   $ ./channel-pool-benchmark --connections=1,2,4,8 --threads=32
+//
+// By default the benchmark serves Arithmetic itself on a free loopback port.
+// To measure an arithmetic server in another process, or on another host:
+//
+//   $ ./arithmetic-server &
+//   $ ./channel-pool-benchmark --target=127.0.0.1:50051
+
+ABSL_FLAG(std::string, target, "",
+          "The arithmetic server to call; empty serves one in-process on a "
+          "free loopback port.");
+ABSL_FLAG(std::vector<std::string>, connections,
+          std::vector<std::string>({"1", "2", "4", "8"}),
+          "Comma-separated connection counts to measure.");
+ABSL_FLAG(int, threads, 32, "Concurrent callers.");
+ABSL_FLAG(int, seconds, 5, "How long to measure each connection count for.");
+
+using ::mathematics::ArithmeticBalancer;
+using ::mathematics::ComputeSquareRequest;
+using ::mathematics::ComputeSquareResponse;
+
+namespace {
+
+bool CallOnce(ArithmeticBalancer* balancer, int number) {
+  ComputeSquareRequest request;
+  request.set_number(number);
+  ComputeSquareResponse response;
+  grpc::Status status = balancer->ComputeSquare(
+      [] { return std::make_unique<grpc::ClientContext>(); }, request,
+      &response);
+  if (!status.ok()) {
+    std::cerr << "ComputeSquare failed: " << status.error_message()
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool Measure(const std::string& target, int connections) {
+  ArithmeticBalancer balancer({target}, ArithmeticBalancer::HedgingOptions(),
+                              /*use_square_stream=*/false,
+                              /*square_stream_window=*/1, connections);
+  if (balancer.WaitForConnected(std::chrono::system_clock::now() +
+                                std::chrono::seconds(5)) == 0) {
+    return false;
+  }
+  // Warms up both ends.
+  for (int i = 0; i < 1000; i++) {
+    if (!CallOnce(&balancer, i % 1000)) return false;
+  }
+
+  const int threads = absl::GetFlag(FLAGS_threads);
+  const int seconds = absl::GetFlag(FLAGS_seconds);
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+  std::atomic<std::int64_t> done{0};
+  std::atomic<bool> failed{false};
+  std::vector<std::thread> callers;
+  for (int t = 0; t < threads; t++) {
+    callers.emplace_back([&balancer, &deadline, &done, &failed] {
+      std::int64_t n = 0;
+      while (!failed && std::chrono::steady_clock::now() < deadline) {
+        if (!CallOnce(&balancer, n % 1000)) {
+          failed = true;
+          break;
+        }
+        n++;
+      }
+      done += n;
+    });
+  }
+  for (auto& caller : callers) caller.join();
+  if (failed) return false;
+
+  std::cout << connections << " connection(s), " << threads
+            << " callers: " << done / seconds << " calls/s" << std::endl;
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+
+  std::string target = absl::GetFlag(FLAGS_target);
+  mathematics::ArithmeticServiceImpl service(nullptr);
+  std::unique_ptr<grpc::Server> server;
+  if (target.empty()) {
+    grpc::ServerBuilder builder;
+    int port = 0;
+    builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(),
+                             &port);
+    builder.RegisterService(&service);
+    server = builder.BuildAndStart();
+    if (server == nullptr) {
+      std::cerr << "Failed to start the arithmetic server" << std::endl;
+      return 1;
+    }
+    target = "127.0.0.1:" + std::to_string(port);
+  }
+
+  for (const std::string& connections : absl::GetFlag(FLAGS_connections)) {
+    if (!Measure(target, std::stoi(connections))) return 1;
+  }
+}
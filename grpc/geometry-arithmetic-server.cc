@@ -0,0 +1,101 @@
+
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <grpc/grpc.h>
+#include <grpcpp/grpcpp.h>
+#include <grpc++/server.h>
+#include <grpc++/server_builder.h>
+#include <grpc++/server_context.h>
+#include <grpc++/security/server_credentials.h>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "admission-control.h"
+#include "arithmetic-balancer.h"
+#include "arithmetic-service-impl.h"
+#include "geometry-service-impl.h"
+#include "length-cache.h"
+#include "metrics.h"
+#include "startup.h"
+#include "sum-of-squares.h"
+#include "tracing.h"
+
+ABSL_FLAG(std::string, listen_address, "127.0.0.20:40123",
+          "The address to serve both Geometry and Arithmetic on: host:port, "
+          "or unix:/path/to/socket or unix-abstract:name.");
+
+// A geometry server and an arithmetic server in one process, for hosts that
+// would otherwise run both side by side. Both services are registered on one
+// grpc::Server, and Geometry calls Arithmetic through the server's
+// in-process channel: requests and responses are still serialized, through
+// the same Arithmetic::Stub, but never touch a socket.
+//
+// Arithmetic stays reachable on --listen_address for other geometry servers.
+// Each Geometry call waiting on Arithmetic holds a server thread while its
+// Arithmetic calls need another, so --max_server_threads, if set, has to
+// allow for both.
+
+namespace mathematics {
+namespace {
+
+using ::grpc::Server;
+using ::grpc::ServerBuilder;
+
+void RunServer() {
+  StartupTimer startup;
+  if (!tracing::StartFileExporterFromFlags()) {
+    std::cerr << "Failed to open the trace file" << std::endl;
+    exit(-1);
+  }
+  if (!metrics::StartHttpServerFromFlags()) {
+    std::cerr << "Failed to start the metrics server" << std::endl;
+    exit(-1);
+  }
+
+  const std::string server_address = absl::GetFlag(FLAGS_listen_address);
+  // Outlives the server, which calls through it until it shuts down.
+  std::unique_ptr<ArithmeticBalancer> arithmetic;
+  std::unique_ptr<AdmissionControl> admission = AdmissionControl::FromFlags();
+  ArithmeticServiceImpl arithmetic_service(admission.get());
+  std::unique_ptr<LengthCache> cache = LengthCache::FromFlags();
+  // The channel to Arithmetic is only there once the server started.
+  GeometryServiceImpl geometry_service(nullptr, LocalArithmeticFromFlags(),
+                                       cache.get());
+  grpc::EnableDefaultHealthCheckService(true);
+  ServerBuilder builder;
+  SetResourceQuotaFromFlags(&builder);
+  builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+  builder.RegisterService(&arithmetic_service);
+  builder.RegisterService(&geometry_service);
+  std::unique_ptr<Server> server(builder.BuildAndStart());
+  if (server == nullptr) {
+    std::cerr << "Failed to start the server at " << server_address << std::endl;
+    exit(-1);
+  }
+  // Not healthy until Geometry has its channel and memo.
+  server->GetHealthCheckService()->SetServingStatus(false);
+  arithmetic = ArithmeticBalancer::FromFlags(
+      "in-process", server->InProcessChannel(grpc::ChannelArguments()));
+  geometry_service.SetArithmetic(arithmetic.get());
+  if (PrimeSquareMemoFromFlags()) {
+    grpc::Status s = geometry_service.PrimeSquareMemo(startup.deadline());
+    if (!s.ok()) {
+      std::cerr << "Failed to prime the square memo: " << s.error_message()
+                << std::endl;
+    }
+  }
+  server->GetHealthCheckService()->SetServingStatus(true);
+  std::cout << "Server listening on " << server_address << std::endl;
+  startup.Ready("Geometry and arithmetic server");
+  server->Wait();
+}
+
+}  // namespace
+}  // namespace mathematics
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  mathematics::RunServer();
+}
@@ -1,7 +1,8 @@
 
-#include <cmath>
 #include <iostream>
 #include <memory>
+#include <string>
+
 #include <grpc/grpc.h>
 #include <grpcpp/grpcpp.h>
 #include <grpc++/server.h>
@@ -9,63 +10,61 @@
 #include <grpc++/server_context.h>
 #include <grpc++/security/server_credentials.h>
 
-#include "arithmetic-service.grpc.pb.h"
-#include "geometry-service.grpc.pb.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "arithmetic-balancer.h"
+#include "geometry-service-impl.h"
+#include "length-cache.h"
+#include "metrics.h"
+#include "startup.h"
+#include "sum-of-squares.h"
+#include "tracing.h"
+
+ABSL_FLAG(std::string, listen_address, "127.0.0.20:40123",
+          "The address to serve on: host:port, or unix:/path/to/socket or "
+          "unix-abstract:name for a Unix domain socket.");
 
 namespace mathematics {
 namespace {
 
-using ::grpc::Channel;
-using ::grpc::ChannelArguments;
-using ::grpc::ClientContext;
 using ::grpc::Server;
 using ::grpc::ServerBuilder;
-using ::grpc::ServerContext;
-using ::grpc::Status;
-using ::grpc::StatusCode;
-
-class GeometryServiceImpl final : public Geometry::Service {
- public:
-  GeometryServiceImpl(Arithmetic::Stub* arithmetic)
-      : arithmetic_(arithmetic) {}
-
-  Status ComputeLength(ServerContext* context,
-                       const ComputeLengthRequest* request,
-                       ComputeLengthResponse* response) override {
-    double sum = 0;
-    for (const auto& n : request->coordinates()) {
-      ComputeSquareRequest square_req;
-      square_req.set_number(n);
-      ComputeSquareResponse square_resp;
-      ClientContext ctx;
-      Status s = arithmetic_->ComputeSquare(&ctx, square_req, &square_resp);
-      if (!s.ok()) {
-        return Status(s.error_code(),
-                      s.error_message() + "; calling the arithmetic server.");
-      }
-      sum += square_resp.square();
-    }
-    response->set_length(sqrt(sum));
 
-    return Status::OK;
+void RunServer() {
+  StartupTimer startup;
+  if (!tracing::StartFileExporterFromFlags()) {
+    std::cerr << "Failed to open the trace file" << std::endl;
+    exit(-1);
+  }
+  if (!metrics::StartHttpServerFromFlags()) {
+    std::cerr << "Failed to start the metrics server" << std::endl;
+    exit(-1);
   }
-  
- private:
-  Arithmetic::Stub* arithmetic_;  // Not owned.
-};
 
-void RunServer() {
-  // Connect to the arithmetic server.
-  ChannelArguments args;
-  args.SetLoadBalancingPolicyName("round_robin");
-  std::unique_ptr<Arithmetic::Stub> stub(Arithmetic::NewStub(
-      grpc::CreateCustomChannel("127.0.0.1:50051",
-                                grpc::InsecureChannelCredentials(),
-                                args)));
+  // Connect to the arithmetic servers.
+  const bool local_arithmetic = LocalArithmeticFromFlags();
+  std::unique_ptr<ArithmeticBalancer> arithmetic =
+      ArithmeticBalancer::FromFlags();
+  if (arithmetic == nullptr) {
+    exit(-1);
+  }
+  if (!local_arithmetic) {
+    arithmetic->WaitForConnected(startup.deadline());
+  }
 
-  // Create the service implementation and start the server.
-  std::string server_address("127.0.0.20:40123");
-  GeometryServiceImpl service(stub.get());
+  // Create the service implementation and start the server once it is warm.
+  const std::string server_address = absl::GetFlag(FLAGS_listen_address);
+  std::unique_ptr<LengthCache> cache = LengthCache::FromFlags();
+  GeometryServiceImpl service(arithmetic.get(), local_arithmetic,
+                              cache.get());
+  if (PrimeSquareMemoFromFlags()) {
+    grpc::Status s = service.PrimeSquareMemo(startup.deadline());
+    if (!s.ok()) {
+      std::cerr << "Failed to prime the square memo: " << s.error_message()
+                << std::endl;
+    }
+  }
+  grpc::EnableDefaultHealthCheckService(true);
   ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
   builder.RegisterService(&service);
@@ -75,12 +74,14 @@ void RunServer() {
     exit(-1);
   }
   std::cout << "Server listening on " << server_address << std::endl;
+  startup.Ready("Geometry server");
   server->Wait();
 }
 
 }  // namespace
 }  // namespace mathematics
 
-int main() {
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
   mathematics::RunServer();
 }
@@ -0,0 +1,572 @@
+
+#include "geometry-service-impl.h"
+
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "absl/flags/flag.h"
+#include "packed-numbers.h"
+#include "sum-of-squares.h"
+
+ABSL_FLAG(bool, prime_square_memo, false,
+          "If true, the squares of all valid coordinates are fetched from the "
+          "arithmetic servers at startup rather than as requests need them.");
+
+namespace mathematics {
+namespace {
+
+// How many chunks of a ComputeLengthStream may be read ahead of the one being
+// computed. Bounds the memory a stream uses, however long it is.
+constexpr std::size_t kStreamChunksReadAhead = 4;
+
+// A blocking queue with a fixed capacity, between one producer and one
+// consumer.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(std::size_t capacity) : capacity_(capacity) {}
+
+  // Blocks while the queue is full. Returns false if the queue was closed.
+  bool Push(T item) {
+    std::unique_lock<std::mutex> lock(mu_);
+    not_full_.wait(lock,
+                   [this] { return closed_ || items_.size() < capacity_; });
+    if (closed_) return false;
+    items_.push_back(std::move(item));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  // Blocks while the queue is empty. Returns false once the queue is closed
+  // and empty.
+  bool Pop(T* item) {
+    std::unique_lock<std::mutex> lock(mu_);
+    not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+    if (items_.empty()) return false;
+    *item = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(mu_);
+    closed_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+ private:
+  const std::size_t capacity_;
+  std::mutex mu_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::deque<T> items_;  // Guarded by mu_.
+  bool closed_ = false;  // Guarded by mu_.
+};
+
+}  // namespace
+
+using ::grpc::ClientContext;
+using ::grpc::ServerContext;
+using ::grpc::ServerReader;
+using ::grpc::Status;
+using ::grpc::StatusCode;
+
+GeometryServiceImpl::GeometryServiceImpl(ArithmeticBalancer* arithmetic,
+                                         bool local_arithmetic,
+                                         LengthCache* cache)
+    : arithmetic_(arithmetic),
+      local_arithmetic_(local_arithmetic),
+      cache_(cache),
+      abandoned_(metrics::NewCounter(
+          "geometry_server_abandoned_requests_total",
+          "ComputeLength requests stopped early because the caller "
+          "cancelled or the deadline passed.")),
+      square_calls_saved_(metrics::NewCounter(
+          "geometry_server_square_calls_saved_total",
+          "ComputeSquare calls not made for abandoned requests.")),
+      squares_fetched_(metrics::NewCounter(
+          "geometry_server_squares_fetched_total",
+          "Squares ComputeLengths fetched from the arithmetic servers "
+          "because the square memo did not have them yet.")) {}
+
+Status GeometryServiceImpl::PrimeSquareMemo(
+    std::chrono::system_clock::time_point deadline) {
+  if (local_arithmetic_ || arithmetic() == nullptr) {
+    return Status::OK;
+  }
+  const std::string missing =
+      square_memo_.Missing(std::vector<bool>(packed::kMaxNumber + 1, true));
+  if (missing.empty()) {
+    return Status::OK;
+  }
+  ComputePackedSquaresRequest squares_req;
+  *squares_req.mutable_packed_numbers() = missing;
+  ComputePackedSquaresResponse squares_resp;
+  Status s = arithmetic()->ComputePackedSquares(
+      [deadline] {
+        auto ctx = std::make_unique<ClientContext>();
+        ctx->set_deadline(deadline);
+        return ctx;
+      },
+      squares_req, &squares_resp);
+  if (!s.ok()) {
+    return s;
+  }
+  if (squares_resp.packed_squares().size() != 2 * missing.size()) {
+    return Status(StatusCode::INTERNAL,
+                  "The arithmetic server returned the wrong number of "
+                  "squares.");
+  }
+  square_memo_.Add(missing, squares_resp.packed_squares());
+  squares_fetched_->Increment(packed::Count(missing));
+  return Status::OK;
+}
+
+Status GeometryServiceImpl::ComputeLength(ServerContext* context,
+                                          const ComputeLengthRequest* request,
+                                          ComputeLengthResponse* response) {
+  tracing::Span span("Geometry.ComputeLength", tracing::Extract(*context));
+  span.SetAttribute("coordinates", CoordinateCount(*request));
+
+  std::string packed_coordinates;
+  const std::string* cache_key = nullptr;
+  if (cache_ != nullptr) {
+    cache_key = CacheKey(*request, &packed_coordinates);
+    double length;
+    if (cache_key != nullptr && cache_->Lookup(*cache_key, &length)) {
+      span.SetAttribute("cache_hit", 1);
+      response->set_length(length);
+      return Status::OK;
+    }
+  }
+
+  double sum = 0;
+  Status s = AddSquares(context, *request, &span, &sum);
+  if (!s.ok()) {
+    return s;
+  }
+  response->set_length(sqrt(sum));
+  if (cache_key != nullptr) {
+    cache_->Insert(*cache_key, response->length());
+  }
+
+  return Status::OK;
+}
+
+Status GeometryServiceImpl::ComputeLengthStream(
+    ServerContext* context, ServerReader<ComputeLengthRequest>* reader,
+    ComputeLengthResponse* response) {
+  tracing::Span span("Geometry.ComputeLengthStream",
+                     tracing::Extract(*context));
+
+  // Read the next chunks while squaring the current one.
+  BoundedQueue<ComputeLengthRequest> chunks(kStreamChunksReadAhead);
+  std::thread read_ahead([reader, &chunks] {
+    ComputeLengthRequest chunk;
+    while (reader->Read(&chunk)) {
+      // Once squaring has failed the queue is closed, and the rest of the
+      // stream is read and dropped until the caller half-closes it:
+      // cancelling the call instead would replace its status with
+      // CANCELLED.
+      chunks.Push(std::move(chunk));
+    }
+    chunks.Close();
+  });
+
+  double sum = 0;
+  std::int64_t coordinates = 0;
+  ComputeLengthRequest chunk;
+  Status s;
+  while (chunks.Pop(&chunk)) {
+    coordinates += CoordinateCount(chunk);
+    s = AddSquares(context, chunk, &span, &sum);
+    if (!s.ok()) {
+      // Unblocks the reader if it waits on the queue.
+      chunks.Close();
+      break;
+    }
+  }
+  read_ahead.join();
+  span.SetAttribute("coordinates", coordinates);
+  if (!s.ok()) {
+    return s;
+  }
+  if (context->IsCancelled()) {
+    // The stream ended because the caller went away.
+    span.SetStatus(StatusCode::CANCELLED, "Cancelled");
+    return Status(StatusCode::CANCELLED, "The caller cancelled.");
+  }
+  response->set_length(sqrt(sum));
+
+  return Status::OK;
+}
+
+Status GeometryServiceImpl::ComputeLengths(
+    ServerContext* context, const ComputeLengthsRequest* request,
+    ComputeLengthsResponse* response) {
+  tracing::Span span("Geometry.ComputeLengths", tracing::Extract(*context));
+
+  // All the coordinates, packed, and where each vector ends. A request that
+  // is packed already is read in place.
+  const std::string* coordinates = &request->packed_coordinates();
+  const std::uint32_t* ends = request->vector_ends().data();
+  std::size_t vectors = request->vector_ends_size();
+  std::vector<std::string> errors(vectors);
+  std::string flattened;
+  std::vector<std::uint32_t> flattened_ends;
+  if (request->vectors_size() > 0) {
+    if (!coordinates->empty() || vectors > 0) {
+      return InvalidArgument(
+          "request has both vectors and packed_coordinates or vector_ends",
+          &span);
+    }
+    Flatten(request->vectors(), &flattened, &flattened_ends, &errors);
+    coordinates = &flattened;
+    ends = flattened_ends.data();
+    vectors = flattened_ends.size();
+  } else {
+    if (!packed::WellFormed(*coordinates)) {
+      return InvalidArgument(
+          "request.packed_coordinates is not a whole number of uint16",
+          &span);
+    }
+    for (std::size_t i = 0; i < vectors; i++) {
+      if (ends[i] < (i == 0 ? 0 : ends[i - 1])) {
+        return InvalidArgument("request.vector_ends is not non-decreasing",
+                               &span);
+      }
+    }
+    if ((vectors == 0 ? 0 : ends[vectors - 1]) !=
+        packed::Count(*coordinates)) {
+      return InvalidArgument(
+          "request.vector_ends does not end at the last coordinate", &span);
+    }
+  }
+  span.SetAttribute("vectors", vectors);
+  span.SetAttribute("coordinates", packed::Count(*coordinates));
+
+  // One pass over the vectors checks their coordinates, sums their squares
+  // if local arithmetic is trusted, and otherwise notes which squares will
+  // be needed.
+  std::vector<std::uint64_t> sums(vectors);
+  std::vector<bool> wanted(packed::kMaxNumber + 1);
+  for (std::size_t i = 0; i < vectors; i++) {
+    if (!errors[i].empty()) continue;
+    const std::uint32_t begin = i == 0 ? 0 : ends[i - 1];
+    const char* data = coordinates->data() + 2 * begin;
+    const std::size_t count = ends[i] - begin;
+    const std::size_t bad = SumOfPackedSquares(data, count, &sums[i]);
+    if (bad != count) {
+      std::stringstream ss;
+      ss << "coordinates[" << bad << "] "
+         << packed::At(*coordinates, begin + bad)
+         << " is outside the valid range 0 .. " << packed::kMaxNumber;
+      errors[i] = ss.str();
+    } else if (!local_arithmetic_) {
+      for (std::size_t j = begin; j < ends[i]; j++) {
+        wanted[packed::At(*coordinates, j)] = true;
+      }
+    }
+  }
+
+  if (!local_arithmetic_) {
+    // Only squares no earlier request needed go to the arithmetic servers,
+    // each once however many vectors have it.
+    const std::string missing = square_memo_.Missing(wanted);
+    span.SetAttribute("squares_fetched", packed::Count(missing));
+    if (!missing.empty()) {
+      if (context->IsCancelled()) {
+        return Abandon(packed::Count(missing), &span);
+      }
+      if (arithmetic() == nullptr) {
+        return NoArithmetic(&span);
+      }
+      std::string squares;
+      Status s = ComputePackedSquares(context, missing, &span, &squares);
+      if (!s.ok()) {
+        return s;
+      }
+      square_memo_.Add(missing, squares);
+      squares_fetched_->Increment(packed::Count(missing));
+    }
+    for (std::size_t i = 0; i < vectors; i++) {
+      if (!errors[i].empty()) continue;
+      const std::uint32_t begin = i == 0 ? 0 : ends[i - 1];
+      sums[i] = square_memo_.Sum(coordinates->data() + 2 * begin,
+                                 ends[i] - begin);
+    }
+  }
+
+  response->mutable_lengths()->Reserve(vectors);
+  for (std::size_t i = 0; i < vectors; i++) {
+    if (errors[i].empty()) {
+      response->add_lengths(sqrt(sums[i]));
+      continue;
+    }
+    response->add_lengths(0);
+    VectorError* error = response->add_errors();
+    error->set_index(i);
+    error->set_code(StatusCode::INVALID_ARGUMENT);
+    error->set_message(errors[i]);
+  }
+  span.SetAttribute("errors", response->errors_size());
+
+  return Status::OK;
+}
+
+const std::string* GeometryServiceImpl::CacheKey(
+    const ComputeLengthRequest& request, std::string* packed_coordinates) {
+  if (!request.packed_coordinates().empty()) {
+    if (request.coordinates_size() > 0) return nullptr;
+    return &request.packed_coordinates();
+  }
+  if (request.coordinates_size() == 0) return nullptr;
+  for (std::int32_t n : request.coordinates()) {
+    // Packing would wrap these onto valid coordinates.
+    if (n < 0 || n > packed::kMaxNumber) return nullptr;
+  }
+  *packed_coordinates = packed::Pack(request.coordinates().data(),
+                                     request.coordinates_size());
+  return packed_coordinates;
+}
+
+std::size_t GeometryServiceImpl::CoordinateCount(
+    const ComputeLengthRequest& request) {
+  return request.coordinates_size() +
+         packed::Count(request.packed_coordinates());
+}
+
+Status GeometryServiceImpl::AddSquares(ServerContext* context,
+                                       const ComputeLengthRequest& request,
+                                       tracing::Span* span, double* sum) {
+  if (!request.packed_coordinates().empty()) {
+    if (request.coordinates_size() > 0) {
+      return InvalidArgument(
+          "request has both coordinates and packed_coordinates", span);
+    }
+    if (!packed::WellFormed(request.packed_coordinates())) {
+      return InvalidArgument(
+          "request.packed_coordinates is not a whole number of uint16",
+          span);
+    }
+  }
+  if (local_arithmetic_) {
+    return AddSquaresLocally(request, span, sum);
+  }
+  if (arithmetic() == nullptr) {
+    return NoArithmetic(span);
+  }
+  if (request.packed_coordinates().empty()) {
+    return AddSquares(context, request.coordinates(), span, sum);
+  }
+  return AddPackedSquares(context, request.packed_coordinates(), span, sum);
+}
+
+Status GeometryServiceImpl::AddSquaresLocally(
+    const ComputeLengthRequest& request, tracing::Span* span, double* sum) {
+  std::uint64_t squares;
+  std::size_t count;
+  std::size_t end;
+  std::int32_t bad;
+  if (request.packed_coordinates().empty()) {
+    count = request.coordinates_size();
+    end = SumOfSquares(request.coordinates().data(), count, &squares);
+    bad = end < count ? request.coordinates(end) : 0;
+  } else {
+    count = packed::Count(request.packed_coordinates());
+    end = SumOfPackedSquares(request.packed_coordinates(), &squares);
+    bad = end < count ? packed::At(request.packed_coordinates(), end) : 0;
+  }
+  if (end != count) {
+    std::stringstream ss;
+    ss << "request.coordinates[" << end << "] " << bad
+       << " is outside the valid range 0 .. " << packed::kMaxNumber;
+    return InvalidArgument(ss.str(), span);
+  }
+  *sum += squares;
+  return Status::OK;
+}
+
+Status GeometryServiceImpl::AddSquares(
+    ServerContext* context,
+    const google::protobuf::RepeatedField<int32_t>& coordinates,
+    tracing::Span* span, double* sum) {
+  if (arithmetic()->use_square_stream()) {
+    return AddSquaresStreamed(context, coordinates, span, sum);
+  }
+  for (int i = 0; i < coordinates.size(); i++) {
+    if (context->IsCancelled()) {
+      return Abandon(coordinates.size() - i, span);
+    }
+    ComputeSquareRequest square_req;
+    square_req.set_number(coordinates[i]);
+    ComputeSquareResponse square_resp;
+    tracing::Span call_span("Arithmetic.ComputeSquare/client",
+                            span->context());
+    Status s = arithmetic()->ComputeSquare(
+        [context, &call_span] {
+          // Inherits the caller's deadline, and is cancelled with it.
+          std::unique_ptr<ClientContext> ctx =
+              ClientContext::FromServerContext(*context);
+          tracing::Inject(call_span.context(), ctx.get());
+          return ctx;
+        },
+        square_req, &square_resp);
+    call_span.SetStatus(s.error_code(), s.error_message());
+    if (!s.ok()) {
+      if (context->IsCancelled()) {
+        return Abandon(coordinates.size() - i - 1, span);
+      }
+      span->SetStatus(s.error_code(), s.error_message());
+      return Status(s.error_code(),
+                    s.error_message() + "; calling the arithmetic server.");
+    }
+    *sum += square_resp.square();
+  }
+  return Status::OK;
+}
+
+Status GeometryServiceImpl::AddSquaresStreamed(
+    ServerContext* context,
+    const google::protobuf::RepeatedField<int32_t>& coordinates,
+    tracing::Span* span, double* sum) {
+  tracing::Span call_span("Arithmetic.SquareStream/client", span->context());
+  call_span.SetAttribute("numbers", coordinates.size());
+  std::vector<std::int64_t> squares;
+  Status s = arithmetic()->ComputeSquares(coordinates.data(),
+                                         coordinates.size(),
+                                         context->deadline(), &squares);
+  call_span.SetStatus(s.error_code(), s.error_message());
+  if (!s.ok()) {
+    if (context->IsCancelled()) {
+      return Abandon(0, span);
+    }
+    span->SetStatus(s.error_code(), s.error_message());
+    return Status(s.error_code(),
+                  s.error_message() + "; calling the arithmetic server.");
+  }
+  for (std::int64_t square : squares) {
+    *sum += square;
+  }
+  return Status::OK;
+}
+
+Status GeometryServiceImpl::AddPackedSquares(ServerContext* context,
+                                             const std::string& packed,
+                                             tracing::Span* span,
+                                             double* sum) {
+  std::string squares;
+  Status s = ComputePackedSquares(context, packed, span, &squares);
+  if (!s.ok()) {
+    return s;
+  }
+  *sum += packed::Sum(squares);
+  return Status::OK;
+}
+
+Status GeometryServiceImpl::ComputePackedSquares(ServerContext* context,
+                                                 const std::string& numbers,
+                                                 tracing::Span* span,
+                                                 std::string* squares) {
+  ComputePackedSquaresRequest squares_req;
+  *squares_req.mutable_packed_numbers() = numbers;
+  ComputePackedSquaresResponse squares_resp;
+  tracing::Span call_span("Arithmetic.ComputePackedSquares/client",
+                          span->context());
+  call_span.SetAttribute("numbers", packed::Count(numbers));
+  Status s = arithmetic()->ComputePackedSquares(
+      [context, &call_span] {
+        std::unique_ptr<ClientContext> ctx =
+            ClientContext::FromServerContext(*context);
+        tracing::Inject(call_span.context(), ctx.get());
+        return ctx;
+      },
+      squares_req, &squares_resp);
+  call_span.SetStatus(s.error_code(), s.error_message());
+  if (!s.ok()) {
+    if (context->IsCancelled()) {
+      return Abandon(0, span);
+    }
+    span->SetStatus(s.error_code(), s.error_message());
+    return Status(s.error_code(),
+                  s.error_message() + "; calling the arithmetic server.");
+  }
+  if (squares_resp.packed_squares().size() != 2 * numbers.size()) {
+    span->SetStatus(StatusCode::INTERNAL, "Wrong number of squares");
+    return Status(StatusCode::INTERNAL,
+                  "The arithmetic server returned the wrong number of "
+                  "squares.");
+  }
+  squares->swap(*squares_resp.mutable_packed_squares());
+  return Status::OK;
+}
+
+void GeometryServiceImpl::Flatten(
+    const google::protobuf::RepeatedPtrField<ComputeLengthRequest>& vectors,
+    std::string* coordinates, std::vector<std::uint32_t>* ends,
+    std::vector<std::string>* errors) {
+  errors->resize(vectors.size());
+  for (int i = 0; i < vectors.size(); i++) {
+    const ComputeLengthRequest& vector = vectors[i];
+    if (!vector.packed_coordinates().empty()) {
+      if (vector.coordinates_size() > 0) {
+        (*errors)[i] = "has both coordinates and packed_coordinates";
+      } else if (!packed::WellFormed(vector.packed_coordinates())) {
+        (*errors)[i] = "packed_coordinates is not a whole number of uint16";
+      } else {
+        // Checked for range with all the others.
+        *coordinates += vector.packed_coordinates();
+      }
+    } else {
+      const std::size_t begin = coordinates->size();
+      for (int j = 0; j < vector.coordinates_size(); j++) {
+        const std::int32_t n = vector.coordinates(j);
+        if (n < 0 || n > packed::kMaxNumber) {
+          std::stringstream ss;
+          ss << "coordinates[" << j << "] " << n
+             << " is outside the valid range 0 .. " << packed::kMaxNumber;
+          (*errors)[i] = ss.str();
+          coordinates->resize(begin);
+          break;
+        }
+        coordinates->push_back(n & 0xff);
+        coordinates->push_back(n >> 8);
+      }
+    }
+    ends->push_back(packed::Count(*coordinates));
+  }
+}
+
+Status GeometryServiceImpl::InvalidArgument(const std::string& message,
+                                            tracing::Span* span) {
+  span->SetStatus(StatusCode::INVALID_ARGUMENT, message);
+  return Status(StatusCode::INVALID_ARGUMENT, message);
+}
+
+Status GeometryServiceImpl::NoArithmetic(tracing::Span* span) {
+  span->SetStatus(StatusCode::UNAVAILABLE, "No arithmetic servers yet");
+  return Status(StatusCode::UNAVAILABLE,
+                "The server is starting; try again shortly.");
+}
+
+Status GeometryServiceImpl::Abandon(int remaining, tracing::Span* span) {
+  abandoned_->Increment();
+  square_calls_saved_->Increment(remaining);
+  span->SetAttribute("square_calls_saved", remaining);
+  span->SetStatus(StatusCode::CANCELLED, "Abandoned");
+  return Status(StatusCode::CANCELLED,
+                "The caller cancelled or the deadline passed.");
+}
+
+bool PrimeSquareMemoFromFlags() {
+  return absl::GetFlag(FLAGS_prime_square_memo);
+}
+
+}  // namespace mathematics
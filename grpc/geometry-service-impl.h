@@ -0,0 +1,148 @@
+
+#ifndef GEOMETRY_SERVICE_IMPL_H_
+#define GEOMETRY_SERVICE_IMPL_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "arithmetic-balancer.h"
+#include "geometry-service.grpc.pb.h"
+#include "length-cache.h"
+#include "metrics.h"
+#include "square-memo.h"
+#include "tracing.h"
+
+namespace mathematics {
+
+// The Geometry service, which squares coordinates with the arithmetic
+// servers, or in-process with --local_arithmetic. For the geometry servers
+// and for binaries that serve it alongside other services.
+class GeometryServiceImpl final : public Geometry::Service {
+ public:
+  // 'arithmetic' may be null until SetArithmetic() if 'local_arithmetic' is
+  // false, and is unused otherwise. 'cache' may be null, for no caching.
+  GeometryServiceImpl(ArithmeticBalancer* arithmetic, bool local_arithmetic,
+                      LengthCache* cache);
+
+  // Sets the arithmetic servers to call, for a service that has to be
+  // registered before there is a channel to them: when the same grpc::Server
+  // serves Arithmetic, its in-process channel only exists once it started.
+  // Until then, requests that need the arithmetic servers fail with
+  // UNAVAILABLE.
+  void SetArithmetic(ArithmeticBalancer* arithmetic) {
+    arithmetic_.store(arithmetic, std::memory_order_release);
+  }
+
+  // Fetches the squares of all valid coordinates into the square memo at
+  // once, so that ComputeLengths never waits on the arithmetic servers for
+  // them. Call before serving.
+  grpc::Status PrimeSquareMemo(std::chrono::system_clock::time_point deadline);
+
+  grpc::Status ComputeLength(grpc::ServerContext* context,
+                             const ComputeLengthRequest* request,
+                             ComputeLengthResponse* response) override;
+
+  grpc::Status ComputeLengthStream(
+      grpc::ServerContext* context,
+      grpc::ServerReader<ComputeLengthRequest>* reader,
+      ComputeLengthResponse* response) override;
+
+  grpc::Status ComputeLengths(grpc::ServerContext* context,
+                              const ComputeLengthsRequest* request,
+                              ComputeLengthsResponse* response) override;
+
+ private:
+  // Returns the coordinates of 'request', packed, as the result cache's key:
+  // the request's own packed_coordinates, or else its coordinates packed
+  // into '*packed_coordinates'. Returns null for requests not worth caching
+  // or that will fail anyway.
+  static const std::string* CacheKey(const ComputeLengthRequest& request,
+                                     std::string* packed_coordinates);
+
+  static std::size_t CoordinateCount(const ComputeLengthRequest& request);
+
+  ArithmeticBalancer* arithmetic() const {
+    return arithmetic_.load(std::memory_order_acquire);
+  }
+
+  // Adds the squares of the coordinates of 'request', in whichever encoding
+  // it has them, to '*sum'. On failure also sets the status of 'span'.
+  grpc::Status AddSquares(grpc::ServerContext* context,
+                          const ComputeLengthRequest& request,
+                          tracing::Span* span, double* sum);
+
+  // Same as AddSquares(), squaring the coordinates in-process rather than
+  // calling the arithmetic servers.
+  grpc::Status AddSquaresLocally(const ComputeLengthRequest& request,
+                                 tracing::Span* span, double* sum);
+
+  // Adds the squares of 'coordinates' to '*sum'. On failure also sets the
+  // status of 'span'.
+  grpc::Status AddSquares(
+      grpc::ServerContext* context,
+      const google::protobuf::RepeatedField<int32_t>& coordinates,
+      tracing::Span* span, double* sum);
+
+  // Same as AddSquares(), with all of 'coordinates' in flight at once on a
+  // shared SquareStream. The stream outlives the caller, so only the
+  // caller's deadline, not a cancellation, stops the numbers already sent.
+  grpc::Status AddSquaresStreamed(
+      grpc::ServerContext* context,
+      const google::protobuf::RepeatedField<int32_t>& coordinates,
+      tracing::Span* span, double* sum);
+
+  // Same as AddSquares(), for packed coordinates, which are passed on to a
+  // single ComputePackedSquares call as they are.
+  grpc::Status AddPackedSquares(grpc::ServerContext* context,
+                                const std::string& packed, tracing::Span* span,
+                                double* sum);
+
+  // Sets '*squares' to the packed squares of the packed 'numbers', with one
+  // call to the arithmetic servers. On failure also sets the status of
+  // 'span'.
+  grpc::Status ComputePackedSquares(grpc::ServerContext* context,
+                                    const std::string& numbers,
+                                    tracing::Span* span, std::string* squares);
+
+  // Flattens the 'vectors' of a ComputeLengthsRequest into the packed form:
+  // all coordinates in '*coordinates', and where each vector ends in
+  // '*ends'. A vector that is invalid gets its error in '(*errors)[i]' and no
+  // coordinates.
+  static void Flatten(
+      const google::protobuf::RepeatedPtrField<ComputeLengthRequest>& vectors,
+      std::string* coordinates, std::vector<std::uint32_t>* ends,
+      std::vector<std::string>* errors);
+
+  static grpc::Status InvalidArgument(const std::string& message,
+                                      tracing::Span* span);
+
+  // Fails a request that needs the arithmetic servers before SetArithmetic().
+  static grpc::Status NoArithmetic(tracing::Span* span);
+
+  // Gives up on a request whose caller has cancelled or whose deadline has
+  // passed, with 'remaining' coordinates left to square (for a stream, in the
+  // current chunk).
+  grpc::Status Abandon(int remaining, tracing::Span* span);
+
+  std::atomic<ArithmeticBalancer*> arithmetic_;  // Not owned.
+  const bool local_arithmetic_;
+  LengthCache* cache_;  // Not owned.
+  SquareMemo square_memo_;
+  metrics::Counter* abandoned_;
+  metrics::Counter* square_calls_saved_;
+  metrics::Counter* squares_fetched_;
+};
+
+// The value of --prime_square_memo: whether geometry servers should fill
+// their square memo before serving.
+bool PrimeSquareMemoFromFlags();
+
+}  // namespace mathematics
+
+#endif  // GEOMETRY_SERVICE_IMPL_H_
@@ -0,0 +1,27 @@
+
+#ifndef HASH128_H_
+#define HASH128_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mathematics {
+
+// A 128-bit hash, not cryptographic: fast, and good enough that distinct
+// inputs practically never share one, so it can stand in for a payload in
+// an index. Users that cannot afford even a practical-never still compare
+// the payloads themselves on a match.
+struct Hash128 {
+  std::uint64_t low;
+  std::uint64_t high;
+
+  bool operator==(const Hash128& other) const {
+    return low == other.low && high == other.high;
+  }
+};
+
+Hash128 HashBytes(const char* data, std::size_t size);
+
+}  // namespace mathematics
+
+#endif  // HASH128_H_
@@ -0,0 +1,136 @@
+
+#include "length-cache.h"
+
+#include "absl/flags/flag.h"
+
+ABSL_FLAG(std::int64_t, result_cache_bytes, 64 << 20,
+          "Memory for caching the lengths of recently seen vectors, so that "
+          "they are not computed again; 0 disables the cache.");
+
+namespace mathematics {
+namespace {
+
+// Per entry, besides the coordinates: the slot, the index node and the
+// string's own allocation header, roughly.
+constexpr std::size_t kEntryOverhead = 128;
+
+}  // namespace
+
+LengthCache::LengthCache(std::size_t max_bytes)
+    : max_shard_bytes_(max_bytes / kShards),
+      hits_(metrics::NewCounter("geometry_server_result_cache_hits_total",
+                                "ComputeLength requests answered from the "
+                                "result cache.")),
+      misses_(metrics::NewCounter("geometry_server_result_cache_misses_total",
+                                  "ComputeLength requests not in the result "
+                                  "cache.")),
+      collisions_(metrics::NewCounter(
+          "geometry_server_result_cache_collisions_total",
+          "Result cache lookups that found the hash of a different vector.")),
+      evictions_(metrics::NewCounter(
+          "geometry_server_result_cache_evictions_total",
+          "Entries evicted from the result cache to make room.")),
+      entries_(metrics::NewGauge("geometry_server_result_cache_entries",
+                                 "Vectors in the result cache.")),
+      bytes_(metrics::NewGauge("geometry_server_result_cache_bytes",
+                               "Memory used by the result cache, roughly.")) {}
+
+std::unique_ptr<LengthCache> LengthCache::FromFlags() {
+  const std::int64_t max_bytes = absl::GetFlag(FLAGS_result_cache_bytes);
+  if (max_bytes <= 0) {
+    return nullptr;
+  }
+  return std::make_unique<LengthCache>(max_bytes);
+}
+
+std::size_t LengthCache::EntryBytes(const std::string& coordinates) {
+  return coordinates.size() + kEntryOverhead;
+}
+
+bool LengthCache::Lookup(const std::string& coordinates, double* length) {
+  const Hash128 hash = HashBytes(coordinates.data(), coordinates.size());
+  Shard* shard = ShardFor(hash);
+  std::lock_guard<std::mutex> lock(shard->mu);
+  auto it = shard->index.find(hash);
+  if (it == shard->index.end()) {
+    misses_->Increment();
+    return false;
+  }
+  Entry& entry = shard->slots[it->second];
+  if (entry.coordinates != coordinates) {
+    collisions_->Increment();
+    misses_->Increment();
+    return false;
+  }
+  entry.referenced = true;
+  *length = entry.length;
+  hits_->Increment();
+  return true;
+}
+
+void LengthCache::Insert(const std::string& coordinates, double length) {
+  const std::size_t bytes = EntryBytes(coordinates);
+  if (bytes > max_shard_bytes_) {
+    return;
+  }
+  const Hash128 hash = HashBytes(coordinates.data(), coordinates.size());
+  Shard* shard = ShardFor(hash);
+  std::lock_guard<std::mutex> lock(shard->mu);
+  auto it = shard->index.find(hash);
+  if (it != shard->index.end()) {
+    // Raced with another request for the same vector, or a collision; the
+    // newer vector wins.
+    RemoveLocked(shard, it->second);
+  }
+  MakeRoomLocked(shard, bytes);
+
+  std::size_t slot;
+  if (shard->free_slots.empty()) {
+    slot = shard->slots.size();
+    shard->slots.emplace_back();
+  } else {
+    slot = shard->free_slots.back();
+    shard->free_slots.pop_back();
+  }
+  Entry& entry = shard->slots[slot];
+  entry.hash = hash;
+  entry.coordinates = coordinates;
+  entry.length = length;
+  // Not referenced until hit, so that vectors seen once go first.
+  entry.referenced = false;
+  entry.used = true;
+  shard->index.emplace(hash, slot);
+  shard->bytes += bytes;
+  entries_->Add(1);
+  bytes_->Add(bytes);
+}
+
+void LengthCache::MakeRoomLocked(Shard* shard, std::size_t bytes) {
+  while (shard->bytes + bytes > max_shard_bytes_ && !shard->index.empty()) {
+    if (shard->hand >= shard->slots.size()) {
+      shard->hand = 0;
+    }
+    Entry& entry = shard->slots[shard->hand];
+    if (entry.used && entry.referenced) {
+      entry.referenced = false;
+    } else if (entry.used) {
+      RemoveLocked(shard, shard->hand);
+      evictions_->Increment();
+    }
+    shard->hand++;
+  }
+}
+
+void LengthCache::RemoveLocked(Shard* shard, std::size_t slot) {
+  Entry& entry = shard->slots[slot];
+  const std::size_t bytes = EntryBytes(entry.coordinates);
+  shard->index.erase(entry.hash);
+  entry.used = false;
+  std::string().swap(entry.coordinates);
+  shard->free_slots.push_back(slot);
+  shard->bytes -= bytes;
+  entries_->Add(-1);
+  bytes_->Add(-static_cast<std::int64_t>(bytes));
+}
+
+}  // namespace mathematics
@@ -0,0 +1,88 @@
+
+#ifndef LENGTH_CACHE_H_
+#define LENGTH_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "hash128.h"
+#include "metrics.h"
+
+namespace mathematics {
+
+// The lengths of recently seen vectors, keyed by the hash of their packed
+// coordinates, so that a vector sent again is answered without calling the
+// arithmetic servers.
+//
+// Memory is bounded by the bytes of the cached coordinates plus a fixed
+// overhead per entry. When full, entries are evicted with the CLOCK
+// algorithm: each entry has a bit that a hit sets, and a hand sweeps the
+// entries, clearing set bits and evicting the first entry whose bit is
+// already clear. That approximates LRU without reordering a list on every
+// hit. The cache is split into shards with a lock each. Thread-safe.
+class LengthCache {
+ public:
+  explicit LengthCache(std::size_t max_bytes);
+
+  // Returns nullptr if --result_cache_bytes is 0.
+  static std::unique_ptr<LengthCache> FromFlags();
+
+  // Returns true and sets '*length' if 'coordinates', packed, are cached.
+  bool Lookup(const std::string& coordinates, double* length);
+
+  void Insert(const std::string& coordinates, double length);
+
+ private:
+  static constexpr int kShards = 16;
+
+  struct Entry {
+    Hash128 hash;
+    std::string coordinates;
+    double length;
+    bool referenced;
+    bool used;
+  };
+
+  struct HashOfHash {
+    std::size_t operator()(const Hash128& hash) const { return hash.low; }
+  };
+
+  struct Shard {
+    std::mutex mu;
+    // The rest is guarded by mu.
+    std::vector<Entry> slots;
+    std::vector<std::size_t> free_slots;
+    std::unordered_map<Hash128, std::size_t, HashOfHash> index;
+    std::size_t hand = 0;  // The next slot the CLOCK hand looks at.
+    std::size_t bytes = 0;
+  };
+
+  static std::size_t EntryBytes(const std::string& coordinates);
+
+  Shard* ShardFor(const Hash128& hash) {
+    return &shards_[hash.high % kShards];
+  }
+
+  // Evicts entries from 'shard' until 'bytes' more fit. Requires shard->mu.
+  void MakeRoomLocked(Shard* shard, std::size_t bytes);
+  void RemoveLocked(Shard* shard, std::size_t slot);
+
+  const std::size_t max_shard_bytes_;
+  Shard shards_[kShards];
+
+  metrics::Counter* hits_;
+  metrics::Counter* misses_;
+  metrics::Counter* collisions_;
+  metrics::Counter* evictions_;
+  metrics::Gauge* entries_;
+  metrics::Gauge* bytes_;
+};
+
+}  // namespace mathematics
+
+#endif  // LENGTH_CACHE_H_
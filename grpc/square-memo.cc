@@ -0,0 +1,44 @@
+
+#include "square-memo.h"
+
+namespace mathematics {
+
+SquareMemo::SquareMemo() {
+  for (auto& square : squares_) {
+    square.store(kUnknown, std::memory_order_relaxed);
+  }
+}
+
+std::string SquareMemo::Missing(const std::vector<bool>& wanted) const {
+  std::vector<std::int32_t> missing;
+  for (std::int32_t n = 0; n <= packed::kMaxNumber; n++) {
+    if (wanted[n] &&
+        squares_[n].load(std::memory_order_relaxed) == kUnknown) {
+      missing.push_back(n);
+    }
+  }
+  return packed::Pack(missing.data(), missing.size());
+}
+
+void SquareMemo::Add(const std::string& numbers, const std::string& squares) {
+  const auto* p = reinterpret_cast<const unsigned char*>(squares.data());
+  for (std::size_t i = 0; i < packed::Count(numbers); i++) {
+    const std::uint32_t square =
+        std::uint32_t{p[4 * i]} | std::uint32_t{p[4 * i + 1]} << 8 |
+        std::uint32_t{p[4 * i + 2]} << 16 | std::uint32_t{p[4 * i + 3]} << 24;
+    squares_[packed::At(numbers, i)].store(square, std::memory_order_relaxed);
+  }
+}
+
+std::uint64_t SquareMemo::Sum(const char* numbers, std::size_t count) const {
+  // The table is 4KB, so the lookups stay in L1 however long the vectors.
+  const auto* p = reinterpret_cast<const unsigned char*>(numbers);
+  std::uint64_t sum = 0;
+  for (std::size_t i = 0; i < count; i++) {
+    sum += squares_[p[2 * i] | p[2 * i + 1] << 8].load(
+        std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+}  // namespace mathematics
@@ -0,0 +1,46 @@
+
+#ifndef SQUARE_MEMO_H_
+#define SQUARE_MEMO_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "packed-numbers.h"
+
+namespace mathematics {
+
+// The squares of 0 .. packed::kMaxNumber, filled in from the arithmetic
+// servers as requests need them and then shared by all requests. A square
+// never changes, so once known it is never asked for again, and a batch of
+// vectors needs at most one arithmetic call for the numbers none of them had
+// seen before. Thread-safe.
+class SquareMemo {
+ public:
+  SquareMemo();
+
+  SquareMemo(const SquareMemo&) = delete;
+  SquareMemo& operator=(const SquareMemo&) = delete;
+
+  // Returns, packed, the numbers 'n' with 'wanted[n]' set whose squares are
+  // not known yet.
+  std::string Missing(const std::vector<bool>& wanted) const;
+
+  // Records the packed 'squares' of the packed 'numbers'.
+  void Add(const std::string& numbers, const std::string& squares);
+
+  // Returns the sum of the squares of 'count' packed 'numbers', all of which
+  // must be known.
+  std::uint64_t Sum(const char* numbers, std::size_t count) const;
+
+ private:
+  static constexpr std::uint32_t kUnknown = ~std::uint32_t{0};
+
+  std::atomic<std::uint32_t> squares_[packed::kMaxNumber + 1];
+};
+
+}  // namespace mathematics
+
+#endif  // SQUARE_MEMO_H_
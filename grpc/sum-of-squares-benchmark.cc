@@ -0,0 +1,238 @@
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "arithmetic-service.grpc.pb.h"
+#include "packed-numbers.h"
+#include "sum-of-squares.h"
+
+// Checks that every sum-of-squares kernel this CPU supports agrees with the
+// scalar one, and with the arithmetic server if --target is set, then times
+// them:
+//
+//   $ ./sum-of-squares-benchmark
+//   $ ./arithmetic-server &
+//   $ ./sum-of-squares-benchmark --target=127.0.0.1:50051
+//
+// Exits with 1 on any disagreement.
+
+ABSL_FLAG(std::string, target, "",
+          "An arithmetic server to check the local sums against; empty skips "
+          "the check.");
+ABSL_FLAG(std::vector<std::string>, sizes,
+          (std::vector<std::string>{"500", "1000000"}),
+          "The vector sizes to time.");
+ABSL_FLAG(int, min_coordinates, 100000000,
+          "How many coordinates to time each kernel on, per size.");
+
+namespace mathematics {
+namespace {
+
+constexpr SumOfSquaresKernel kKernels[] = {SumOfSquaresKernel::kScalar,
+                                           SumOfSquaresKernel::kAvx2,
+                                           SumOfSquaresKernel::kAvx512};
+
+std::vector<std::int32_t> RandomNumbers(std::mt19937* random,
+                                        std::size_t count) {
+  std::uniform_int_distribution<std::int32_t> number(0, packed::kMaxNumber);
+  std::vector<std::int32_t> numbers(count);
+  for (auto& n : numbers) n = number(*random);
+  return numbers;
+}
+
+// Sums squares the obvious way, as the reference for every kernel.
+std::size_t ReferenceSumOfSquares(const std::vector<std::int32_t>& numbers,
+                                  std::uint64_t* sum) {
+  *sum = 0;
+  for (std::size_t i = 0; i < numbers.size(); i++) {
+    if (numbers[i] < 0 || numbers[i] > packed::kMaxNumber) return i;
+    *sum += std::uint64_t(numbers[i]) * numbers[i];
+  }
+  return numbers.size();
+}
+
+bool CheckKernel(SumOfSquaresKernel kernel,
+                 const std::vector<std::int32_t>& numbers) {
+  std::uint64_t want = 0;
+  const std::size_t want_end = ReferenceSumOfSquares(numbers, &want);
+
+  std::uint64_t got = 0;
+  std::size_t end = SumOfSquares(numbers.data(), numbers.size(), &got, kernel);
+  bool ok = end == want_end && (end != numbers.size() || got == want);
+
+  // Packing wraps negative and large numbers into 0 .. 65535, so only check
+  // vectors that stay what they were.
+  bool packable = true;
+  for (std::int32_t n : numbers) packable &= n >= 0 && n <= 0xffff;
+  if (packable) {
+    const std::string packed_numbers =
+        packed::Pack(numbers.data(), numbers.size());
+    end = SumOfPackedSquares(packed_numbers, &got, kernel);
+    ok &= end == want_end && (end != numbers.size() || got == want);
+  }
+  if (!ok) {
+    std::cerr << KernelName(kernel) << " disagrees on " << numbers.size()
+              << " numbers: want index " << want_end << ", sum " << want
+              << "; got index " << end << ", sum " << got << std::endl;
+  }
+  return ok;
+}
+
+bool CheckKernels(std::mt19937* random) {
+  bool ok = true;
+  for (SumOfSquaresKernel kernel : kKernels) {
+    if (!KernelSupported(kernel)) continue;
+    // Every length around the vector widths, and some long ones.
+    for (std::size_t count = 0; count < 200; count++) {
+      std::vector<std::int32_t> numbers = RandomNumbers(random, count);
+      ok &= CheckKernel(kernel, numbers);
+      if (count == 0) continue;
+      // The largest number in range must pass, and anything out of range
+      // must be caught wherever it is, including in the tail.
+      std::size_t i = (*random)() % count;
+      numbers[i] = packed::kMaxNumber;
+      ok &= CheckKernel(kernel, numbers);
+      for (std::int32_t bad : {packed::kMaxNumber + 1, 0xffff, -1,
+                               std::int32_t{-0x7fffffff - 1}}) {
+        numbers[i] = bad;
+        ok &= CheckKernel(kernel, numbers);
+        numbers[i] = packed::kMaxNumber;
+      }
+    }
+    ok &= CheckKernel(kernel, RandomNumbers(random, 1 << 20));
+  }
+  return ok;
+}
+
+// Compares local sums against the arithmetic server's, both for the packed
+// ComputePackedSquares and per-number ComputeSquare calls.
+bool CheckAgainstServer(const std::string& target, std::mt19937* random) {
+  std::unique_ptr<Arithmetic::Stub> stub(Arithmetic::NewStub(
+      grpc::CreateChannel(target, grpc::InsecureChannelCredentials())));
+  bool ok = true;
+  for (std::size_t count : {0, 1, 17, 500, 5000}) {
+    std::vector<std::int32_t> numbers = RandomNumbers(random, count);
+    std::uint64_t local = 0;
+    SumOfSquares(numbers.data(), numbers.size(), &local);
+
+    ComputePackedSquaresRequest request;
+    request.set_packed_numbers(packed::Pack(numbers.data(), numbers.size()));
+    ComputePackedSquaresResponse response;
+    grpc::ClientContext context;
+    grpc::Status status =
+        stub->ComputePackedSquares(&context, request, &response);
+    if (!status.ok()) {
+      std::cerr << "ComputePackedSquares failed: " << status.error_message()
+                << std::endl;
+      return false;
+    }
+    const std::uint64_t remote = packed::Sum(response.packed_squares());
+
+    std::uint64_t unary = 0;
+    for (std::size_t i = 0; i < numbers.size() && i < 500; i++) {
+      ComputeSquareRequest square_req;
+      square_req.set_number(numbers[i]);
+      ComputeSquareResponse square_resp;
+      grpc::ClientContext square_context;
+      status = stub->ComputeSquare(&square_context, square_req, &square_resp);
+      if (!status.ok()) {
+        std::cerr << "ComputeSquare failed: " << status.error_message()
+                  << std::endl;
+        return false;
+      }
+      unary += square_resp.square();
+    }
+    if (numbers.size() > 500) {
+      // Too slow one by one; vouched for by the packed sum instead.
+      unary = remote;
+    }
+    if (local != remote || local != unary) {
+      std::cerr << "Local sum " << local << " of " << count
+                << " numbers differs from the server's: packed " << remote
+                << ", unary " << unary << std::endl;
+      ok = false;
+    }
+  }
+
+  // Both reject out-of-range numbers.
+  std::vector<std::int32_t> numbers = RandomNumbers(random, 100);
+  numbers[42] = packed::kMaxNumber + 1;
+  std::uint64_t local;
+  const bool local_rejects =
+      SumOfSquares(numbers.data(), numbers.size(), &local) == 42;
+  ComputePackedSquaresRequest request;
+  request.set_packed_numbers(packed::Pack(numbers.data(), numbers.size()));
+  ComputePackedSquaresResponse response;
+  grpc::ClientContext context;
+  const grpc::Status status =
+      stub->ComputePackedSquares(&context, request, &response);
+  if (!local_rejects ||
+      status.error_code() != grpc::StatusCode::INVALID_ARGUMENT) {
+    std::cerr << "Out-of-range number not rejected by both" << std::endl;
+    ok = false;
+  }
+  return ok;
+}
+
+void Time(std::size_t count, std::mt19937* random) {
+  const std::vector<std::int32_t> numbers = RandomNumbers(random, count);
+  const std::string packed_numbers =
+      packed::Pack(numbers.data(), numbers.size());
+  const std::size_t reps =
+      std::max<std::size_t>(1, absl::GetFlag(FLAGS_min_coordinates) / count);
+  for (SumOfSquaresKernel kernel : kKernels) {
+    if (!KernelSupported(kernel)) continue;
+    for (bool is_packed : {false, true}) {
+      std::uint64_t total = 0;
+      const auto start = std::chrono::steady_clock::now();
+      for (std::size_t r = 0; r < reps; r++) {
+        std::uint64_t sum;
+        if (is_packed) {
+          SumOfPackedSquares(packed_numbers, &sum, kernel);
+        } else {
+          SumOfSquares(numbers.data(), numbers.size(), &sum, kernel);
+        }
+        total += sum;
+      }
+      const double ns = std::chrono::duration<double, std::nano>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+      std::cout << KernelName(kernel) << (is_packed ? " packed" : " int32")
+                << " " << count << " coordinates: "
+                << ns / (reps * count) << " ns/coordinate (checksum "
+                << total % 1000 << ")" << std::endl;
+    }
+  }
+}
+
+}  // namespace
+}  // namespace mathematics
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  std::mt19937 random(42);
+
+  std::cout << "best kernel: "
+            << mathematics::KernelName(mathematics::BestKernel()) << std::endl;
+  if (!mathematics::CheckKernels(&random)) {
+    return 1;
+  }
+  const std::string target = absl::GetFlag(FLAGS_target);
+  if (!target.empty() && !mathematics::CheckAgainstServer(target, &random)) {
+    return 1;
+  }
+  for (const std::string& size : absl::GetFlag(FLAGS_sizes)) {
+    mathematics::Time(std::stoul(size), &random);
+  }
+  return 0;
+}
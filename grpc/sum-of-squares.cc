@@ -0,0 +1,256 @@
+
+#include "sum-of-squares.h"
+
+#include "absl/flags/flag.h"
+#include "packed-numbers.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SUM_OF_SQUARES_X86 1
+#include <immintrin.h>
+#endif
+
+ABSL_FLAG(bool, local_arithmetic, false,
+          "If true, the squares of coordinates are computed in-process "
+          "instead of by the arithmetic servers.");
+
+namespace mathematics {
+namespace {
+
+std::size_t ScalarSumOfSquares(const std::int32_t* numbers, std::size_t count,
+                               std::uint64_t* sum) {
+  std::uint64_t s = 0;
+  for (std::size_t i = 0; i < count; i++) {
+    // Unsigned, so that negative numbers are out of range too.
+    const std::uint32_t n = numbers[i];
+    if (n > packed::kMaxNumber) {
+      return i;
+    }
+    s += std::uint64_t{n} * n;
+  }
+  *sum = s;
+  return count;
+}
+
+std::size_t ScalarSumOfPackedSquares(const char* numbers, std::size_t count,
+                                     std::size_t begin, std::uint64_t* sum) {
+  const auto* p = reinterpret_cast<const unsigned char*>(numbers);
+  std::uint64_t s = 0;
+  for (std::size_t i = begin; i < count; i++) {
+    const std::uint32_t n = p[2 * i] | p[2 * i + 1] << 8;
+    if (n > packed::kMaxNumber) {
+      return i;
+    }
+    s += std::uint64_t{n} * n;
+  }
+  *sum = s;
+  return count;
+}
+
+#ifdef SUM_OF_SQUARES_X86
+
+// The SIMD loops accumulate squares into 64-bit lanes and only note whether
+// some number was out of range. If one was, the scalar loop runs again to
+// find the first.
+
+__attribute__((target("avx2"))) std::uint64_t Avx2HorizontalSum(__m256i v) {
+  alignas(32) std::uint64_t lanes[4];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), v);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2"))) std::size_t Avx2SumOfSquares(
+    const std::int32_t* numbers, std::size_t count, std::uint64_t* sum) {
+  const __m256i max = _mm256_set1_epi32(packed::kMaxNumber);
+  __m256i bad = _mm256_setzero_si256();
+  __m256i acc = _mm256_setzero_si256();
+  std::size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256i x = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(numbers + i));
+    // Non-zero where x > max, comparing unsigned.
+    bad = _mm256_or_si256(bad,
+                          _mm256_xor_si256(_mm256_max_epu32(x, max), max));
+    // Squares the even and the odd 32-bit lanes into 64-bit lanes.
+    const __m256i odd = _mm256_srli_epi64(x, 32);
+    acc = _mm256_add_epi64(acc, _mm256_mul_epu32(x, x));
+    acc = _mm256_add_epi64(acc, _mm256_mul_epu32(odd, odd));
+  }
+  if (!_mm256_testz_si256(bad, bad)) {
+    return ScalarSumOfSquares(numbers, count, sum);
+  }
+  std::uint64_t tail = 0;
+  const std::size_t end = ScalarSumOfSquares(numbers + i, count - i, &tail);
+  if (end != count - i) {
+    return i + end;
+  }
+  *sum = Avx2HorizontalSum(acc) + tail;
+  return count;
+}
+
+__attribute__((target("avx2"))) std::size_t Avx2SumOfPackedSquares(
+    const char* numbers, std::size_t count, std::uint64_t* sum) {
+  const auto* p = reinterpret_cast<const __m256i*>(numbers);
+  const __m256i max = _mm256_set1_epi16(packed::kMaxNumber);
+  const __m256i low_halves = _mm256_set1_epi64x(0xffffffff);
+  __m256i bad = _mm256_setzero_si256();
+  __m256i acc = _mm256_setzero_si256();
+  std::size_t i = 0;
+  for (; i + 16 <= count; i += 16, p++) {
+    const __m256i x = _mm256_loadu_si256(p);
+    bad = _mm256_or_si256(bad,
+                          _mm256_xor_si256(_mm256_max_epu16(x, max), max));
+    // Numbers in range are also valid int16, so this sums the squares of
+    // adjacent pairs into 32-bit lanes, which then add up as 64 bits.
+    const __m256i pairs = _mm256_madd_epi16(x, x);
+    acc = _mm256_add_epi64(acc, _mm256_and_si256(pairs, low_halves));
+    acc = _mm256_add_epi64(acc, _mm256_srli_epi64(pairs, 32));
+  }
+  if (!_mm256_testz_si256(bad, bad)) {
+    return ScalarSumOfPackedSquares(numbers, count, 0, sum);
+  }
+  std::uint64_t tail = 0;
+  const std::size_t end =
+      ScalarSumOfPackedSquares(numbers, count, i, &tail);
+  if (end != count) {
+    return end;
+  }
+  *sum = Avx2HorizontalSum(acc) + tail;
+  return count;
+}
+
+__attribute__((target("avx512f,avx512bw"))) std::size_t Avx512SumOfSquares(
+    const std::int32_t* numbers, std::size_t count, std::uint64_t* sum) {
+  const __m512i max = _mm512_set1_epi32(packed::kMaxNumber);
+  __mmask16 bad = 0;
+  __m512i acc = _mm512_setzero_si512();
+  std::size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m512i x = _mm512_loadu_si512(numbers + i);
+    bad |= _mm512_cmpgt_epu32_mask(x, max);
+    const __m512i odd = _mm512_srli_epi64(x, 32);
+    acc = _mm512_add_epi64(acc, _mm512_mul_epu32(x, x));
+    acc = _mm512_add_epi64(acc, _mm512_mul_epu32(odd, odd));
+  }
+  if (bad != 0) {
+    return ScalarSumOfSquares(numbers, count, sum);
+  }
+  std::uint64_t tail = 0;
+  const std::size_t end = ScalarSumOfSquares(numbers + i, count - i, &tail);
+  if (end != count - i) {
+    return i + end;
+  }
+  *sum = _mm512_reduce_add_epi64(acc) + tail;
+  return count;
+}
+
+__attribute__((target("avx512f,avx512bw"))) std::size_t
+Avx512SumOfPackedSquares(const char* numbers, std::size_t count,
+                         std::uint64_t* sum) {
+  const char* p = numbers;
+  const __m512i max = _mm512_set1_epi16(packed::kMaxNumber);
+  const __m512i low_halves = _mm512_set1_epi64(0xffffffff);
+  __mmask32 bad = 0;
+  __m512i acc = _mm512_setzero_si512();
+  std::size_t i = 0;
+  for (; i + 32 <= count; i += 32, p += 64) {
+    const __m512i x = _mm512_loadu_si512(p);
+    bad |= _mm512_cmpgt_epu16_mask(x, max);
+    const __m512i pairs = _mm512_madd_epi16(x, x);
+    acc = _mm512_add_epi64(acc, _mm512_and_si512(pairs, low_halves));
+    acc = _mm512_add_epi64(acc, _mm512_srli_epi64(pairs, 32));
+  }
+  if (bad != 0) {
+    return ScalarSumOfPackedSquares(numbers, count, 0, sum);
+  }
+  std::uint64_t tail = 0;
+  const std::size_t end =
+      ScalarSumOfPackedSquares(numbers, count, i, &tail);
+  if (end != count) {
+    return end;
+  }
+  *sum = _mm512_reduce_add_epi64(acc) + tail;
+  return count;
+}
+
+#endif  // SUM_OF_SQUARES_X86
+
+}  // namespace
+
+const char* KernelName(SumOfSquaresKernel kernel) {
+  switch (kernel) {
+    case SumOfSquaresKernel::kScalar:
+      return "scalar";
+    case SumOfSquaresKernel::kAvx2:
+      return "avx2";
+    case SumOfSquaresKernel::kAvx512:
+      return "avx512";
+  }
+  return "unknown";
+}
+
+bool KernelSupported(SumOfSquaresKernel kernel) {
+  switch (kernel) {
+    case SumOfSquaresKernel::kScalar:
+      return true;
+#ifdef SUM_OF_SQUARES_X86
+    case SumOfSquaresKernel::kAvx2:
+      return __builtin_cpu_supports("avx2");
+    case SumOfSquaresKernel::kAvx512:
+      return __builtin_cpu_supports("avx512f") &&
+             __builtin_cpu_supports("avx512bw");
+#endif
+    default:
+      return false;
+  }
+}
+
+SumOfSquaresKernel BestKernel() {
+  static const SumOfSquaresKernel best = [] {
+    for (SumOfSquaresKernel kernel :
+         {SumOfSquaresKernel::kAvx512, SumOfSquaresKernel::kAvx2}) {
+      if (KernelSupported(kernel)) return kernel;
+    }
+    return SumOfSquaresKernel::kScalar;
+  }();
+  return best;
+}
+
+std::size_t SumOfSquares(const std::int32_t* numbers, std::size_t count,
+                         std::uint64_t* sum, SumOfSquaresKernel kernel) {
+  switch (kernel) {
+#ifdef SUM_OF_SQUARES_X86
+    case SumOfSquaresKernel::kAvx2:
+      return Avx2SumOfSquares(numbers, count, sum);
+    case SumOfSquaresKernel::kAvx512:
+      return Avx512SumOfSquares(numbers, count, sum);
+#endif
+    default:
+      return ScalarSumOfSquares(numbers, count, sum);
+  }
+}
+
+std::size_t SumOfPackedSquares(const char* numbers, std::size_t count,
+                               std::uint64_t* sum, SumOfSquaresKernel kernel) {
+  switch (kernel) {
+#ifdef SUM_OF_SQUARES_X86
+    case SumOfSquaresKernel::kAvx2:
+      return Avx2SumOfPackedSquares(numbers, count, sum);
+    case SumOfSquaresKernel::kAvx512:
+      return Avx512SumOfPackedSquares(numbers, count, sum);
+#endif
+    default:
+      return ScalarSumOfPackedSquares(numbers, count, 0, sum);
+  }
+}
+
+std::size_t SumOfPackedSquares(const std::string& numbers, std::uint64_t* sum,
+                               SumOfSquaresKernel kernel) {
+  return SumOfPackedSquares(numbers.data(), packed::Count(numbers), sum,
+                            kernel);
+}
+
+bool LocalArithmeticFromFlags() {
+  return absl::GetFlag(FLAGS_local_arithmetic);
+}
+
+}  // namespace mathematics
@@ -0,0 +1,251 @@
+
+#include "tracing.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include "absl/flags/flag.h"
+
+ABSL_FLAG(std::string, trace_file, "",
+          "If set, finished trace spans are appended to this file.");
+
+namespace mathematics {
+namespace tracing {
+namespace {
+
+constexpr auto kExportInterval = std::chrono::seconds(1);
+
+std::int64_t ToMicros(std::chrono::system_clock::time_point t) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             t.time_since_epoch())
+      .count();
+}
+
+std::uint64_t RandomId() {
+  thread_local std::mt19937_64 random(std::random_device{}());
+  std::uint64_t id;
+  do {
+    id = random();
+  } while (id == 0);
+  return id;
+}
+
+void AppendHex(std::uint64_t v, std::string* out) {
+  char buf[17];
+  std::snprintf(buf, sizeof(buf), "%016llx",
+                static_cast<unsigned long long>(v));
+  out->append(buf, 16);
+}
+
+bool ParseHex(const std::string& s, std::size_t pos, std::uint64_t* v) {
+  *v = 0;
+  for (std::size_t i = pos; i < pos + 16; i++) {
+    const char c = s[i];
+    int digit;
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      digit = c - 'a' + 10;
+    } else {
+      return false;
+    }
+    *v = (*v << 4) | digit;
+  }
+  return true;
+}
+
+void AppendJsonString(const std::string& s, std::string* out) {
+  out->push_back('"');
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (c < 0x20) {
+      char buf[8];
+      std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out->append(buf);
+    } else {
+      out->push_back(c);
+    }
+  }
+  out->push_back('"');
+}
+
+// Collects finished spans and appends them to the trace file once a second.
+class FileExporter {
+ public:
+  explicit FileExporter(std::ofstream file) : file_(std::move(file)) {
+    std::thread([this] { ExportLoop(); }).detach();
+  }
+
+  void Add(std::string line) {
+    std::lock_guard<std::mutex> lock(mu_);
+    pending_.push_back(std::move(line));
+  }
+
+  void Flush() {
+    std::vector<std::string> lines;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      lines.swap(pending_);
+    }
+    std::lock_guard<std::mutex> lock(file_mu_);
+    for (const auto& line : lines) {
+      file_ << line << '\n';
+    }
+    file_.flush();
+  }
+
+ private:
+  void ExportLoop() {
+    for (;;) {
+      std::this_thread::sleep_for(kExportInterval);
+      Flush();
+    }
+  }
+
+  std::mutex mu_;
+  std::vector<std::string> pending_;  // Guarded by mu_.
+
+  std::mutex file_mu_;
+  std::ofstream file_;  // Guarded by file_mu_.
+};
+
+std::atomic<FileExporter*> exporter{nullptr};
+
+}  // namespace
+
+std::string SpanContext::ToTraceparent() const {
+  if (!valid()) return "";
+  std::string s = "00-";
+  AppendHex(trace_id_high, &s);
+  AppendHex(trace_id_low, &s);
+  s += '-';
+  AppendHex(span_id, &s);
+  s += "-01";
+  return s;
+}
+
+SpanContext SpanContext::FromTraceparent(const std::string& traceparent) {
+  SpanContext context;
+  if (traceparent.size() != 55 || traceparent.compare(0, 3, "00-") != 0 ||
+      traceparent[35] != '-' || traceparent[52] != '-') {
+    return SpanContext();
+  }
+  if (!ParseHex(traceparent, 3, &context.trace_id_high) ||
+      !ParseHex(traceparent, 19, &context.trace_id_low) ||
+      !ParseHex(traceparent, 36, &context.span_id)) {
+    return SpanContext();
+  }
+  return context;
+}
+
+Span::Span(std::string name, const SpanContext& parent)
+    : Span(std::move(name), parent, std::chrono::system_clock::now()) {}
+
+Span::Span(std::string name, const SpanContext& parent,
+           std::chrono::system_clock::time_point start)
+    : recording_(Enabled()) {
+  if (!recording_) {
+    // Pass the caller's context through unchanged.
+    context_ = parent;
+    return;
+  }
+  if (parent.valid()) {
+    context_.trace_id_high = parent.trace_id_high;
+    context_.trace_id_low = parent.trace_id_low;
+    parent_span_id_ = parent.span_id;
+  } else {
+    context_.trace_id_high = RandomId();
+    context_.trace_id_low = RandomId();
+  }
+  context_.span_id = RandomId();
+  name_ = std::move(name);
+  start_us_ = ToMicros(start);
+}
+
+Span::~Span() { End(); }
+
+void Span::SetAttribute(const std::string& key, const std::string& value) {
+  if (!recording_) return;
+  std::string json;
+  AppendJsonString(value, &json);
+  attributes_.emplace_back(key, std::move(json));
+}
+
+void Span::SetAttribute(const std::string& key, std::int64_t value) {
+  if (!recording_) return;
+  attributes_.emplace_back(key, std::to_string(value));
+}
+
+void Span::SetStatus(int code, const std::string& message) {
+  SetAttribute("status_code", code);
+  if (code != 0) {
+    SetAttribute("status_message", message);
+  }
+}
+
+void Span::End() {
+  if (!recording_ || ended_) return;
+  ended_ = true;
+  const std::int64_t end_us = ToMicros(std::chrono::system_clock::now());
+
+  std::string line = "{\"trace_id\":\"";
+  AppendHex(context_.trace_id_high, &line);
+  AppendHex(context_.trace_id_low, &line);
+  line += "\",\"span_id\":\"";
+  AppendHex(context_.span_id, &line);
+  line += "\",\"parent_span_id\":\"";
+  if (parent_span_id_ != 0) {
+    AppendHex(parent_span_id_, &line);
+  }
+  line += "\",\"name\":";
+  AppendJsonString(name_, &line);
+  line += ",\"start_us\":" + std::to_string(start_us_) +
+          ",\"end_us\":" + std::to_string(end_us) + ",\"attributes\":{";
+  for (std::size_t i = 0; i < attributes_.size(); i++) {
+    if (i > 0) line += ',';
+    AppendJsonString(attributes_[i].first, &line);
+    line += ':' + attributes_[i].second;
+  }
+  line += "}}";
+  exporter.load(std::memory_order_acquire)->Add(std::move(line));
+}
+
+bool StartFileExporter(const std::string& path) {
+  std::ofstream file(path, std::ios::app);
+  if (!file) return false;
+  auto* e = new FileExporter(std::move(file));
+  exporter.store(e, std::memory_order_release);
+  std::atexit([] { exporter.load()->Flush(); });
+  return true;
+}
+
+bool StartFileExporterFromFlags() {
+  const std::string path = absl::GetFlag(FLAGS_trace_file);
+  return path.empty() || StartFileExporter(path);
+}
+
+bool Enabled() { return exporter.load(std::memory_order_acquire) != nullptr; }
+
+void Inject(const SpanContext& context, grpc::ClientContext* client_context) {
+  if (context.valid()) {
+    client_context->AddMetadata(kTraceparentKey, context.ToTraceparent());
+  }
+}
+
+SpanContext Extract(const grpc::ServerContextBase& server_context) {
+  const auto& metadata = server_context.client_metadata();
+  auto it = metadata.find(kTraceparentKey);
+  if (it == metadata.end()) return SpanContext();
+  return SpanContext::FromTraceparent(
+      std::string(it->second.data(), it->second.size()));
+}
+
+}  // namespace tracing
+}  // namespace mathematics
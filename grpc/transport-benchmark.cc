@@ -0,0 +1,156 @@
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "arithmetic-service-impl.h"
+
+// Compares ComputeSquare over TCP loopback with ComputeSquare over a Unix
+// domain socket, the two ways to reach an arithmetic server on the same
+// host. For each transport, measures the latency of one call at a time and
+// the throughput of --threads callers:
+//
+//   $ ./transport-benchmark --calls=20000 --threads=8
+//
+// By default the benchmark serves Arithmetic itself, on both transports. To
+// measure arithmetic servers in other processes instead, as sidecars run:
+//
+//   $ ./arithmetic-server --listen_address=127.0.0.1:50051 &
+//   $ ./arithmetic-server --listen_address=unix:/tmp/arithmetic.sock &
+//   $ ./transport-benchmark --tcp_target=127.0.0.1:50051
+//         --uds_target=unix:/tmp/arithmetic.sock
+
+ABSL_FLAG(std::string, tcp_target, "",
+          "An arithmetic server to call over TCP; empty serves one in-process "
+          "on a free loopback port.");
+ABSL_FLAG(std::string, uds_target, "",
+          "An arithmetic server to call over a Unix domain socket; empty "
+          "serves one in-process on --uds_path.");
+ABSL_FLAG(std::string, uds_path, "/tmp/transport-benchmark.sock",
+          "The socket the in-process server listens on.");
+ABSL_FLAG(int, calls, 20000, "Calls made one at a time, for latency.");
+ABSL_FLAG(int, threads, 8, "Concurrent callers, for throughput.");
+ABSL_FLAG(int, seconds, 5, "How long to measure throughput for.");
+
+using ::mathematics::Arithmetic;
+using ::mathematics::ComputeSquareRequest;
+using ::mathematics::ComputeSquareResponse;
+
+namespace {
+
+bool CallOnce(Arithmetic::Stub* stub, int number) {
+  ComputeSquareRequest request;
+  request.set_number(number);
+  ComputeSquareResponse response;
+  grpc::ClientContext context;
+  grpc::Status status = stub->ComputeSquare(&context, request, &response);
+  if (!status.ok()) {
+    std::cerr << "ComputeSquare failed: " << status.error_message()
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool Measure(const char* transport, const std::string& target) {
+  std::unique_ptr<Arithmetic::Stub> stub(Arithmetic::NewStub(
+      grpc::CreateChannel(target, grpc::InsecureChannelCredentials())));
+
+  // Connects, and warms up both ends.
+  for (int i = 0; i < 1000; i++) {
+    if (!CallOnce(stub.get(), i % 1000)) return false;
+  }
+
+  const int calls = absl::GetFlag(FLAGS_calls);
+  std::vector<double> latencies_us(calls);
+  for (int i = 0; i < calls; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    if (!CallOnce(stub.get(), i % 1000)) return false;
+    latencies_us[i] = std::chrono::duration<double, std::micro>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+  }
+  std::sort(latencies_us.begin(), latencies_us.end());
+  double total_us = 0;
+  for (double us : latencies_us) total_us += us;
+
+  // Each caller has its own channel, as separate geometry servers would.
+  const int threads = absl::GetFlag(FLAGS_threads);
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::seconds(absl::GetFlag(FLAGS_seconds));
+  std::atomic<std::int64_t> done{0};
+  std::atomic<bool> failed{false};
+  std::vector<std::thread> callers;
+  for (int t = 0; t < threads; t++) {
+    callers.emplace_back([&target, &deadline, &done, &failed] {
+      std::unique_ptr<Arithmetic::Stub> stub(Arithmetic::NewStub(
+          grpc::CreateChannel(target, grpc::InsecureChannelCredentials())));
+      std::int64_t n = 0;
+      while (!failed && std::chrono::steady_clock::now() < deadline) {
+        if (!CallOnce(stub.get(), n % 1000)) {
+          failed = true;
+          break;
+        }
+        n++;
+      }
+      done += n;
+    });
+  }
+  for (auto& caller : callers) caller.join();
+  if (failed) return false;
+
+  std::cout << transport << " (" << target << "): latency mean "
+            << total_us / calls << " us, p50 " << latencies_us[calls / 2]
+            << " us, p99 " << latencies_us[calls * 99 / 100]
+            << " us; throughput with " << threads << " callers "
+            << done / absl::GetFlag(FLAGS_seconds) << " calls/s"
+            << std::endl;
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+
+  std::string tcp_target = absl::GetFlag(FLAGS_tcp_target);
+  std::string uds_target = absl::GetFlag(FLAGS_uds_target);
+  mathematics::ArithmeticServiceImpl service(nullptr);
+  std::unique_ptr<grpc::Server> server;
+  if (tcp_target.empty() || uds_target.empty()) {
+    grpc::ServerBuilder builder;
+    int tcp_port = 0;
+    if (tcp_target.empty()) {
+      builder.AddListeningPort("127.0.0.1:0",
+                               grpc::InsecureServerCredentials(), &tcp_port);
+    }
+    if (uds_target.empty()) {
+      uds_target = "unix:" + absl::GetFlag(FLAGS_uds_path);
+      builder.AddListeningPort(uds_target, grpc::InsecureServerCredentials());
+    }
+    builder.RegisterService(&service);
+    server = builder.BuildAndStart();
+    if (server == nullptr) {
+      std::cerr << "Failed to start the arithmetic server" << std::endl;
+      return 1;
+    }
+    if (tcp_target.empty()) {
+      tcp_target = "127.0.0.1:" + std::to_string(tcp_port);
+    }
+  }
+
+  if (!Measure("TCP loopback", tcp_target) ||
+      !Measure("Unix domain socket", uds_target)) {
+    return 1;
+  }
+}
@@ -0,0 +1,170 @@
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "animals.pb.h"
+#include "geometry-service.pb.h"
+#include "record-file.h"
+
+// Writes --records Zwierze and as many geometry requests to record files in
+// --directory, then measures reading them back: a scan that parses every
+// record, random access by index, and parallel scans on each of --threads
+// threads. Reports, per message, the throughput of each:
+//
+//   $ ./record-file-benchmark --records=1000000 --threads=1,2,4,8
+//
+// The files are left in place, so a second run with --nowrite measures reads
+// that start with the files in the page cache, or not, if it is dropped in
+// between.
+
+ABSL_FLAG(std::string, directory, "/tmp", "Where to write the files.");
+ABSL_FLAG(std::int64_t, records, 1000000, "Records per file.");
+ABSL_FLAG(int, coordinates, 100, "Coordinates per geometry request.");
+ABSL_FLAG(std::int64_t, lookups, 1000000, "Random accesses to measure.");
+ABSL_FLAG(std::vector<std::string>, threads,
+          std::vector<std::string>({"1", "2", "4", "8"}),
+          "Comma-separated thread counts to measure parallel scans with.");
+ABSL_FLAG(bool, write, true, "If false, reads the files of an earlier run.");
+
+namespace {
+
+using ::mathematics::RecordReader;
+using ::mathematics::RecordWriter;
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+void Report(const std::string& what, std::int64_t records, std::int64_t bytes,
+            double seconds) {
+  const auto rate = static_cast<std::int64_t>(records / seconds);
+  std::cout << "  " << what << ": " << rate << " records/s, "
+            << bytes / seconds / 1e6 << " MB/s" << std::endl;
+}
+
+zwierzeta::Zwierze Zwierze(std::int64_t i) {
+  zwierzeta::Zwierze zwierze;
+  zwierze.mutable_gatunek()->set_nazwa(i % 2 ? "krowa" : "kura");
+  zwierze.mutable_gatunek()->set_liczba_nog(i % 2 ? 4 : 2);
+  zwierze.mutable_gatunek()->add_odglosy(i % 2 ? "Muuuu" : "ko ko ko");
+  zwierze.set_imie("Krasula " + std::to_string(i));
+  return zwierze;
+}
+
+mathematics::ScheduleLengthComputationRequest Request(std::int64_t i) {
+  mathematics::ScheduleLengthComputationRequest request;
+  request.set_id("length-request-" + std::to_string(i));
+  request.set_publish_time_micros(1700000000000000 + i);
+  for (int c = 0; c < absl::GetFlag(FLAGS_coordinates); c++) {
+    request.add_coordinates((i * 37 + c * 11) % 1001);
+  }
+  return request;
+}
+
+template <typename Message>
+bool Measure(const std::string& name, Message (*make)(std::int64_t)) {
+  const std::string path = absl::GetFlag(FLAGS_directory) + "/" + name +
+                           ".records";
+  const std::int64_t records = absl::GetFlag(FLAGS_records);
+  std::string error;
+  std::cout << name << std::endl;
+
+  if (absl::GetFlag(FLAGS_write)) {
+    // Made up front, so that only the writing is timed.
+    std::vector<Message> messages;
+    for (std::int64_t i = 0; i < records; i++) messages.push_back(make(i));
+    const auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<RecordWriter> writer = RecordWriter::Create(path, &error);
+    if (writer == nullptr) {
+      std::cerr << error << std::endl;
+      return false;
+    }
+    std::int64_t bytes = 0;
+    for (const Message& message : messages) {
+      if (!writer->Append(message)) {
+        std::cerr << writer->error() << std::endl;
+        return false;
+      }
+      bytes += message.GetCachedSize();
+    }
+    if (!writer->Close()) {
+      std::cerr << writer->error() << std::endl;
+      return false;
+    }
+    Report("write", records, bytes, Seconds(start));
+  }
+
+  std::unique_ptr<RecordReader> reader = RecordReader::Open(path, &error);
+  if (reader == nullptr) {
+    std::cerr << error << std::endl;
+    return false;
+  }
+  std::cout << "  " << reader->size() << " records in " << reader->blocks()
+            << " blocks" << std::endl;
+  if (reader->size() == 0) return true;
+
+  std::int64_t bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  Message message;
+  if (!reader->Scan([&](std::uint64_t, std::string_view record) {
+        bytes += record.size();
+        return message.ParseFromArray(record.data(),
+                                      static_cast<int>(record.size()));
+      })) {
+    std::cerr << path << ": scan failed" << std::endl;
+    return false;
+  }
+  Report("scan and parse", reader->size(), bytes, Seconds(start));
+
+  const std::int64_t lookups = absl::GetFlag(FLAGS_lookups);
+  std::uint64_t index = 0;
+  start = std::chrono::steady_clock::now();
+  for (std::int64_t i = 0; i < lookups; i++) {
+    // An LCG, so that lookups land all over the file.
+    index = index * 6364136223846793005u + 1442695040888963407u;
+    if (!reader->Get(index % reader->size(), &message)) {
+      std::cerr << path << ": record " << index % reader->size()
+                << " not found" << std::endl;
+      return false;
+    }
+  }
+  Report("random access and parse", lookups,
+         lookups * (bytes / static_cast<std::int64_t>(reader->size())),
+         Seconds(start));
+
+  for (const std::string& threads : absl::GetFlag(FLAGS_threads)) {
+    start = std::chrono::steady_clock::now();
+    if (!reader->ParallelScan(std::stoi(threads), [](int) {
+          auto message = std::make_shared<Message>();
+          return [message](std::uint64_t, std::string_view record) {
+            return message->ParseFromArray(record.data(),
+                                           static_cast<int>(record.size()));
+          };
+        })) {
+      std::cerr << path << ": parallel scan failed" << std::endl;
+      return false;
+    }
+    Report("parallel scan and parse, " + threads + " thread(s)",
+           reader->size(), bytes, Seconds(start));
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+
+  if (!Measure("Zwierze", Zwierze) ||
+      !Measure("ScheduleLengthComputationRequest", Request)) {
+    return 1;
+  }
+}
@@ -0,0 +1,440 @@
+
+#include "record-file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <thread>
+#include <utility>
+
+#include <google/protobuf/io/coded_stream.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define RECORD_FILE_X86 1
+#include <nmmintrin.h>
+#endif
+
+namespace mathematics {
+namespace {
+
+using ::google::protobuf::io::CodedOutputStream;
+
+constexpr char kMagic[] = {'M', 'A', 'T', 'H', 'R', 'E', 'C', '1'};
+constexpr std::size_t kHeaderSize = sizeof(kMagic);
+constexpr std::size_t kEntrySize = 8 + 8 + 4 + 4 + 4;
+constexpr std::size_t kMarkSize = 4;
+constexpr std::size_t kFooterSize = 8 + 8 + 8 + 4 + sizeof(kMagic);
+
+enum BlockState : std::uint8_t { kUnverified = 0, kIntact = 1, kCorrupt = 2 };
+
+void PutFixed32(std::uint32_t value, std::string* out) {
+  for (int i = 0; i < 4; i++) out->push_back(static_cast<char>(value >> 8 * i));
+}
+
+void PutFixed64(std::uint64_t value, std::string* out) {
+  for (int i = 0; i < 8; i++) out->push_back(static_cast<char>(value >> 8 * i));
+}
+
+std::uint32_t Fixed32(const char* p) {
+  const auto* u = reinterpret_cast<const unsigned char*>(p);
+  return std::uint32_t{u[0]} | std::uint32_t{u[1]} << 8 |
+         std::uint32_t{u[2]} << 16 | std::uint32_t{u[3]} << 24;
+}
+
+std::uint64_t Fixed64(const char* p) {
+  return Fixed32(p) | std::uint64_t{Fixed32(p + 4)} << 32;
+}
+
+// Reads the record at '*p', which ends by 'end', into '*record' and moves
+// '*p' past it. Returns false if it does not fit.
+bool ReadRecord(const char** p, const char* end, std::string_view* record) {
+  std::uint32_t size = 0;
+  for (int shift = 0;; shift += 7) {
+    if (*p == end || shift > 28) return false;
+    const auto byte = static_cast<unsigned char>(*(*p)++);
+    size |= std::uint32_t{byte & 0x7fu} << shift;
+    if (byte < 0x80) break;
+  }
+  if (static_cast<std::size_t>(end - *p) < size) return false;
+  *record = std::string_view(*p, size);
+  *p += size;
+  return true;
+}
+
+// CRC-32C, the Castagnoli polynomial, as iSCSI and most storage formats use,
+// which x86 computes in hardware since SSE 4.2.
+
+std::uint32_t TableCrc32c(const char* data, std::size_t size) {
+  static const auto* table = [] {
+    auto* t = new std::uint32_t[256];
+    for (std::uint32_t i = 0; i < 256; i++) {
+      std::uint32_t c = i;
+      for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+      t[i] = c;
+    }
+    return t;
+  }();
+  std::uint32_t crc = ~0u;
+  for (std::size_t i = 0; i < size; i++) {
+    crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^ crc >> 8;
+  }
+  return ~crc;
+}
+
+#ifdef RECORD_FILE_X86
+
+__attribute__((target("sse4.2"))) std::uint32_t Sse42Crc32c(
+    const char* data, std::size_t size) {
+  std::uint64_t crc = ~0u;
+  for (; size >= 8; data += 8, size -= 8) {
+    std::uint64_t word;
+    std::memcpy(&word, data, 8);
+    crc = _mm_crc32_u64(crc, word);
+  }
+  auto crc32 = static_cast<std::uint32_t>(crc);
+  for (; size > 0; data++, size--) {
+    crc32 = _mm_crc32_u8(crc32, static_cast<unsigned char>(*data));
+  }
+  return ~crc32;
+}
+
+#endif
+
+std::uint32_t Crc32c(const char* data, std::size_t size) {
+#ifdef RECORD_FILE_X86
+  static const bool sse42 = __builtin_cpu_supports("sse4.2");
+  if (sse42) return Sse42Crc32c(data, size);
+#endif
+  return TableCrc32c(data, size);
+}
+
+std::string ErrnoError(const std::string& path) {
+  return path + ": " + std::strerror(errno);
+}
+
+}  // namespace
+
+std::unique_ptr<RecordWriter> RecordWriter::Create(const std::string& path,
+                                                   std::string* error) {
+  const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+  if (fd < 0) {
+    *error = ErrnoError(path);
+    return nullptr;
+  }
+  std::unique_ptr<RecordWriter> writer(new RecordWriter(fd, path));
+  if (!writer->Write(kMagic, kHeaderSize)) {
+    *error = writer->error();
+    return nullptr;
+  }
+  return writer;
+}
+
+RecordWriter::RecordWriter(int fd, std::string path)
+    : fd_(fd), path_(std::move(path)) {
+  block_.reserve(kBlockSize);
+}
+
+RecordWriter::~RecordWriter() {
+  if (fd_ >= 0) Close();
+}
+
+bool RecordWriter::Append(std::string_view record) {
+  char* bytes = Reserve(record.size());
+  if (bytes == nullptr) return false;
+  std::memcpy(bytes, record.data(), record.size());
+  return true;
+}
+
+bool RecordWriter::Append(const google::protobuf::MessageLite& message) {
+  const std::size_t size = message.ByteSizeLong();
+  char* bytes = Reserve(size);
+  if (bytes == nullptr) return false;
+  message.SerializeWithCachedSizesToArray(
+      reinterpret_cast<std::uint8_t*>(bytes));
+  return true;
+}
+
+char* RecordWriter::Reserve(std::size_t size) {
+  if (fd_ < 0) {
+    if (error_.empty()) error_ = path_ + ": already closed";
+    return nullptr;
+  }
+  if (size > INT_MAX) {
+    error_ = path_ + ": a record of " + std::to_string(size) +
+             " bytes is larger than a message can be";
+    return nullptr;
+  }
+  const auto varint = static_cast<std::size_t>(
+      CodedOutputStream::VarintSize32(static_cast<std::uint32_t>(size)));
+  if (!block_.empty() && block_.size() + varint + size > kBlockSize) {
+    if (!FlushBlock()) return nullptr;
+  }
+  const std::size_t start = block_.size();
+  if (block_records_ % kMarkInterval == 0) {
+    marks_.push_back(static_cast<std::uint32_t>(start));
+  }
+  block_.resize(start + varint + size);
+  auto* p = reinterpret_cast<std::uint8_t*>(&block_[start]);
+  CodedOutputStream::WriteVarint32ToArray(static_cast<std::uint32_t>(size), p);
+  block_records_++;
+  records_++;
+  return &block_[start + varint];
+}
+
+bool RecordWriter::FlushBlock() {
+  if (block_.empty()) return true;
+  const Entry entry = {offset_, records_ - block_records_,
+                       static_cast<std::uint32_t>(block_.size()),
+                       block_records_, Crc32c(block_.data(), block_.size())};
+  if (!Write(block_.data(), block_.size())) return false;
+  index_.push_back(entry);
+  block_.clear();
+  block_records_ = 0;
+  return true;
+}
+
+bool RecordWriter::Close() {
+  if (fd_ < 0) {
+    if (error_.empty()) error_ = path_ + ": already closed";
+    return false;
+  }
+  if (!FlushBlock()) return false;
+  const std::uint64_t index_offset = offset_;
+  std::string tail;
+  tail.reserve(index_.size() * kEntrySize + marks_.size() * kMarkSize +
+               kFooterSize);
+  for (const Entry& entry : index_) {
+    PutFixed64(entry.offset, &tail);
+    PutFixed64(entry.first_record, &tail);
+    PutFixed32(entry.size, &tail);
+    PutFixed32(entry.records, &tail);
+    PutFixed32(entry.crc, &tail);
+  }
+  for (std::uint32_t mark : marks_) PutFixed32(mark, &tail);
+  const std::uint32_t index_crc = Crc32c(tail.data(), tail.size());
+  PutFixed64(index_offset, &tail);
+  PutFixed64(index_.size(), &tail);
+  PutFixed64(records_, &tail);
+  PutFixed32(index_crc, &tail);
+  tail.append(kMagic, sizeof(kMagic));
+  if (!Write(tail.data(), tail.size())) return false;
+  const int fd = fd_;
+  fd_ = -1;
+  if (close(fd) != 0) {
+    error_ = ErrnoError(path_);
+    return false;
+  }
+  return true;
+}
+
+bool RecordWriter::Write(const char* data, std::size_t size) {
+  while (size > 0) {
+    const ssize_t written = write(fd_, data, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      error_ = ErrnoError(path_);
+      close(fd_);
+      fd_ = -1;
+      return false;
+    }
+    data += written;
+    size -= written;
+    offset_ += written;
+  }
+  return true;
+}
+
+std::unique_ptr<RecordReader> RecordReader::Open(const std::string& path,
+                                                 std::string* error) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    *error = ErrnoError(path);
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    *error = ErrnoError(path);
+    close(fd);
+    return nullptr;
+  }
+  const auto size = static_cast<std::size_t>(st.st_size);
+  if (size < kHeaderSize + kFooterSize) {
+    *error = path + ": too short for a record file";
+    close(fd);
+    return nullptr;
+  }
+  void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps the file open.
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    *error = ErrnoError(path);
+    return nullptr;
+  }
+  std::unique_ptr<RecordReader> reader(
+      new RecordReader(static_cast<const char*>(mapped), size));
+  const char* data = reader->data_;
+
+  const char* footer = data + size - kFooterSize;
+  if (std::memcmp(data, kMagic, kHeaderSize) != 0 ||
+      std::memcmp(footer + 28, kMagic, sizeof(kMagic)) != 0) {
+    *error = path + ": not a complete record file";
+    return nullptr;
+  }
+  const std::uint64_t index_offset = Fixed64(footer);
+  const std::uint64_t blocks = Fixed64(footer + 8);
+  reader->records_ = Fixed64(footer + 16);
+  const std::size_t index_end = size - kFooterSize;
+  if (index_offset < kHeaderSize || index_offset > index_end ||
+      (index_end - index_offset) / kEntrySize < blocks ||
+      Crc32c(data + index_offset, index_end - index_offset) !=
+          Fixed32(footer + 24)) {
+    *error = path + ": corrupt index";
+    return nullptr;
+  }
+
+  reader->index_.reserve(blocks);
+  std::uint64_t records = 0;
+  std::uint64_t offset = kHeaderSize;
+  const char* entries_end = data + index_offset + blocks * kEntrySize;
+  const char* marks = entries_end;
+  for (const char* entry = data + index_offset; entry < entries_end;
+       entry += kEntrySize) {
+    const Block block = {data + Fixed64(entry), marks, Fixed64(entry + 8),
+                         Fixed32(entry + 16), Fixed32(entry + 20),
+                         Fixed32(entry + 24)};
+    // Blocks follow each other, and so do their records.
+    if (Fixed64(entry) != offset || block.first_record != records ||
+        block.size > index_offset - offset) {
+      *error = path + ": corrupt index";
+      return nullptr;
+    }
+    offset += block.size;
+    records += block.records;
+    marks += (block.records + RecordWriter::kMarkInterval - 1) /
+             RecordWriter::kMarkInterval * kMarkSize;
+    reader->index_.push_back(block);
+  }
+  if (offset != index_offset || records != reader->records_ ||
+      marks != data + index_end) {
+    *error = path + ": corrupt index";
+    return nullptr;
+  }
+  reader->verified_.reset(new std::atomic<std::uint8_t>[blocks]());
+  return reader;
+}
+
+RecordReader::RecordReader(const char* data, std::size_t size)
+    : data_(data), size_(size) {}
+
+RecordReader::~RecordReader() {
+  munmap(const_cast<char*>(data_), size_);
+}
+
+bool RecordReader::CheckBlock(std::size_t block) const {
+  std::uint8_t state = verified_[block].load(std::memory_order_relaxed);
+  if (state == kUnverified) {
+    // Threads that race here compute the same state.
+    const Block& b = index_[block];
+    state = Crc32c(b.data, b.size) == b.crc ? kIntact : kCorrupt;
+    verified_[block].store(state, std::memory_order_relaxed);
+  }
+  return state == kIntact;
+}
+
+bool RecordReader::Get(std::uint64_t index, std::string_view* record) const {
+  if (index >= records_) return false;
+  // The last block that starts at or before the record.
+  const auto it = std::upper_bound(
+      index_.begin(), index_.end(), index,
+      [](std::uint64_t i, const Block& b) { return i < b.first_record; });
+  const std::size_t block = it - index_.begin() - 1;
+  if (!CheckBlock(block)) return false;
+  const Block& b = index_[block];
+  const std::uint64_t i = index - b.first_record;
+  const std::uint64_t interval = RecordWriter::kMarkInterval;
+  const std::uint32_t mark = Fixed32(b.marks + i / interval * kMarkSize);
+  if (mark >= b.size) return false;
+  const char* p = b.data + mark;
+  const char* end = b.data + b.size;
+  for (std::uint64_t skip = 0; skip <= i % interval; skip++) {
+    if (!ReadRecord(&p, end, record)) return false;
+  }
+  return true;
+}
+
+bool RecordReader::Get(std::uint64_t index,
+                       google::protobuf::MessageLite* message) const {
+  std::string_view record;
+  return Get(index, &record) &&
+         message->ParseFromArray(record.data(),
+                                 static_cast<int>(record.size()));
+}
+
+bool RecordReader::Scan(std::size_t first_block, std::size_t last_block,
+                        const Visitor& visit) const {
+  for (std::size_t block = first_block;
+       block < std::min(last_block, index_.size()); block++) {
+    if (!CheckBlock(block)) return false;
+    const Block& b = index_[block];
+    const char* p = b.data;
+    const char* end = b.data + b.size;
+    std::string_view record;
+    for (std::uint32_t i = 0; i < b.records; i++) {
+      if (!ReadRecord(&p, end, &record) || !visit(b.first_record + i, record)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool RecordReader::ParallelScan(
+    int threads, const std::function<Visitor(int thread)>& make_visitor) const {
+  const std::size_t runs = std::min<std::size_t>(std::max(threads, 1),
+                                                 std::max<std::size_t>(
+                                                     blocks(), 1));
+  // A run ends where its share of the bytes does.
+  const std::uint64_t bytes = size_ - kHeaderSize;
+  std::vector<std::size_t> starts = {0};
+  for (std::size_t block = 0; block < index_.size(); block++) {
+    const std::uint64_t offset = index_[block].data - data_ - kHeaderSize;
+    if (offset * runs >= bytes * starts.size() && block > starts.back()) {
+      starts.push_back(block);
+    }
+  }
+  starts.push_back(index_.size());
+
+  std::atomic<bool> failed{false};
+  std::vector<std::thread> scanners;
+  for (std::size_t run = 0; run + 1 < starts.size(); run++) {
+    scanners.emplace_back([this, run, &starts, &failed, &make_visitor] {
+      const Visitor visit = make_visitor(static_cast<int>(run));
+      for (std::size_t block = starts[run]; block < starts[run + 1]; block++) {
+        if (failed.load(std::memory_order_relaxed)) return;
+        if (!Scan(block, block + 1, visit)) {
+          failed = true;
+          return;
+        }
+      }
+    });
+  }
+  for (auto& scanner : scanners) scanner.join();
+  return !failed;
+}
+
+bool RecordReader::Verify() const {
+  bool intact = true;
+  for (std::size_t block = 0; block < index_.size(); block++) {
+    intact = CheckBlock(block) && intact;
+  }
+  return intact;
+}
+
+}  // namespace mathematics
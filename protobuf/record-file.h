@@ -0,0 +1,178 @@
+
+#ifndef RECORD_FILE_H_
+#define RECORD_FILE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <google/protobuf/message_lite.h>
+
+namespace mathematics {
+
+// A record file holds a sequence of serialized messages, for collections too
+// large to keep as one message: a magic header, then the records in blocks
+// of at most kBlockSize bytes, then a sparse index, then a footer that says
+// where the index starts.
+//
+//   record  varint32 length, then that many bytes
+//   index   an entry per block, then the marks of each block in turn
+//   entry   fixed64 offset, fixed64 first record, fixed32 size,
+//           fixed32 records, fixed32 CRC-32C of the block
+//   mark    fixed32 offset in its block of every kMarkInterval-th record
+//   footer  fixed64 index offset, fixed64 blocks, fixed64 records,
+//           fixed32 CRC-32C of the index, magic
+//
+// A record never spans blocks, so one larger than kBlockSize gets a block of
+// its own. All integers are little-endian.
+
+// Writes a record file. Not thread-safe.
+class RecordWriter {
+ public:
+  static constexpr std::size_t kBlockSize = 64 * 1024;
+  // Finding a record by its index skips fewer than this many others.
+  static constexpr std::uint32_t kMarkInterval = 32;
+
+  // Creates or truncates the file at 'path'. Returns nullptr, with the
+  // reason in '*error', if it cannot.
+  static std::unique_ptr<RecordWriter> Create(const std::string& path,
+                                              std::string* error);
+
+  // Closes the file if Close() was not called, ignoring any error.
+  ~RecordWriter();
+
+  RecordWriter(const RecordWriter&) = delete;
+  RecordWriter& operator=(const RecordWriter&) = delete;
+
+  // Appends a record. Returns false, and the writer is no longer usable, if
+  // the file cannot be written.
+  bool Append(std::string_view record);
+  // Appends the serialization of 'message', without a copy in between.
+  bool Append(const google::protobuf::MessageLite& message);
+
+  // Writes the last block, the index and the footer, and closes the file.
+  // Until then the file is not readable. Returns false if any of it fails.
+  bool Close();
+
+  // The number of records appended.
+  std::uint64_t size() const { return records_; }
+  // Why the last call that returned false did.
+  const std::string& error() const { return error_; }
+
+ private:
+  struct Entry {
+    std::uint64_t offset;
+    std::uint64_t first_record;
+    std::uint32_t size;
+    std::uint32_t records;
+    std::uint32_t crc;
+  };
+
+  RecordWriter(int fd, std::string path);
+
+  // Reserves room for a record of 'size' bytes at the end of the block and
+  // returns where its bytes go.
+  char* Reserve(std::size_t size);
+  bool FlushBlock();
+  bool Write(const char* data, std::size_t size);
+
+  int fd_;
+  const std::string path_;
+  std::string block_;
+  std::uint32_t block_records_ = 0;
+  std::uint64_t offset_ = 0;  // Of the end of the file so far.
+  std::uint64_t records_ = 0;
+  std::vector<Entry> index_;
+  std::vector<std::uint32_t> marks_;  // Of all blocks, in order.
+  std::string error_;
+};
+
+// Reads a record file through a read-only memory mapping, so records are
+// handed out as views of the mapping rather than copies, and only the pages
+// touched are read from disk. Thread-safe.
+//
+// Each block's checksum is verified the first time one of its records is
+// read; a block that fails makes the reads of its records fail.
+class RecordReader {
+ public:
+  // Called with the number of a record and a view of its bytes, which stays
+  // valid as long as the reader. Returns false to stop the scan.
+  using Visitor =
+      std::function<bool(std::uint64_t index, std::string_view record)>;
+
+  // Maps the file at 'path' and reads its index. Returns nullptr, with the
+  // reason in '*error', if it cannot or the file is not a complete record
+  // file.
+  static std::unique_ptr<RecordReader> Open(const std::string& path,
+                                            std::string* error);
+
+  ~RecordReader();
+
+  RecordReader(const RecordReader&) = delete;
+  RecordReader& operator=(const RecordReader&) = delete;
+
+  // The number of records and of blocks.
+  std::uint64_t size() const { return records_; }
+  std::size_t blocks() const { return index_.size(); }
+
+  // Sets '*record' to a view of record 'index', which stays valid as long
+  // as the reader. Finds its block by binary search in the index, then
+  // skips from the mark before it. Returns false if there is no such record
+  // or its block is corrupt.
+  bool Get(std::uint64_t index, std::string_view* record) const;
+  // Parses record 'index' into 'message'. Returns false as Get() does, or if
+  // it does not parse.
+  bool Get(std::uint64_t index, google::protobuf::MessageLite* message) const;
+
+  // Calls 'visit' for each record of blocks [first_block, last_block), in
+  // order. Returns false if 'visit' did or a block is corrupt.
+  bool Scan(std::size_t first_block, std::size_t last_block,
+            const Visitor& visit) const;
+  // Calls 'visit' for each record, in order.
+  bool Scan(const Visitor& visit) const {
+    return Scan(0, blocks(), visit);
+  }
+
+  // Splits the blocks into 'threads' runs of about equal bytes and scans
+  // each on its own thread, so 'visit' is called concurrently, but in order
+  // within a run. Each thread gets its own copy of 'visit' through
+  // 'make_visitor', called with the thread's number, so that it can keep
+  // state, such as a message to parse into, without locking. Returns false
+  // if any scan did; the others then stop at their next block.
+  bool ParallelScan(int threads,
+                    const std::function<Visitor(int thread)>& make_visitor)
+      const;
+
+  // Verifies the checksum of every block. Returns false if one fails.
+  bool Verify() const;
+
+ private:
+  struct Block {
+    const char* data;
+    const char* marks;
+    std::uint64_t first_record;
+    std::uint32_t size;
+    std::uint32_t records;
+    std::uint32_t crc;
+  };
+
+  RecordReader(const char* data, std::size_t size);
+
+  bool CheckBlock(std::size_t block) const;
+
+  const char* const data_;  // Mapped; unmapped by the destructor.
+  const std::size_t size_;
+  std::uint64_t records_ = 0;
+  std::vector<Block> index_;
+  // Per block: 0 if not verified yet, 1 if it is intact, 2 if corrupt.
+  std::unique_ptr<std::atomic<std::uint8_t>[]> verified_;
+};
+
+}  // namespace mathematics
+
+#endif  // RECORD_FILE_H_
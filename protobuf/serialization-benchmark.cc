@@ -0,0 +1,306 @@
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "animals.pb.h"
+#include "geometry-service.pb.h"
+
+// Measures the cost of serializing, parsing and copying the messages of
+// animals.proto and of the geometry requests, the ways our code does it and
+// the ways it could:
+//
+//   serialize  SerializeToString into a fresh or a reused string,
+//              SerializeToArray into a buffer allocated once, and through a
+//              CodedOutputStream or a ZeroCopyOutputStream.
+//   parse      ParseFromString into a fresh or a reused message, or onto an
+//              arena, with or without a reused initial block, and through a
+//              CodedInputStream.
+//   copy       Deep copies, like that of a Gatunek into each Zwierze, into a
+//              fresh message, into a reused one, whose strings keep their
+//              buffers, or onto an arena.
+//
+// Each case runs in batches of at least --min_seconds, after one batch to
+// warm up, and is reported as the median of --repetitions batches, with
+// their minimum and maximum to show how stable it is. Results go to stdout
+// as CSV:
+//
+//   $ ./serialization-benchmark --filter=Zwierze > results.csv
+
+ABSL_FLAG(double, min_seconds, 0.2, "The minimum duration of a batch.");
+ABSL_FLAG(int, repetitions, 5, "How many batches to run per case.");
+ABSL_FLAG(std::string, filter, "",
+          "Runs only the cases whose message, operation or variant contains "
+          "this.");
+
+namespace {
+
+using ::google::protobuf::Arena;
+using ::google::protobuf::ArenaOptions;
+using ::google::protobuf::io::ArrayInputStream;
+using ::google::protobuf::io::ArrayOutputStream;
+using ::google::protobuf::io::CodedInputStream;
+using ::google::protobuf::io::CodedOutputStream;
+using ::google::protobuf::io::StringOutputStream;
+
+// The initial block of the arenas that reuse one, large enough for the
+// largest message here.
+constexpr std::size_t kArenaBlockSize = 64 * 1024;
+
+// Keeps the compiler from optimizing away the computation of 'value'.
+template <typename T>
+void DoNotOptimize(const T& value) {
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+struct Case {
+  std::string message;
+  std::string operation;
+  std::string variant;
+  std::size_t bytes;
+  // Runs the operation so many times.
+  std::function<void(std::int64_t)> run;
+};
+
+template <typename Message>
+void AddCases(const std::string& name, const Message& prototype,
+              std::vector<Case>* cases) {
+  const std::string serialized = prototype.SerializeAsString();
+  const std::size_t bytes = serialized.size();
+  auto add = [&](const char* operation, const char* variant,
+                 std::function<void(std::int64_t)> run) {
+    cases->push_back({name, operation, variant, bytes, std::move(run)});
+  };
+
+  add("serialize", "SerializeToString/fresh", [prototype](std::int64_t n) {
+    for (std::int64_t i = 0; i < n; i++) {
+      std::string out;
+      prototype.SerializeToString(&out);
+      DoNotOptimize(out);
+    }
+  });
+  add("serialize", "SerializeToString/reused", [prototype](std::int64_t n) {
+    std::string out;
+    for (std::int64_t i = 0; i < n; i++) {
+      prototype.SerializeToString(&out);
+      DoNotOptimize(out);
+    }
+  });
+  add("serialize", "SerializeToArray/preallocated",
+      [prototype, bytes](std::int64_t n) {
+        std::vector<char> buffer(bytes);
+        for (std::int64_t i = 0; i < n; i++) {
+          prototype.SerializeToArray(buffer.data(),
+                                     static_cast<int>(buffer.size()));
+          DoNotOptimize(buffer);
+        }
+      });
+  add("serialize", "CodedOutputStream/array",
+      [prototype, bytes](std::int64_t n) {
+        std::vector<char> buffer(bytes);
+        for (std::int64_t i = 0; i < n; i++) {
+          ArrayOutputStream array(buffer.data(), static_cast<int>(bytes));
+          CodedOutputStream out(&array);
+          prototype.ByteSizeLong();
+          prototype.SerializeWithCachedSizes(&out);
+          DoNotOptimize(buffer);
+        }
+      });
+  add("serialize", "ZeroCopyOutputStream/string", [prototype](std::int64_t n) {
+    std::string out;
+    for (std::int64_t i = 0; i < n; i++) {
+      out.clear();
+      StringOutputStream stream(&out);
+      prototype.SerializeToZeroCopyStream(&stream);
+      DoNotOptimize(out);
+    }
+  });
+
+  add("parse", "ParseFromString/fresh", [serialized](std::int64_t n) {
+    for (std::int64_t i = 0; i < n; i++) {
+      Message message;
+      message.ParseFromString(serialized);
+      DoNotOptimize(message);
+    }
+  });
+  add("parse", "ParseFromString/reused", [serialized](std::int64_t n) {
+    Message message;
+    for (std::int64_t i = 0; i < n; i++) {
+      message.ParseFromString(serialized);
+      DoNotOptimize(message);
+    }
+  });
+  add("parse", "ParseFromString/arena", [serialized](std::int64_t n) {
+    for (std::int64_t i = 0; i < n; i++) {
+      Arena arena;
+      Message* message = Arena::CreateMessage<Message>(&arena);
+      message->ParseFromString(serialized);
+      DoNotOptimize(*message);
+    }
+  });
+  add("parse", "ParseFromString/arena_reused_block",
+      [serialized](std::int64_t n) {
+        std::vector<char> block(kArenaBlockSize);
+        ArenaOptions options;
+        options.initial_block = block.data();
+        options.initial_block_size = block.size();
+        for (std::int64_t i = 0; i < n; i++) {
+          Arena arena(options);
+          Message* message = Arena::CreateMessage<Message>(&arena);
+          message->ParseFromString(serialized);
+          DoNotOptimize(*message);
+        }
+      });
+  add("parse", "CodedInputStream/array", [serialized](std::int64_t n) {
+    for (std::int64_t i = 0; i < n; i++) {
+      ArrayInputStream array(serialized.data(),
+                             static_cast<int>(serialized.size()));
+      CodedInputStream in(&array);
+      Message message;
+      message.ParseFromCodedStream(&in);
+      DoNotOptimize(message);
+    }
+  });
+
+  add("copy", "CopyFrom/fresh", [prototype](std::int64_t n) {
+    for (std::int64_t i = 0; i < n; i++) {
+      Message copy = prototype;
+      DoNotOptimize(copy);
+    }
+  });
+  add("copy", "CopyFrom/reused", [prototype](std::int64_t n) {
+    Message copy;
+    for (std::int64_t i = 0; i < n; i++) {
+      copy.CopyFrom(prototype);
+      DoNotOptimize(copy);
+    }
+  });
+  add("copy", "CopyFrom/arena_reused_block", [prototype](std::int64_t n) {
+    std::vector<char> block(kArenaBlockSize);
+    ArenaOptions options;
+    options.initial_block = block.data();
+    options.initial_block_size = block.size();
+    for (std::int64_t i = 0; i < n; i++) {
+      Arena arena(options);
+      Message* copy = Arena::CreateMessage<Message>(&arena);
+      copy->CopyFrom(prototype);
+      DoNotOptimize(*copy);
+    }
+  });
+}
+
+zwierzeta::Gatunek Kura() {
+  zwierzeta::Gatunek kura;
+  kura.set_nazwa("Gallus gallus domesticus");
+  kura.add_odglosy("ko ko ko");
+  kura.add_odglosy("kukuryku");
+  kura.set_liczba_nog(2);
+  return kura;
+}
+
+zwierzeta::Zwierze Krowa() {
+  zwierzeta::Zwierze krowa;
+  krowa.mutable_gatunek()->set_nazwa("krowa");
+  krowa.mutable_gatunek()->set_liczba_nog(4);
+  krowa.mutable_gatunek()->add_odglosy("Muuuu");
+  krowa.set_imie("Krasula");
+  return krowa;
+}
+
+// A request with 'coordinates' coordinates, as a repeated field or packed.
+mathematics::ScheduleLengthComputationRequest Request(int coordinates,
+                                                      bool packed) {
+  mathematics::ScheduleLengthComputationRequest request;
+  request.set_id("length-request-000000042");
+  request.set_publish_time_micros(1700000000000000);
+  for (int i = 0; i < coordinates; i++) {
+    const int coordinate = (i * 37) % 1001;
+    if (packed) {
+      request.mutable_packed_coordinates()->push_back(
+          static_cast<char>(coordinate & 0xff));
+      request.mutable_packed_coordinates()->push_back(
+          static_cast<char>(coordinate >> 8));
+    } else {
+      request.add_coordinates(coordinate);
+    }
+  }
+  return request;
+}
+
+mathematics::ScheduleLengthComputationBatch Batch(int requests) {
+  mathematics::ScheduleLengthComputationBatch batch;
+  for (int i = 0; i < requests; i++) {
+    *batch.add_requests() = Request(3, /*packed=*/false);
+    batch.add_traceparents(
+        "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01");
+  }
+  return batch;
+}
+
+// Returns the nanoseconds per operation of a batch of 'n'.
+double TimeBatch(const Case& c, std::int64_t n) {
+  const auto start = std::chrono::steady_clock::now();
+  c.run(n);
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+             .count() /
+         n;
+}
+
+void Run(const Case& c) {
+  const double min_ns = absl::GetFlag(FLAGS_min_seconds) * 1e9;
+  // Grows the batch until it is long enough, which also warms up.
+  std::int64_t n = 1;
+  while (TimeBatch(c, n) * n < min_ns) {
+    n *= 2;
+  }
+  std::vector<double> ns;
+  for (int i = 0; i < std::max(absl::GetFlag(FLAGS_repetitions), 1); i++) {
+    ns.push_back(TimeBatch(c, n));
+  }
+  std::sort(ns.begin(), ns.end());
+  const double median = ns[ns.size() / 2];
+  std::cout << c.message << "," << c.operation << "," << c.variant << ","
+            << c.bytes << "," << n << "," << median << "," << ns.front()
+            << "," << ns.back() << "," << c.bytes / median * 1e3
+            << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+
+  std::vector<Case> cases;
+  AddCases("Gatunek", Kura(), &cases);
+  AddCases("Zwierze", Krowa(), &cases);
+  AddCases("ScheduleLengthComputationRequest/3",
+           Request(3, /*packed=*/false), &cases);
+  AddCases("ScheduleLengthComputationRequest/1000",
+           Request(1000, /*packed=*/false), &cases);
+  AddCases("ScheduleLengthComputationRequest/1000/packed",
+           Request(1000, /*packed=*/true), &cases);
+  AddCases("ScheduleLengthComputationBatch/50", Batch(50), &cases);
+
+  const std::string filter = absl::GetFlag(FLAGS_filter);
+  std::cout << "message,operation,variant,bytes,iterations,ns_per_op,"
+               "ns_per_op_min,ns_per_op_max,mb_per_s"
+            << std::endl;
+  for (const Case& c : cases) {
+    if (filter.empty() ||
+        (c.message + "," + c.operation + "," + c.variant).find(filter) !=
+            std::string::npos) {
+      Run(c);
+    }
+  }
+}
@@ -0,0 +1,101 @@
+
+#ifndef ADMISSION_CONTROL_H_
+#define ADMISSION_CONTROL_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include <grpcpp/grpcpp.h>
+
+#include "metrics.h"
+
+namespace mathematics {
+
+// Limits how many calls a server works on at once, so that under overload
+// it answers the excess at once with RESOURCE_EXHAUSTED, for the clients to
+// retry elsewhere or later, instead of making every call slow.
+//
+// The limit adapts to the latency of the calls, additive increase and
+// multiplicative decrease: each call that completes no slower than the
+// server does unloaded raises the limit by 1/limit, so by about one per
+// round of calls, and a slow call cuts it by kBackoff, at most once per
+// kDecreaseInterval so that one burst is one cut. How fast the server is
+// unloaded is the least latency seen over a recent window.
+//
+// Calls whose deadline has passed, or is closer than the usual latency, are
+// refused with DEADLINE_EXCEEDED before any work is done on them. Thread-safe.
+class AdmissionControl {
+ public:
+  struct Options {
+    int initial_limit = 64;
+    int min_limit = 4;
+    int max_limit = 1000;
+  };
+
+  // Holds a call's place until destroyed. Movable.
+  class Permit {
+   public:
+    Permit() = default;
+    Permit(Permit&& other) { *this = std::move(other); }
+    Permit& operator=(Permit&& other);
+    ~Permit();
+
+   private:
+    friend class AdmissionControl;
+
+    AdmissionControl* control_ = nullptr;  // Not owned.
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  explicit AdmissionControl(Options options);
+
+  // Returns nullptr if --admission_control is false.
+  static std::unique_ptr<AdmissionControl> FromFlags();
+
+  // Returns OK and sets '*permit' if the call may go ahead; otherwise the
+  // status to reply with.
+  grpc::Status Admit(const grpc::ServerContextBase& context, Permit* permit);
+
+ private:
+  static constexpr double kBackoff = 0.9;
+  // How much slower than unloaded a call may be before the limit is cut:
+  // by this factor, and at least kLatencySlack, which keeps the jitter of
+  // calls that take microseconds from counting.
+  static constexpr double kLatencyTolerance = 2;
+  static constexpr std::chrono::microseconds kLatencySlack{1000};
+  static constexpr std::chrono::milliseconds kDecreaseInterval{100};
+  // The least latency is taken over windows this long, so that it follows
+  // the server if it gets slower for good.
+  static constexpr std::chrono::seconds kMinLatencyWindow{10};
+
+  void Release(const Permit& permit);
+
+  const Options options_;
+
+  std::atomic<int> in_flight_{0};
+  // The limit, and the usual latency in nanoseconds; written under mu_.
+  std::atomic<double> limit_;
+  std::atomic<double> typical_latency_ns_{0};
+
+  std::mutex mu_;
+  // The rest is guarded by mu_.
+  double min_latency_ns_ = 0;  // 0 until the first call.
+  double window_min_latency_ns_ = 0;
+  std::chrono::steady_clock::time_point window_start_;
+  std::chrono::steady_clock::time_point last_decrease_;
+
+  metrics::Gauge* limit_gauge_;
+  metrics::Gauge* in_flight_gauge_;
+  metrics::Counter* over_limit_;
+  metrics::Counter* past_deadline_;
+};
+
+// Sets --resource_quota_bytes and --max_server_threads on 'builder'.
+void SetResourceQuotaFromFlags(grpc::ServerBuilder* builder);
+
+}  // namespace mathematics
+
+#endif  // ADMISSION_CONTROL_H_
@@ -0,0 +1,244 @@
+
+#ifndef ARITHMETIC_BALANCER_H_
+#define ARITHMETIC_BALANCER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "arithmetic-service.grpc.pb.h"
+#include "metrics.h"
+#include "square-stream.h"
+
+// Client-side load balancing across arithmetic server replicas.
+//
+// gRPC's round_robin spreads calls evenly, so a replica that is slow for a
+// while (GC pauses, a noisy neighbour) still gets its share of the calls and
+// they make up the tail. Here each call goes to the better of two randomly
+// chosen replicas ("power of two choices"), scoring a replica by its
+// exponentially weighted moving average latency times the number of calls it
+// has outstanding, plus one. Slow or busy replicas get fewer calls without
+// the herding that always picking the single best replica would cause.
+//
+// Replicas are listed in --arithmetic_endpoints. Per-replica load is exported
+// as arithmetic_client_* metrics labelled with the endpoint.
+//
+// With --hedge_arithmetic_calls, a ComputeSquare that has not answered within
+// --hedge_delay_ms (by default the recent p95 latency) is sent again to a
+// different replica, and the first successful reply wins; the other call is
+// cancelled. A token bucket holds hedges to --max_hedge_fraction of calls so
+// that a slow fleet does not see its load doubled.
+//
+// With --arithmetic_square_stream, callers with many numbers to square use
+// ComputeSquares(), which sends them over a long-lived SquareStream to the
+// picked replica rather than making a unary call per number.
+//
+// gRPC multiplexes all calls on a channel over one HTTP/2 connection, which
+// caps the streams in flight and is read and written by one thread at a
+// time, so a busy client can be held back by its connection rather than by
+// the replica. With --arithmetic_connections_per_replica, each replica gets
+// that many channels, made with distinct channel arguments so that gRPC
+// cannot share their subchannels, and each call goes to the picked replica's
+// connection with the fewest calls in flight.
+
+namespace mathematics {
+
+class ArithmeticBalancer {
+ public:
+  class Backend {
+   public:
+    // One of the channels to the backend, each with its own connection, and
+    // the stub and square stream that use it.
+    class Connection {
+     public:
+      Connection(std::shared_ptr<grpc::Channel> channel,
+                 std::size_t square_stream_window);
+
+      grpc::Channel* channel() const { return channel_.get(); }
+      Arithmetic::Stub* stub() const { return stub_.get(); }
+      SquareStream* square_stream() const { return square_stream_.get(); }
+
+     private:
+      friend class Backend;
+
+      const std::shared_ptr<grpc::Channel> channel_;
+      const std::unique_ptr<Arithmetic::Stub> stub_;
+      const std::unique_ptr<SquareStream> square_stream_;
+      std::atomic<std::int64_t> outstanding_{0};
+    };
+
+    // 'channels' must not be empty.
+    Backend(std::string endpoint,
+            const std::vector<std::shared_ptr<grpc::Channel>>& channels,
+            std::size_t square_stream_window);
+
+    const std::string& endpoint() const { return endpoint_; }
+    const std::vector<std::unique_ptr<Connection>>& connections() const {
+      return connections_;
+    }
+
+    // Returns the connection with the fewest calls in flight, for a call
+    // about to be made on it. Every Acquire() must be followed by a call to
+    // Release().
+    Connection* Acquire();
+    void Release(Connection* connection);
+
+   private:
+    friend class ArithmeticBalancer;
+
+    // Lower is better.
+    double Cost(std::chrono::steady_clock::time_point now) const;
+    void Update(std::chrono::steady_clock::time_point now,
+                std::chrono::steady_clock::duration latency);
+
+    const std::string endpoint_;
+    std::vector<std::unique_ptr<Connection>> connections_;
+    // Where Acquire() starts looking, so that ties go round.
+    std::atomic<std::size_t> next_connection_{0};
+
+    std::atomic<std::int64_t> outstanding_{0};
+    std::atomic<double> ewma_latency_us_{0};
+    std::atomic<std::int64_t> last_update_ns_{0};  // Steady clock.
+
+    metrics::Gauge* outstanding_gauge_;
+    metrics::Gauge* ewma_latency_gauge_;
+    metrics::Counter* calls_;
+    metrics::Counter* failures_;
+  };
+
+  struct HedgingOptions {
+    bool enabled = false;
+    // 0 hedges after the p95 latency of recent calls.
+    std::chrono::milliseconds delay{0};
+    // The long-run maximum of hedges per call.
+    double max_fraction = 0.05;
+  };
+
+  // Creates the ClientContext for one attempt of a call. Called twice for a
+  // hedged call.
+  using ContextFactory = std::function<std::unique_ptr<grpc::ClientContext>()>;
+
+  // Replicas, by the name their metrics are labelled with, and the channels
+  // to them: one or more each, all used.
+  using NamedChannels = std::vector<
+      std::pair<std::string, std::vector<std::shared_ptr<grpc::Channel>>>>;
+
+  // Opens 'connections_per_backend' channels to each of 'endpoints'.
+  ArithmeticBalancer(const std::vector<std::string>& endpoints,
+                     const HedgingOptions& hedging, bool use_square_stream,
+                     std::size_t square_stream_window,
+                     std::size_t connections_per_backend = 1);
+
+  // Same, for channels that are not made from an address, such as the
+  // in-process channel of a grpc::Server that serves Arithmetic itself.
+  ArithmeticBalancer(const NamedChannels& channels,
+                     const HedgingOptions& hedging, bool use_square_stream,
+                     std::size_t square_stream_window);
+
+  // Balances across the replicas listed in --arithmetic_endpoints, with
+  // hedging and square streams as set by the other flags. Returns nullptr,
+  // having said why on stderr, if it lists none.
+  static std::unique_ptr<ArithmeticBalancer> FromFlags();
+
+  // Same, with the one replica reached on 'channel' instead of those listed
+  // in --arithmetic_endpoints.
+  static std::unique_ptr<ArithmeticBalancer> FromFlags(
+      const std::string& name, std::shared_ptr<grpc::Channel> channel);
+
+  // Connects to all the backends at once, rather than on their first calls,
+  // waiting until 'deadline' at most. Logs the backends that could not be
+  // reached, which are left to the balancer to avoid, and returns how many
+  // are connected.
+  int WaitForConnected(std::chrono::system_clock::time_point deadline);
+
+  // Picks the backend for the next call, avoiding 'exclude' if there is any
+  // other backend, or returns nullptr if there are no backends at all. Every
+  // Pick() of a backend must be followed by a call to Done().
+  Backend* Pick(const Backend* exclude = nullptr);
+
+  // Records the outcome of a call started at 'start' on 'backend'.
+  void Done(Backend* backend, std::chrono::steady_clock::time_point start,
+            const grpc::Status& status);
+
+  // Same as Arithmetic::Stub::ComputeSquare(), on a picked backend, hedged
+  // if enabled.
+  grpc::Status ComputeSquare(const ContextFactory& new_context,
+                             const ComputeSquareRequest& request,
+                             ComputeSquareResponse* response);
+
+  // Whether callers should prefer ComputeSquares() to ComputeSquare().
+  bool use_square_stream() const { return use_square_stream_; }
+
+  // Sets '*squares' to the squares of 'numbers', sent over the SquareStream
+  // of a picked backend. Not hedged.
+  grpc::Status ComputeSquares(const std::int32_t* numbers, std::size_t count,
+                              std::chrono::system_clock::time_point deadline,
+                              std::vector<std::int64_t>* squares);
+
+  // Same as Arithmetic::Stub::ComputePackedSquares(), on a picked backend.
+  // Not hedged.
+  grpc::Status ComputePackedSquares(const ContextFactory& new_context,
+                                    const ComputePackedSquaresRequest& request,
+                                    ComputePackedSquaresResponse* response);
+
+  const std::vector<std::unique_ptr<Backend>>& backends() const {
+    return backends_;
+  }
+
+ private:
+  // The latencies of the last kSize successful calls of one method.
+  class LatencyWindow {
+   public:
+    void Add(std::chrono::steady_clock::duration latency);
+    // Returns false until enough calls have been seen.
+    bool P95(std::chrono::steady_clock::duration* p95);
+
+   private:
+    static constexpr std::size_t kSize = 1024;
+    // Recomputing the p95 is a partial sort, so do it every so often.
+    static constexpr std::size_t kRecomputeEvery = 64;
+
+    std::mutex mu_;
+    // A ring of the latest samples. Guarded by mu_.
+    std::vector<std::chrono::steady_clock::duration> samples_;
+    std::size_t added_ = 0;                       // Guarded by mu_.
+    std::chrono::steady_clock::duration p95_{0};  // Guarded by mu_.
+  };
+
+  struct HedgedCall;
+
+  grpc::Status UnhedgedComputeSquare(const ContextFactory& new_context,
+                                     const ComputeSquareRequest& request,
+                                     ComputeSquareResponse* response);
+  grpc::Status HedgedComputeSquare(const ContextFactory& new_context,
+                                   const ComputeSquareRequest& request,
+                                   ComputeSquareResponse* response);
+  void StartAttempt(const std::shared_ptr<HedgedCall>& call, int attempt,
+                    std::unique_ptr<grpc::ClientContext> context,
+                    const Backend* exclude);
+  bool TakeHedgeToken();
+
+  std::vector<std::unique_ptr<Backend>> backends_;
+
+  const HedgingOptions hedging_;
+  const bool use_square_stream_;
+  LatencyWindow square_latency_;
+  std::mutex hedge_mu_;
+  double hedge_tokens_ = 0;  // Guarded by hedge_mu_.
+
+  metrics::Counter* hedges_;
+  metrics::Counter* hedge_wins_;
+  metrics::Counter* hedges_over_budget_;
+};
+
+}  // namespace mathematics
+
+#endif  // ARITHMETIC_BALANCER_H_
@@ -10,29 +10,65 @@
 #include <grpc++/server_context.h>
 #include <grpc/grpc.h>
 
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "admission-control.h"
+#include "arena-allocator.h"
 #include "arithmetic-service.grpc.pb.h"
+#include "async-log.h"
+#include "metrics.h"
+#include "packed-numbers.h"
+#include "tracing.h"
+
+ABSL_FLAG(std::string, listen_address, "127.0.0.1:50051",
+          "The address to serve on: host:port, or unix:/path/to/socket or "
+          "unix-abstract:name for a Unix domain socket, which skips the TCP "
+          "stack for clients on the same host. Run several replicas on "
+          "different addresses to balance across them with "
+          "--arithmetic_endpoints.");
 
 namespace mathematics {
 namespace {
 
+using ::grpc::CallbackServerContext;
 using ::grpc::Server;
 using ::grpc::ServerBuilder;
 using ::grpc::ServerContext;
+using ::grpc::ServerContextBase;
+using ::grpc::ServerReaderWriter;
+using ::grpc::ServerUnaryReactor;
 using ::grpc::Status;
 using ::grpc::StatusCode;
 
-class ArithmeticServiceImpl final : public Arithmetic::Service {
+// ComputePackedSquares uses the callback API, so that its request and
+// response, strings and all, are allocated on a pooled arena rather than on
+// the heap; it never blocks, so it does not hold up the callback threads.
+class ArithmeticServiceImpl final
+    : public Arithmetic::WithCallbackMethod_ComputePackedSquares<
+          Arithmetic::Service> {
  public:
-  ArithmeticServiceImpl() {}
+  explicit ArithmeticServiceImpl(AdmissionControl* admission)
+      : admission_(admission) {
+    SetMessageAllocatorFor_ComputePackedSquares(&packed_squares_allocator_);
+  }
 
   Status ComputeSquare(ServerContext* context,
                        const ComputeSquareRequest* request,
                        ComputeSquareResponse* response) override {
-    std::cout << "ComputeSquare; " << request->ShortDebugString() << std::endl;
+    AdmissionControl::Permit permit;
+    Status admitted = Admit(*context, &permit);
+    if (!admitted.ok()) {
+      return admitted;
+    }
+    ASYNC_LOG_SAMPLED(kInfo, 1, 100, "ComputeSquare; number: {}",
+                      request->number());
+    tracing::Span span("Arithmetic.ComputeSquare", tracing::Extract(*context));
+    span.SetAttribute("number", request->number());
     if (request->number() < 0 || request->number() > 1000) {
       std::stringstream ss;
       ss << "request.number " << request->number()
          << " is outside the valid range 0 .. 1000";
+      span.SetStatus(StatusCode::INVALID_ARGUMENT, ss.str());
       return Status(StatusCode::INVALID_ARGUMENT, ss.str());
     }
     response->set_square(request->number() * request->number());
@@ -42,22 +78,135 @@ class ArithmeticServiceImpl final : public Arithmetic::Service {
 
   Status ComputeCube(ServerContext* context, const ComputeCubeRequest* request,
                      ComputeCubeResponse* response) override {
+    AdmissionControl::Permit permit;
+    Status admitted = Admit(*context, &permit);
+    if (!admitted.ok()) {
+      return admitted;
+    }
+    tracing::Span span("Arithmetic.ComputeCube", tracing::Extract(*context));
     int n = request->number();
+    span.SetAttribute("number", n);
     if (n < 0 || n > 1000) {
       std::stringstream ss;
       ss << "request.number " << n << " is outside the valid range 0 .. 1000";
+      span.SetStatus(StatusCode::INVALID_ARGUMENT, ss.str());
       return Status(StatusCode::INVALID_ARGUMENT, ss.str());
     }
     response->set_cube(n * n * n);
 
     return Status::OK;
   }
+
+  Status SquareStream(
+      ServerContext* context,
+      ServerReaderWriter<SquareStreamResponse, SquareStreamRequest>* stream)
+      override {
+    SquareStreamRequest request;
+    SquareStreamResponse response;
+    while (stream->Read(&request)) {
+      response.Clear();
+      response.set_request_id(request.request_id());
+      const int n = request.number();
+      {
+        // Each request is admitted on its own, as a call would be: a stream
+        // lasts as long as the client wants, and holding a place for all of
+        // it would count idle streams against the limit.
+        AdmissionControl::Permit permit;
+        Status admitted = Admit(*context, &permit);
+        if (!admitted.ok()) {
+          response.set_error_code(admitted.error_code());
+          response.set_error_message(admitted.error_message());
+        } else if (n < 0 || n > 1000) {
+          std::stringstream ss;
+          ss << "request.number " << n
+             << " is outside the valid range 0 .. 1000";
+          response.set_error_code(StatusCode::INVALID_ARGUMENT);
+          response.set_error_message(ss.str());
+        } else {
+          response.set_square(n * n);
+        }
+      }
+      if (!stream->Write(response)) {
+        break;
+      }
+    }
+
+    return Status::OK;
+  }
+
+  ServerUnaryReactor* ComputePackedSquares(
+      CallbackServerContext* context,
+      const ComputePackedSquaresRequest* request,
+      ComputePackedSquaresResponse* response) override {
+    ServerUnaryReactor* reactor = context->DefaultReactor();
+    reactor->Finish(PackedSquares(*context, *request, response));
+    return reactor;
+  }
+
+ private:
+  Status PackedSquares(const ServerContextBase& context,
+                       const ComputePackedSquaresRequest& request,
+                       ComputePackedSquaresResponse* response) {
+    AdmissionControl::Permit permit;
+    Status admitted = Admit(context, &permit);
+    if (!admitted.ok()) {
+      return admitted;
+    }
+    tracing::Span span("Arithmetic.ComputePackedSquares",
+                       tracing::Extract(context));
+    // Read in place from the request, with no per-number decoding.
+    const std::string& numbers = request.packed_numbers();
+    if (!packed::WellFormed(numbers)) {
+      std::stringstream ss;
+      ss << "request.packed_numbers has " << numbers.size()
+         << " bytes, which is not a whole number of uint16";
+      span.SetStatus(StatusCode::INVALID_ARGUMENT, ss.str());
+      return Status(StatusCode::INVALID_ARGUMENT, ss.str());
+    }
+    span.SetAttribute("numbers", packed::Count(numbers));
+    const std::size_t bad = packed::FindOutOfRange(numbers);
+    if (bad != packed::Count(numbers)) {
+      std::stringstream ss;
+      ss << "request.packed_numbers[" << bad << "] "
+         << packed::At(numbers, bad) << " is outside the valid range 0 .. "
+         << packed::kMaxNumber;
+      span.SetStatus(StatusCode::INVALID_ARGUMENT, ss.str());
+      return Status(StatusCode::INVALID_ARGUMENT, ss.str());
+    }
+    packed::Square(numbers, response->mutable_packed_squares());
+
+    return Status::OK;
+  }
+
+  // Returns OK and sets '*permit' if the call may be served.
+  Status Admit(const ServerContextBase& context,
+               AdmissionControl::Permit* permit) {
+    if (admission_ == nullptr) {
+      return Status::OK;
+    }
+    return admission_->Admit(context, permit);
+  }
+
+  AdmissionControl* const admission_;  // Not owned; nullptr if off.
+  ArenaAllocator<ComputePackedSquaresRequest, ComputePackedSquaresResponse>
+      packed_squares_allocator_;
 };
 
 void RunServer() {
-  std::string server_address("127.0.0.1:50051");
-  ArithmeticServiceImpl service;
+  if (!tracing::StartFileExporterFromFlags()) {
+    std::cerr << "Failed to open the trace file" << std::endl;
+    exit(-1);
+  }
+  if (!metrics::StartHttpServerFromFlags()) {
+    std::cerr << "Failed to start the metrics server" << std::endl;
+    exit(-1);
+  }
+
+  const std::string server_address = absl::GetFlag(FLAGS_listen_address);
+  std::unique_ptr<AdmissionControl> admission = AdmissionControl::FromFlags();
+  ArithmeticServiceImpl service(admission.get());
   ServerBuilder builder;
+  SetResourceQuotaFromFlags(&builder);
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
   builder.RegisterService(&service);
   std::unique_ptr<Server> server(builder.BuildAndStart());
@@ -73,4 +222,7 @@ void RunServer() {
 }  // namespace
 }  // namespace mathematics
 
-int main() { mathematics::RunServer(); }
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  mathematics::RunServer();
+}
@@ -0,0 +1,221 @@
+
+#include "envelope.h"
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+
+#include "absl/flags/flag.h"
+
+ABSL_FLAG(int, envelope_max_requests, 0,
+          "Publish up to this many requests in one pubsub message, an "
+          "envelope; below 2, each request is a message of its own.");
+ABSL_FLAG(std::int64_t, envelope_max_bytes, 1 << 20,
+          "Publish an envelope once its requests take this many bytes.");
+ABSL_FLAG(int, envelope_max_delay_ms, 5,
+          "Publish an envelope this long after its first request, however "
+          "few requests it holds.");
+
+namespace mathematics {
+
+namespace pubsub = ::google::cloud::pubsub;
+
+tracing::SpanContext RequestTraceContext(
+    const ScheduleLengthComputationBatch& envelope, int index,
+    const tracing::SpanContext& fallback) {
+  if (index >= envelope.traceparents_size()) {
+    return fallback;
+  }
+  tracing::SpanContext context =
+      tracing::SpanContext::FromTraceparent(envelope.traceparents(index));
+  return context.valid() ? context : fallback;
+}
+
+PublishBatcher::PublishBatcher(
+    std::shared_ptr<pubsub::PublisherConnection> connection, int max_requests,
+    std::size_t max_bytes, std::chrono::milliseconds max_delay)
+    : publisher_(std::move(connection)),
+      max_requests_(max_requests),
+      max_bytes_(max_bytes),
+      max_delay_(max_delay),
+      envelope_requests_(metrics::NewHistogram(
+          "geometry_server_envelope_requests",
+          "Requests per envelope published.",
+          metrics::ExponentialBuckets(1, 2, 12))) {
+  flusher_ = std::thread(&PublishBatcher::FlushLoop, this);
+}
+
+PublishBatcher::~PublishBatcher() {
+  Envelope last;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stop_ = true;
+    last = TakeLocked();
+  }
+  cv_.notify_all();
+  flusher_.join();
+  Send(std::move(last));
+}
+
+std::unique_ptr<PublishBatcher> PublishBatcher::FromFlags(
+    std::shared_ptr<pubsub::PublisherConnection> connection) {
+  const int max_requests = absl::GetFlag(FLAGS_envelope_max_requests);
+  if (max_requests < 2) {
+    return nullptr;
+  }
+  return std::make_unique<PublishBatcher>(
+      std::move(connection), max_requests,
+      absl::GetFlag(FLAGS_envelope_max_bytes),
+      std::chrono::milliseconds(absl::GetFlag(FLAGS_envelope_max_delay_ms)));
+}
+
+std::shared_future<PublishBatcher::Result> PublishBatcher::Publish(
+    const ScheduleLengthComputationRequest& request,
+    const tracing::SpanContext& context) {
+  Envelope full;
+  std::shared_future<Result> result;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (current_.batch.requests_size() == 0) {
+      current_.started = std::chrono::steady_clock::now();
+      current_.promise = std::make_shared<std::promise<Result>>();
+      current_.result = current_.promise->get_future().share();
+      cv_.notify_all();
+    }
+    *current_.batch.add_requests() = request;
+    current_.batch.add_traceparents(
+        context.valid() ? context.ToTraceparent() : std::string());
+    current_.bytes += request.ByteSizeLong();
+    result = current_.result;
+    if (current_.batch.requests_size() >= max_requests_ ||
+        current_.bytes >= max_bytes_) {
+      full = TakeLocked();
+    }
+  }
+  Send(std::move(full));
+  return result;
+}
+
+PublishBatcher::Envelope PublishBatcher::TakeLocked() {
+  Envelope taken = std::move(current_);
+  current_ = Envelope();
+  generation_++;
+  return taken;
+}
+
+void PublishBatcher::Send(Envelope envelope) {
+  if (envelope.batch.requests_size() == 0) {
+    return;
+  }
+  envelope_requests_->Observe(envelope.batch.requests_size());
+  pubsub::MessageBuilder message;
+  message.SetData(envelope.batch.SerializeAsString());
+  message.InsertAttribute(kEnvelopeKey, "1");
+  // Copies of a Publisher may be used from different threads; the same one
+  // may not.
+  auto publisher = publisher_;
+  auto promise = std::move(envelope.promise);
+  publisher.Publish(std::move(message).Build())
+      .then([promise](google::cloud::future<Result> f) {
+        promise->set_value(f.get());
+      });
+}
+
+void PublishBatcher::FlushLoop() {
+  std::unique_lock<std::mutex> lock(mu_);
+  while (!stop_) {
+    if (current_.batch.requests_size() == 0) {
+      cv_.wait(lock);
+      continue;
+    }
+    const std::uint64_t generation = generation_;
+    const auto due = current_.started + max_delay_;
+    cv_.wait_until(lock, due,
+                   [&] { return stop_ || generation_ != generation; });
+    if (stop_ || generation_ != generation) {
+      continue;
+    }
+    Envelope due_envelope = TakeLocked();
+    lock.unlock();
+    Send(std::move(due_envelope));
+    lock.lock();
+  }
+}
+
+EnvelopeTracker::Delivery::Delivery(EnvelopeTracker* tracker,
+                                    std::string message_id,
+                                    std::vector<char> completed)
+    : tracker_(tracker),
+      message_id_(std::move(message_id)),
+      completed_(std::move(completed)) {
+  for (std::size_t i = 0; i < completed_.size(); i++) {
+    if (!completed_[i]) {
+      pending_.push_back(static_cast<int>(i));
+    }
+  }
+  remaining_ = pending_.size();
+}
+
+bool EnvelopeTracker::Delivery::Record(int index, bool done) {
+  completed_[index] = done;
+  // Orders the entries written by the other requests before the reads below.
+  if (remaining_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return false;
+  }
+  if (std::all_of(completed_.begin(), completed_.end(),
+                  [](char c) { return c; })) {
+    return true;
+  }
+  tracker_->Keep(message_id_, std::move(completed_));
+  return false;
+}
+
+EnvelopeTracker::EnvelopeTracker()
+    : processed_(metrics::NewCounter(
+          "geometry_processor_envelope_requests_total",
+          "Requests processed from envelopes.")),
+      skipped_(metrics::NewCounter(
+          "geometry_processor_envelope_requests_skipped_total",
+          "Requests of envelopes delivered again that had already been "
+          "completed.")) {}
+
+std::shared_ptr<EnvelopeTracker::Delivery> EnvelopeTracker::Begin(
+    const std::string& message_id, int count) {
+  std::vector<char> completed(count, false);
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    ExpireLocked(Clock::now());
+    auto it = progress_.find(message_id);
+    if (it != progress_.end() &&
+        it->second.completed.size() == completed.size()) {
+      completed = std::move(it->second.completed);
+      progress_.erase(it);
+    }
+  }
+  std::shared_ptr<Delivery> delivery(
+      new Delivery(this, message_id, std::move(completed)));
+  skipped_->Increment(count - delivery->pending().size());
+  processed_->Increment(delivery->pending().size());
+  return delivery;
+}
+
+void EnvelopeTracker::Keep(const std::string& message_id,
+                           std::vector<char> completed) {
+  std::lock_guard<std::mutex> lock(mu_);
+  const Clock::time_point now = Clock::now();
+  progress_[message_id] = Progress{std::move(completed), now};
+  recorded_.emplace_back(now, message_id);
+}
+
+void EnvelopeTracker::ExpireLocked(Clock::time_point now) {
+  while (!recorded_.empty() && recorded_.front().first + kRetention <= now) {
+    auto it = progress_.find(recorded_.front().second);
+    // Only if not recorded again since.
+    if (it != progress_.end() && it->second.recorded + kRetention <= now) {
+      progress_.erase(it);
+    }
+    recorded_.pop_front();
+  }
+}
+
+}  // namespace mathematics
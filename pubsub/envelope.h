@@ -0,0 +1,183 @@
+
+#ifndef ENVELOPE_H_
+#define ENVELOPE_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <google/cloud/pubsub/publisher.h>
+#include <google/cloud/status_or.h>
+
+#include "geometry-service.pb.h"
+#include "metrics.h"
+#include "tracing.h"
+
+// Envelopes: ScheduleLengthComputationBatch messages, which carry many
+// requests in one pubsub message.
+//
+// The geometry server packs requests into envelopes with a PublishBatcher,
+// which publishes an envelope once it holds enough requests or bytes, or
+// once its first request has waited long enough. The processors tell
+// envelopes from single requests by the kEnvelopeKey attribute, and schedule
+// the requests in an envelope one by one, as if each came in a message of
+// its own, tracking them with an EnvelopeTracker.
+//
+// A message is acknowledged as a whole, so an envelope is acknowledged only
+// once all its requests are done. The tracker remembers which were, so that
+// when the envelope is delivered again only the others are processed.
+
+namespace mathematics {
+
+// The attribute that marks a message as an envelope.
+constexpr char kEnvelopeKey[] = "envelope";
+
+// Whether 'attributes', those of a pubsub message, mark it as an envelope.
+inline bool IsEnvelope(const std::map<std::string, std::string>& attributes) {
+  return attributes.count(kEnvelopeKey) > 0;
+}
+
+// Returns the trace context the geometry server recorded for request 'index'
+// of 'envelope', or 'fallback' if there is none.
+tracing::SpanContext RequestTraceContext(
+    const ScheduleLengthComputationBatch& envelope, int index,
+    const tracing::SpanContext& fallback);
+
+class PublishBatcher {
+ public:
+  // The id of the message that carried a request, or why publishing it
+  // failed.
+  using Result = google::cloud::StatusOr<std::string>;
+
+  // Publishes an envelope when it holds 'max_requests' requests or
+  // 'max_bytes' bytes, or 'max_delay' after its first request.
+  PublishBatcher(
+      std::shared_ptr<google::cloud::pubsub::PublisherConnection> connection,
+      int max_requests, std::size_t max_bytes,
+      std::chrono::milliseconds max_delay);
+
+  // Publishes the envelope being filled, if any.
+  ~PublishBatcher();
+
+  PublishBatcher(const PublishBatcher&) = delete;
+  PublishBatcher& operator=(const PublishBatcher&) = delete;
+
+  // Returns nullptr if --envelope_max_requests is below 2.
+  static std::unique_ptr<PublishBatcher> FromFlags(
+      std::shared_ptr<google::cloud::pubsub::PublisherConnection> connection);
+
+  // Adds 'request' to the envelope being filled. 'context' is the trace
+  // context the processor should continue.
+  std::shared_future<Result> Publish(
+      const ScheduleLengthComputationRequest& request,
+      const tracing::SpanContext& context);
+
+ private:
+  struct Envelope {
+    ScheduleLengthComputationBatch batch;
+    std::size_t bytes = 0;
+    std::chrono::steady_clock::time_point started;
+    std::shared_ptr<std::promise<Result>> promise;
+    std::shared_future<Result> result;
+  };
+
+  // Takes the envelope being filled. Requires mu_.
+  Envelope TakeLocked();
+  void Send(Envelope envelope);
+  // Publishes envelopes that have waited 'max_delay_'.
+  void FlushLoop();
+
+  const google::cloud::pubsub::Publisher publisher_;
+  const int max_requests_;
+  const std::size_t max_bytes_;
+  const std::chrono::milliseconds max_delay_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  Envelope current_;  // Guarded by mu_.
+  // Counts envelopes taken, so that the flusher can tell whether the one it
+  // waited on is still being filled. Guarded by mu_.
+  std::uint64_t generation_ = 0;
+  bool stop_ = false;  // Guarded by mu_.
+  std::thread flusher_;
+
+  metrics::Histogram* envelope_requests_;
+};
+
+class EnvelopeTracker {
+ public:
+  // One delivery of an envelope, whose requests may be processed on any
+  // threads and in any order.
+  class Delivery {
+   public:
+    // The requests to process: those not completed on an earlier delivery.
+    const std::vector<int>& pending() const { return pending_; }
+
+    // Records whether request 'index', one of pending(), is done. Returns
+    // true to the call that records the last of them if all the requests of
+    // the envelope are done, in which case it may be acknowledged.
+    // Thread-safe.
+    bool Record(int index, bool done);
+
+   private:
+    friend class EnvelopeTracker;
+
+    Delivery(EnvelopeTracker* tracker, std::string message_id,
+             std::vector<char> completed);
+
+    EnvelopeTracker* const tracker_;  // Not owned.
+    const std::string message_id_;
+    std::vector<int> pending_;
+    // Each request writes only its own entry.
+    std::vector<char> completed_;
+    std::atomic<std::size_t> remaining_;
+  };
+
+  EnvelopeTracker();
+
+  // Starts a delivery of the envelope in message 'message_id', which holds
+  // 'count' requests.
+  std::shared_ptr<Delivery> Begin(const std::string& message_id, int count);
+
+ private:
+  // How long the progress of a failed envelope is kept for its next
+  // delivery, which may well go to another processor.
+  static constexpr std::chrono::hours kRetention{1};
+
+  using Clock = std::chrono::steady_clock;
+
+  // Keeps the progress of a delivery some of whose requests failed.
+  void Keep(const std::string& message_id, std::vector<char> completed);
+  // Forgets progress older than kRetention. Requires mu_.
+  void ExpireLocked(Clock::time_point now);
+
+  struct Progress {
+    std::vector<char> completed;  // By request index.
+    Clock::time_point recorded;
+  };
+
+  std::mutex mu_;
+  // The progress of partly failed envelopes, by message id. Guarded by mu_.
+  std::map<std::string, Progress> progress_;
+  // The message ids in the order their progress was recorded, possibly more
+  // than once. Guarded by mu_.
+  std::deque<std::pair<Clock::time_point, std::string>> recorded_;
+
+  metrics::Counter* processed_;
+  metrics::Counter* skipped_;
+};
+
+}  // namespace mathematics
+
+#endif  // ENVELOPE_H_
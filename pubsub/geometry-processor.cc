@@ -1,10 +1,24 @@
 
 #include <google/cloud/pubsub/subscriber.h>
 #include <grpcpp/grpcpp.h>
+#include <chrono>
 #include <iostream>
+#include <sstream>
+#include <string>
 
+#include "absl/flags/parse.h"
+#include "arithmetic-balancer.h"
 #include "arithmetic-service.grpc.pb.h"
+#include "async-log.h"
+#include "envelope.h"
 #include "geometry-service.pb.h"
+#include "lane-scheduler.h"
+#include "metrics.h"
+#include "packed-numbers.h"
+#include "scoped-arena.h"
+#include "startup.h"
+#include "sum-of-squares.h"
+#include "tracing.h"
 
 namespace mathematics {
 namespace {
@@ -17,18 +31,74 @@ constexpr char kSubscriptionId[] = "foobar-subscription";
 
 class GeometryComputer {
  public:
-  GeometryComputer(Arithmetic::Stub* arithmetic) : arithmetic_(arithmetic) {}
+  GeometryComputer(ArithmeticBalancer* arithmetic, bool local_arithmetic)
+      : arithmetic_(arithmetic), local_arithmetic_(local_arithmetic) {}
 
-  grpc::Status ComputeLength(const ScheduleLengthComputationRequest& request,
-                             double* length) {
+  grpc::Status ComputeLength(
+      const ScheduleLengthComputationRequest& request,
+      const std::chrono::system_clock::time_point& deadline,
+      const tracing::SpanContext& trace_parent, double* length) {
+    tracing::Span span("GeometryComputer.ComputeLength", trace_parent);
+    span.SetAttribute("coordinates",
+                      request.coordinates_size() +
+                          packed::Count(request.packed_coordinates()));
     double sum = 0;
+    if (local_arithmetic_) {
+      std::uint64_t squares;
+      grpc::Status s = SumSquaresLocally(request, &squares);
+      if (!s.ok()) {
+        span.SetStatus(s.error_code(), s.error_message());
+        return s;
+      }
+      *length = sqrt(squares);
+      return grpc::Status::OK;
+    }
+    if (!request.packed_coordinates().empty()) {
+      std::uint64_t packed_sum;
+      grpc::Status s =
+          SumPackedSquares(request, deadline, span.context(), &packed_sum);
+      if (!s.ok()) {
+        return grpc::Status(
+            s.error_code(),
+            s.error_message() + "; calling the arithmetic server.");
+      }
+      *length = sqrt(packed_sum);
+      return grpc::Status::OK;
+    }
+    if (arithmetic_->use_square_stream()) {
+      tracing::Span call_span("Arithmetic.SquareStream/client",
+                              span.context());
+      std::vector<std::int64_t> squares;
+      grpc::Status s = arithmetic_->ComputeSquares(
+          request.coordinates().data(), request.coordinates_size(), deadline,
+          &squares);
+      call_span.SetStatus(s.error_code(), s.error_message());
+      if (!s.ok()) {
+        return grpc::Status(
+            s.error_code(),
+            s.error_message() + "; calling the arithmetic server.");
+      }
+      for (std::int64_t square : squares) {
+        sum += square;
+      }
+      *length = sqrt(sum);
+      return grpc::Status::OK;
+    }
     for (const auto& n : request.coordinates()) {
       ComputeSquareRequest square_req;
       square_req.set_number(n);
       ComputeSquareResponse square_resp;
-      grpc::ClientContext ctx;
-      grpc::Status s =
-          arithmetic_->ComputeSquare(&ctx, square_req, &square_resp);
+      tracing::Span call_span("Arithmetic.ComputeSquare/client",
+                              span.context());
+      grpc::Status s = arithmetic_->ComputeSquare(
+          [&call_span, &deadline] {
+            auto ctx = std::make_unique<grpc::ClientContext>();
+            ctx->set_deadline(deadline);
+            tracing::Inject(call_span.context(), ctx.get());
+            return ctx;
+          },
+          square_req, &square_resp);
+      call_span.SetStatus(s.error_code(), s.error_message());
       if (!s.ok()) {
         return grpc::Status(
             s.error_code(),
@@ -43,41 +113,302 @@ class GeometryComputer {
   }
 
  private:
-  Arithmetic::Stub* arithmetic_;  // Not owned.
+  // Sets '*sum' to the sum of the squares of the coordinates of 'request',
+  // squared in-process rather than by the arithmetic servers.
+  grpc::Status SumSquaresLocally(
+      const ScheduleLengthComputationRequest& request, std::uint64_t* sum) {
+    const std::string& coordinates = request.packed_coordinates();
+    std::size_t count;
+    std::size_t end;
+    std::int32_t bad;
+    if (coordinates.empty()) {
+      count = request.coordinates_size();
+      end = SumOfSquares(request.coordinates().data(), count, sum);
+      bad = end < count ? request.coordinates(end) : 0;
+    } else {
+      if (request.coordinates_size() > 0) {
+        return grpc::Status(
+            grpc::StatusCode::INVALID_ARGUMENT,
+            "request has both coordinates and packed_coordinates");
+      }
+      if (!packed::WellFormed(coordinates)) {
+        return grpc::Status(
+            grpc::StatusCode::INVALID_ARGUMENT,
+            "request.packed_coordinates is not a whole number of uint16");
+      }
+      count = packed::Count(coordinates);
+      end = SumOfPackedSquares(coordinates, sum);
+      bad = end < count ? packed::At(coordinates, end) : 0;
+    }
+    if (end != count) {
+      std::stringstream ss;
+      ss << "request.coordinates[" << end << "] " << bad
+         << " is outside the valid range 0 .. " << packed::kMaxNumber;
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, ss.str());
+    }
+    return grpc::Status::OK;
+  }
+
+  // Sets '*sum' to the sum of the squares of the packed coordinates of
+  // 'request', computed with a single ComputePackedSquares call.
+  grpc::Status SumPackedSquares(
+      const ScheduleLengthComputationRequest& request,
+      const std::chrono::system_clock::time_point& deadline,
+      const tracing::SpanContext& trace_parent, std::uint64_t* sum) {
+    const std::string& coordinates = request.packed_coordinates();
+    if (request.coordinates_size() > 0) {
+      return grpc::Status(
+          grpc::StatusCode::INVALID_ARGUMENT,
+          "request has both coordinates and packed_coordinates");
+    }
+    if (!packed::WellFormed(coordinates)) {
+      return grpc::Status(
+          grpc::StatusCode::INVALID_ARGUMENT,
+          "request.packed_coordinates is not a whole number of uint16");
+    }
+    ComputePackedSquaresRequest squares_req;
+    *squares_req.mutable_packed_numbers() = coordinates;
+    ComputePackedSquaresResponse squares_resp;
+    tracing::Span call_span("Arithmetic.ComputePackedSquares/client",
+                            trace_parent);
+    call_span.SetAttribute("numbers", packed::Count(coordinates));
+    grpc::Status s = arithmetic_->ComputePackedSquares(
+        [&call_span, &deadline] {
+          auto ctx = std::make_unique<grpc::ClientContext>();
+          ctx->set_deadline(deadline);
+          tracing::Inject(call_span.context(), ctx.get());
+          return ctx;
+        },
+        squares_req, &squares_resp);
+    call_span.SetStatus(s.error_code(), s.error_message());
+    if (!s.ok()) {
+      return s;
+    }
+    if (squares_resp.packed_squares().size() != 2 * coordinates.size()) {
+      return grpc::Status(grpc::StatusCode::INTERNAL,
+                          "The arithmetic server returned the wrong number "
+                          "of squares.");
+    }
+    *sum = packed::Sum(squares_resp.packed_squares());
+    return grpc::Status::OK;
+  }
+
+  ArithmeticBalancer* arithmetic_;  // Not owned.
+  const bool local_arithmetic_;
 };
 
+// Processing lag and outcome metrics, served on --metrics_port.
+struct ProcessorMetrics {
+  metrics::Histogram* queue_delay = metrics::NewHistogram(
+      "geometry_processor_queue_delay_seconds",
+      "Time from the geometry server publishing a request to the processor "
+      "starting on it.",
+      metrics::ExponentialBuckets(0.001, 2, 24));
+  metrics::Histogram* compute_time = metrics::NewHistogram(
+      "geometry_processor_compute_seconds",
+      "Time spent computing a length.", metrics::LatencyBuckets());
+  metrics::Counter* acks = metrics::NewCounter(
+      "geometry_processor_acks_total", "Messages processed and acknowledged.");
+  metrics::Counter* malformed_drops = metrics::NewCounter(
+      "geometry_processor_drops_total",
+      "Messages left unacknowledged, by reason.",
+      {{"reason", "malformed"}});
+  metrics::Counter* compute_failure_drops = metrics::NewCounter(
+      "geometry_processor_drops_total",
+      "Messages left unacknowledged, by reason.",
+      {{"reason", "compute_failure"}});
+  metrics::Gauge* in_flight = metrics::NewGauge(
+      "geometry_processor_in_flight_messages",
+      "Messages, or requests of envelopes, currently being processed.");
+};
+
+// Returns how long the request in 'm' waited to be processed. 'request' is
+// null if the message could not be parsed.
+double QueueDelaySeconds(const ScheduleLengthComputationRequest* request,
+                         const pubsub::Message& m) {
+  auto published = m.publish_time();
+  if (request != nullptr && request->publish_time_micros() != 0) {
+    published = std::chrono::system_clock::time_point(
+        std::chrono::microseconds(request->publish_time_micros()));
+  }
+  return std::chrono::duration<double>(std::chrono::system_clock::now() -
+                                       published)
+      .count();
+}
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Returns the trace context the geometry server attached to 'm', if any.
+tracing::SpanContext ExtractTraceContext(const pubsub::Message& m) {
+  const auto attributes = m.attributes();
+  auto it = attributes.find(tracing::kTraceparentKey);
+  if (it == attributes.end()) return tracing::SpanContext();
+  return tracing::SpanContext::FromTraceparent(it->second);
+}
+
 void Run() {
+  StartupTimer startup;
+  if (!tracing::StartFileExporterFromFlags()) {
+    std::cerr << "Failed to open the trace file" << std::endl;
+    exit(-1);
+  }
+  if (!metrics::StartHttpServerFromFlags()) {
+    std::cerr << "Failed to start the metrics server" << std::endl;
+    exit(-1);
+  }
+  ProcessorMetrics processor_metrics;
+
   pubsub::Subscription subscription(kProjectId, kSubscriptionId);
   pubsub::Subscriber subscriber(pubsub::MakeSubscriberConnection(subscription));
 
-  std::unique_ptr<Arithmetic::Stub> stub(
-      Arithmetic::NewStub(grpc::CreateChannel(
-          "127.0.0.1:50051", grpc::InsecureChannelCredentials())));
-  GeometryComputer computer(stub.get());
+  const bool local_arithmetic = LocalArithmeticFromFlags();
+  std::unique_ptr<ArithmeticBalancer> arithmetic =
+      ArithmeticBalancer::FromFlags();
+  if (arithmetic == nullptr) {
+    exit(-1);
+  }
+  if (!local_arithmetic) {
+    arithmetic->WaitForConnected(startup.deadline());
+  }
+  GeometryComputer computer(arithmetic.get(), local_arithmetic);
 
-  auto session =
-      subscriber.Subscribe([&](const pubsub::Message& m, pubsub::AckHandler h) {
-        std::cout << "Received message " << m << std::endl;
-        ScheduleLengthComputationRequest request;
-        if (!request.ParseFromString(m.data())) {
-          std::cerr << "Malformed message, id: " << m.message_id() << std::endl;
-          return;
-        }
-        std::cout << "Length computation request:\n"
-                  << request.DebugString() << std::endl;
+  EnvelopeTracker envelopes;
 
-        double length;
-        auto status = computer.ComputeLength(request, &length);
-        if (!status.ok()) {
-          std::cerr << "Length computation failure: " << status.error_message();
-          return;
-        }
+  // Computes the length for 'request', which came in message 'm', and
+  // returns whether it is done with.
+  auto process = [&](const ScheduleLengthComputationRequest& request,
+                     const pubsub::Message& m, tracing::Span* span) {
+    span->SetAttribute("id", request.id());
+    processor_metrics.queue_delay->Observe(QueueDelaySeconds(&request, m));
+    ASYNC_LOG(kInfo,
+              "Received a length computation request with id {}, "
+              "message id: {}, {} coordinates",
+              request.id(), m.message_id(), request.coordinates_size());
+
+    double length;
+    const auto deadline =
+        std::chrono::system_clock::now() + std::chrono::minutes(1);
+    const auto compute_start = std::chrono::steady_clock::now();
+    auto status =
+        computer.ComputeLength(request, deadline, span->context(), &length);
+    processor_metrics.compute_time->Observe(SecondsSince(compute_start));
+    if (!status.ok()) {
+      processor_metrics.compute_failure_drops->Increment();
+      ASYNC_LOG(kError, "Length computation failure: {}",
+                status.error_message());
+      span->SetStatus(status.error_code(), status.error_message());
+      return false;
+    }
+
+    ASYNC_LOG(kInfo, "Request id {}, length: {}", request.id(), length);
 
-        std::cout << "length: " << length << std::endl;
+    // ...
 
-        // ...
+    return true;
+  };
 
-        std::move(h).ack();
+  // Processes message 'm', a single request, and acknowledges it once done
+  // with.
+  auto handle = [&](const pubsub::Message& m, pubsub::AckHandler h) {
+    const tracing::SpanContext publish_context = ExtractTraceContext(m);
+    // Time between the publish and the start of processing, including the
+    // wait in the lane.
+    tracing::Span("pubsub.Queue", publish_context, m.publish_time()).End();
+    tracing::Span span("GeometryProcessor.ProcessMessage", publish_context);
+    span.SetAttribute("message_id", m.message_id());
+    metrics::GaugeIncrement in_flight(processor_metrics.in_flight);
+
+    // Parsed onto the thread's arena block, and freed with it.
+    ScopedArena arena;
+    auto& request = *arena.Create<ScheduleLengthComputationRequest>();
+    if (!request.ParseFromString(m.data())) {
+      processor_metrics.queue_delay->Observe(QueueDelaySeconds(nullptr, m));
+      processor_metrics.malformed_drops->Increment();
+      ASYNC_LOG(kError, "Malformed message, id: {}", m.message_id());
+      span.SetStatus(grpc::StatusCode::INVALID_ARGUMENT, "Malformed message");
+      return;
+    }
+    if (!process(request, m, &span)) {
+      return;
+    }
+
+    std::move(h).ack();
+    processor_metrics.acks->Increment();
+  };
+
+  std::unique_ptr<LaneScheduler> lanes = LaneScheduler::FromFlags();
+  if (lanes == nullptr) {
+    exit(-1);
+  }
+
+  // Submits each request of the envelope in message 'm' to a lane, as if it
+  // came in a message of its own, so that the lanes bound how many requests
+  // are processed at once whatever message they came in. The last request
+  // done acknowledges the message, if all of them are.
+  auto split = [&](const pubsub::Message& m,
+                   std::shared_ptr<pubsub::AckHandler> h) {
+    const tracing::SpanContext publish_context = ExtractTraceContext(m);
+    tracing::Span("pubsub.Queue", publish_context, m.publish_time()).End();
+    tracing::Span span("GeometryProcessor.ProcessMessage", publish_context);
+    span.SetAttribute("message_id", m.message_id());
+
+    // Shared by the requests, which outlive this call in their lanes.
+    auto message = std::make_shared<const pubsub::Message>(m);
+    auto envelope = std::make_shared<ScheduleLengthComputationBatch>();
+    if (!envelope->ParseFromString(m.data())) {
+      processor_metrics.queue_delay->Observe(QueueDelaySeconds(nullptr, m));
+      processor_metrics.malformed_drops->Increment();
+      ASYNC_LOG(kError, "Malformed message, id: {}", m.message_id());
+      span.SetStatus(grpc::StatusCode::INVALID_ARGUMENT, "Malformed message");
+      return;
+    }
+    span.SetAttribute("requests", envelope->requests_size());
+
+    std::shared_ptr<EnvelopeTracker::Delivery> delivery =
+        envelopes.Begin(m.message_id(), envelope->requests_size());
+    if (delivery->pending().empty()) {
+      std::move(*h).ack();
+      processor_metrics.acks->Increment();
+      return;
+    }
+    const tracing::SpanContext context = span.context();
+    for (int i : delivery->pending()) {
+      const std::size_t bytes = envelope->requests(i).ByteSizeLong();
+      lanes->Submit(
+          lanes->LaneFor(m.attributes(), bytes), bytes,
+          [&process, &processor_metrics, message, envelope, delivery, h, i,
+           context] {
+            tracing::Span request_span(
+                "GeometryProcessor.ProcessRequest",
+                RequestTraceContext(*envelope, i, context));
+            metrics::GaugeIncrement in_flight(processor_metrics.in_flight);
+            if (delivery->Record(i, process(envelope->requests(i), *message,
+                                            &request_span))) {
+              std::move(*h).ack();
+              processor_metrics.acks->Increment();
+            }
+          });
+    }
+  };
+
+  startup.Ready("Geometry processor");
+  auto session =
+      subscriber.Subscribe([&](const pubsub::Message& m, pubsub::AckHandler h) {
+        // The message waits in its lane while the subscriber goes on to
+        // deliver others.
+        auto handler = std::make_shared<pubsub::AckHandler>(std::move(h));
+        if (IsEnvelope(m.attributes())) {
+          split(m, std::move(handler));
+          return;
+        }
+        const std::size_t bytes = m.data().size();
+        lanes->Submit(
+            lanes->LaneFor(m.attributes(), bytes), bytes,
+            [&handle, m, handler] { handle(m, std::move(*handler)); });
       });
 
   auto status = session.get();
@@ -87,4 +418,7 @@ void Run() {
 }  // namespace
 }  // namespace mathematics
 
-int main() { mathematics::Run(); }
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  mathematics::Run();
+}
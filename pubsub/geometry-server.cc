@@ -1,7 +1,9 @@
 
+#include <chrono>
 #include <cmath>
 #include <iostream>
 #include <memory>
+#include <string>
 #include <thread>
 
 #include <google/cloud/pubsub/publisher.h>
@@ -12,7 +14,20 @@
 #include <grpc/grpc.h>
 #include <grpcpp/grpcpp.h>
 
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "envelope.h"
 #include "geometry-service.grpc.pb.h"
+#include "lane-scheduler.h"
+#include "metrics.h"
+#include "packed-numbers.h"
+#include "publish-dedup.h"
+#include "scoped-arena.h"
+#include "tracing.h"
+
+ABSL_FLAG(std::string, listen_address, "127.0.0.20:40123",
+          "The address to serve on: host:port, or unix:/path/to/socket or "
+          "unix-abstract:name for a Unix domain socket.");
 
 namespace mathematics {
 namespace {
@@ -24,8 +39,9 @@ constexpr char kTopicId[] = "foobar-topic";
 
 class GeometryServiceImpl final : public Geometry::Service {
  public:
-  GeometryServiceImpl(std::shared_ptr<pubsub::PublisherConnection> pubsub_conn)
-      : publisher_(pubsub_conn) {}
+  GeometryServiceImpl(std::shared_ptr<pubsub::PublisherConnection> pubsub_conn,
+                      PublishDedup* dedup, PublishBatcher* batcher)
+      : publisher_(pubsub_conn), dedup_(dedup), batcher_(batcher) {}
 
   grpc::Status ScheduleLengthComputation(
       grpc::ServerContext* context,
@@ -37,12 +53,61 @@ class GeometryServiceImpl final : public Geometry::Service {
     // multiple threads is guaranteed to work. Two threads operating on the same
     // instance of this class is not guaranteed to work."
     auto publisher = publisher_;
-    auto message_id = publisher
-                          .Publish(pubsub::MessageBuilder()
-                                       .SetData(request->SerializeAsString())
-                                       .Build())
-                          .get();
+
+    tracing::Span span("Geometry.ScheduleLengthComputation",
+                       tracing::Extract(*context));
+    span.SetAttribute("id", request->id());
+    span.SetAttribute("coordinates",
+                      request->coordinates_size() +
+                          packed::Count(request->packed_coordinates()));
+    // Stamped when published; the rest is what identifies a request sent
+    // again.
+    ScopedArena arena;
+    auto& stamped = *arena.Create<ScheduleLengthComputationRequest>();
+    stamped = *request;
+    stamped.clear_publish_time_micros();
+
+    auto publish = [&]() -> PublishDedup::Result {
+      tracing::Span publish_span("pubsub.Publish", span.context());
+      stamped.set_publish_time_micros(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::system_clock::now().time_since_epoch())
+              .count());
+      // A request with a priority goes on its own, so that the processors can
+      // route it by the attribute.
+      if (batcher_ != nullptr && stamped.priority() == PRIORITY_DEFAULT) {
+        return batcher_->Publish(stamped, publish_span.context()).get();
+      }
+
+      pubsub::MessageBuilder message;
+      message.SetData(stamped.SerializeAsString());
+      if (publish_span.context().valid()) {
+        // The processor continues the trace from here.
+        message.InsertAttribute(tracing::kTraceparentKey,
+                                publish_span.context().ToTraceparent());
+      }
+      if (stamped.priority() != PRIORITY_DEFAULT) {
+        message.InsertAttribute(kPriorityKey,
+                                Priority_Name(stamped.priority()));
+      }
+      return publisher.Publish(std::move(message).Build()).get();
+    };
+    PublishDedup::Result message_id;
+    if (dedup_ == nullptr) {
+      message_id = publish();
+    } else {
+      bool duplicate;
+      message_id = dedup_->Publish(
+          PublishDedup::MakeKey(request->id(), 0,
+                                stamped.SerializeAsString()),
+          publish, &duplicate);
+      if (duplicate) {
+        span.SetAttribute("duplicate", 1);
+      }
+    }
     if (!message_id.ok()) {
+      span.SetStatus(static_cast<int>(message_id.status().code()),
+                     message_id.status().message());
       return grpc::Status(
           static_cast<grpc::StatusCode>(message_id.status().code()),
           message_id.status().message() +
@@ -53,16 +118,31 @@ class GeometryServiceImpl final : public Geometry::Service {
 
  private:
   const pubsub::Publisher publisher_;
+  PublishDedup* const dedup_;  // Not owned; nullptr if off.
+  PublishBatcher* const batcher_;  // Not owned; nullptr if off.
 };
 
 void RunServer() {
+  if (!tracing::StartFileExporterFromFlags()) {
+    std::cerr << "Failed to open the trace file" << std::endl;
+    exit(-1);
+  }
+  if (!metrics::StartHttpServerFromFlags()) {
+    std::cerr << "Failed to start the metrics server" << std::endl;
+    exit(-1);
+  }
+
   // Connect to pubsub for publishing.
   std::shared_ptr<pubsub::PublisherConnection> pubsub_conn(
       pubsub::MakePublisherConnection(pubsub::Topic(kProjectId, kTopicId), {}));
 
+  std::unique_ptr<PublishDedup> dedup = PublishDedup::FromFlags();
+  std::unique_ptr<PublishBatcher> batcher =
+      PublishBatcher::FromFlags(pubsub_conn);
+
   // Create the service implementation and start the server.
-  std::string server_address("127.0.0.20:40123");
-  GeometryServiceImpl service(pubsub_conn);
+  const std::string server_address = absl::GetFlag(FLAGS_listen_address);
+  GeometryServiceImpl service(pubsub_conn, dedup.get(), batcher.get());
   grpc::ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
   builder.RegisterService(&service);
@@ -79,4 +159,7 @@ void RunServer() {
 }  // namespace
 }  // namespace mathematics
 
-int main() { mathematics::RunServer(); }
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  mathematics::RunServer();
+}
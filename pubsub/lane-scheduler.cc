@@ -0,0 +1,185 @@
+
+#include "lane-scheduler.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <utility>
+
+#include "absl/flags/flag.h"
+#include "absl/strings/numbers.h"
+#include "geometry-service.pb.h"
+
+ABSL_FLAG(std::vector<std::string>, lane_max_bytes,
+          (std::vector<std::string>{"4096", "262144"}),
+          "The largest message, in bytes, for each lane but the last; the "
+          "last lane takes the rest.");
+ABSL_FLAG(std::vector<std::string>, lane_weights,
+          (std::vector<std::string>{"8", "2", "1"}),
+          "The share of the processor each lane gets while all are busy.");
+ABSL_FLAG(std::vector<std::string>, lane_concurrency,
+          (std::vector<std::string>{"16", "4", "2"}),
+          "How many messages each lane processes at once.");
+
+namespace mathematics {
+
+LaneScheduler::LaneScheduler(std::vector<Lane> lanes) : lanes_(lanes.size()) {
+  int workers = 0;
+  for (std::size_t i = 0; i < lanes.size(); i++) {
+    const metrics::Labels labels = {{"lane", std::to_string(i)}};
+    LaneState& lane = lanes_[i];
+    lane.config = lanes[i];
+    lane.queued_gauge = metrics::NewGauge(
+        "geometry_processor_lane_queued_messages",
+        "Messages waiting in each lane.", labels);
+    lane.running_gauge = metrics::NewGauge(
+        "geometry_processor_lane_running_messages",
+        "Messages being processed in each lane.", labels);
+    lane.wait_time = metrics::NewHistogram(
+        "geometry_processor_lane_wait_seconds",
+        "Time messages wait in their lane before being processed.",
+        metrics::ExponentialBuckets(0.0001, 2, 24), labels);
+    workers += lanes[i].concurrency;
+  }
+  for (int i = 0; i < workers; i++) {
+    workers_.emplace_back(&LaneScheduler::WorkLoop, this);
+  }
+}
+
+LaneScheduler::~LaneScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+std::unique_ptr<LaneScheduler> LaneScheduler::FromFlags() {
+  const std::vector<std::string> max_bytes =
+      absl::GetFlag(FLAGS_lane_max_bytes);
+  const std::vector<std::string> weights = absl::GetFlag(FLAGS_lane_weights);
+  const std::vector<std::string> concurrency =
+      absl::GetFlag(FLAGS_lane_concurrency);
+  if (weights.size() != max_bytes.size() + 1 ||
+      concurrency.size() != weights.size()) {
+    std::cerr << "--lane_weights and --lane_concurrency need one value per "
+              << "lane, one more than --lane_max_bytes" << std::endl;
+    return nullptr;
+  }
+  std::vector<Lane> lanes(weights.size());
+  for (std::size_t i = 0; i < lanes.size(); i++) {
+    lanes[i].max_bytes = SIZE_MAX;
+    const char* bad_flag = nullptr;
+    std::string bad_value;
+    if (i < max_bytes.size() &&
+        !absl::SimpleAtoi(max_bytes[i], &lanes[i].max_bytes)) {
+      bad_flag = "--lane_max_bytes";
+      bad_value = max_bytes[i];
+    } else if (!absl::SimpleAtod(weights[i], &lanes[i].weight)) {
+      bad_flag = "--lane_weights";
+      bad_value = weights[i];
+    } else if (!absl::SimpleAtoi(concurrency[i], &lanes[i].concurrency)) {
+      bad_flag = "--lane_concurrency";
+      bad_value = concurrency[i];
+    }
+    if (bad_flag != nullptr) {
+      std::cerr << bad_flag << " has \"" << bad_value << "\" for lane " << i
+                << ", which is not a number" << std::endl;
+      return nullptr;
+    }
+    if (lanes[i].weight <= 0 || lanes[i].concurrency <= 0 ||
+        (i > 0 && lanes[i].max_bytes <= lanes[i - 1].max_bytes)) {
+      std::cerr << "Lane " << i << " needs a positive weight and "
+                << "concurrency, and a larger --lane_max_bytes than the "
+                << "lane before" << std::endl;
+      return nullptr;
+    }
+  }
+  return std::make_unique<LaneScheduler>(std::move(lanes));
+}
+
+int LaneScheduler::LaneFor(
+    const std::map<std::string, std::string>& attributes,
+    std::size_t bytes) const {
+  auto it = attributes.find(kPriorityKey);
+  Priority priority;
+  if (it != attributes.end() && Priority_Parse(it->second, &priority)) {
+    if (priority == PRIORITY_HIGH) {
+      return 0;
+    }
+    if (priority == PRIORITY_LOW) {
+      return lanes_.size() - 1;
+    }
+  }
+  int lane = 0;
+  while (lane + 1 < static_cast<int>(lanes_.size()) &&
+         bytes > lanes_[lane].config.max_bytes) {
+    lane++;
+  }
+  return lane;
+}
+
+void LaneScheduler::Submit(int lane_index, std::size_t bytes,
+                           std::function<void()> work) {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    LaneState& lane = lanes_[lane_index];
+    const double start_tag = std::max(virtual_time_, lane.finish_tag);
+    lane.finish_tag = start_tag + (bytes + kMessageCost) / lane.config.weight;
+    lane.queue.push_back(
+        Queued{start_tag, std::move(work), std::chrono::steady_clock::now()});
+    lane.queued_gauge->Add(1);
+  }
+  cv_.notify_one();
+}
+
+int LaneScheduler::PickLocked() const {
+  int picked = -1;
+  for (std::size_t i = 0; i < lanes_.size(); i++) {
+    const LaneState& lane = lanes_[i];
+    if (lane.queue.empty() || lane.running >= lane.config.concurrency) {
+      continue;
+    }
+    if (picked < 0 ||
+        lane.queue.front().start_tag < lanes_[picked].queue.front().start_tag) {
+      picked = i;
+    }
+  }
+  return picked;
+}
+
+void LaneScheduler::WorkLoop() {
+  std::unique_lock<std::mutex> lock(mu_);
+  while (true) {
+    int picked = -1;
+    cv_.wait(lock, [&] { return stop_ || (picked = PickLocked()) >= 0; });
+    if (stop_) {
+      return;
+    }
+    LaneState& lane = lanes_[picked];
+    Queued next = std::move(lane.queue.front());
+    lane.queue.pop_front();
+    lane.running++;
+    virtual_time_ = std::max(virtual_time_, next.start_tag);
+    lane.queued_gauge->Add(-1);
+    lane.running_gauge->Add(1);
+    lock.unlock();
+
+    lane.wait_time->Observe(
+        std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                      next.queued)
+            .count());
+    next.work();
+
+    lock.lock();
+    lane.running--;
+    lane.running_gauge->Add(-1);
+    // A slot in this lane may let another worker start on it.
+    cv_.notify_one();
+  }
+}
+
+}  // namespace mathematics
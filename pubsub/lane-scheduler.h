@@ -0,0 +1,111 @@
+
+#ifndef LANE_SCHEDULER_H_
+#define LANE_SCHEDULER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+
+// Lanes: separate work queues in a processor, so that a burst of large
+// requests does not hold up small ones.
+//
+// A message goes to a lane by its size, or by the priority the geometry
+// server put in its kPriorityKey attribute. Each lane runs at most so many
+// messages at once. When workers are free, the lanes share them by weighted
+// fair queueing, in its start-time form: each message is tagged, when it is
+// queued, with the virtual time at which its lane would start it, and the
+// lane whose next message has the smallest tag goes first. A lane's tags
+// advance by the message's size over the lane's weight, so while all lanes
+// are busy each processes bytes in proportion to its weight, and small
+// requests stay fast while large ones keep progressing. A lane that was idle
+// starts from the current virtual time, not from credit saved while idle.
+
+namespace mathematics {
+
+// The attribute that carries a request's Priority, by name, if it has one.
+constexpr char kPriorityKey[] = "priority";
+
+class LaneScheduler {
+ public:
+  struct Lane {
+    // The largest message, in bytes, routed here by size; the last lane
+    // takes everything larger.
+    std::size_t max_bytes;
+    double weight;
+    int concurrency;
+  };
+
+  // Lanes go from the smallest messages to the largest. Starts a worker per
+  // unit of concurrency.
+  explicit LaneScheduler(std::vector<Lane> lanes);
+
+  // Stops the workers once they finish what they are running; work still
+  // queued is dropped.
+  ~LaneScheduler();
+
+  LaneScheduler(const LaneScheduler&) = delete;
+  LaneScheduler& operator=(const LaneScheduler&) = delete;
+
+  // From --lane_max_bytes, --lane_weights and --lane_concurrency. Returns
+  // nullptr, having said why on stderr, if they do not agree.
+  static std::unique_ptr<LaneScheduler> FromFlags();
+
+  // The lane for a message of 'bytes' with 'attributes'. High priority
+  // messages go to the first lane, low priority ones to the last.
+  int LaneFor(const std::map<std::string, std::string>& attributes,
+              std::size_t bytes) const;
+
+  // Queues 'work', which costs 'bytes', on 'lane'.
+  void Submit(int lane, std::size_t bytes, std::function<void()> work);
+
+ private:
+  // Charged on top of the bytes of every message, for the work that does
+  // not depend on its size.
+  static constexpr double kMessageCost = 256;
+
+  struct Queued {
+    double start_tag;
+    std::function<void()> work;
+    std::chrono::steady_clock::time_point queued;
+  };
+
+  struct LaneState {
+    Lane config;
+    // The rest is guarded by mu_.
+    std::deque<Queued> queue;
+    int running = 0;
+    double finish_tag = 0;  // Of the last message queued.
+
+    metrics::Gauge* queued_gauge;
+    metrics::Gauge* running_gauge;
+    metrics::Histogram* wait_time;
+  };
+
+  void WorkLoop();
+  // The lane whose next message should run, or -1 if none may. Requires
+  // mu_.
+  int PickLocked() const;
+
+  std::vector<LaneState> lanes_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  double virtual_time_ = 0;  // Guarded by mu_.
+  bool stop_ = false;        // Guarded by mu_.
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace mathematics
+
+#endif  // LANE_SCHEDULER_H_
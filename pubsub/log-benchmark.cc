@@ -0,0 +1,131 @@
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "arithmetic-service.pb.h"
+#include "async-log.h"
+
+// Compares the cost of logging every ComputeSquare request the way
+// arithmetic-server used to (std::cout << ... << std::endl) against the
+// asynchronous logger, with and without sampling. The results are printed to
+// stderr.
+//
+// Log lines go to an unlinked temporary file, so that the lines actually
+// written can be counted. Each thread logs in bursts that fit in its ring
+// buffer, and drains the rings itself between bursts, so that the async
+// logger drops nothing: the rate reported is that of lines delivered, the
+// draining included, and the cost per call is that of calls that were all
+// logged.
+
+namespace mathematics {
+namespace {
+
+constexpr int kLinesPerThread = 200000;
+// Half a ring buffer, leaving room for other lines the thread logs.
+constexpr int kBurst = async_log::kRingRecords / 2;
+
+// Returns the newlines in the file open as 'fd' from 'offset' to its end.
+long LinesFrom(int fd, off_t offset) {
+  long lines = 0;
+  char buffer[1 << 16];
+  ssize_t n;
+  while ((n = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+    lines += std::count(buffer, buffer + n, '\n');
+    offset += n;
+  }
+  return lines;
+}
+
+void LogWithStdout(int i) {
+  ComputeSquareRequest request;
+  request.set_number(i % 1000);
+  std::cout << "ComputeSquare; " << request.ShortDebugString() << std::endl;
+}
+
+void LogAsync(int i) {
+  ComputeSquareRequest request;
+  request.set_number(i % 1000);
+  ASYNC_LOG(kInfo, "ComputeSquare; number: {}", request.number());
+}
+
+void LogAsyncSampled(int i) {
+  ComputeSquareRequest request;
+  request.set_number(i % 1000);
+  ASYNC_LOG_SAMPLED(kInfo, 100, 1000, "ComputeSquare; number: {}",
+                    request.number());
+}
+
+void Run(const char* name, int num_threads, std::function<void(int)> log) {
+  const auto dropped_before = async_log::DroppedRecords();
+  const off_t offset = lseek(STDOUT_FILENO, 0, SEEK_END);
+  // Time spent in the calling threads' logging calls, i.e. what a request
+  // handler pays, summed over the threads.
+  std::atomic<std::int64_t> logging_ns{0};
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&log, &logging_ns] {
+      for (int i = 0; i < kLinesPerThread;) {
+        const auto burst_start = std::chrono::steady_clock::now();
+        for (const int end = std::min(i + kBurst, kLinesPerThread); i < end;
+             i++) {
+          log(i);
+        }
+        logging_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - burst_start)
+                          .count();
+        async_log::Flush();
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  // Including the time to get everything written out.
+  const std::chrono::duration<double> total =
+      std::chrono::steady_clock::now() - start;
+  const long calls = static_cast<long>(num_threads) * kLinesPerThread;
+  const long lines = LinesFrom(STDOUT_FILENO, offset);
+  const long dropped = async_log::DroppedRecords() - dropped_before;
+  char ns_per_call[32] = "n/a";
+  if (dropped == 0) {
+    std::snprintf(ns_per_call, sizeof(ns_per_call), "%.1f",
+                  static_cast<double>(logging_ns) / calls);
+  }
+  std::fprintf(stderr,
+               "%-14s threads=%d calls=%ld lines=%ld dropped=%ld "
+               "ns_per_call=%s lines_per_second=%.0f total_seconds=%.3f\n",
+               name, num_threads, calls, lines, dropped, ns_per_call,
+               lines / total.count(), total.count());
+}
+
+}  // namespace
+}  // namespace mathematics
+
+int main() {
+  // Send the log lines themselves to a file no one else sees.
+  char path[] = "/tmp/log-benchmark-XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0) {
+    std::perror("mkstemp");
+    return 1;
+  }
+  unlink(path);
+  dup2(fd, STDOUT_FILENO);
+
+  for (int threads : {1, 4}) {
+    mathematics::Run("stdout+endl", threads, mathematics::LogWithStdout);
+    mathematics::Run("async", threads, mathematics::LogAsync);
+    mathematics::Run("async-sampled", threads, mathematics::LogAsyncSampled);
+  }
+}
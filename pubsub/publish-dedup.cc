@@ -0,0 +1,79 @@
+
+#include "publish-dedup.h"
+
+#include <utility>
+
+#include "absl/flags/flag.h"
+
+ABSL_FLAG(std::int64_t, dedup_window_ms, 1000,
+          "How long after publishing a request an identical one is answered "
+          "with the same result instead of being published again; 0 turns "
+          "de-duplication off, including of requests in flight.");
+
+namespace mathematics {
+
+PublishDedup::PublishDedup(std::chrono::milliseconds window)
+    : window_(window),
+      suppressed_(metrics::NewCounter(
+          "geometry_server_duplicates_suppressed_total",
+          "Requests not published because an identical one was in flight "
+          "or had just been published.")),
+      tracked_(metrics::NewGauge(
+          "geometry_server_dedup_entries",
+          "Requests in flight or published within the de-dup window.")) {}
+
+std::unique_ptr<PublishDedup> PublishDedup::FromFlags() {
+  const std::int64_t window_ms = absl::GetFlag(FLAGS_dedup_window_ms);
+  if (window_ms <= 0) {
+    return nullptr;
+  }
+  return std::make_unique<PublishDedup>(std::chrono::milliseconds(window_ms));
+}
+
+PublishDedup::Key PublishDedup::MakeKey(const std::string& id,
+                                        std::int64_t version,
+                                        const std::string& payload) {
+  return Key{id, version, HashBytes(payload.data(), payload.size())};
+}
+
+PublishDedup::Result PublishDedup::Publish(
+    const Key& key, const std::function<Result()>& publish, bool* duplicate) {
+  std::unique_lock<std::mutex> lock(mu_);
+  ExpireLocked(Clock::now());
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    std::shared_future<Result> result = it->second;
+    lock.unlock();
+    suppressed_->Increment();
+    *duplicate = true;
+    return result.get();
+  }
+  std::promise<Result> promise;
+  entries_.emplace(key, promise.get_future().share());
+  tracked_->Add(1);
+  lock.unlock();
+  *duplicate = false;
+
+  Result result = publish();
+  promise.set_value(result);
+
+  lock.lock();
+  if (result.ok()) {
+    expiries_.emplace_back(Clock::now() + window_, key);
+  } else {
+    // Duplicates already waiting share the failure; later ones try again.
+    entries_.erase(key);
+    tracked_->Add(-1);
+  }
+  return result;
+}
+
+void PublishDedup::ExpireLocked(Clock::time_point now) {
+  while (!expiries_.empty() && expiries_.front().first <= now) {
+    entries_.erase(expiries_.front().second);
+    expiries_.pop_front();
+    tracked_->Add(-1);
+  }
+}
+
+}  // namespace mathematics
@@ -0,0 +1,44 @@
+
+#include "scoped-arena.h"
+
+#include <memory>
+
+namespace mathematics {
+namespace {
+
+struct ThreadBlock {
+  std::unique_ptr<char[]> bytes;
+  bool taken = false;
+};
+
+thread_local ThreadBlock thread_block;
+
+// Returns options that start the arena on the thread's block if no other
+// ScopedArena has it, and sets '*taken' if so.
+google::protobuf::ArenaOptions TakeThreadBlock(bool* taken) {
+  google::protobuf::ArenaOptions options;
+  if (!thread_block.taken) {
+    if (thread_block.bytes == nullptr) {
+      thread_block.bytes.reset(new char[ScopedArena::kBlockSize]);
+    }
+    thread_block.taken = true;
+    *taken = true;
+    options.initial_block = thread_block.bytes.get();
+    options.initial_block_size = ScopedArena::kBlockSize;
+  }
+  return options;
+}
+
+}  // namespace
+
+ScopedArena::ScopedArena() : arena_(TakeThreadBlock(&has_thread_block_)) {}
+
+ScopedArena::~ScopedArena() {
+  // Runs the destructors of the messages while the block is still ours.
+  arena_.Reset();
+  if (has_thread_block_) {
+    thread_block.taken = false;
+  }
+}
+
+}  // namespace mathematics
@@ -0,0 +1,82 @@
+
+#ifndef SQUARE_STREAM_H_
+#define SQUARE_STREAM_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "arithmetic-service.grpc.pb.h"
+
+namespace mathematics {
+
+// Squares numbers over one long-lived Arithmetic.SquareStream call, shared by
+// all threads, instead of a unary ComputeSquare call per number.
+//
+// Every number is sent with a request id and answered on the same stream, so
+// many callers can have many numbers in flight at once. At most 'window'
+// numbers are outstanding on the stream; callers wait for room beyond that.
+// The stream is opened on first use, and opened again after it fails.
+class SquareStream {
+ public:
+  SquareStream(Arithmetic::Stub* stub, std::size_t window);
+
+  // Cancels the stream.
+  ~SquareStream();
+
+  SquareStream(const SquareStream&) = delete;
+  SquareStream& operator=(const SquareStream&) = delete;
+
+  // Sets '*squares' to the squares of 'numbers', in the same order. Fails
+  // with the first error returned for a number, with the stream's status if
+  // it breaks, or with DEADLINE_EXCEEDED.
+  grpc::Status ComputeSquares(const std::int32_t* numbers, std::size_t count,
+                              std::chrono::system_clock::time_point deadline,
+                              std::vector<std::int64_t>* squares);
+
+ private:
+  struct Connection;
+
+  // The numbers of one ComputeSquares() call that have been sent.
+  struct Batch {
+    std::vector<std::int64_t>* squares;
+    std::size_t outstanding = 0;
+    grpc::Status status;
+  };
+
+  struct Pending {
+    Batch* batch;
+    std::size_t index;
+  };
+
+  // Returns the current connection, opening a new one if there is none or
+  // the last one broke. Requires mu_.
+  std::shared_ptr<Connection> OpenLocked();
+
+  void ReadLoop(std::shared_ptr<Connection> connection);
+
+  // Removes what is left of 'batch' from pending_. Requires mu_.
+  void AbandonLocked(Batch* batch, const std::vector<std::uint64_t>& ids);
+
+  Arithmetic::Stub* const stub_;  // Not owned.
+  const std::size_t window_;
+
+  std::mutex mu_;
+  // Signalled when responses arrive, so also when the window has room, and
+  // when the stream breaks.
+  std::condition_variable cv_;
+  std::shared_ptr<Connection> connection_;              // Guarded by mu_.
+  std::uint64_t next_id_ = 0;                           // Guarded by mu_.
+  std::unordered_map<std::uint64_t, Pending> pending_;  // Guarded by mu_.
+};
+
+}  // namespace mathematics
+
+#endif  // SQUARE_STREAM_H_
@@ -0,0 +1,31 @@
+
+#include "startup.h"
+
+#include <iostream>
+
+#include "absl/flags/flag.h"
+
+ABSL_FLAG(int, warmup_timeout_ms, 10000,
+          "How long to spend connecting to backends at startup before "
+          "serving anyway.");
+
+namespace mathematics {
+
+StartupTimer::StartupTimer()
+    : start_(std::chrono::steady_clock::now()),
+      deadline_(std::chrono::system_clock::now() +
+                std::chrono::milliseconds(
+                    absl::GetFlag(FLAGS_warmup_timeout_ms))),
+      time_to_ready_ms_(metrics::NewGauge(
+          "startup_time_to_ready_ms",
+          "How long the process took from starting to serving, warm-up "
+          "included.")) {}
+
+void StartupTimer::Ready(const std::string& what) {
+  const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start_);
+  time_to_ready_ms_->Set(elapsed.count());
+  std::cout << what << " ready in " << elapsed.count() << " ms" << std::endl;
+}
+
+}  // namespace mathematics
@@ -0,0 +1,39 @@
+
+#ifndef STARTUP_H_
+#define STARTUP_H_
+
+#include <chrono>
+#include <string>
+
+#include "metrics.h"
+
+namespace mathematics {
+
+// Warming up a binary before it serves. gRPC channels, Spanner sessions and
+// Bigtable channels are all made on first use, so a process that serves as
+// soon as it starts makes its first requests pay for connection setup, and a
+// rollout shows up as a latency spike. Instead, binaries connect their
+// clients up front, giving up after --warmup_timeout_ms, and only then start
+// serving and report themselves healthy.
+//
+// A StartupTimer times that from the start of the process to when it is
+// ready, for the log and the startup_time_to_ready_ms gauge.
+class StartupTimer {
+ public:
+  StartupTimer();
+
+  // When warming up should give up and serve anyway.
+  std::chrono::system_clock::time_point deadline() const { return deadline_; }
+
+  // Logs that 'what' is ready, and how long it took to get there.
+  void Ready(const std::string& what);
+
+ private:
+  const std::chrono::steady_clock::time_point start_;
+  const std::chrono::system_clock::time_point deadline_;
+  metrics::Gauge* time_to_ready_ms_;
+};
+
+}  // namespace mathematics
+
+#endif  // STARTUP_H_
@@ -0,0 +1,54 @@
+
+#ifndef SUM_OF_SQUARES_H_
+#define SUM_OF_SQUARES_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Validates vectors of coordinates and sums their squares in-process, for
+// geometry servers run with --local_arithmetic.
+//
+// The sums are exact integers: a square is at most 10^6, so a uint64 cannot
+// overflow before some 10^13 coordinates, whereas adding squares into a
+// double stops being exact once the sum passes 2^53.
+//
+// The kernels use AVX-512 or AVX2 when the CPU has them, picked at run time,
+// and plain C++ otherwise. All kernels give the same results.
+
+namespace mathematics {
+
+enum class SumOfSquaresKernel { kScalar, kAvx2, kAvx512 };
+
+const char* KernelName(SumOfSquaresKernel kernel);
+
+// Whether this CPU, and this build, can run 'kernel'.
+bool KernelSupported(SumOfSquaresKernel kernel);
+
+// The fastest supported kernel.
+SumOfSquaresKernel BestKernel();
+
+// Sets '*sum' to the sum of the squares of 'numbers' and returns 'count'.
+// If a number is outside 0 .. packed::kMaxNumber, returns the index of the
+// first such number instead, and leaves '*sum' unspecified.
+std::size_t SumOfSquares(const std::int32_t* numbers, std::size_t count,
+                         std::uint64_t* sum,
+                         SumOfSquaresKernel kernel = BestKernel());
+
+// Same as SumOfSquares(), for 'count' numbers in the packed encoding.
+std::size_t SumOfPackedSquares(const char* numbers, std::size_t count,
+                               std::uint64_t* sum,
+                               SumOfSquaresKernel kernel = BestKernel());
+
+// Same as above, for a whole packed string; returns packed::Count(numbers)
+// if they are all in range.
+std::size_t SumOfPackedSquares(const std::string& numbers, std::uint64_t* sum,
+                               SumOfSquaresKernel kernel = BestKernel());
+
+// The value of --local_arithmetic: whether geometry servers should square
+// coordinates themselves rather than call the arithmetic servers.
+bool LocalArithmeticFromFlags();
+
+}  // namespace mathematics
+
+#endif  // SUM_OF_SQUARES_H_
@@ -0,0 +1,521 @@
+
+#include "arithmetic-balancer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <iostream>
+#include <random>
+
+#include "absl/flags/flag.h"
+
+ABSL_FLAG(std::vector<std::string>, arithmetic_endpoints, {"127.0.0.1:50051"},
+          "Comma-separated addresses of the arithmetic server replicas, "
+          "each host:port, unix:/path/to/socket or unix-abstract:name.");
+ABSL_FLAG(bool, hedge_arithmetic_calls, false,
+          "If true, slow ComputeSquare calls are repeated on another replica.");
+ABSL_FLAG(int, hedge_delay_ms, 0,
+          "How long to wait before hedging a call; 0 waits for the p95 "
+          "latency of recent calls.");
+ABSL_FLAG(double, max_hedge_fraction, 0.05,
+          "The maximum number of hedged calls per call, over time.");
+ABSL_FLAG(bool, arithmetic_square_stream, false,
+          "If true, many numbers are squared at once over a SquareStream "
+          "rather than with a ComputeSquare call each.");
+ABSL_FLAG(int, square_stream_window, 128,
+          "The maximum numbers in flight on a SquareStream.");
+ABSL_FLAG(int, arithmetic_connections_per_replica, 1,
+          "How many connections to open to each arithmetic server replica, "
+          "for callers with more calls in flight than one connection "
+          "carries well.");
+
+namespace mathematics {
+namespace {
+
+// How quickly the average follows new samples: a sample's weight halves
+// every kDecayTime. The score of an idle backend decays at the same rate, so
+// that a backend that was slow once gets tried again after a while rather
+// than never.
+constexpr auto kDecayTime = std::chrono::milliseconds(500);
+
+// Keeps outstanding calls counting against backends with no latency yet.
+constexpr double kMinLatencyUs = 50;
+
+// The latency charged for a call failing with UNAVAILABLE, which usually
+// comes back quickly from a dead backend, or with RESOURCE_EXHAUSTED, which
+// comes back quickly from an overloaded one.
+constexpr auto kUnavailablePenalty = std::chrono::seconds(1);
+
+// How many hedges can be saved up during quiet periods.
+constexpr double kMaxHedgeTokens = 10;
+
+// The p95 is not trusted before this many calls.
+constexpr std::size_t kMinLatencySamples = 100;
+
+grpc::Status NoBackends() {
+  return grpc::Status(grpc::StatusCode::UNAVAILABLE,
+                      "No arithmetic servers to call");
+}
+
+std::int64_t ToNanos(std::chrono::steady_clock::time_point t) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             t.time_since_epoch())
+      .count();
+}
+
+// Channels to the same address with the same arguments share a subchannel,
+// and so a connection, through gRPC's global subchannel pool. Each of these
+// has its own pool and an argument of its own besides.
+ArithmeticBalancer::NamedChannels ChannelsTo(
+    const std::vector<std::string>& endpoints, std::size_t per_endpoint) {
+  ArithmeticBalancer::NamedChannels channels;
+  for (const auto& endpoint : endpoints) {
+    std::vector<std::shared_ptr<grpc::Channel>> to_endpoint;
+    for (std::size_t i = 0; i < std::max<std::size_t>(per_endpoint, 1); i++) {
+      grpc::ChannelArguments arguments;
+      arguments.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+      arguments.SetInt("mathematics.arithmetic_connection", i);
+      to_endpoint.push_back(grpc::CreateCustomChannel(
+          endpoint, grpc::InsecureChannelCredentials(), arguments));
+    }
+    channels.emplace_back(endpoint, std::move(to_endpoint));
+  }
+  return channels;
+}
+
+ArithmeticBalancer::HedgingOptions HedgingFromFlags() {
+  ArithmeticBalancer::HedgingOptions hedging;
+  hedging.enabled = absl::GetFlag(FLAGS_hedge_arithmetic_calls);
+  hedging.delay =
+      std::chrono::milliseconds(absl::GetFlag(FLAGS_hedge_delay_ms));
+  hedging.max_fraction = absl::GetFlag(FLAGS_max_hedge_fraction);
+  return hedging;
+}
+
+}  // namespace
+
+ArithmeticBalancer::Backend::Connection::Connection(
+    std::shared_ptr<grpc::Channel> channel, std::size_t square_stream_window)
+    : channel_(std::move(channel)),
+      stub_(Arithmetic::NewStub(channel_)),
+      square_stream_(new SquareStream(stub_.get(), square_stream_window)) {}
+
+ArithmeticBalancer::Backend::Backend(
+    std::string endpoint,
+    const std::vector<std::shared_ptr<grpc::Channel>>& channels,
+    std::size_t square_stream_window)
+    : endpoint_(std::move(endpoint)) {
+  for (const auto& channel : channels) {
+    connections_.push_back(
+        std::make_unique<Connection>(channel, square_stream_window));
+  }
+  const metrics::Labels labels = {{"backend", endpoint_}};
+  outstanding_gauge_ = metrics::NewGauge(
+      "arithmetic_client_outstanding_calls",
+      "Calls in flight to an arithmetic server replica.", labels);
+  ewma_latency_gauge_ = metrics::NewGauge(
+      "arithmetic_client_ewma_latency_us",
+      "Moving average latency of an arithmetic server replica, in "
+      "microseconds.",
+      labels);
+  calls_ = metrics::NewCounter("arithmetic_client_calls_total",
+                               "Calls sent to an arithmetic server replica.",
+                               labels);
+  failures_ = metrics::NewCounter(
+      "arithmetic_client_failures_total",
+      "Calls to an arithmetic server replica that failed.", labels);
+}
+
+ArithmeticBalancer::Backend::Connection*
+ArithmeticBalancer::Backend::Acquire() {
+  const std::size_t n = connections_.size();
+  Connection* acquired = connections_[0].get();
+  if (n > 1) {
+    const std::size_t first =
+        next_connection_.fetch_add(1, std::memory_order_relaxed);
+    acquired = connections_[first % n].get();
+    for (std::size_t i = 1; i < n; i++) {
+      Connection* c = connections_[(first + i) % n].get();
+      if (c->outstanding_.load(std::memory_order_relaxed) <
+          acquired->outstanding_.load(std::memory_order_relaxed)) {
+        acquired = c;
+      }
+    }
+  }
+  acquired->outstanding_.fetch_add(1, std::memory_order_relaxed);
+  return acquired;
+}
+
+void ArithmeticBalancer::Backend::Release(Connection* connection) {
+  connection->outstanding_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+double ArithmeticBalancer::Backend::Cost(
+    std::chrono::steady_clock::time_point now) const {
+  const std::int64_t outstanding =
+      outstanding_.load(std::memory_order_relaxed);
+  double latency_us = ewma_latency_us_.load(std::memory_order_relaxed);
+  if (outstanding == 0) {
+    const double idle_ns = static_cast<double>(
+        ToNanos(now) - last_update_ns_.load(std::memory_order_relaxed));
+    latency_us *=
+        std::exp2(-idle_ns / std::chrono::nanoseconds(kDecayTime).count());
+  }
+  return (latency_us + kMinLatencyUs) * (outstanding + 1);
+}
+
+void ArithmeticBalancer::Backend::Update(
+    std::chrono::steady_clock::time_point now,
+    std::chrono::steady_clock::duration latency) {
+  const std::int64_t now_ns = ToNanos(now);
+  const std::int64_t last_ns =
+      last_update_ns_.exchange(now_ns, std::memory_order_relaxed);
+  const double sample_us =
+      std::chrono::duration<double, std::micro>(latency).count();
+  // Weigh the new sample by the time since the previous one, so that the
+  // average tracks the backend at the same pace at any call rate.
+  const double elapsed_ns = static_cast<double>(now_ns - last_ns);
+  const double decay = std::exp2(
+      -elapsed_ns / std::chrono::nanoseconds(kDecayTime).count());
+  double old_us = ewma_latency_us_.load(std::memory_order_relaxed);
+  double new_us;
+  do {
+    new_us = old_us * decay + sample_us * (1 - decay);
+  } while (!ewma_latency_us_.compare_exchange_weak(old_us, new_us,
+                                                   std::memory_order_relaxed));
+  ewma_latency_gauge_->Set(static_cast<std::int64_t>(new_us));
+}
+
+void ArithmeticBalancer::LatencyWindow::Add(
+    std::chrono::steady_clock::duration latency) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (samples_.size() < kSize) {
+    samples_.push_back(latency);
+  } else {
+    samples_[added_ % kSize] = latency;
+  }
+  added_++;
+  if (added_ % kRecomputeEvery == 0) {
+    auto sorted = samples_;
+    auto p95 = sorted.begin() + sorted.size() * 95 / 100;
+    std::nth_element(sorted.begin(), p95, sorted.end());
+    p95_ = *p95;
+  }
+}
+
+bool ArithmeticBalancer::LatencyWindow::P95(
+    std::chrono::steady_clock::duration* p95) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (added_ < std::max(kMinLatencySamples, kRecomputeEvery)) return false;
+  *p95 = p95_;
+  return true;
+}
+
+// The state of a hedged call, shared with the completion callbacks, which
+// may run after HedgedComputeSquare() has returned.
+struct ArithmeticBalancer::HedgedCall {
+  struct Attempt {
+    std::unique_ptr<grpc::ClientContext> context;
+    ComputeSquareResponse response;
+  };
+
+  explicit HedgedCall(const ComputeSquareRequest& request)
+      : request(request) {}
+
+  bool finished() const { return winner >= 0 || pending == 0; }
+
+  const ComputeSquareRequest request;
+  Attempt attempts[2];
+
+  std::mutex mu;
+  std::condition_variable cv;
+  int started = 0;                   // Guarded by mu.
+  int pending = 0;                   // Guarded by mu.
+  int winner = -1;                   // Guarded by mu.
+  grpc::Status status;               // Guarded by mu.
+  Backend* backends[2] = {nullptr};  // Guarded by mu.
+};
+
+ArithmeticBalancer::ArithmeticBalancer(
+    const std::vector<std::string>& endpoints, const HedgingOptions& hedging,
+    bool use_square_stream, std::size_t square_stream_window,
+    std::size_t connections_per_backend)
+    : ArithmeticBalancer(ChannelsTo(endpoints, connections_per_backend),
+                         hedging, use_square_stream, square_stream_window) {}
+
+ArithmeticBalancer::ArithmeticBalancer(const NamedChannels& channels,
+                                       const HedgingOptions& hedging,
+                                       bool use_square_stream,
+                                       std::size_t square_stream_window)
+    : hedging_(hedging), use_square_stream_(use_square_stream) {
+  for (const auto& [name, to_backend] : channels) {
+    backends_.push_back(
+        std::make_unique<Backend>(name, to_backend, square_stream_window));
+  }
+  hedges_ = metrics::NewCounter("arithmetic_client_hedges_total",
+                                "ComputeSquare calls sent a second time.");
+  hedge_wins_ = metrics::NewCounter(
+      "arithmetic_client_hedge_wins_total",
+      "Hedged ComputeSquare calls answered first by the hedge.");
+  hedges_over_budget_ = metrics::NewCounter(
+      "arithmetic_client_hedges_over_budget_total",
+      "Slow ComputeSquare calls not hedged because of --max_hedge_fraction.");
+}
+
+std::unique_ptr<ArithmeticBalancer> ArithmeticBalancer::FromFlags() {
+  if (absl::GetFlag(FLAGS_arithmetic_endpoints).empty()) {
+    std::cerr << "--arithmetic_endpoints lists no arithmetic servers"
+              << std::endl;
+    return nullptr;
+  }
+  return std::make_unique<ArithmeticBalancer>(
+      ChannelsTo(absl::GetFlag(FLAGS_arithmetic_endpoints),
+                 absl::GetFlag(FLAGS_arithmetic_connections_per_replica)),
+      HedgingFromFlags(), absl::GetFlag(FLAGS_arithmetic_square_stream),
+      absl::GetFlag(FLAGS_square_stream_window));
+}
+
+std::unique_ptr<ArithmeticBalancer> ArithmeticBalancer::FromFlags(
+    const std::string& name, std::shared_ptr<grpc::Channel> channel) {
+  return std::make_unique<ArithmeticBalancer>(
+      NamedChannels{{name, {std::move(channel)}}}, HedgingFromFlags(),
+      absl::GetFlag(FLAGS_arithmetic_square_stream),
+      absl::GetFlag(FLAGS_square_stream_window));
+}
+
+int ArithmeticBalancer::WaitForConnected(
+    std::chrono::system_clock::time_point deadline) {
+  // Connecting is asynchronous, so start all connections before waiting on
+  // any.
+  for (const auto& backend : backends_) {
+    for (const auto& connection : backend->connections()) {
+      connection->channel()->GetState(/*try_to_connect=*/true);
+    }
+  }
+  int connected = 0;
+  std::string unreachable;
+  for (const auto& backend : backends_) {
+    // A backend counts as connected once all its connections are.
+    bool all_connected = true;
+    for (const auto& connection : backend->connections()) {
+      all_connected =
+          connection->channel()->WaitForConnected(deadline) && all_connected;
+    }
+    if (all_connected) {
+      connected++;
+    } else {
+      unreachable += " " + backend->endpoint();
+    }
+  }
+  if (!unreachable.empty()) {
+    std::cerr << "Could not connect to arithmetic servers:" << unreachable
+              << std::endl;
+  }
+  return connected;
+}
+
+ArithmeticBalancer::Backend* ArithmeticBalancer::Pick(const Backend* exclude) {
+  thread_local std::minstd_rand random(std::random_device{}());
+
+  const std::size_t n = backends_.size();
+  if (n == 0) return nullptr;
+  Backend* picked;
+  if (n == 1) {
+    picked = backends_[0].get();
+  } else if (n == 2 && exclude != nullptr) {
+    picked = backends_[backends_[0].get() == exclude ? 1 : 0].get();
+  } else {
+    // Two distinct random backends, neither of them 'exclude'.
+    Backend* a;
+    Backend* b;
+    do {
+      a = backends_[random() % n].get();
+    } while (a == exclude);
+    do {
+      b = backends_[random() % n].get();
+    } while (b == a || b == exclude);
+    const auto now = std::chrono::steady_clock::now();
+    picked = a->Cost(now) <= b->Cost(now) ? a : b;
+  }
+
+  picked->outstanding_.fetch_add(1, std::memory_order_relaxed);
+  picked->outstanding_gauge_->Add(1);
+  picked->calls_->Increment();
+  return picked;
+}
+
+void ArithmeticBalancer::Done(Backend* backend,
+                              std::chrono::steady_clock::time_point start,
+                              const grpc::Status& status) {
+  backend->outstanding_.fetch_sub(1, std::memory_order_relaxed);
+  backend->outstanding_gauge_->Add(-1);
+
+  const auto now = std::chrono::steady_clock::now();
+  switch (status.error_code()) {
+    case grpc::StatusCode::OK:
+    case grpc::StatusCode::INVALID_ARGUMENT:
+      // The backend did its job.
+      backend->Update(now, now - start);
+      break;
+    case grpc::StatusCode::UNAVAILABLE:
+    case grpc::StatusCode::RESOURCE_EXHAUSTED:
+      backend->failures_->Increment();
+      backend->Update(now, std::max<std::chrono::steady_clock::duration>(
+                               now - start, kUnavailablePenalty));
+      break;
+    case grpc::StatusCode::CANCELLED:
+      // Says more about the caller than about the backend.
+      break;
+    default:
+      backend->failures_->Increment();
+      backend->Update(now, now - start);
+      break;
+  }
+}
+
+grpc::Status ArithmeticBalancer::ComputeSquare(
+    const ContextFactory& new_context, const ComputeSquareRequest& request,
+    ComputeSquareResponse* response) {
+  if (!hedging_.enabled || backends_.size() < 2) {
+    return UnhedgedComputeSquare(new_context, request, response);
+  }
+  return HedgedComputeSquare(new_context, request, response);
+}
+
+grpc::Status ArithmeticBalancer::UnhedgedComputeSquare(
+    const ContextFactory& new_context, const ComputeSquareRequest& request,
+    ComputeSquareResponse* response) {
+  std::unique_ptr<grpc::ClientContext> context = new_context();
+  Backend* backend = Pick();
+  if (backend == nullptr) return NoBackends();
+  Backend::Connection* connection = backend->Acquire();
+  const auto start = std::chrono::steady_clock::now();
+  grpc::Status status =
+      connection->stub()->ComputeSquare(context.get(), request, response);
+  backend->Release(connection);
+  Done(backend, start, status);
+  return status;
+}
+
+grpc::Status ArithmeticBalancer::HedgedComputeSquare(
+    const ContextFactory& new_context, const ComputeSquareRequest& request,
+    ComputeSquareResponse* response) {
+  {
+    std::lock_guard<std::mutex> lock(hedge_mu_);
+    hedge_tokens_ =
+        std::min(hedge_tokens_ + hedging_.max_fraction, kMaxHedgeTokens);
+  }
+
+  auto call = std::make_shared<HedgedCall>(request);
+  StartAttempt(call, 0, new_context(), nullptr);
+
+  std::chrono::steady_clock::duration delay = hedging_.delay;
+  const bool can_hedge =
+      hedging_.delay.count() > 0 || square_latency_.P95(&delay);
+
+  std::unique_lock<std::mutex> lock(call->mu);
+  if (can_hedge &&
+      !call->cv.wait_for(lock, delay, [&call] { return call->finished(); })) {
+    if (TakeHedgeToken()) {
+      Backend* primary = call->backends[0];
+      lock.unlock();
+      // Created outside the lock, as the factory may do real work.
+      StartAttempt(call, 1, new_context(), primary);
+      hedges_->Increment();
+      lock.lock();
+    } else {
+      hedges_over_budget_->Increment();
+    }
+  }
+  call->cv.wait(lock, [&call] { return call->finished(); });
+
+  if (call->winner < 0) {
+    return call->status;
+  }
+  if (call->winner == 1) {
+    hedge_wins_->Increment();
+  }
+  // The loser's callback still runs, with CANCELLED, and releases its
+  // backend.
+  for (int i = 0; i < call->started; i++) {
+    if (i != call->winner) {
+      call->attempts[i].context->TryCancel();
+    }
+  }
+  *response = call->attempts[call->winner].response;
+  return grpc::Status::OK;
+}
+
+void ArithmeticBalancer::StartAttempt(
+    const std::shared_ptr<HedgedCall>& call, int attempt,
+    std::unique_ptr<grpc::ClientContext> context, const Backend* exclude) {
+  Backend* backend = Pick(exclude);
+  HedgedCall::Attempt* a = &call->attempts[attempt];
+  a->context = std::move(context);
+  {
+    std::lock_guard<std::mutex> lock(call->mu);
+    call->backends[attempt] = backend;
+    call->started++;
+    call->pending++;
+  }
+  Backend::Connection* connection = backend->Acquire();
+  const auto start = std::chrono::steady_clock::now();
+  connection->stub()->async()->ComputeSquare(
+      a->context.get(), &call->request, &a->response,
+      [this, call, attempt, backend, connection, start](grpc::Status status) {
+        backend->Release(connection);
+        Done(backend, start, status);
+        if (status.ok()) {
+          square_latency_.Add(std::chrono::steady_clock::now() - start);
+        }
+        std::lock_guard<std::mutex> lock(call->mu);
+        call->pending--;
+        if (status.ok()) {
+          if (call->winner < 0) call->winner = attempt;
+        } else if (call->winner < 0 && (call->status.ok() || attempt == 0)) {
+          // With both attempts failing, report the primary's error.
+          call->status = status;
+        }
+        call->cv.notify_all();
+      });
+}
+
+grpc::Status ArithmeticBalancer::ComputeSquares(
+    const std::int32_t* numbers, std::size_t count,
+    std::chrono::system_clock::time_point deadline,
+    std::vector<std::int64_t>* squares) {
+  Backend* backend = Pick();
+  if (backend == nullptr) return NoBackends();
+  Backend::Connection* connection = backend->Acquire();
+  const auto start = std::chrono::steady_clock::now();
+  grpc::Status status = connection->square_stream()->ComputeSquares(
+      numbers, count, deadline, squares);
+  backend->Release(connection);
+  Done(backend, start, status);
+  return status;
+}
+
+grpc::Status ArithmeticBalancer::ComputePackedSquares(
+    const ContextFactory& new_context,
+    const ComputePackedSquaresRequest& request,
+    ComputePackedSquaresResponse* response) {
+  std::unique_ptr<grpc::ClientContext> context = new_context();
+  Backend* backend = Pick();
+  if (backend == nullptr) return NoBackends();
+  Backend::Connection* connection = backend->Acquire();
+  const auto start = std::chrono::steady_clock::now();
+  grpc::Status status = connection->stub()->ComputePackedSquares(
+      context.get(), request, response);
+  backend->Release(connection);
+  Done(backend, start, status);
+  return status;
+}
+
+bool ArithmeticBalancer::TakeHedgeToken() {
+  std::lock_guard<std::mutex> lock(hedge_mu_);
+  if (hedge_tokens_ < 1) return false;
+  hedge_tokens_ -= 1;
+  return true;
+}
+
+}  // namespace mathematics
@@ -5,8 +5,14 @@
 
 #include <grpcpp/grpcpp.h>
 
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
 #include "arithmetic-service.grpc.pb.h"
 
+ABSL_FLAG(std::string, target, "127.0.0.1:50051",
+          "The arithmetic server to call: host:port, or unix:/path/to/socket "
+          "or unix-abstract:name.");
+
 using ::grpc::Channel;
 using ::grpc::ChannelArguments;
 using ::grpc::ClientContext;
@@ -15,11 +21,12 @@ using ::mathematics::Arithmetic;
 using ::mathematics::ComputeSquareRequest;
 using ::mathematics::ComputeSquareResponse;
 
-int main() {
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
   ChannelArguments args;
   args.SetLoadBalancingPolicyName("round_robin");
   std::unique_ptr<Arithmetic::Stub> stub(Arithmetic::NewStub(
-      grpc::CreateCustomChannel("127.0.0.1:50051",
+      grpc::CreateCustomChannel(absl::GetFlag(FLAGS_target),
                                 grpc::InsecureChannelCredentials(), args)));
 
   for (int i = 0; i < 10; i++) {
@@ -0,0 +1,204 @@
+
+#ifndef ASYNC_LOG_H_
+#define ASYNC_LOG_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+// A small asynchronous logger for request hot paths.
+//
+// Writing to std::cout with std::endl on every request costs a formatting
+// pass, a lock on the stream and a write() syscall. Here the calling thread
+// only copies the raw arguments into a fixed-size record in its own
+// single-producer ring buffer; a background thread drains all the rings,
+// formats the records and writes them out in batches.
+//
+//   ASYNC_LOG(kInfo, "Received a length computation request with id {}", id);
+//
+//   // At most every 10th call, and no more than 100 lines per second.
+//   ASYNC_LOG_SAMPLED(kInfo, 10, 100, "ComputeSquare; number: {}", n);
+//
+// Each "{}" in the format string is replaced by the next argument. Arguments
+// may be integers, floating point numbers or strings; strings are truncated
+// to fit in the record. When a thread's ring is full, kInfo records are
+// dropped, and counted, while kWarning and kError records wait for the
+// calling thread to drain the rings itself: those are the lines that matter
+// under the overload that fills the rings.
+
+namespace mathematics {
+namespace async_log {
+
+enum class Severity : std::uint8_t { kInfo, kWarning, kError };
+
+// A logging call site. The ASYNC_LOG macros create one as a function-local
+// static, so its sampling and rate limiting state is shared by all threads
+// executing the same line.
+class LogSite {
+ public:
+  LogSite(Severity severity, const char* format, int sample_every_n,
+          int max_per_second)
+      : severity_(severity),
+        format_(format),
+        sample_every_n_(sample_every_n),
+        max_per_second_(max_per_second) {}
+
+  // Returns true if the current call passes sampling and rate limiting.
+  bool ShouldLog();
+
+  // Returns the number of calls rejected since the last call to this method.
+  std::uint64_t TakeSuppressed() {
+    if (suppressed_.load(std::memory_order_relaxed) == 0) return 0;
+    return suppressed_.exchange(0, std::memory_order_relaxed);
+  }
+
+  Severity severity() const { return severity_; }
+  const char* format() const { return format_; }
+
+ private:
+  const Severity severity_;
+  const char* const format_;
+  const int sample_every_n_;  // 1 logs every call.
+  const int max_per_second_;  // 0 means no limit.
+
+  std::atomic<std::uint64_t> calls_{0};
+  std::atomic<std::int64_t> window_second_{0};
+  std::atomic<int> window_count_{0};
+  std::atomic<std::uint64_t> suppressed_{0};
+};
+
+// The binary form of a log line, as written by the hot path.
+struct Record {
+  static constexpr int kMaxArgs = 4;
+  static constexpr int kStringBytes = 192;
+
+  enum ArgType : std::uint8_t { kInt, kDouble, kString };
+
+  const LogSite* site;
+  std::int64_t timestamp_us;
+  std::uint32_t suppressed;
+  std::uint16_t thread_index;
+  std::uint8_t num_args;
+  std::uint8_t string_bytes;
+  ArgType types[kMaxArgs];
+  union {
+    std::int64_t i;
+    double d;
+    struct {
+      std::uint8_t offset;
+      std::uint8_t size;
+    } s;
+  } values[kMaxArgs];
+  char strings[kStringBytes];
+};
+static_assert(sizeof(Record) == 256, "Record should fill four cache lines");
+
+// Records per thread ring buffer.
+constexpr int kRingRecords = 4096;
+
+// Returns a free record in the calling thread's ring buffer. If the ring is
+// full, returns nullptr and counts the drop if 'may_drop', and otherwise
+// drains the rings on the calling thread to make room.
+Record* BeginRecord(bool may_drop);
+
+// Makes the record returned by the last BeginRecord() visible to the
+// background thread.
+void CommitRecord();
+
+// Blocks until every record committed so far has been written out.
+void Flush();
+
+// Returns the number of kInfo records dropped because a ring buffer was
+// full.
+std::uint64_t DroppedRecords();
+
+namespace internal {
+
+inline void EncodeArg(Record* r, std::int64_t v) {
+  r->types[r->num_args] = Record::kInt;
+  r->values[r->num_args++].i = v;
+}
+
+inline void EncodeArg(Record* r, double v) {
+  r->types[r->num_args] = Record::kDouble;
+  r->values[r->num_args++].d = v;
+}
+
+inline void EncodeArg(Record* r, const char* data, std::size_t size) {
+  const std::size_t room = Record::kStringBytes - r->string_bytes;
+  if (size > room) size = room;
+  std::memcpy(r->strings + r->string_bytes, data, size);
+  r->types[r->num_args] = Record::kString;
+  r->values[r->num_args].s.offset = r->string_bytes;
+  r->values[r->num_args++].s.size = static_cast<std::uint8_t>(size);
+  r->string_bytes += static_cast<std::uint8_t>(size);
+}
+
+inline void EncodeArg(Record* r, const std::string& v) {
+  EncodeArg(r, v.data(), v.size());
+}
+
+inline void EncodeArg(Record* r, const char* v) {
+  EncodeArg(r, v, std::strlen(v));
+}
+
+template <typename T,
+          typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+void EncodeArg(Record* r, T v) {
+  EncodeArg(r, static_cast<std::int64_t>(v));
+}
+
+template <typename T, typename std::enable_if<std::is_floating_point<T>::value,
+                                              int>::type = 0>
+void EncodeArg(Record* r, T v) {
+  EncodeArg(r, static_cast<double>(v));
+}
+
+inline void EncodeArgs(Record*) {}
+
+template <typename T, typename... Rest>
+void EncodeArgs(Record* r, const T& v, const Rest&... rest) {
+  static_assert(sizeof...(Rest) < Record::kMaxArgs,
+                "too many arguments for an async log record");
+  EncodeArg(r, v);
+  EncodeArgs(r, rest...);
+}
+
+std::int64_t NowMicros();
+std::uint16_t ThreadIndex();
+
+}  // namespace internal
+
+template <typename... Args>
+void Log(LogSite* site, const Args&... args) {
+  Record* r = BeginRecord(site->severity() == Severity::kInfo);
+  if (r == nullptr) return;
+  r->site = site;
+  r->timestamp_us = internal::NowMicros();
+  r->suppressed = static_cast<std::uint32_t>(site->TakeSuppressed());
+  r->thread_index = internal::ThreadIndex();
+  r->num_args = 0;
+  r->string_bytes = 0;
+  internal::EncodeArgs(r, args...);
+  CommitRecord();
+}
+
+}  // namespace async_log
+}  // namespace mathematics
+
+#define ASYNC_LOG_SAMPLED(severity, every_n, per_second, format, ...)  \
+  do {                                                                   \
+    static ::mathematics::async_log::LogSite async_log_site(             \
+        ::mathematics::async_log::Severity::severity, (format), (every_n), \
+        (per_second));                                                   \
+    if (async_log_site.ShouldLog()) {                                    \
+      ::mathematics::async_log::Log(&async_log_site, ##__VA_ARGS__);     \
+    }                                                                    \
+  } while (0)
+
+#define ASYNC_LOG(severity, format, ...) \
+  ASYNC_LOG_SAMPLED(severity, 1, 0, (format), ##__VA_ARGS__)
+
+#endif  // ASYNC_LOG_H_
@@ -0,0 +1,378 @@
+
+#include "computed-length-file.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <utility>
+
+namespace mathematics {
+namespace {
+
+constexpr char kMagic[] = {'M', 'A', 'T', 'H', 'C', 'O', 'L', '1'};
+constexpr std::size_t kIndexEntrySize = 8 + 8;
+constexpr std::size_t kFooterSize = 8 + 8 + 8 + sizeof(kMagic);
+
+void PutVarint(std::uint64_t value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+void PutFixed64(std::uint64_t value, std::string* out) {
+  for (int i = 0; i < 8; i++) out->push_back(static_cast<char>(value >> 8 * i));
+}
+
+std::uint64_t Fixed64(const char* p) {
+  std::uint64_t value = 0;
+  for (int i = 7; i >= 0; i--) {
+    value = value << 8 | static_cast<unsigned char>(p[i]);
+  }
+  return value;
+}
+
+void SetBit(std::size_t bit, std::vector<std::uint8_t>* bitmap) {
+  (*bitmap)[bit / 8] |= 1 << bit % 8;
+}
+
+std::string ErrnoError(const std::string& path) {
+  return path + ": " + std::strerror(errno);
+}
+
+// Reads what the encoding of a group holds, failing on anything past its
+// end.
+class GroupReader {
+ public:
+  GroupReader(const char* p, const char* end) : p_(p), end_(end) {}
+
+  bool Varint(std::uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (p_ == end_) return false;
+      const auto byte = static_cast<unsigned char>(*p_++);
+      *value |= std::uint64_t{byte & 0x7fu} << shift;
+      if (byte < 0x80) return true;
+    }
+    return false;
+  }
+
+  bool Bytes(std::uint64_t size, const char** bytes) {
+    if (static_cast<std::uint64_t>(end_ - p_) < size) return false;
+    *bytes = p_;
+    p_ += size;
+    return true;
+  }
+
+  // Splits off the next column, as a reader of its own.
+  bool Column(GroupReader* column) {
+    std::uint64_t size;
+    const char* bytes;
+    if (!Varint(&size) || !Bytes(size, &bytes)) return false;
+    *column = GroupReader(bytes, bytes + size);
+    return true;
+  }
+
+ private:
+  const char* p_;
+  const char* end_;
+};
+
+bool HasBit(const char* bitmap, std::size_t bit) {
+  return static_cast<unsigned char>(bitmap[bit / 8]) >> bit % 8 & 1;
+}
+
+// Decodes a group into 'rows'.
+bool DecodeGroup(const std::string& group, std::vector<ComputedLength>* rows) {
+  GroupReader reader(group.data(), group.data() + group.size());
+  std::uint64_t count;
+  GroupReader ids(nullptr, nullptr), versions(nullptr, nullptr),
+      lengths(nullptr, nullptr), error_details(nullptr, nullptr);
+  if (!reader.Varint(&count) || !reader.Column(&ids) ||
+      !reader.Column(&versions) || !reader.Column(&lengths) ||
+      !reader.Column(&error_details) || count > group.size() * 8) {
+    return false;
+  }
+  rows->assign(count, ComputedLength());
+
+  std::string id;
+  // Unsigned, so that the differences wrap as they did when encoded.
+  std::uint64_t version = 0;
+  for (ComputedLength& row : *rows) {
+    std::uint64_t shared, size, zigzag;
+    const char* rest;
+    if (!ids.Varint(&shared) || shared > id.size() || !ids.Varint(&size) ||
+        !ids.Bytes(size, &rest) || !versions.Varint(&zigzag)) {
+      return false;
+    }
+    id.resize(shared);
+    id.append(rest, size);
+    row.id = id;
+    version += zigzag >> 1 ^ -(zigzag & 1);
+    row.version = static_cast<std::int64_t>(version);
+  }
+
+  const std::size_t bitmap_size = (count + 7) / 8;
+  const char* has_length;
+  const char* has_error_details;
+  if (!lengths.Bytes(bitmap_size, &has_length) ||
+      !error_details.Bytes(bitmap_size, &has_error_details)) {
+    return false;
+  }
+  for (std::size_t i = 0; i < count; i++) {
+    ComputedLength& row = (*rows)[i];
+    if (HasBit(has_length, i)) {
+      const char* bits;
+      if (!lengths.Bytes(8, &bits)) return false;
+      const std::uint64_t value = Fixed64(bits);
+      double length;
+      std::memcpy(&length, &value, sizeof(length));
+      row.length = length;
+    }
+    if (HasBit(has_error_details, i)) {
+      std::uint64_t size;
+      const char* bytes;
+      if (!error_details.Varint(&size) || !error_details.Bytes(size, &bytes)) {
+        return false;
+      }
+      row.error_details.emplace(bytes, size);
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+void ComputedLengthColumns::Add(const ComputedLength& row) {
+  const std::size_t shared =
+      std::mismatch(row.id.begin(),
+                    row.id.begin() + std::min(row.id.size(), last_id_.size()),
+                    last_id_.begin())
+          .first -
+      row.id.begin();
+  PutVarint(shared, &ids_);
+  PutVarint(row.id.size() - shared, &ids_);
+  ids_.append(row.id, shared, std::string::npos);
+  last_id_ = row.id;
+
+  const std::uint64_t delta = static_cast<std::uint64_t>(row.version) -
+                              static_cast<std::uint64_t>(last_version_);
+  PutVarint(delta << 1 ^ -(delta >> 63), &versions_);
+  last_version_ = row.version;
+
+  if (rows_ % 8 == 0) {
+    has_length_.push_back(0);
+    has_error_details_.push_back(0);
+  }
+  if (row.length.has_value()) {
+    SetBit(rows_, &has_length_);
+    std::uint64_t bits;
+    std::memcpy(&bits, &*row.length, sizeof(bits));
+    PutFixed64(bits, &lengths_);
+  }
+  if (row.error_details.has_value()) {
+    SetBit(rows_, &has_error_details_);
+    PutVarint(row.error_details->size(), &error_details_);
+    error_details_.append(*row.error_details);
+  }
+  rows_++;
+}
+
+std::size_t ComputedLengthColumns::bytes() const {
+  return ids_.size() + versions_.size() + has_length_.size() + lengths_.size() +
+         has_error_details_.size() + error_details_.size();
+}
+
+void ComputedLengthColumns::Encode(std::string* out) const {
+  PutVarint(rows_, out);
+  PutVarint(ids_.size(), out);
+  out->append(ids_);
+  PutVarint(versions_.size(), out);
+  out->append(versions_);
+  PutVarint(has_length_.size() + lengths_.size(), out);
+  out->append(has_length_.begin(), has_length_.end());
+  out->append(lengths_);
+  PutVarint(has_error_details_.size() + error_details_.size(), out);
+  out->append(has_error_details_.begin(), has_error_details_.end());
+  out->append(error_details_);
+}
+
+void ComputedLengthColumns::Clear() {
+  rows_ = 0;
+  last_id_.clear();
+  last_version_ = 0;
+  ids_.clear();
+  versions_.clear();
+  has_length_.clear();
+  lengths_.clear();
+  has_error_details_.clear();
+  error_details_.clear();
+}
+
+std::unique_ptr<ComputedLengthFileWriter> ComputedLengthFileWriter::Create(
+    const std::string& path, std::string* error) {
+  const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+  if (fd < 0) {
+    *error = ErrnoError(path);
+    return nullptr;
+  }
+  std::unique_ptr<ComputedLengthFileWriter> writer(
+      new ComputedLengthFileWriter(fd, path));
+  std::lock_guard<std::mutex> lock(writer->mu_);
+  if (!writer->Write(std::string(kMagic, sizeof(kMagic)))) {
+    *error = writer->error_;
+    return nullptr;
+  }
+  return writer;
+}
+
+ComputedLengthFileWriter::ComputedLengthFileWriter(int fd, std::string path)
+    : path_(std::move(path)), fd_(fd) {}
+
+ComputedLengthFileWriter::~ComputedLengthFileWriter() {
+  bool open;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    open = fd_ >= 0;
+  }
+  if (open) Close();
+}
+
+bool ComputedLengthFileWriter::Append(const ComputedLengthColumns& columns) {
+  if (columns.rows() == 0) return true;
+  // Encoded outside the lock, so that workers only wait for each other's
+  // writes.
+  std::string group;
+  group.reserve(columns.bytes() + 32);
+  columns.Encode(&group);
+  std::lock_guard<std::mutex> lock(mu_);
+  const std::uint64_t offset = offset_;
+  if (!Write(group)) return false;
+  groups_.push_back({offset, columns.rows()});
+  rows_ += columns.rows();
+  return true;
+}
+
+bool ComputedLengthFileWriter::Close() {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (fd_ < 0) {
+    if (error_.empty()) error_ = path_ + ": already closed";
+    return false;
+  }
+  const std::uint64_t index_offset = offset_;
+  std::string tail;
+  tail.reserve(groups_.size() * kIndexEntrySize + kFooterSize);
+  for (const Group& group : groups_) {
+    PutFixed64(group.offset, &tail);
+    PutFixed64(group.rows, &tail);
+  }
+  PutFixed64(index_offset, &tail);
+  PutFixed64(groups_.size(), &tail);
+  PutFixed64(rows_, &tail);
+  tail.append(kMagic, sizeof(kMagic));
+  if (!Write(tail)) return false;
+  const int fd = fd_;
+  fd_ = -1;
+  if (close(fd) != 0) {
+    error_ = ErrnoError(path_);
+    return false;
+  }
+  return true;
+}
+
+std::uint64_t ComputedLengthFileWriter::rows() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return rows_;
+}
+
+std::uint64_t ComputedLengthFileWriter::bytes() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return offset_;
+}
+
+std::string ComputedLengthFileWriter::error() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return error_;
+}
+
+bool ComputedLengthFileWriter::Write(const std::string& bytes) {
+  if (fd_ < 0) {
+    if (error_.empty()) error_ = path_ + ": already closed";
+    return false;
+  }
+  const char* data = bytes.data();
+  std::size_t size = bytes.size();
+  while (size > 0) {
+    const ssize_t written = write(fd_, data, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      error_ = ErrnoError(path_);
+      close(fd_);
+      fd_ = -1;
+      return false;
+    }
+    data += written;
+    size -= written;
+    offset_ += written;
+  }
+  return true;
+}
+
+bool ReadComputedLengthFile(
+    const std::string& path,
+    const std::function<void(const ComputedLength& row)>& visit,
+    std::string* error) {
+  std::ifstream file(path, std::ios::binary);
+  std::string footer(kFooterSize, '\0');
+  file.seekg(0, std::ios::end);
+  const auto size = static_cast<std::uint64_t>(file.tellg());
+  if (!file || size < sizeof(kMagic) + kFooterSize ||
+      !file.seekg(size - kFooterSize) || !file.read(&footer[0], kFooterSize) ||
+      std::memcmp(&footer[24], kMagic, sizeof(kMagic)) != 0) {
+    *error = path + ": not a complete computed_length file";
+    return false;
+  }
+  const std::uint64_t index_offset = Fixed64(&footer[0]);
+  const std::uint64_t groups = Fixed64(&footer[8]);
+  if (index_offset < sizeof(kMagic) ||
+      (size - kFooterSize - index_offset) / kIndexEntrySize != groups ||
+      index_offset > size - kFooterSize) {
+    *error = path + ": corrupt footer";
+    return false;
+  }
+  std::string index(groups * kIndexEntrySize, '\0');
+  if (!file.seekg(index_offset) || !file.read(&index[0], index.size())) {
+    *error = path + ": cannot read the index";
+    return false;
+  }
+
+  std::string group;
+  std::vector<ComputedLength> rows;
+  for (std::uint64_t g = 0; g < groups; g++) {
+    const std::uint64_t offset = Fixed64(&index[g * kIndexEntrySize]);
+    const std::uint64_t end =
+        g + 1 < groups ? Fixed64(&index[(g + 1) * kIndexEntrySize])
+                       : index_offset;
+    if (offset < sizeof(kMagic) || end < offset || end > index_offset) {
+      *error = path + ": corrupt index";
+      return false;
+    }
+    group.resize(end - offset);
+    if (!file.seekg(offset) || !file.read(&group[0], group.size()) ||
+        !DecodeGroup(group, &rows) ||
+        rows.size() != Fixed64(&index[g * kIndexEntrySize + 8])) {
+      *error = path + ": corrupt group at offset " + std::to_string(offset);
+      return false;
+    }
+    for (const ComputedLength& row : rows) visit(row);
+  }
+  return true;
+}
+
+}  // namespace mathematics
@@ -0,0 +1,133 @@
+
+#ifndef COMPUTED_LENGTH_FILE_H_
+#define COMPUTED_LENGTH_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <absl/types/optional.h>
+
+// A local, columnar file of computed_length rows, for analytics.
+//
+// The rows are stored in groups, and each group a column after the other,
+// so that a reader interested in one column skips the others, and values of
+// the same kind sit together, where they encode compactly:
+//
+//   file           magic, groups, index, footer
+//   group          varint rows, then each column as varint size and bytes
+//   id             per row, varint bytes shared with the id before, varint
+//                  length of the rest, and the rest
+//   version        per row, zigzag varint difference from the version before
+//   length         bitmap of the rows that have one, then the fixed64 bits
+//                  of each
+//   error_details  bitmap of the rows that have them, then of each the
+//                  varint length and the bytes
+//   index          per group, fixed64 offset and fixed64 rows
+//   footer         fixed64 index offset, fixed64 groups, fixed64 rows, magic
+//
+// Bitmaps hold a bit per row, lowest first. Fixed integers are
+// little-endian. The order of the groups in the file is not that of the
+// table.
+
+namespace mathematics {
+
+struct ComputedLength {
+  std::string id;
+  std::int64_t version = 0;
+  absl::optional<double> length;
+  // A serialized LengthComputationErrorDetails.
+  absl::optional<std::string> error_details;
+};
+
+// The columns of one group, as rows are added. Not thread-safe.
+class ComputedLengthColumns {
+ public:
+  void Add(const ComputedLength& row);
+
+  std::size_t rows() const { return rows_; }
+  // About the size of the encoded group.
+  std::size_t bytes() const;
+
+  // Appends the encoded group to '*out'.
+  void Encode(std::string* out) const;
+
+  void Clear();
+
+ private:
+  std::size_t rows_ = 0;
+  std::string last_id_;
+  std::int64_t last_version_ = 0;
+  std::string ids_;
+  std::string versions_;
+  std::vector<std::uint8_t> has_length_;
+  std::string lengths_;
+  std::vector<std::uint8_t> has_error_details_;
+  std::string error_details_;
+};
+
+// Writes a file of groups. Thread-safe: groups from many threads are
+// appended whole, in the order they come.
+class ComputedLengthFileWriter {
+ public:
+  // Creates or truncates the file at 'path'. Returns nullptr, with the
+  // reason in '*error', if it cannot.
+  static std::unique_ptr<ComputedLengthFileWriter> Create(
+      const std::string& path, std::string* error);
+
+  // Closes the file if Close() was not called, ignoring any error.
+  ~ComputedLengthFileWriter();
+
+  ComputedLengthFileWriter(const ComputedLengthFileWriter&) = delete;
+  ComputedLengthFileWriter& operator=(const ComputedLengthFileWriter&) =
+      delete;
+
+  // Appends 'columns' as a group, unless it has no rows. Returns false, and
+  // the writer is no longer usable, if the file cannot be written.
+  bool Append(const ComputedLengthColumns& columns);
+
+  // Writes the index and footer and closes the file. Returns false if any of
+  // it fails.
+  bool Close();
+
+  // The rows and bytes written so far.
+  std::uint64_t rows() const;
+  std::uint64_t bytes() const;
+
+  // Why the last call that returned false did.
+  std::string error() const;
+
+ private:
+  struct Group {
+    std::uint64_t offset;
+    std::uint64_t rows;
+  };
+
+  ComputedLengthFileWriter(int fd, std::string path);
+
+  bool Write(const std::string& bytes);  // Requires mu_.
+
+  const std::string path_;
+  mutable std::mutex mu_;
+  int fd_;                      // Guarded by mu_; -1 once closed.
+  std::uint64_t offset_ = 0;    // Guarded by mu_.
+  std::uint64_t rows_ = 0;      // Guarded by mu_.
+  std::vector<Group> groups_;   // Guarded by mu_.
+  std::string error_;           // Guarded by mu_.
+};
+
+// Calls 'visit' for each row of the file at 'path', a group at a time.
+// Returns false, with the reason in '*error', if the file cannot be read or
+// is not a complete computed_length file.
+bool ReadComputedLengthFile(
+    const std::string& path,
+    const std::function<void(const ComputedLength& row)>& visit,
+    std::string* error);
+
+}  // namespace mathematics
+
+#endif  // COMPUTED_LENGTH_FILE_H_
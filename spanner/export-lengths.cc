@@ -0,0 +1,252 @@
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <google/cloud/spanner/client.h>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "computed-length-file.h"
+#include "spanner-warm-up.h"
+
+// Exports every computed_length row to a local columnar file (see
+// computed-length-file.h), for analytics:
+//
+//   $ ./export-lengths --output=/data/computed_length.columns --workers=32
+//
+// A single query would stream the whole table through one session, one
+// server and one connection. Instead, the query is split with
+// PartitionQuery, in a read-only transaction so that all the partitions read
+// the same snapshot, and --workers threads read partitions at once and
+// append their rows to the file a group at a time. The workers share the
+// client's connection, whose pools hold a channel per worker and the
+// sessions they read with. Spanner is asked for --partitions_per_worker
+// partitions per worker, so that when they differ in size the workers that
+// finish early take on more rather than sit idle at the end.
+
+ABSL_FLAG(std::string, output, "computed_length.columns",
+          "The file to write.");
+ABSL_FLAG(int, workers, 16, "How many partitions to read at once.");
+ABSL_FLAG(int, partitions_per_worker, 8,
+          "How many partitions to ask Spanner for per worker. Spanner may "
+          "make fewer.");
+ABSL_FLAG(int, group_rows, 64 * 1024, "Rows per group in the file.");
+ABSL_FLAG(int, progress_seconds, 10,
+          "How often to report progress on stderr.");
+ABSL_FLAG(bool, verify, true,
+          "Read the file back once written, and check that it holds all the "
+          "rows exported.");
+
+namespace mathematics {
+namespace {
+
+namespace spanner = ::google::cloud::spanner;
+
+constexpr char kProjectId[] = "plum-butter-123";
+constexpr char kSpannerInstanceId[] = "foobar-instance";
+constexpr char kDatabaseId[] = "geometry";
+
+using RowType = std::tuple<std::string, std::int64_t, absl::optional<double>,
+                           absl::optional<spanner::Bytes>>;
+
+class Export {
+ public:
+  Export(spanner::Client client,
+         std::vector<spanner::QueryPartition> partitions,
+         ComputedLengthFileWriter* writer)
+      : client_(std::move(client)),
+        partitions_(std::move(partitions)),
+        writer_(writer) {}
+
+  // Reads all partitions on 'workers' threads, reporting progress every
+  // 'progress'. Returns false, having said why on stderr, if reading a
+  // partition or writing the file failed.
+  bool Run(int workers, std::chrono::seconds progress) {
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < workers; i++) {
+      // Copies of a client share its connection, and so its channel and
+      // session pools.
+      threads.emplace_back(&Export::Work, this, client_);
+    }
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      while (!cv_.wait_for(lock, progress, [this] {
+        return done_ == partitions_.size() || !error_.empty();
+      })) {
+        Report("exported", start);
+      }
+    }
+    for (auto& thread : threads) thread.join();
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!error_.empty()) {
+      std::cerr << error_ << std::endl;
+      return false;
+    }
+    Report("done", start);
+    return true;
+  }
+
+ private:
+  void Work(spanner::Client client) {
+    const std::size_t group_rows =
+        std::max(absl::GetFlag(FLAGS_group_rows), 1);
+    ComputedLengthColumns columns;
+    ComputedLength row;
+    for (std::size_t i = next_++; i < partitions_.size(); i = next_++) {
+      auto rows = client.ExecuteQuery(partitions_[i]);
+      for (auto& r : spanner::StreamOf<RowType>(rows)) {
+        if (!r) {
+          Fail("Reading partition " + std::to_string(i) + " failed: " +
+               r.status().message());
+          return;
+        }
+        row.id = std::move(std::get<0>(*r));
+        row.version = std::get<1>(*r);
+        row.length = std::get<2>(*r);
+        if (std::get<3>(*r).has_value()) {
+          row.error_details = std::get<3>(*r)->get<std::string>();
+        } else {
+          row.error_details.reset();
+        }
+        columns.Add(row);
+        if (columns.rows() >= group_rows) {
+          // Another worker failed, and the export with it.
+          if (failed_) return;
+          if (!writer_->Append(columns)) {
+            Fail(writer_->error());
+            return;
+          }
+          columns.Clear();
+        }
+      }
+      std::lock_guard<std::mutex> lock(mu_);
+      if (++done_ == partitions_.size()) cv_.notify_all();
+    }
+    if (!failed_ && !writer_->Append(columns)) Fail(writer_->error());
+  }
+
+  void Fail(const std::string& error) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (error_.empty()) error_ = error;
+    // The others stop at their next group, and take no more partitions.
+    failed_ = true;
+    next_ = partitions_.size();
+    cv_.notify_all();
+  }
+
+  // Requires mu_.
+  void Report(const char* what,
+              std::chrono::steady_clock::time_point start) const {
+    const double seconds = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+    const std::uint64_t rows = writer_->rows();
+    std::cerr << what << " " << done_ << "/" << partitions_.size()
+              << " partitions, " << rows << " rows, "
+              << writer_->bytes() / 1e6 << " MB in " << seconds << " s ("
+              << static_cast<std::uint64_t>(rows / seconds) << " rows/s)"
+              << std::endl;
+  }
+
+  const spanner::Client client_;
+  const std::vector<spanner::QueryPartition> partitions_;
+  ComputedLengthFileWriter* const writer_;  // Not owned.
+  std::atomic<std::size_t> next_{0};
+  std::atomic<bool> failed_{false};
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::size_t done_ = 0;  // Guarded by mu_.
+  std::string error_;     // Guarded by mu_.
+};
+
+// Reads the file at 'path' back, and returns whether it holds 'rows' rows,
+// having said why not on stderr.
+bool Verify(const std::string& path, std::uint64_t rows) {
+  std::uint64_t read = 0;
+  std::string error;
+  if (!ReadComputedLengthFile(
+          path, [&read](const ComputedLength&) { read++; }, &error)) {
+    std::cerr << "Verifying the export failed: " << error << std::endl;
+    return false;
+  }
+  if (read != rows) {
+    std::cerr << "Verifying the export failed: " << path << " holds " << read
+              << " rows, not the " << rows << " exported" << std::endl;
+    return false;
+  }
+  std::cerr << "verified " << read << " rows" << std::endl;
+  return true;
+}
+
+int Main() {
+  const int workers = std::max(absl::GetFlag(FLAGS_workers), 1);
+  // As many channels as workers, for the pool to spread the partitions
+  // being read across.
+  spanner::Client client(spanner::MakeConnection(
+      spanner::Database(kProjectId, kSpannerInstanceId, kDatabaseId),
+      spanner::ConnectionOptions().set_num_channels(workers),
+      SessionPoolOptionsFromFlags()));
+
+  spanner::PartitionOptions partition_options;
+  partition_options.max_partitions =
+      std::int64_t{workers} *
+      std::max(absl::GetFlag(FLAGS_partitions_per_worker), 1);
+  auto partitions = client.PartitionQuery(
+      spanner::MakeReadOnlyTransaction(),
+      spanner::SqlStatement("SELECT id, version, length, error_details "
+                            "FROM computed_length"),
+      partition_options);
+  if (!partitions) {
+    std::cerr << "Failed to partition the query: " << partitions.status()
+              << std::endl;
+    return 1;
+  }
+  std::cerr << "Reading " << partitions->size() << " partitions with "
+            << workers << " workers" << std::endl;
+
+  const std::string output = absl::GetFlag(FLAGS_output);
+  std::string error;
+  std::unique_ptr<ComputedLengthFileWriter> writer =
+      ComputedLengthFileWriter::Create(output, &error);
+  if (writer == nullptr) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  Export job(client, *std::move(partitions), writer.get());
+  if (!job.Run(workers,
+               std::chrono::seconds(
+                   std::max(absl::GetFlag(FLAGS_progress_seconds), 1)))) {
+    // Not left behind to pass for a complete export.
+    writer.reset();
+    std::remove(output.c_str());
+    return 1;
+  }
+  if (!writer->Close()) {
+    std::cerr << writer->error() << std::endl;
+    return 1;
+  }
+  if (absl::GetFlag(FLAGS_verify) && !Verify(output, writer->rows())) {
+    std::remove(output.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace mathematics
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  return mathematics::Main();
+}
@@ -9,8 +9,22 @@
 #include <google/cloud/spanner/client.h>
 #include <grpcpp/grpcpp.h>
 
+#include "absl/flags/parse.h"
+#include "arithmetic-balancer.h"
 #include "arithmetic-service.grpc.pb.h"
+#include "async-log.h"
+#include "backlog.h"
+#include "envelope.h"
 #include "geometry-service.pb.h"
+#include "lane-scheduler.h"
+#include "metrics.h"
+#include "packed-numbers.h"
+#include "scoped-arena.h"
+#include "spanner-backlog-store.h"
+#include "spanner-warm-up.h"
+#include "startup.h"
+#include "sum-of-squares.h"
+#include "tracing.h"
 
 namespace mathematics {
 namespace {
@@ -55,20 +69,59 @@ std::string FormatDuration(std::chrono::system_clock::duration t) {
 
 class GeometryComputer {
  public:
-  GeometryComputer(Arithmetic::Stub *arithmetic)
+  GeometryComputer(ArithmeticBalancer *arithmetic, bool local_arithmetic)
       : arithmetic_(arithmetic),
+        local_arithmetic_(local_arithmetic),
         random_(std::chrono::system_clock::now().time_since_epoch().count()) {}
 
   cloud::StatusOr<double> ComputeLength(
       const ScheduleLengthComputationRequest &request,
-      const std::chrono::system_clock::time_point &deadline) {
+      const std::chrono::system_clock::time_point &deadline,
+      const tracing::SpanContext &trace_parent) {
+    tracing::Span span("GeometryComputer.ComputeLength", trace_parent);
+    span.SetAttribute("coordinates",
+                      request.coordinates_size() +
+                          packed::Count(request.packed_coordinates()));
     double sum = 0;
-    for (const auto &n : request.coordinates()) {
-      auto square = ComputeSquare(n, deadline);
-      if (!square.ok()) {
-        return square.status();
+    if (local_arithmetic_) {
+      std::uint64_t squares;
+      grpc::Status s = SumSquaresLocally(request, &squares);
+      if (!s.ok()) {
+        span.SetStatus(s.error_code(), s.error_message());
+        return cloud::Status(static_cast<cloud::StatusCode>(s.error_code()),
+                             s.error_message());
+      }
+      sum = squares;
+    } else if (!request.packed_coordinates().empty()) {
+      std::uint64_t packed_sum;
+      grpc::Status s =
+          SumPackedSquares(request, deadline, span.context(), &packed_sum);
+      if (!s.ok()) {
+        span.SetStatus(s.error_code(), s.error_message());
+        return ToCloudStatus(s);
+      }
+      sum = packed_sum;
+    } else if (arithmetic_->use_square_stream()) {
+      std::vector<std::int64_t> squares;
+      grpc::Status s = ComputeSquares(request.coordinates(), deadline,
+                                      span.context(), &squares);
+      if (!s.ok()) {
+        span.SetStatus(s.error_code(), s.error_message());
+        return ToCloudStatus(s);
+      }
+      for (std::int64_t square : squares) {
+        sum += square;
+      }
+    } else {
+      for (const auto &n : request.coordinates()) {
+        auto square = ComputeSquare(n, deadline, span.context());
+        if (!square.ok()) {
+          span.SetStatus(static_cast<int>(square.status().code()),
+                         square.status().message());
+          return square.status();
+        }
+        sum += *square;
       }
-      sum += *square;
     }
 
     return sqrt(sum);
@@ -78,33 +131,176 @@ class GeometryComputer {
   bool IsRetryableError(const grpc::Status &status) const {
     switch (status.error_code()) {
       case grpc::StatusCode::UNAVAILABLE:
+      // Refused by an overloaded arithmetic server, without doing any work.
+      case grpc::StatusCode::RESOURCE_EXHAUSTED:
         return true;
       default:
         return false;
     }
   }
 
+  static cloud::Status ToCloudStatus(const grpc::Status &s) {
+    if (s.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
+      return cloud::Status(cloud::StatusCode::kDeadlineExceeded,
+                           s.error_message());
+    }
+    return cloud::Status(
+        static_cast<cloud::StatusCode>(s.error_code()),
+        s.error_message() + "; calling the arithmetic server.");
+  }
+
   cloud::StatusOr<int> ComputeSquare(
-      int n, const std::chrono::system_clock::time_point &deadline) {
+      int n, const std::chrono::system_clock::time_point &deadline,
+      const tracing::SpanContext &trace_parent) {
     ComputeSquareRequest request;
     request.set_number(n);
+    ComputeSquareResponse response;
+
+    grpc::Status s = CallWithRetries(
+        "Arithmetic.ComputeSquare", deadline, [&](int attempt) {
+          tracing::Span call_span("Arithmetic.ComputeSquare/client",
+                                  trace_parent);
+          call_span.SetAttribute("attempt", attempt);
+          grpc::Status s = arithmetic_->ComputeSquare(
+              [&call_span, &deadline] {
+                auto ctx = std::make_unique<grpc::ClientContext>();
+                ctx->set_deadline(deadline);
+                tracing::Inject(call_span.context(), ctx.get());
+                return ctx;
+              },
+              request, &response);
+          call_span.SetStatus(s.error_code(), s.error_message());
+          return s;
+        });
+    if (!s.ok()) {
+      return ToCloudStatus(s);
+    }
+    return response.square();
+  }
+
+  grpc::Status ComputeSquares(
+      const google::protobuf::RepeatedField<std::int32_t> &numbers,
+      const std::chrono::system_clock::time_point &deadline,
+      const tracing::SpanContext &trace_parent,
+      std::vector<std::int64_t> *squares) {
+    return CallWithRetries(
+        "Arithmetic.SquareStream", deadline, [&](int attempt) {
+          tracing::Span call_span("Arithmetic.SquareStream/client",
+                                  trace_parent);
+          call_span.SetAttribute("attempt", attempt);
+          call_span.SetAttribute("numbers", numbers.size());
+          grpc::Status s = arithmetic_->ComputeSquares(
+              numbers.data(), numbers.size(), deadline, squares);
+          call_span.SetStatus(s.error_code(), s.error_message());
+          return s;
+        });
+  }
 
+  // Sets '*sum' to the sum of the squares of the coordinates of 'request',
+  // squared in-process rather than by the arithmetic servers.
+  grpc::Status SumSquaresLocally(
+      const ScheduleLengthComputationRequest &request, std::uint64_t *sum) {
+    const std::string &coordinates = request.packed_coordinates();
+    std::size_t count;
+    std::size_t end;
+    std::int32_t bad;
+    if (coordinates.empty()) {
+      count = request.coordinates_size();
+      end = SumOfSquares(request.coordinates().data(), count, sum);
+      bad = end < count ? request.coordinates(end) : 0;
+    } else {
+      if (request.coordinates_size() > 0) {
+        return grpc::Status(
+            grpc::StatusCode::INVALID_ARGUMENT,
+            "request has both coordinates and packed_coordinates");
+      }
+      if (!packed::WellFormed(coordinates)) {
+        return grpc::Status(
+            grpc::StatusCode::INVALID_ARGUMENT,
+            "request.packed_coordinates is not a whole number of uint16");
+      }
+      count = packed::Count(coordinates);
+      end = SumOfPackedSquares(coordinates, sum);
+      bad = end < count ? packed::At(coordinates, end) : 0;
+    }
+    if (end != count) {
+      std::stringstream ss;
+      ss << "request.coordinates[" << end << "] " << bad
+         << " is outside the valid range 0 .. " << packed::kMaxNumber;
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, ss.str());
+    }
+    return grpc::Status::OK;
+  }
+
+  // Sets '*sum' to the sum of the squares of the packed coordinates of
+  // 'request', computed with a single ComputePackedSquares call.
+  grpc::Status SumPackedSquares(
+      const ScheduleLengthComputationRequest &request,
+      const std::chrono::system_clock::time_point &deadline,
+      const tracing::SpanContext &trace_parent, std::uint64_t *sum) {
+    const std::string &coordinates = request.packed_coordinates();
+    if (request.coordinates_size() > 0) {
+      return grpc::Status(
+          grpc::StatusCode::INVALID_ARGUMENT,
+          "request has both coordinates and packed_coordinates");
+    }
+    if (!packed::WellFormed(coordinates)) {
+      return grpc::Status(
+          grpc::StatusCode::INVALID_ARGUMENT,
+          "request.packed_coordinates is not a whole number of uint16");
+    }
+    ComputePackedSquaresRequest squares_req;
+    *squares_req.mutable_packed_numbers() = coordinates;
+    ComputePackedSquaresResponse squares_resp;
+    grpc::Status s = CallWithRetries(
+        "Arithmetic.ComputePackedSquares", deadline, [&](int attempt) {
+          tracing::Span call_span("Arithmetic.ComputePackedSquares/client",
+                                  trace_parent);
+          call_span.SetAttribute("attempt", attempt);
+          call_span.SetAttribute("numbers", packed::Count(coordinates));
+          grpc::Status s = arithmetic_->ComputePackedSquares(
+              [&call_span, &deadline] {
+                auto ctx = std::make_unique<grpc::ClientContext>();
+                ctx->set_deadline(deadline);
+                tracing::Inject(call_span.context(), ctx.get());
+                return ctx;
+              },
+              squares_req, &squares_resp);
+          call_span.SetStatus(s.error_code(), s.error_message());
+          return s;
+        });
+    if (!s.ok()) {
+      return s;
+    }
+    if (squares_resp.packed_squares().size() != 2 * coordinates.size()) {
+      return grpc::Status(grpc::StatusCode::INTERNAL,
+                          "The arithmetic server returned the wrong number "
+                          "of squares.");
+    }
+    *sum = packed::Sum(squares_resp.packed_squares());
+    return grpc::Status::OK;
+  }
+
+  // Calls 'call(attempt)', with attempt = 1, 2, ..., until it succeeds,
+  // fails with an error that is not retryable, or the deadline would pass
+  // before the next attempt. Waits with jittered exponential backoff
+  // between attempts.
+  template <typename Call>
+  grpc::Status CallWithRetries(
+      const char *method,
+      const std::chrono::system_clock::time_point &deadline, Call call) {
     const auto kInitialDelayMs = 200;
     const double kScaling = 1.5;
 
     auto next_delay_ms = kInitialDelayMs;
 
-    for (;;) {
-      ComputeSquareResponse response;
-      grpc::ClientContext ctx;
-      grpc::Status s = arithmetic_->ComputeSquare(&ctx, request, &response);
+    for (int attempt = 1;; attempt++) {
+      grpc::Status s = call(attempt);
       if (s.ok()) {
-        return response.square();
+        return grpc::Status::OK;
       }
       if (!IsRetryableError(s)) {
-        return cloud::Status(
-            static_cast<cloud::StatusCode>(s.error_code()),
-            s.error_message() + "; calling the arithmetic server.");
+        return s;
       }
 
       int delay_ms =
@@ -113,13 +309,12 @@ class GeometryComputer {
       next_delay_ms *= kScaling;
 
       if (std::chrono::system_clock::now() + delay > deadline) {
-        return cloud::Status(
-            cloud::StatusCode::kDeadlineExceeded,
-            "Deadline exceeded calling Arithmetic.ComputeSquare");
+        return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                            std::string("Deadline exceeded calling ") + method);
       }
 
-      std::cerr << "ComputeSquare request failed: " << s.error_message()
-                << "; will retry after " << FormatDuration(delay) << std::endl;
+      ASYNC_LOG(kWarning, "{} request failed: {}; will retry after {}", method,
+                s.error_message(), FormatDuration(delay));
 
       std::this_thread::sleep_for(delay);
     }
@@ -132,7 +327,8 @@ class GeometryComputer {
     return dist(random_);
   }
 
-  Arithmetic::Stub *arithmetic_;  // Not owned.
+  ArithmeticBalancer *arithmetic_;  // Not owned.
+  const bool local_arithmetic_;
   std::mutex mu_;
   std::default_random_engine random_;  // Guarded by mu_.
 };
@@ -143,7 +339,9 @@ class GeometryDatabase {
 
   cloud::Status MaybeUpdateComputedLength(
       const std::string &id, std::int64_t version,
-      const cloud::StatusOr<double> &length) {
+      const cloud::StatusOr<double> &length,
+      const tracing::SpanContext &trace_parent) {
+    tracing::Span span("spanner.Commit", trace_parent);
     // From spanner::Client's documentation:
     // "Instances of this class created via copy-construction
     // or copy-assignment share the underlying pool of connections.
@@ -215,6 +413,8 @@ class GeometryDatabase {
               id, version, length_or_null, serialized_error_or_null),
       };
     });
+    span.SetStatus(static_cast<int>(commit.status().code()),
+                   commit.status().message());
     return commit.status();
   }
 
@@ -222,47 +422,258 @@ class GeometryDatabase {
   const spanner::Client client_;
 };
 
+// Processing lag and outcome metrics, served on --metrics_port.
+struct ProcessorMetrics {
+  metrics::Histogram *queue_delay = metrics::NewHistogram(
+      "geometry_processor_queue_delay_seconds",
+      "Time from the geometry server publishing a request to the processor "
+      "starting on it.",
+      metrics::ExponentialBuckets(0.001, 2, 24));
+  metrics::Histogram *compute_time = metrics::NewHistogram(
+      "geometry_processor_compute_seconds",
+      "Time spent computing a length.", metrics::LatencyBuckets());
+  metrics::Histogram *write_time = metrics::NewHistogram(
+      "geometry_processor_write_seconds",
+      "Time spent writing a result to Spanner.", metrics::LatencyBuckets());
+  metrics::Counter *acks = metrics::NewCounter(
+      "geometry_processor_acks_total", "Messages processed and acknowledged.");
+  metrics::Counter *malformed_drops = metrics::NewCounter(
+      "geometry_processor_drops_total",
+      "Messages left unacknowledged, by reason.",
+      {{"reason", "malformed"}});
+  metrics::Counter *write_failure_drops = metrics::NewCounter(
+      "geometry_processor_drops_total",
+      "Messages left unacknowledged, by reason.",
+      {{"reason", "write_failure"}});
+  metrics::Gauge *in_flight = metrics::NewGauge(
+      "geometry_processor_in_flight_messages",
+      "Messages, or requests of envelopes, currently being processed.");
+};
+
+// Returns when the request in 'm' was published. 'request' is null if the
+// message could not be parsed.
+std::chrono::system_clock::time_point PublishTime(
+    const ScheduleLengthComputationRequest *request, const pubsub::Message &m) {
+  if (request != nullptr && request->publish_time_micros() != 0) {
+    return std::chrono::system_clock::time_point(
+        std::chrono::microseconds(request->publish_time_micros()));
+  }
+  return m.publish_time();
+}
+
+// Returns how long the request in 'm' waited to be processed. 'request' is
+// null if the message could not be parsed.
+double QueueDelaySeconds(const ScheduleLengthComputationRequest * request,
+                         const pubsub::Message & m) {
+  return std::chrono::duration<double>(std::chrono::system_clock::now() -
+                                       PublishTime(request, m))
+      .count();
+}
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Returns the trace context the geometry server attached to 'm', if any.
+tracing::SpanContext ExtractTraceContext(const pubsub::Message &m) {
+  const auto attributes = m.attributes();
+  auto it = attributes.find(tracing::kTraceparentKey);
+  if (it == attributes.end()) return tracing::SpanContext();
+  return tracing::SpanContext::FromTraceparent(it->second);
+}
+
 void Run() {
+  StartupTimer startup;
+  if (!tracing::StartFileExporterFromFlags()) {
+    std::cerr << "Failed to open the trace file" << std::endl;
+    exit(-1);
+  }
+  if (!metrics::StartHttpServerFromFlags()) {
+    std::cerr << "Failed to start the metrics server" << std::endl;
+    exit(-1);
+  }
+  ProcessorMetrics processor_metrics;
+
   // Open a client connection to the arithmetic server.
-  grpc::ChannelArguments args;
-  args.SetLoadBalancingPolicyName("round_robin");
-  std::unique_ptr<Arithmetic::Stub> stub(Arithmetic::NewStub(
-      grpc::CreateCustomChannel("127.0.0.1:50051",
-                                grpc::InsecureChannelCredentials(), args)));
+  const bool local_arithmetic = LocalArithmeticFromFlags();
+  std::unique_ptr<ArithmeticBalancer> arithmetic =
+      ArithmeticBalancer::FromFlags();
+  if (arithmetic == nullptr) {
+    exit(-1);
+  }
+  if (!local_arithmetic) {
+    arithmetic->WaitForConnected(startup.deadline());
+  }
 
-  GeometryComputer computer(stub.get());
+  GeometryComputer computer(arithmetic.get(), local_arithmetic);
 
   // Connect to Spanner.
   const spanner::Client spanner_client(spanner::MakeConnection(
-      spanner::Database(kProjectId, kSpannerInstanceId, kDatabaseId)));
+      spanner::Database(kProjectId, kSpannerInstanceId, kDatabaseId),
+      spanner::ConnectionOptions(), SessionPoolOptionsFromFlags()));
+  WarmUpSpanner(spanner_client, startup.deadline());
   GeometryDatabase db(spanner_client);
+  // Counts the requests acknowledged, for the geometry servers to tell how
+  // far behind the processors are.
+  SpannerBacklogStore backlog_store(spanner_client);
+  std::unique_ptr<BacklogCounter> backlog =
+      BacklogCounter::FromFlags(&backlog_store);
 
   // Subscribe to pubsub.
   pubsub::Subscription subscription(kProjectId, kSubscriptionId);
   pubsub::Subscriber subscriber(pubsub::MakeSubscriberConnection(subscription));
-  auto session =
-      subscriber.Subscribe([&](const pubsub::Message &m, pubsub::AckHandler h) {
-        ScheduleLengthComputationRequest request;
-        if (!request.ParseFromString(m.data())) {
-          std::cerr << "Malformed message, id: " << m.message_id() << std::endl;
-          return;
-        }
+  EnvelopeTracker envelopes;
+
+  // Computes the length for 'request', which came in message 'm', writes it
+  // and returns whether it is done with.
+  auto process = [&](const ScheduleLengthComputationRequest &request,
+                     const pubsub::Message &m, tracing::Span *span) {
+    span->SetAttribute("id", request.id());
+    span->SetAttribute("version", request.version());
+    processor_metrics.queue_delay->Observe(QueueDelaySeconds(&request, m));
+
+    ASYNC_LOG(kInfo, "Received a length computation request with id {}",
+              request.id());
+
+    const auto deadline =
+        std::chrono::system_clock::now() + std::chrono::minutes(1);
+    const auto compute_start = std::chrono::steady_clock::now();
+    const auto length =
+        computer.ComputeLength(request, deadline, span->context());
+    processor_metrics.compute_time->Observe(SecondsSince(compute_start));
+
+    // A failed computation is not a drop: the error is written to
+    // Spanner instead of a length.
+    const auto write_start = std::chrono::steady_clock::now();
+    const auto commit_status = db.MaybeUpdateComputedLength(
+        request.id(), request.version(), length, span->context());
+    processor_metrics.write_time->Observe(SecondsSince(write_start));
+    if (!commit_status.ok()) {
+      processor_metrics.write_failure_drops->Increment();
+      span->SetStatus(static_cast<int>(commit_status.code()),
+                      commit_status.message());
+      ASYNC_LOG(kError, "Spanner write failure: {} [{}]",
+                commit_status.message(),
+                cloud::StatusCodeToString(commit_status.code()));
+      return false;
+    }
 
-        std::cout << "Received a length computation request with id "
-                  << request.id() << std::endl;
+    return true;
+  };
+
+  // Processes message 'm', a single request, and acknowledges it once done
+  // with.
+  auto handle = [&](const pubsub::Message &m, pubsub::AckHandler h) {
+    const tracing::SpanContext publish_context = ExtractTraceContext(m);
+    // Time between the publish and the start of processing, including the
+    // wait in the lane.
+    tracing::Span("pubsub.Queue", publish_context, m.publish_time()).End();
+    tracing::Span span("GeometryProcessor.ProcessMessage", publish_context);
+    span.SetAttribute("message_id", m.message_id());
+    metrics::GaugeIncrement in_flight(processor_metrics.in_flight);
+
+    // Parsed onto the thread's arena block, and freed with it.
+    ScopedArena arena;
+    auto &request = *arena.Create<ScheduleLengthComputationRequest>();
+    if (!request.ParseFromString(m.data())) {
+      processor_metrics.queue_delay->Observe(QueueDelaySeconds(nullptr, m));
+      processor_metrics.malformed_drops->Increment();
+      ASYNC_LOG(kError, "Malformed message, id: {}", m.message_id());
+      span.SetStatus(grpc::StatusCode::INVALID_ARGUMENT, "Malformed message");
+      return;
+    }
+    if (!process(request, m, &span)) {
+      return;
+    }
 
-        const auto deadline =
-            std::chrono::system_clock::now() + std::chrono::minutes(1);
-        const auto length = computer.ComputeLength(request, deadline);
+    std::move(h).ack();
+    processor_metrics.acks->Increment();
+    if (backlog != nullptr) {
+      backlog->AddCompleted(PublishTime(&request, m));
+    }
+  };
 
-        const auto commit_status = db.MaybeUpdateComputedLength(
-            request.id(), request.version(), length);
-        if (!commit_status.ok()) {
-          std::cerr << "Spanner write failure: " << commit_status << std::endl;
-          return;
+  std::unique_ptr<LaneScheduler> lanes = LaneScheduler::FromFlags();
+  if (lanes == nullptr) {
+    exit(-1);
+  }
+
+  // Submits each request of the envelope in message 'm' to a lane, as if it
+  // came in a message of its own, so that the lanes bound how many requests
+  // are processed at once whatever message they came in. The last request
+  // done acknowledges the message, if all of them are.
+  auto split = [&](const pubsub::Message &m,
+                   std::shared_ptr<pubsub::AckHandler> h) {
+    const tracing::SpanContext publish_context = ExtractTraceContext(m);
+    tracing::Span("pubsub.Queue", publish_context, m.publish_time()).End();
+    tracing::Span span("GeometryProcessor.ProcessMessage", publish_context);
+    span.SetAttribute("message_id", m.message_id());
+
+    // Shared by the requests, which outlive this call in their lanes.
+    auto message = std::make_shared<const pubsub::Message>(m);
+    auto envelope = std::make_shared<ScheduleLengthComputationBatch>();
+    if (!envelope->ParseFromString(m.data())) {
+      processor_metrics.queue_delay->Observe(QueueDelaySeconds(nullptr, m));
+      processor_metrics.malformed_drops->Increment();
+      ASYNC_LOG(kError, "Malformed message, id: {}", m.message_id());
+      span.SetStatus(grpc::StatusCode::INVALID_ARGUMENT, "Malformed message");
+      return;
+    }
+    span.SetAttribute("requests", envelope->requests_size());
+
+    std::shared_ptr<EnvelopeTracker::Delivery> delivery =
+        envelopes.Begin(m.message_id(), envelope->requests_size());
+    if (delivery->pending().empty()) {
+      std::move(*h).ack();
+      processor_metrics.acks->Increment();
+      if (backlog != nullptr) {
+        for (const auto &r : envelope->requests()) {
+          backlog->AddCompleted(PublishTime(&r, m));
         }
+      }
+      return;
+    }
+    const tracing::SpanContext context = span.context();
+    for (int i : delivery->pending()) {
+      const std::size_t bytes = envelope->requests(i).ByteSizeLong();
+      lanes->Submit(
+          lanes->LaneFor(m.attributes(), bytes), bytes,
+          [&process, &processor_metrics, &backlog, message, envelope,
+           delivery, h, i, context] {
+            tracing::Span request_span(
+                "GeometryProcessor.ProcessRequest",
+                RequestTraceContext(*envelope, i, context));
+            metrics::GaugeIncrement in_flight(processor_metrics.in_flight);
+            if (delivery->Record(i, process(envelope->requests(i), *message,
+                                            &request_span))) {
+              std::move(*h).ack();
+              processor_metrics.acks->Increment();
+              if (backlog != nullptr) {
+                for (const auto &r : envelope->requests()) {
+                  backlog->AddCompleted(PublishTime(&r, *message));
+                }
+              }
+            }
+          });
+    }
+  };
 
-        std::move(h).ack();
+  startup.Ready("Geometry processor");
+  auto session =
+      subscriber.Subscribe([&](const pubsub::Message &m, pubsub::AckHandler h) {
+        // The message waits in its lane while the subscriber goes on to
+        // deliver others.
+        auto handler = std::make_shared<pubsub::AckHandler>(std::move(h));
+        if (IsEnvelope(m.attributes())) {
+          split(m, std::move(handler));
+          return;
+        }
+        const std::size_t bytes = m.data().size();
+        lanes->Submit(
+            lanes->LaneFor(m.attributes(), bytes), bytes,
+            [&handle, m, handler] { handle(m, std::move(*handler)); });
       });
 
   auto status = session.get();
@@ -272,4 +683,7 @@ void Run() {
 }  // namespace
 }  // namespace mathematics
 
-int main() { mathematics::Run(); }
+int main(int argc, char **argv) {
+  absl::ParseCommandLine(argc, argv);
+  mathematics::Run();
+}
@@ -0,0 +1,50 @@
+
+#include "hash128.h"
+
+#include <cstring>
+
+namespace mathematics {
+namespace {
+
+constexpr std::uint64_t kMultiplier1 = 0x9e3779b97f4a7c15;
+constexpr std::uint64_t kMultiplier2 = 0xc2b2ae3d27d4eb4f;
+
+// Multiplies into 128 bits and folds the halves together, which mixes every
+// input bit into every output bit.
+std::uint64_t Mix(std::uint64_t a, std::uint64_t b) {
+  const unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+  return static_cast<std::uint64_t>(product) ^
+         static_cast<std::uint64_t>(product >> 64);
+}
+
+std::uint64_t Load64(const char* p) {
+  std::uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+}  // namespace
+
+Hash128 HashBytes(const char* data, std::size_t size) {
+  // Two lanes of 8 bytes each per 16-byte block, each lane multiplied by a
+  // different constant, and crossed at the end.
+  std::uint64_t a = kMultiplier1 ^ size;
+  std::uint64_t b = kMultiplier2 + size;
+  std::size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    a = Mix(a ^ Load64(data + i), kMultiplier1);
+    b = Mix(b ^ Load64(data + i + 8), kMultiplier2);
+  }
+  if (i < size) {
+    char tail[16] = {};
+    std::memcpy(tail, data + i, size - i);
+    a = Mix(a ^ Load64(tail), kMultiplier1);
+    b = Mix(b ^ Load64(tail + 8), kMultiplier2);
+  }
+  Hash128 hash;
+  hash.low = Mix(a ^ kMultiplier2, b ^ kMultiplier1);
+  hash.high = Mix(b + hash.low, a ^ kMultiplier1);
+  return hash;
+}
+
+}  // namespace mathematics
@@ -0,0 +1,321 @@
+
+#include "metrics.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <thread>
+
+#include "absl/flags/flag.h"
+
+ABSL_FLAG(int, metrics_port, 0,
+          "If not 0, metrics are served at http://0.0.0.0:<port>/metrics.");
+
+namespace mathematics {
+namespace metrics {
+namespace {
+
+enum class Type { kCounter, kGauge, kHistogram };
+
+struct LabeledMetric {
+  std::string labels;  // Formatted, e.g. {reason="malformed"}, or "".
+  Labels label_map;
+  void* metric;
+};
+
+struct Family {
+  std::string name;
+  std::string help;
+  Type type;
+  std::vector<LabeledMetric> instances;
+};
+
+std::string FormatDouble(double v) {
+  if (std::isinf(v)) return v > 0 ? "+Inf" : "-Inf";
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "%.12g", v);
+  return buf;
+}
+
+std::string EscapeLabelValue(const std::string& v) {
+  std::string out;
+  for (char c : v) {
+    if (c == '\\' || c == '"') {
+      out.push_back('\\');
+      out.push_back(c);
+    } else if (c == '\n') {
+      out.append("\\n");
+    } else {
+      out.push_back(c);
+    }
+  }
+  return out;
+}
+
+// Formats 'labels' plus an optional extra label, as used for "le".
+std::string FormatLabels(const Labels& labels, const std::string& extra_name,
+                         const std::string& extra_value) {
+  std::string out;
+  auto append = [&out](const std::string& name, const std::string& value) {
+    out += out.empty() ? "{" : ",";
+    out += name + "=\"" + EscapeLabelValue(value) + "\"";
+  };
+  for (const auto& label : labels) {
+    append(label.first, label.second);
+  }
+  if (!extra_name.empty()) {
+    append(extra_name, extra_value);
+  }
+  if (!out.empty()) out += "}";
+  return out;
+}
+
+class Registry {
+ public:
+  static Registry& Instance() {
+    static Registry* registry = new Registry;
+    return *registry;
+  }
+
+  void Add(const std::string& name, const std::string& help, Type type,
+           const Labels& labels, void* metric) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = std::find_if(
+        families_.begin(), families_.end(),
+        [&name](const Family& f) { return f.name == name; });
+    if (it == families_.end()) {
+      families_.push_back(Family{name, help, type, {}});
+      it = families_.end() - 1;
+    }
+    it->instances.push_back(
+        LabeledMetric{FormatLabels(labels, "", ""), labels, metric});
+  }
+
+  std::string TextFormat() {
+    std::lock_guard<std::mutex> lock(mu_);
+    std::string out;
+    for (const auto& f : families_) {
+      static constexpr const char* kTypeNames[] = {"counter", "gauge",
+                                                   "histogram"};
+      out += "# HELP " + f.name + " " + f.help + "\n";
+      out += "# TYPE " + f.name + " " + kTypeNames[static_cast<int>(f.type)] +
+             "\n";
+      for (const auto& i : f.instances) {
+        switch (f.type) {
+          case Type::kCounter:
+            out += f.name + i.labels + " " +
+                   std::to_string(static_cast<Counter*>(i.metric)->value()) +
+                   "\n";
+            break;
+          case Type::kGauge:
+            out += f.name + i.labels + " " +
+                   std::to_string(static_cast<Gauge*>(i.metric)->value()) +
+                   "\n";
+            break;
+          case Type::kHistogram:
+            AppendHistogram(f.name, i, &out);
+            break;
+        }
+      }
+    }
+    return out;
+  }
+
+ private:
+  static void AppendHistogram(const std::string& name, const LabeledMetric& i,
+                              std::string* out) {
+    const auto* h = static_cast<Histogram*>(i.metric);
+    std::uint64_t cumulative = 0;
+    for (std::size_t b = 0; b <= h->bounds().size(); b++) {
+      cumulative += h->bucket_count(b);
+      const double le = b < h->bounds().size()
+                            ? h->bounds()[b]
+                            : std::numeric_limits<double>::infinity();
+      *out += name + "_bucket" +
+              FormatLabels(i.label_map, "le", FormatDouble(le)) + " " +
+              std::to_string(cumulative) + "\n";
+    }
+    *out += name + "_sum" + i.labels + " " + FormatDouble(h->sum()) + "\n";
+    *out += name + "_count" + i.labels + " " + std::to_string(cumulative) +
+            "\n";
+  }
+
+  std::mutex mu_;
+  std::vector<Family> families_;  // Guarded by mu_.
+};
+
+void WriteFully(int fd, const std::string& data) {
+  std::size_t done = 0;
+  while (done < data.size()) {
+    ssize_t n =
+        ::send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+    if (n <= 0) return;
+    done += n;
+  }
+}
+
+// How long a scrape may take to send its request or receive the response.
+// Connections are served one at a time, so a client that connects and sends
+// nothing, such as a half-open health check, holds up the others this long.
+constexpr std::chrono::seconds kIoTimeout{5};
+// How long to wait before accepting again after accept() fails, e.g. with
+// EMFILE, which would otherwise fail again at once.
+constexpr std::chrono::milliseconds kAcceptBackoff{100};
+
+void HandleConnection(int fd) {
+  timeval timeout;
+  timeout.tv_sec = kIoTimeout.count();
+  timeout.tv_usec = 0;
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  // Only the request line matters; read until the end of the headers.
+  std::string request;
+  char buf[1024];
+  while (request.find("\r\n\r\n") == std::string::npos &&
+         request.size() < 8192) {
+    ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+    if (n < 0) {
+      // Timed out, or the client is gone: no one to answer.
+      ::close(fd);
+      return;
+    }
+    if (n == 0) break;
+    request.append(buf, n);
+  }
+
+  std::string status = "200 OK";
+  std::string body;
+  if (request.compare(0, 13, "GET /metrics ") == 0) {
+    body = TextFormat();
+  } else {
+    status = "404 Not Found";
+    body = "Not found; try /metrics\n";
+  }
+  WriteFully(fd,
+             "HTTP/1.1 " + status +
+                 "\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: " +
+                 std::to_string(body.size()) +
+                 "\r\nConnection: close\r\n\r\n" + body);
+  ::close(fd);
+}
+
+}  // namespace
+
+Histogram::Histogram(std::vector<double> bounds)
+    : bounds_(std::move(bounds)),
+      buckets_(new std::atomic<std::uint64_t>[bounds_.size() + 1]) {
+  for (std::size_t i = 0; i <= bounds_.size(); i++) {
+    buckets_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void Histogram::Observe(double v) {
+  const std::size_t bucket =
+      std::lower_bound(bounds_.begin(), bounds_.end(), v) - bounds_.begin();
+  buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+
+  std::uint64_t old_bits = sum_bits_.load(std::memory_order_relaxed);
+  std::uint64_t new_bits;
+  do {
+    double sum;
+    std::memcpy(&sum, &old_bits, sizeof(sum));
+    sum += v;
+    std::memcpy(&new_bits, &sum, sizeof(sum));
+  } while (!sum_bits_.compare_exchange_weak(old_bits, new_bits,
+                                            std::memory_order_relaxed));
+}
+
+double Histogram::sum() const {
+  const std::uint64_t bits = sum_bits_.load(std::memory_order_relaxed);
+  double sum;
+  std::memcpy(&sum, &bits, sizeof(sum));
+  return sum;
+}
+
+std::vector<double> ExponentialBuckets(double start, double factor,
+                                       int count) {
+  std::vector<double> bounds;
+  for (int i = 0; i < count; i++) {
+    bounds.push_back(start);
+    start *= factor;
+  }
+  return bounds;
+}
+
+std::vector<double> LatencyBuckets() {
+  return ExponentialBuckets(0.0001, 2, 21);
+}
+
+Counter* NewCounter(const std::string& name, const std::string& help,
+                    const Labels& labels) {
+  auto* counter = new Counter;
+  Registry::Instance().Add(name, help, Type::kCounter, labels, counter);
+  return counter;
+}
+
+Gauge* NewGauge(const std::string& name, const std::string& help,
+                const Labels& labels) {
+  auto* gauge = new Gauge;
+  Registry::Instance().Add(name, help, Type::kGauge, labels, gauge);
+  return gauge;
+}
+
+Histogram* NewHistogram(const std::string& name, const std::string& help,
+                        std::vector<double> bounds, const Labels& labels) {
+  auto* histogram = new Histogram(std::move(bounds));
+  Registry::Instance().Add(name, help, Type::kHistogram, labels, histogram);
+  return histogram;
+}
+
+std::string TextFormat() { return Registry::Instance().TextFormat(); }
+
+bool StartHttpServer(int port) {
+  int fd = ::socket(AF_INET6, SOCK_STREAM, 0);
+  if (fd < 0) return false;
+  int one = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in6 addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  addr.sin6_port = htons(port);
+  if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      ::listen(fd, 16) != 0) {
+    ::close(fd);
+    return false;
+  }
+  std::thread([fd] {
+    for (;;) {
+      int conn = ::accept(fd, nullptr, nullptr);
+      if (conn < 0) {
+        if (errno != EINTR && errno != ECONNABORTED) {
+          std::this_thread::sleep_for(kAcceptBackoff);
+        }
+        continue;
+      }
+      // Scrapes are rare; serving them one at a time is enough.
+      HandleConnection(conn);
+    }
+  }).detach();
+  return true;
+}
+
+bool StartHttpServerFromFlags() {
+  const int port = absl::GetFlag(FLAGS_metrics_port);
+  return port == 0 || StartHttpServer(port);
+}
+
+}  // namespace metrics
+}  // namespace mathematics
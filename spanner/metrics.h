@@ -0,0 +1,117 @@
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Process-wide counters, gauges and histograms, served over HTTP in the
+// Prometheus text format:
+//
+//   metrics::Counter* acks = metrics::NewCounter(
+//       "geometry_processor_acks_total", "Messages acknowledged.");
+//   acks->Increment();
+//
+//   $ curl localhost:9464/metrics
+//
+// Metrics are created once, usually at startup, and are never destroyed.
+// Updating a metric is a few relaxed atomic operations, so they can be used
+// on request paths.
+
+namespace mathematics {
+namespace metrics {
+
+// Label names and values, e.g. {{"reason", "malformed"}}.
+using Labels = std::map<std::string, std::string>;
+
+class Counter {
+ public:
+  void Increment(std::uint64_t n = 1) {
+    value_.fetch_add(n, std::memory_order_relaxed);
+  }
+  std::uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<std::uint64_t> value_{0};
+};
+
+class Gauge {
+ public:
+  void Set(std::int64_t v) { value_.store(v, std::memory_order_relaxed); }
+  void Add(std::int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+  std::int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<std::int64_t> value_{0};
+};
+
+// Increments a gauge for the lifetime of the object, e.g. to count requests
+// in flight.
+class GaugeIncrement {
+ public:
+  explicit GaugeIncrement(Gauge* gauge) : gauge_(gauge) { gauge_->Add(1); }
+  ~GaugeIncrement() { gauge_->Add(-1); }
+
+  GaugeIncrement(const GaugeIncrement&) = delete;
+  GaugeIncrement& operator=(const GaugeIncrement&) = delete;
+
+ private:
+  Gauge* gauge_;  // Not owned.
+};
+
+class Histogram {
+ public:
+  // 'bounds' are the inclusive upper bounds of the buckets, in increasing
+  // order. An extra bucket catches everything above the last bound.
+  explicit Histogram(std::vector<double> bounds);
+
+  void Observe(double v);
+
+  const std::vector<double>& bounds() const { return bounds_; }
+  // Bucket 'i' counts observations in (bounds[i-1], bounds[i]]; not
+  // cumulative.
+  std::uint64_t bucket_count(std::size_t i) const {
+    return buckets_[i].load(std::memory_order_relaxed);
+  }
+  double sum() const;
+
+ private:
+  const std::vector<double> bounds_;
+  std::unique_ptr<std::atomic<std::uint64_t>[]> buckets_;
+  std::atomic<std::uint64_t> sum_bits_{0};  // A double.
+};
+
+// Returns {start, start * factor, start * factor^2, ...}, 'count' bounds.
+std::vector<double> ExponentialBuckets(double start, double factor, int count);
+
+// Bounds suitable for latencies in seconds, from 100us to about 2 minutes.
+std::vector<double> LatencyBuckets();
+
+// Create and register metrics. Metrics with the same name must have the same
+// type and help text, and differ in their labels.
+Counter* NewCounter(const std::string& name, const std::string& help,
+                    const Labels& labels = {});
+Gauge* NewGauge(const std::string& name, const std::string& help,
+                const Labels& labels = {});
+Histogram* NewHistogram(const std::string& name, const std::string& help,
+                        std::vector<double> bounds, const Labels& labels = {});
+
+// Returns every registered metric in the Prometheus text exposition format.
+std::string TextFormat();
+
+// Serves TextFormat() at http://0.0.0.0:<port>/metrics from a background
+// thread. Returns false if the port cannot be bound.
+bool StartHttpServer(int port);
+
+// Calls StartHttpServer() with the value of --metrics_port, unless it is 0.
+// Returns false if the port cannot be bound.
+bool StartHttpServerFromFlags();
+
+}  // namespace metrics
+}  // namespace mathematics
+
+#endif  // METRICS_H_
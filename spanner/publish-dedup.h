@@ -0,0 +1,89 @@
+
+#ifndef PUBLISH_DEDUP_H_
+#define PUBLISH_DEDUP_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <google/cloud/status_or.h>
+
+#include "hash128.h"
+#include "metrics.h"
+
+namespace mathematics {
+
+// Collapses publishes of the same request into one. Clients that retry send
+// the same ScheduleLengthComputationRequest several times within a second,
+// and every copy published is another message for the processors to compute
+// and write.
+//
+// A request is identified by its id, version and a hash of its payload. The
+// first of a kind is published; a duplicate that arrives while it is in
+// flight waits for the same result, and one that arrives within the window
+// after it was published gets that result at once. A failed publish is
+// forgotten immediately, so that a retry publishes again. Thread-safe.
+class PublishDedup {
+ public:
+  // The message id, or why publishing failed.
+  using Result = google::cloud::StatusOr<std::string>;
+
+  struct Key {
+    std::string id;
+    std::int64_t version;
+    Hash128 payload;
+
+    bool operator==(const Key& other) const {
+      return id == other.id && version == other.version &&
+             payload == other.payload;
+    }
+  };
+
+  explicit PublishDedup(std::chrono::milliseconds window);
+
+  // Returns nullptr if --dedup_window_ms is 0.
+  static std::unique_ptr<PublishDedup> FromFlags();
+
+  // 'version' is 0 for requests that have none.
+  static Key MakeKey(const std::string& id, std::int64_t version,
+                     const std::string& payload);
+
+  // Returns the result of calling 'publish', or of the call already made for
+  // 'key', and sets '*duplicate' to whether it was the latter.
+  Result Publish(const Key& key, const std::function<Result()>& publish,
+                 bool* duplicate);
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct KeyHash {
+    std::size_t operator()(const Key& key) const {
+      return key.payload.low ^ std::hash<std::string>()(key.id);
+    }
+  };
+
+  // Forgets the entries whose window has passed. Requires mu_.
+  void ExpireLocked(Clock::time_point now);
+
+  const std::chrono::milliseconds window_;
+
+  std::mutex mu_;
+  // The result of each request in flight or in its window. Guarded by mu_.
+  std::unordered_map<Key, std::shared_future<Result>, KeyHash> entries_;
+  // When the published entries' windows end, oldest first. Guarded by mu_.
+  std::deque<std::pair<Clock::time_point, Key>> expiries_;
+
+  metrics::Counter* suppressed_;
+  metrics::Gauge* tracked_;
+};
+
+}  // namespace mathematics
+
+#endif  // PUBLISH_DEDUP_H_
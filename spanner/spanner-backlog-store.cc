@@ -0,0 +1,72 @@
+
+#include "spanner-backlog-store.h"
+
+#include <tuple>
+
+namespace mathematics {
+namespace {
+
+namespace cloud = ::google::cloud;
+namespace spanner = ::google::cloud::spanner;
+
+constexpr char kBacklogTableName[] = "backlog_counters";
+constexpr char kWindowStartColumn[] = "window_start";
+constexpr char kShardColumn[] = "shard";
+constexpr char kScheduledColumn[] = "scheduled";
+constexpr char kCompletedColumn[] = "completed";
+constexpr char kUpdatedColumn[] = "updated";
+
+}  // namespace
+
+cloud::Status SpannerBacklogStore::Add(std::int64_t window_start, int shard,
+                                       std::int64_t scheduled,
+                                       std::int64_t completed) {
+  // Copies of a Client may be used from different threads; the same one may
+  // not.
+  auto client = client_;
+  auto commit = client.Commit([&](const spanner::Transaction &txn)
+                                  -> cloud::StatusOr<spanner::Mutations> {
+    auto rows = client.Read(txn, kBacklogTableName,
+                            spanner::KeySet().AddKey(spanner::MakeKey(
+                                window_start, std::int64_t{shard})),
+                            {kScheduledColumn, kCompletedColumn});
+    std::int64_t read_scheduled = 0;
+    std::int64_t read_completed = 0;
+    using RowType = std::tuple<std::int64_t, std::int64_t>;
+    for (const auto &row : spanner::StreamOf<RowType>(rows)) {
+      if (!row.ok()) {
+        return row.status();
+      }
+      std::tie(read_scheduled, read_completed) = *row;
+    }
+    return spanner::Mutations{spanner::MakeInsertOrUpdateMutation(
+        kBacklogTableName,
+        {kWindowStartColumn, kShardColumn, kScheduledColumn, kCompletedColumn,
+         kUpdatedColumn},
+        window_start, std::int64_t{shard}, read_scheduled + scheduled,
+        read_completed + completed, spanner::CommitTimestamp{})};
+  });
+  return commit.status();
+}
+
+cloud::StatusOr<BacklogWindows> SpannerBacklogStore::Read(std::int64_t since) {
+  auto client = client_;
+  auto rows = client.ExecuteQuery(spanner::SqlStatement(
+      "SELECT window_start, SUM(scheduled), SUM(completed) "
+      "FROM backlog_counters WHERE window_start >= @since "
+      "GROUP BY window_start",
+      {{"since", spanner::Value(since)}}));
+  BacklogWindows windows;
+  using RowType = std::tuple<std::int64_t, std::int64_t, std::int64_t>;
+  for (const auto &row : spanner::StreamOf<RowType>(rows)) {
+    if (!row.ok()) {
+      return row.status();
+    }
+    BacklogTotals &totals = windows[std::get<0>(*row)];
+    totals.scheduled = std::get<1>(*row);
+    totals.completed = std::get<2>(*row);
+  }
+  return windows;
+}
+
+}  // namespace mathematics
@@ -0,0 +1,32 @@
+
+#ifndef SPANNER_BACKLOG_STORE_H_
+#define SPANNER_BACKLOG_STORE_H_
+
+#include <cstdint>
+#include <utility>
+
+#include <google/cloud/spanner/client.h>
+
+#include "backlog.h"
+
+namespace mathematics {
+
+// Keeps the backlog counters in the backlog_counters table (see geometry.sdl),
+// a row per window and shard.
+class SpannerBacklogStore final : public BacklogStore {
+ public:
+  explicit SpannerBacklogStore(google::cloud::spanner::Client client)
+      : client_(std::move(client)) {}
+
+  google::cloud::Status Add(std::int64_t window_start, int shard,
+                            std::int64_t scheduled,
+                            std::int64_t completed) override;
+  google::cloud::StatusOr<BacklogWindows> Read(std::int64_t since) override;
+
+ private:
+  const google::cloud::spanner::Client client_;
+};
+
+}  // namespace mathematics
+
+#endif  // SPANNER_BACKLOG_STORE_H_
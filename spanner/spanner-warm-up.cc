@@ -0,0 +1,47 @@
+
+#include "spanner-warm-up.h"
+
+#include <future>
+#include <iostream>
+#include <thread>
+
+#include "absl/flags/flag.h"
+
+ABSL_FLAG(int, spanner_min_sessions, 16,
+          "The Spanner sessions to create at startup and keep open.");
+
+namespace mathematics {
+
+namespace spanner = ::google::cloud::spanner;
+
+spanner::SessionPoolOptions SessionPoolOptionsFromFlags() {
+  spanner::SessionPoolOptions options;
+  options.set_min_sessions(absl::GetFlag(FLAGS_spanner_min_sessions));
+  return options;
+}
+
+void WarmUpSpanner(spanner::Client client,
+                   std::chrono::system_clock::time_point deadline) {
+  // A query that hangs is left behind, on its own copy of the client,
+  // rather than waited for.
+  std::packaged_task<google::cloud::Status()> query([client]() mutable {
+    for (auto& row : client.ExecuteQuery(spanner::SqlStatement("SELECT 1"))) {
+      if (!row) {
+        return row.status();
+      }
+    }
+    return google::cloud::Status();
+  });
+  std::future<google::cloud::Status> done = query.get_future();
+  std::thread(std::move(query)).detach();
+  if (done.wait_until(deadline) != std::future_status::ready) {
+    std::cerr << "Spanner warm-up query did not finish in time" << std::endl;
+    return;
+  }
+  google::cloud::Status status = done.get();
+  if (!status.ok()) {
+    std::cerr << "Spanner warm-up query failed: " << status << std::endl;
+  }
+}
+
+}  // namespace mathematics
@@ -0,0 +1,24 @@
+
+#ifndef SPANNER_WARM_UP_H_
+#define SPANNER_WARM_UP_H_
+
+#include <chrono>
+
+#include <google/cloud/spanner/client.h>
+
+namespace mathematics {
+
+// The session pool options for the geometry database: at least
+// --spanner_min_sessions sessions, which the pool creates as soon as the
+// connection is made rather than as transactions need them.
+google::cloud::spanner::SessionPoolOptions SessionPoolOptionsFromFlags();
+
+// Runs a trivial query on 'client', so that the first real transaction finds
+// a channel connected and a session ready. Waits until 'deadline' at most,
+// and logs if the query failed or did not finish.
+void WarmUpSpanner(google::cloud::spanner::Client client,
+                   std::chrono::system_clock::time_point deadline);
+
+}  // namespace mathematics
+
+#endif  // SPANNER_WARM_UP_H_
@@ -0,0 +1,166 @@
+
+#include "square-stream.h"
+
+namespace mathematics {
+namespace {
+
+// Same as cv->wait_until(), also for deadlines too far off to convert to the
+// condition variable's clock, such as those of calls with no deadline.
+template <typename Predicate>
+bool WaitUntil(std::condition_variable* cv, std::unique_lock<std::mutex>* lock,
+               std::chrono::system_clock::time_point deadline,
+               Predicate predicate) {
+  if (deadline - std::chrono::system_clock::now() > std::chrono::hours(24)) {
+    cv->wait(*lock, predicate);
+    return true;
+  }
+  return cv->wait_until(*lock, deadline, predicate);
+}
+
+}  // namespace
+
+struct SquareStream::Connection {
+  grpc::ClientContext context;
+  std::unique_ptr<grpc::ClientReaderWriter<SquareStreamRequest,
+                                           SquareStreamResponse>>
+      stream;
+  std::thread reader;
+
+  // Serializes writes; reads happen only on 'reader'.
+  std::mutex write_mu;
+
+  bool broken = false;  // Guarded by SquareStream::mu_.
+};
+
+SquareStream::SquareStream(Arithmetic::Stub* stub, std::size_t window)
+    : stub_(stub), window_(window) {}
+
+SquareStream::~SquareStream() {
+  std::shared_ptr<Connection> connection;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    connection = connection_;
+  }
+  if (connection != nullptr) {
+    connection->context.TryCancel();
+    connection->reader.join();
+  }
+}
+
+std::shared_ptr<SquareStream::Connection> SquareStream::OpenLocked() {
+  if (connection_ != nullptr && !connection_->broken) {
+    return connection_;
+  }
+  if (connection_ != nullptr) {
+    // Its reader has failed every pending number and is exiting.
+    connection_->reader.join();
+  }
+  connection_ = std::make_shared<Connection>();
+  connection_->stream = stub_->SquareStream(&connection_->context);
+  connection_->reader =
+      std::thread(&SquareStream::ReadLoop, this, connection_);
+  return connection_;
+}
+
+void SquareStream::ReadLoop(std::shared_ptr<Connection> connection) {
+  SquareStreamResponse response;
+  while (connection->stream->Read(&response)) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = pending_.find(response.request_id());
+    if (it == pending_.end()) {
+      // Its batch gave up waiting.
+      continue;
+    }
+    Batch* batch = it->second.batch;
+    if (response.error_code() != 0 && batch->status.ok()) {
+      batch->status =
+          grpc::Status(static_cast<grpc::StatusCode>(response.error_code()),
+                       response.error_message());
+    }
+    (*batch->squares)[it->second.index] = response.square();
+    batch->outstanding--;
+    pending_.erase(it);
+    cv_.notify_all();
+  }
+
+  grpc::Status status;
+  {
+    std::lock_guard<std::mutex> lock(connection->write_mu);
+    status = connection->stream->Finish();
+  }
+  if (status.ok()) {
+    status = grpc::Status(grpc::StatusCode::UNAVAILABLE,
+                          "The square stream was closed by the server.");
+  }
+  std::lock_guard<std::mutex> lock(mu_);
+  connection->broken = true;
+  // Numbers are only ever pending on the current connection.
+  for (auto& p : pending_) {
+    Batch* batch = p.second.batch;
+    if (batch->status.ok()) batch->status = status;
+    batch->outstanding--;
+  }
+  pending_.clear();
+  cv_.notify_all();
+}
+
+grpc::Status SquareStream::ComputeSquares(
+    const std::int32_t* numbers, std::size_t count,
+    std::chrono::system_clock::time_point deadline,
+    std::vector<std::int64_t>* squares) {
+  squares->assign(count, 0);
+  Batch batch;
+  batch.squares = squares;
+  std::vector<std::uint64_t> ids;
+  ids.reserve(count);
+
+  SquareStreamRequest request;
+  for (std::size_t i = 0; i < count; i++) {
+    std::shared_ptr<Connection> connection;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      if (!WaitUntil(&cv_, &lock, deadline, [this, &batch] {
+            return pending_.size() < window_ || !batch.status.ok();
+          })) {
+        AbandonLocked(&batch, ids);
+        return grpc::Status(
+            grpc::StatusCode::DEADLINE_EXCEEDED,
+            "Deadline exceeded waiting for the square stream.");
+      }
+      if (!batch.status.ok()) {
+        break;
+      }
+      connection = OpenLocked();
+      request.set_request_id(next_id_++);
+      request.set_number(numbers[i]);
+      pending_[request.request_id()] = Pending{&batch, i};
+      ids.push_back(request.request_id());
+      batch.outstanding++;
+    }
+    std::lock_guard<std::mutex> lock(connection->write_mu);
+    // On failure the reader sees the stream end and fails the batch.
+    connection->stream->Write(request);
+  }
+
+  std::unique_lock<std::mutex> lock(mu_);
+  if (!WaitUntil(&cv_, &lock, deadline,
+                 [&batch] { return batch.outstanding == 0; })) {
+    AbandonLocked(&batch, ids);
+    return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                        "Deadline exceeded waiting for the square stream.");
+  }
+  return batch.status;
+}
+
+void SquareStream::AbandonLocked(Batch* batch,
+                                 const std::vector<std::uint64_t>& ids) {
+  for (std::uint64_t id : ids) {
+    auto it = pending_.find(id);
+    if (it != pending_.end() && it->second.batch == batch) {
+      pending_.erase(it);
+    }
+  }
+  cv_.notify_all();
+}
+
+}  // namespace mathematics
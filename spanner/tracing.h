@@ -0,0 +1,105 @@
+
+#ifndef TRACING_H_
+#define TRACING_H_
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+// Minimal distributed tracing, enough to break the latency of a request down
+// by stage across the geometry server, Pub/Sub, the processors, the arithmetic
+// servers and the databases.
+//
+// Span contexts travel between processes in the W3C "traceparent" format, in
+// gRPC metadata and in Pub/Sub message attributes. Finished spans are written
+// by a background thread to a local file, one JSON object per line, with start
+// and end times in microseconds since the Unix epoch:
+//
+//   {"trace_id":"...","span_id":"...","parent_span_id":"...",
+//    "name":"Arithmetic.ComputeSquare","start_us":...,"end_us":...,
+//    "attributes":{"number":5}}
+//
+// Until StartFileExporter() is called spans are not recorded, but incoming
+// contexts are still passed on to downstream calls.
+
+namespace mathematics {
+namespace tracing {
+
+// The name of the gRPC metadata key and Pub/Sub attribute carrying a context.
+constexpr char kTraceparentKey[] = "traceparent";
+
+struct SpanContext {
+  std::uint64_t trace_id_high = 0;
+  std::uint64_t trace_id_low = 0;
+  std::uint64_t span_id = 0;
+
+  bool valid() const { return (trace_id_high | trace_id_low) != 0; }
+
+  // Returns "00-<trace id>-<span id>-01", or "" for an invalid context.
+  std::string ToTraceparent() const;
+
+  // Returns an invalid context if 'traceparent' cannot be parsed.
+  static SpanContext FromTraceparent(const std::string& traceparent);
+};
+
+class Span {
+ public:
+  // Starts a span now. If 'parent' is invalid the span starts a new trace.
+  Span(std::string name, const SpanContext& parent);
+
+  // Starts a span at a given time, e.g. to cover time spent in a queue.
+  Span(std::string name, const SpanContext& parent,
+       std::chrono::system_clock::time_point start);
+
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+
+  // Ends the span if End() has not been called.
+  ~Span();
+
+  void SetAttribute(const std::string& key, const std::string& value);
+  void SetAttribute(const std::string& key, std::int64_t value);
+
+  // Records the gRPC status code, and the message unless the status is OK.
+  void SetStatus(int code, const std::string& message);
+
+  void End();
+
+  // The context to pass on to children of this span.
+  const SpanContext& context() const { return context_; }
+
+ private:
+  const bool recording_;
+  SpanContext context_;
+  std::uint64_t parent_span_id_ = 0;
+  std::string name_;
+  std::int64_t start_us_ = 0;
+  std::vector<std::pair<std::string, std::string>> attributes_;  // JSON values.
+  bool ended_ = false;
+};
+
+// Starts writing finished spans to 'path', appending if the file exists.
+// Returns false if the file cannot be opened.
+bool StartFileExporter(const std::string& path);
+
+// Calls StartFileExporter() with the value of --trace_file, if set. Returns
+// false if the file cannot be opened.
+bool StartFileExporterFromFlags();
+
+// Returns true if StartFileExporter() succeeded.
+bool Enabled();
+
+// Adds 'context' to the metadata sent with a downstream call.
+void Inject(const SpanContext& context, grpc::ClientContext* client_context);
+
+// Returns the context sent by the caller, or an invalid context.
+SpanContext Extract(const grpc::ServerContextBase& server_context);
+
+}  // namespace tracing
+}  // namespace mathematics
+
+#endif  // TRACING_H_